@@ -66,6 +66,7 @@ public:
     gen_moveable_ = false;
     gen_no_ostream_operators_ = false;
     gen_no_skeleton_ = false;
+    gen_direct_client_ = false;
     has_members_ = false;
 
     for( iter = parsed_options.begin(); iter != parsed_options.end(); ++iter) {
@@ -88,6 +89,8 @@ public:
         gen_no_ostream_operators_ = true;
       } else if ( iter->first.compare("no_skeleton") == 0) {
         gen_no_skeleton_ = true;
+      } else if ( iter->first.compare("direct_client") == 0) {
+        gen_direct_client_ = true;
       } else {
         throw "unknown option cpp:" + iter->first;
       }
@@ -169,6 +172,7 @@ public:
   void generate_service_interface_factory(t_service* tservice, string style);
   void generate_service_null(t_service* tservice, string style);
   void generate_service_multiface(t_service* tservice);
+  void generate_service_direct_client(t_service* tservice);
   void generate_service_helpers(t_service* tservice);
   void generate_service_client(t_service* tservice, string style);
   void generate_service_processor(t_service* tservice, string style);
@@ -373,6 +377,11 @@ private:
    */
   bool gen_no_skeleton_;
 
+  /**
+   * True if we should generate an in-process client calling the handler directly.
+   */
+  bool gen_direct_client_;
+
   /**
    * True if thrift has member(s)
    */
@@ -2004,6 +2013,9 @@ void t_cpp_generator::generate_service(t_service* tservice) {
   generate_service_processor(tservice, "");
   generate_service_multiface(tservice);
   generate_service_client(tservice, "Concurrent");
+  if (gen_direct_client_) {
+    generate_service_direct_client(tservice);
+  }
 
   // Generate skeleton
   if (!gen_no_skeleton_) {
@@ -2495,6 +2507,168 @@ void t_cpp_generator::generate_service_multiface(t_service* tservice) {
   f_header_ << indent() << "};" << '\n' << '\n';
 }
 
+/**
+ * Generates an in-process client. It implements the service interface by
+ * calling a handler directly, so arguments and results are never serialized,
+ * while still driving the TProcessorEventHandler hooks the way the processor
+ * does (with zero byte counts).
+ *
+ * @param tservice The service to generate a direct client for.
+ */
+void t_cpp_generator::generate_service_direct_client(t_service* tservice) {
+  vector<t_function*> functions = tservice->get_functions();
+  vector<t_function*>::iterator f_iter;
+
+  string extends = "";
+  string extends_client = "";
+  if (tservice->get_extends() != nullptr) {
+    extends = type_name(tservice->get_extends());
+    extends_client = ", public " + extends + "DirectClient";
+  }
+
+  string class_name = service_name_ + "DirectClient";
+  string handler_type = "::std::shared_ptr< ::apache::thrift::TProcessorEventHandler>";
+
+  // Generate the header portion
+  f_header_ << "class " << class_name << " : "
+            << "virtual public " << service_name_ << "If" << extends_client << " {" << '\n'
+            << " public:" << '\n';
+  indent_up();
+  f_header_ << indent() << class_name << "(const ::std::shared_ptr<" << service_name_
+            << "If>& iface) :" << '\n';
+  if (!extends.empty()) {
+    f_header_ << indent() << "  " << extends << "DirectClient(iface)," << '\n';
+  }
+  f_header_ << indent() << "  iface_(iface) {}" << '\n' << indent() << "virtual ~" << class_name
+            << "() {}" << '\n';
+  if (extends.empty()) {
+    f_header_ << '\n' << indent() << "void setEventHandler(const " << handler_type
+              << "& eventHandler) {" << '\n' << indent() << "  eventHandler_ = eventHandler;"
+              << '\n' << indent() << "}" << '\n' << indent() << handler_type
+              << " getEventHandler() const {" << '\n' << indent() << "  return eventHandler_;"
+              << '\n' << indent() << "}" << '\n';
+  }
+  f_header_ << '\n';
+  for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
+    generate_java_doc(f_header_, *f_iter);
+    f_header_ << indent() << function_signature(*f_iter, "") << " override;" << '\n';
+  }
+  indent_down();
+
+  if (extends.empty()) {
+    f_header_ << " protected:" << '\n';
+    indent_up();
+    f_header_ << indent() << handler_type << " eventHandler_;" << '\n';
+    indent_down();
+  }
+  f_header_ << " private:" << '\n';
+  indent_up();
+  f_header_ << indent() << "::std::shared_ptr<" << service_name_ << "If> iface_;" << '\n';
+  indent_down();
+  f_header_ << "};" << '\n' << '\n';
+
+  // Generate the method implementations
+  for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
+    t_function* tfunction = *f_iter;
+    t_type* returntype = tfunction->get_returntype();
+    const vector<t_field*>& args = tfunction->get_arglist()->get_members();
+    const vector<t_field*>& xceptions = tfunction->get_xceptions()->get_members();
+    vector<t_field*>::const_iterator a_iter;
+    vector<t_field*>::const_iterator x_iter;
+    string service_func_name = "\"" + tservice->get_name() + "." + tfunction->get_name() + "\"";
+    bool returns_value = !returntype->is_void() && !is_complex_type(returntype);
+
+    f_service_ << function_signature(tfunction, "", class_name + "::") << '\n';
+    scope_up(f_service_);
+    f_service_ << indent() << "void* _ctx = nullptr;" << '\n' << indent()
+               << "if (this->eventHandler_.get() != nullptr) {" << '\n' << indent()
+               << "  _ctx = this->eventHandler_->getContext(" << service_func_name << ", nullptr);"
+               << '\n' << indent() << "}" << '\n' << indent()
+               << "::apache::thrift::TProcessorContextFreer _freer("
+               << "this->eventHandler_.get(), _ctx, " << service_func_name << ");" << '\n' << '\n'
+               << indent() << "if (this->eventHandler_.get() != nullptr) {" << '\n' << indent()
+               << "  this->eventHandler_->preRead(_ctx, " << service_func_name << ");" << '\n'
+               << indent() << "  this->eventHandler_->postRead(_ctx, " << service_func_name
+               << ", 0);" << '\n' << indent() << "}" << '\n' << '\n';
+
+    if (returns_value) {
+      f_service_ << indent() << type_name(returntype) << " _result;" << '\n';
+    }
+
+    // Generate the function call
+    f_service_ << indent() << "try {" << '\n';
+    indent_up();
+    f_service_ << indent() << (returns_value ? "_result = " : "") << "iface_->"
+               << tfunction->get_name() << "(";
+    bool first = true;
+    if (is_complex_type(returntype)) {
+      f_service_ << "_return";
+      first = false;
+    }
+    for (a_iter = args.begin(); a_iter != args.end(); ++a_iter) {
+      if (first) {
+        first = false;
+      } else {
+        f_service_ << ", ";
+      }
+      f_service_ << (*a_iter)->get_name();
+    }
+    f_service_ << ");" << '\n';
+    indent_down();
+    f_service_ << indent() << "}";
+
+    // Declared exceptions are regular results as far as the hooks are concerned
+    if (!tfunction->is_oneway()) {
+      for (x_iter = xceptions.begin(); x_iter != xceptions.end(); ++x_iter) {
+        f_service_ << " catch (const " << type_name((*x_iter)->get_type()) << "&) {" << '\n';
+        indent_up();
+        f_service_ << indent() << "if (this->eventHandler_.get() != nullptr) {" << '\n'
+                   << indent() << "  this->eventHandler_->preWrite(_ctx, " << service_func_name
+                   << ");" << '\n' << indent() << "  this->eventHandler_->postWrite(_ctx, "
+                   << service_func_name << ", 0);" << '\n' << indent() << "}" << '\n' << indent()
+                   << "throw;" << '\n';
+        indent_down();
+        f_service_ << indent() << "}";
+      }
+    }
+
+    // Anything else reaches a remote caller as a TApplicationException, or
+    // not at all for oneway calls, so keep it that way
+    if (!tfunction->is_oneway()) {
+      f_service_ << " catch (const std::exception& e) {" << '\n';
+    } else {
+      f_service_ << " catch (const std::exception&) {" << '\n';
+    }
+    indent_up();
+    f_service_ << indent() << "if (this->eventHandler_.get() != nullptr) {" << '\n' << indent()
+               << "  this->eventHandler_->handlerError(_ctx, " << service_func_name << ");"
+               << '\n' << indent() << "}" << '\n';
+    if (!tfunction->is_oneway()) {
+      f_service_ << indent() << "throw ::apache::thrift::TApplicationException(e.what());" << '\n';
+    } else {
+      f_service_ << indent() << "return;" << '\n';
+    }
+    indent_down();
+    f_service_ << indent() << "}" << '\n' << '\n';
+
+    if (tfunction->is_oneway()) {
+      f_service_ << indent() << "if (this->eventHandler_.get() != nullptr) {" << '\n' << indent()
+                 << "  this->eventHandler_->asyncComplete(_ctx, " << service_func_name << ");"
+                 << '\n' << indent() << "}" << '\n';
+    } else {
+      f_service_ << indent() << "if (this->eventHandler_.get() != nullptr) {" << '\n' << indent()
+                 << "  this->eventHandler_->preWrite(_ctx, " << service_func_name << ");" << '\n'
+                 << indent() << "  this->eventHandler_->postWrite(_ctx, " << service_func_name
+                 << ", 0);" << '\n' << indent() << "}" << '\n';
+      if (returns_value) {
+        f_service_ << indent() << "return _result;" << '\n';
+      }
+    }
+    scope_down(f_service_);
+    f_service_ << '\n';
+  }
+}
+
 /**
  * Generates a service client definition.
  *
@@ -3101,14 +3275,32 @@ public:
     // Generate all of the process subfunctions
     generate_process_functions();
 
+    // Generate the getPlacement() function
+    if (has_placements()) {
+      generate_placement();
+    }
+
     generate_factory();
   }
 
   void generate_class_definition();
   void generate_dispatch_call(bool template_protocol);
   void generate_process_functions();
+  void generate_placement();
   void generate_factory();
 
+  /**
+   * Returns the cpp.placement annotation of a function, "inline" or
+   * "worker", or an empty string if it has none.
+   */
+  static string get_placement(t_function* tfunction);
+
+  /**
+   * Whether the processor overrides getPlacement(), which only the
+   * synchronous processor of a service with annotated functions does.
+   */
+  bool has_placements();
+
 protected:
   std::string type_name(t_type* ttype, bool in_typedef = false, bool arg = false) {
     return generator_->type_name(ttype, in_typedef, arg);
@@ -3327,6 +3519,10 @@ void ProcessorGenerator::generate_class_definition() {
   indent_down();
   f_header_ << indent() << "}" << '\n' << '\n' << indent() << "virtual ~" << class_name_ << "() {}"
             << '\n';
+  if (has_placements()) {
+    f_header_ << indent() << "::apache::thrift::TPlacement getPlacement(const std::string& fname) "
+              << "const override;" << '\n';
+  }
   indent_down();
   f_header_ << "};" << '\n' << '\n';
 
@@ -3428,6 +3624,62 @@ void ProcessorGenerator::generate_process_functions() {
   }
 }
 
+string ProcessorGenerator::get_placement(t_function* tfunction) {
+  std::map<string, std::vector<string>>::iterator it
+      = tfunction->annotations_.find("cpp.placement");
+  if (it == tfunction->annotations_.end() || it->second.empty()) {
+    return "";
+  }
+  const string& placement = it->second.back();
+  if (placement != "inline" && placement != "worker") {
+    throw "cpp.placement of " + tfunction->get_name() + " must be \"inline\" or \"worker\", not \""
+        + placement + "\"";
+  }
+  return placement;
+}
+
+bool ProcessorGenerator::has_placements() {
+  if (style_ == "Cob") {
+    return false;
+  }
+  vector<t_function*> functions = service_->get_functions();
+  vector<t_function*>::iterator f_iter;
+  for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
+    if (!get_placement(*f_iter).empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ProcessorGenerator::generate_placement() {
+  f_out_ << template_header_ << "::apache::thrift::TPlacement " << class_name_ << template_suffix_
+         << "::getPlacement(const std::string& fname) const {" << '\n';
+  indent_up();
+
+  vector<t_function*> functions = service_->get_functions();
+  vector<t_function*>::iterator f_iter;
+  for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
+    string placement = get_placement(*f_iter);
+    if (placement.empty()) {
+      continue;
+    }
+    f_out_ << indent() << "if (fname == \"" << (*f_iter)->get_name() << "\") {" << '\n'
+           << indent() << "  return ::apache::thrift::"
+           << (placement == "inline" ? "T_PLACEMENT_INLINE" : "T_PLACEMENT_WORKER") << ";" << '\n'
+           << indent() << "}" << '\n';
+  }
+
+  if (extends_.empty()) {
+    f_out_ << indent() << "return ::apache::thrift::T_PLACEMENT_ANY;" << '\n';
+  } else {
+    f_out_ << indent() << "return " << extends_ << "::getPlacement(fname);" << '\n';
+  }
+
+  indent_down();
+  f_out_ << "}" << '\n' << '\n';
+}
+
 void ProcessorGenerator::generate_factory() {
   string if_factory_name = if_name_ + "Factory";
 
@@ -4854,4 +5106,6 @@ THRIFT_REGISTER_GENERATOR(
     "    moveable_types:  Generate move constructors and assignment operators.\n"
     "    no_ostream_operators:\n"
     "                     Omit generation of ostream definitions.\n"
-    "    no_skeleton:     Omits generation of skeleton.\n")
+    "    no_skeleton:     Omits generation of skeleton.\n"
+    "    direct_client:   Generate an in-process client that calls a handler directly,\n"
+    "                     bypassing serialization but still invoking event handler hooks.\n")
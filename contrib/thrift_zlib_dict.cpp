@@ -0,0 +1,95 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Trains a preset dictionary for TZlibTransport and the THeaderTransport
+ * ZLIB transform from request logs written by TFileTransport. Each logged
+ * event is used as one sample message.
+ *
+ * Build with:
+ *   g++ -std=c++11 thrift_zlib_dict.cpp -o thrift_zlib_dict -lthriftz -lthrift -lz
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <thrift/transport/TFileTransport.h>
+#include <thrift/transport/TZlibDictionary.h>
+
+using namespace std;
+using namespace apache::thrift::transport;
+
+void usage() {
+  fprintf(stderr,
+      "usage: thrift_zlib_dict [-s size] [-n samples] output log...\n"
+      "  -s maximum dictionary size in bytes (default 32768)\n"
+      "  -n maximum number of events to sample (default 100000)\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t maxSize = TZlibDictionary::MAX_SIZE;
+  size_t maxSamples = 100000;
+
+  int arg = 1;
+  for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+    if (argv[arg] == std::string("-s")) {
+      maxSize = static_cast<uint32_t>(atoi(argv[arg + 1]));
+    } else if (argv[arg] == std::string("-n")) {
+      maxSamples = static_cast<size_t>(atoi(argv[arg + 1]));
+    } else {
+      usage();
+    }
+  }
+  if (argc - arg < 2) {
+    usage();
+  }
+  std::string output = argv[arg++];
+
+  vector<string> samples;
+  for (; arg < argc && samples.size() < maxSamples; ++arg) {
+    TFileTransport log(argv[arg], true);
+    log.setReadTimeout(TFileTransport::NO_TAIL_READ_TIMEOUT);
+    // read() never returns more than the rest of the current event
+    vector<uint8_t> buf(log.getMaxEventSize() ? log.getMaxEventSize() : 16 * 1024 * 1024);
+    while (samples.size() < maxSamples) {
+      uint32_t got = log.read(buf.data(), static_cast<uint32_t>(buf.size()));
+      if (got == 0) {
+        break;
+      }
+      samples.push_back(string(reinterpret_cast<char*>(buf.data()), got));
+    }
+  }
+  cout << "read " << samples.size() << " events" << '\n';
+
+  try {
+    std::shared_ptr<TZlibDictionary> dictionary = TZlibDictionary::train(samples, maxSize);
+    dictionary->save(output);
+    cout << "wrote " << dictionary->getData().size() << " byte dictionary " << output
+         << " (id " << dictionary->getId() << ")" << '\n';
+  } catch (TTransportException& ex) {
+    cerr << ex.what() << '\n';
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
@@ -130,6 +130,16 @@ private:
   const char* method_;
 };
 
+/**
+ * Where a server that can process calls on its IO threads or on a thread
+ * pool should run a call.
+ */
+enum TPlacement {
+  T_PLACEMENT_ANY,    ///< No preference, the server decides
+  T_PLACEMENT_INLINE, ///< On the IO thread, for calls that never block
+  T_PLACEMENT_WORKER  ///< On a thread pool, for calls that are slow or block
+};
+
 /**
  * A processor is a generic object that acts upon two streams of data, one
  * an input and the other an output. The definition of this object is loose,
@@ -155,6 +165,15 @@ public:
     eventHandler_ = eventHandler;
   }
 
+  /**
+   * Returns where a method asks to be run. Generated processors return what
+   * the method's cpp.placement annotation ("inline" or "worker") says.
+   */
+  virtual TPlacement getPlacement(const std::string& fname) const {
+    (void)fname;
+    return T_PLACEMENT_ANY;
+  }
+
 protected:
   TProcessor() = default;
 
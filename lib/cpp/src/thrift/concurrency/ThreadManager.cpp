@@ -23,10 +23,13 @@
 #include <thrift/concurrency/Exception.h>
 #include <thrift/concurrency/Monitor.h>
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
 
 #include <stdexcept>
 #include <deque>
+#include <map>
 #include <set>
 
 namespace apache {
@@ -59,6 +62,13 @@ public:
       idleCount_(0),
       pendingTaskCountMax_(0),
       expiredCount_(0),
+      shedCount_(0),
+      queueDelayTarget_(0),
+      queueDelayInterval_(0),
+      dropping_(false),
+      dropCount_(0),
+      lastDropCount_(0),
+      edf_(false),
       state_(ThreadManager::UNINITIALIZED),
       monitor_(&mutex_),
       maxMonitor_(&mutex_),
@@ -97,12 +107,12 @@ public:
 
   size_t pendingTaskCount() const override {
     Guard g(mutex_);
-    return tasks_.size();
+    return pendingCount();
   }
 
   size_t totalTaskCount() const override {
     Guard g(mutex_);
-    return tasks_.size() + workerCount_ - idleCount_;
+    return pendingCount() + workerCount_ - idleCount_;
   }
 
   size_t pendingTaskCountMax() const override {
@@ -115,6 +125,11 @@ public:
     return expiredCount_;
   }
 
+  size_t shedTaskCount() const override {
+    Guard g(mutex_);
+    return shedCount_;
+  }
+
   void pendingTaskCountMax(const size_t value) {
     Guard g(mutex_);
     pendingTaskCountMax_ = value;
@@ -132,7 +147,37 @@ public:
 
   void setExpireCallback(ExpireCallback expireCallback) override;
 
+  void setQueueDelayTarget(int64_t target, int64_t interval) override;
+
+  void setShedCallback(ExpireCallback shedCallback) override;
+
+  void setEarliestDeadlineFirst(bool edf) override {
+    Guard g(mutex_);
+    edf_ = edf;
+  }
+
 private:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  /**
+   * \returns the number of queued tasks. The caller is responsible for
+   * acquiring a lock on the class mutex_.
+   */
+  size_t pendingCount() const { return tasks_.size() + deadlineTasks_.size(); }
+
+  /**
+   * Takes the next task off the queue: the one due first if any were queued
+   * by deadline, else the oldest. The caller is responsible for acquiring a
+   * lock on the class mutex_ and for checking the queue is not empty.
+   */
+  shared_ptr<Task> popTask();
+
+  /**
+   * Decides whether a task just taken off the queue is shed. The caller is
+   * responsible for acquiring a lock on the class mutex_.
+   */
+  bool shed(const Task& task, time_point now);
+
   /**
    * Remove one or more expired tasks.
    * \param[in]  justOne  if true, try to remove just one task and return
@@ -156,7 +201,20 @@ private:
   size_t idleCount_;
   size_t pendingTaskCountMax_;
   size_t expiredCount_;
+  size_t shedCount_;
   ExpireCallback expireCallback_;
+  ExpireCallback shedCallback_;
+
+  /// CoDel state, see setQueueDelayTarget()
+  std::chrono::milliseconds queueDelayTarget_;
+  std::chrono::milliseconds queueDelayInterval_;
+  time_point firstAboveTime_;
+  time_point dropNext_;
+  bool dropping_;
+  uint32_t dropCount_;
+  uint32_t lastDropCount_;
+
+  bool edf_;
 
   ThreadManager::STATE state_;
   shared_ptr<ThreadFactory> threadFactory_;
@@ -164,6 +222,10 @@ private:
   friend class ThreadManager::Task;
   typedef std::deque<shared_ptr<Task> > TaskQueue;
   TaskQueue tasks_;
+
+  /// Tasks queued by deadline while edf_ was set, earliest first
+  typedef std::multimap<time_point, shared_ptr<Task> > DeadlineQueue;
+  DeadlineQueue deadlineTasks_;
   Mutex mutex_;
   Monitor monitor_;
   Monitor maxMonitor_;
@@ -178,11 +240,12 @@ private:
 class ThreadManager::Task : public Runnable {
 
 public:
-  enum STATE { WAITING, EXECUTING, TIMEDOUT, COMPLETE };
+  enum STATE { WAITING, EXECUTING, TIMEDOUT, SHED, COMPLETE };
 
   Task(shared_ptr<Runnable> runnable, uint64_t expiration = 0ULL)
     : runnable_(runnable),
-      state_(WAITING) {
+      state_(WAITING),
+      queueTime_(std::chrono::steady_clock::now()) {
         if (expiration != 0ULL) {
           expireTime_.reset(new std::chrono::steady_clock::time_point(std::chrono::steady_clock::now() + std::chrono::milliseconds(expiration)));
         }
@@ -201,11 +264,14 @@ public:
 
   const unique_ptr<std::chrono::steady_clock::time_point> & getExpireTime() const { return expireTime_; }
 
+  std::chrono::steady_clock::time_point getQueueTime() const { return queueTime_; }
+
 private:
   shared_ptr<Runnable> runnable_;
   friend class ThreadManager::Worker;
   STATE state_;
   unique_ptr<std::chrono::steady_clock::time_point> expireTime_;
+  std::chrono::steady_clock::time_point queueTime_;
 };
 
 class ThreadManager::Worker : public Runnable {
@@ -219,7 +285,7 @@ public:
 private:
   bool isActive() const {
     return (manager_->workerCount_ <= manager_->workerMaxCount_)
-           || (manager_->state_ == JOINING && !manager_->tasks_.empty());
+           || (manager_->state_ == JOINING && manager_->pendingCount() > 0);
   }
 
 public:
@@ -266,7 +332,7 @@ public:
         */
       active = isActive();
 
-      while (active && manager_->tasks_.empty()) {
+      while (active && manager_->pendingCount() == 0) {
         manager_->idleCount_++;
         manager_->monitor_.wait();
         active = isActive();
@@ -276,23 +342,26 @@ public:
       shared_ptr<ThreadManager::Task> task;
 
       if (active) {
-        if (!manager_->tasks_.empty()) {
-          task = manager_->tasks_.front();
-          manager_->tasks_.pop_front();
+        if (manager_->pendingCount() > 0) {
+          task = manager_->popTask();
           if (task->state_ == ThreadManager::Task::WAITING) {
-            // If the state is changed to anything other than EXECUTING or TIMEDOUT here
+            // If the state is changed to anything other than EXECUTING, TIMEDOUT or SHED here
             // then the execution loop needs to be changed below.
-            task->state_ =
-                (task->getExpireTime() && *(task->getExpireTime()) < std::chrono::steady_clock::now()) ?
-                    ThreadManager::Task::TIMEDOUT :
-                    ThreadManager::Task::EXECUTING;
+            auto now = std::chrono::steady_clock::now();
+            if (task->getExpireTime() && *(task->getExpireTime()) < now) {
+              task->state_ = ThreadManager::Task::TIMEDOUT;
+            } else if (manager_->shed(*task, now)) {
+              task->state_ = ThreadManager::Task::SHED;
+            } else {
+              task->state_ = ThreadManager::Task::EXECUTING;
+            }
           }
         }
 
         /* If we have a pending task max and we just dropped below it, wakeup any
             thread that might be blocked on add. */
         if (manager_->pendingTaskCountMax_ != 0
-            && manager_->tasks_.size() <= manager_->pendingTaskCountMax_ - 1) {
+            && manager_->pendingCount() <= manager_->pendingTaskCountMax_ - 1) {
           manager_->maxMonitor_.notify();
         }
       }
@@ -317,6 +386,15 @@ public:
           // Re-acquire the lock to proceed in the thread manager
           manager_->mutex_.lock();
 
+        } else if (task->state_ == ThreadManager::Task::SHED) {
+          ExpireCallback callback = manager_->shedCallback_ ? manager_->shedCallback_
+                                                            : manager_->expireCallback_;
+          if (callback) {
+            manager_->mutex_.unlock();
+            callback(task->getRunnable());
+            manager_->mutex_.lock();
+          }
+          manager_->shedCount_++;
         } else if (manager_->expireCallback_) {
           // The only other state the task could have been in is TIMEDOUT (see above)
           manager_->mutex_.unlock();
@@ -464,13 +542,13 @@ void ThreadManager::Impl::add(shared_ptr<Runnable> value, int64_t timeout, int64
   }
 
   // if we're at a limit, remove an expired task to see if the limit clears
-  if (pendingTaskCountMax_ > 0 && (tasks_.size() >= pendingTaskCountMax_)) {
+  if (pendingTaskCountMax_ > 0 && (pendingCount() >= pendingTaskCountMax_)) {
     removeExpired(true);
   }
 
-  if (pendingTaskCountMax_ > 0 && (tasks_.size() >= pendingTaskCountMax_)) {
+  if (pendingTaskCountMax_ > 0 && (pendingCount() >= pendingTaskCountMax_)) {
     if (canSleep() && timeout >= 0) {
-      while (pendingTaskCountMax_ > 0 && tasks_.size() >= pendingTaskCountMax_) {
+      while (pendingTaskCountMax_ > 0 && pendingCount() >= pendingTaskCountMax_) {
         // This is thread safe because the mutex is shared between monitors.
         maxMonitor_.wait(timeout);
       }
@@ -479,7 +557,13 @@ void ThreadManager::Impl::add(shared_ptr<Runnable> value, int64_t timeout, int64
     }
   }
 
-  tasks_.push_back(std::make_shared<ThreadManager::Task>(value, expiration));
+  shared_ptr<ThreadManager::Task> task = std::make_shared<ThreadManager::Task>(value, expiration);
+  if (edf_ && task->getExpireTime()) {
+    // Tasks due at the same time keep their order
+    deadlineTasks_.insert(std::make_pair(*task->getExpireTime(), task));
+  } else {
+    tasks_.push_back(task);
+  }
 
   // If idle thread is available notify it, otherwise all worker threads are
   // running and will get around to this task in time.
@@ -496,6 +580,15 @@ void ThreadManager::Impl::remove(shared_ptr<Runnable> task) {
         "started");
   }
 
+  for (auto it = deadlineTasks_.begin(); it != deadlineTasks_.end(); ++it)
+  {
+    if (it->second->getRunnable() == task)
+    {
+      deadlineTasks_.erase(it);
+      return;
+    }
+  }
+
   for (auto it = tasks_.begin(); it != tasks_.end(); ++it)
   {
     if ((*it)->getRunnable() == task)
@@ -514,23 +607,44 @@ std::shared_ptr<Runnable> ThreadManager::Impl::removeNextPending() {
         "ThreadManager not started");
   }
 
-  if (tasks_.empty()) {
+  if (pendingCount() == 0) {
     return std::shared_ptr<Runnable>();
   }
 
-  shared_ptr<ThreadManager::Task> task = tasks_.front();
-  tasks_.pop_front();
+  return popTask()->getRunnable();
+}
 
-  return task->getRunnable();
+shared_ptr<ThreadManager::Task> ThreadManager::Impl::popTask() {
+  shared_ptr<Task> task;
+  if (!deadlineTasks_.empty()) {
+    task = deadlineTasks_.begin()->second;
+    deadlineTasks_.erase(deadlineTasks_.begin());
+  } else {
+    task = tasks_.front();
+    tasks_.pop_front();
+  }
+  return task;
 }
 
 void ThreadManager::Impl::removeExpired(bool justOne) {
   // this is always called under a lock
-  if (tasks_.empty()) {
+  if (pendingCount() == 0) {
     return;
   }
   auto now = std::chrono::steady_clock::now();
 
+  // tasks queued by deadline expire in order
+  while (!deadlineTasks_.empty() && deadlineTasks_.begin()->first < now) {
+    if (expireCallback_) {
+      expireCallback_(deadlineTasks_.begin()->second->getRunnable());
+    }
+    deadlineTasks_.erase(deadlineTasks_.begin());
+    ++expiredCount_;
+    if (justOne) {
+      return;
+    }
+  }
+
   for (auto it = tasks_.begin(); it != tasks_.end(); )
   {
     if ((*it)->getExpireTime() && *((*it)->getExpireTime()) < now) {
@@ -555,6 +669,65 @@ void ThreadManager::Impl::setExpireCallback(ExpireCallback expireCallback) {
   expireCallback_ = expireCallback;
 }
 
+void ThreadManager::Impl::setQueueDelayTarget(int64_t target, int64_t interval) {
+  if (target < 0 || interval <= 0) {
+    throw InvalidArgumentException();
+  }
+  Guard g(mutex_);
+  queueDelayTarget_ = std::chrono::milliseconds(target);
+  queueDelayInterval_ = std::chrono::milliseconds(interval);
+  firstAboveTime_ = time_point();
+  dropping_ = false;
+  dropCount_ = 0;
+  lastDropCount_ = 0;
+}
+
+void ThreadManager::Impl::setShedCallback(ExpireCallback shedCallback) {
+  Guard g(mutex_);
+  shedCallback_ = shedCallback;
+}
+
+bool ThreadManager::Impl::shed(const Task& task, time_point now) {
+  if (queueDelayTarget_.count() == 0) {
+    return false;
+  }
+
+  // The delay only counts as standing if tasks are still waiting behind this one
+  bool aboveTarget = false;
+  if (now - task.getQueueTime() < queueDelayTarget_ || pendingCount() == 0) {
+    firstAboveTime_ = time_point();
+  } else if (firstAboveTime_ == time_point()) {
+    firstAboveTime_ = now + queueDelayInterval_;
+  } else {
+    aboveTarget = now >= firstAboveTime_;
+  }
+
+  // The time between sheds shrinks with the square root of their count
+  auto controlLaw = [this](time_point t, uint32_t count) {
+    return t + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                   queueDelayInterval_ / std::sqrt(static_cast<double>(count)));
+  };
+
+  if (dropping_) {
+    if (!aboveTarget) {
+      dropping_ = false;
+    } else if (now >= dropNext_) {
+      ++dropCount_;
+      dropNext_ = controlLaw(dropNext_, dropCount_);
+      return true;
+    }
+  } else if (aboveTarget) {
+    dropping_ = true;
+    // Resume at the previous rate if the last shedding stopped only recently
+    uint32_t delta = dropCount_ - lastDropCount_;
+    dropCount_ = (delta > 1 && now - dropNext_ < 16 * queueDelayInterval_) ? delta : 1;
+    lastDropCount_ = dropCount_;
+    dropNext_ = controlLaw(now, dropCount_);
+    return true;
+  }
+  return false;
+}
+
 class SimpleThreadManager : public ThreadManager::Impl {
 
 public:
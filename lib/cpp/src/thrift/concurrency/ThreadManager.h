@@ -142,6 +142,13 @@ public:
    */
   virtual size_t expiredTaskCount() const = 0;
 
+  /**
+   * Gets the number of tasks which have been shed because of their queue
+   * delay without being run since start() was called. Thread managers that
+   * do not shed tasks return 0.
+   */
+  virtual size_t shedTaskCount() const { return 0; }
+
   /**
    * Adds a task to be executed at some time in the future by a worker thread.
    *
@@ -190,6 +197,44 @@ public:
    */
   virtual void setExpireCallback(ExpireCallback expireCallback) = 0;
 
+  /**
+   * Sheds tasks once the time they wait in the queue stays above a target,
+   * following CoDel (RFC 8289): when every task taken off the queue for an
+   * interval has waited longer than target, the next one is not run, and
+   * tasks are then shed at increasing frequency until the delay falls below
+   * target again. Short bursts pass, a standing queue is cut back, so the
+   * latency of the tasks that do run stays bounded under overload.
+   *
+   * @param target   acceptable queue delay in milliseconds, 0 to never shed
+   * @param interval milliseconds the delay must stay above target before
+   *                 shedding starts, about the time it takes to serve a
+   *                 burst of tasks
+   *
+   * Thread managers that do not shed tasks ignore this.
+   */
+  virtual void setQueueDelayTarget(int64_t target, int64_t interval = 100LL) {
+    (void)target;
+    (void)interval;
+  }
+
+  /**
+   * Set a callback to be called when a task is shed and not run, e.g. to
+   * fail the request it belongs to. Without one, shed tasks are passed to
+   * the expire callback.
+   *
+   * @param shedCallback a function called with the shared_ptr<Runnable> for
+   * the shed task.
+   */
+  virtual void setShedCallback(ExpireCallback shedCallback) { (void)shedCallback; }
+
+  /**
+   * Runs the pending tasks with an expiration earliest deadline first instead
+   * of in the order they were added. Tasks without one come after all others
+   * and keep their order, so under sustained load they may wait long.
+   * Thread managers that only run tasks in order ignore this.
+   */
+  virtual void setEarliestDeadlineFirst(bool edf) { (void)edf; }
+
   static std::shared_ptr<ThreadManager> newThreadManager();
 
   /**
@@ -210,6 +210,20 @@ public:
     }
   }
 
+  /**
+   * Asks the processor registered for the service of a "service:method"
+   * name, or the default processor for a plain method name.
+   */
+  TPlacement getPlacement(const std::string& fname) const override {
+    std::string::size_type separator = fname.find(':');
+    if (separator == std::string::npos) {
+      return defaultProcessor ? defaultProcessor->getPlacement(fname) : T_PLACEMENT_ANY;
+    }
+    auto it = services.find(fname.substr(0, separator));
+    return it != services.end() ? it->second->getPlacement(fname.substr(separator + 1))
+                                : T_PLACEMENT_ANY;
+  }
+
 private:
   /** Map of service processor objects, indexed by service names. */
   services_t services;
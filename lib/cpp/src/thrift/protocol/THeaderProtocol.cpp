@@ -59,6 +59,13 @@ uint32_t THeaderProtocol::writeMessageBegin(const std::string& name,
                                             const int32_t seqId) {
   resetProtocol(); // Reset in case we changed protocols
   trans_->setSequenceNumber(seqId);
+  if (messageType == T_CALL) {
+    // Tell the server how long we wait for the response
+    int timeout = trans_->getClientTimeout();
+    if (timeout > 0) {
+      trans_->setHeader(THeaderTransport::CLIENT_TIMEOUT_HEADER, std::to_string(timeout));
+    }
+  }
   return proto_->writeMessageBegin(name, messageType, seqId);
 }
 
@@ -87,6 +87,12 @@ public:
   // these work with read headers
   const StringToStringMap& getHeaders() const { return trans_->getHeaders(); }
 
+  /**
+   * The client timeout the last request read was sent with in milliseconds,
+   * 0 if it had none, see THeaderTransport::CLIENT_TIMEOUT_HEADER.
+   */
+  int getRequestTimeout() const { return trans_->getRequestTimeout(); }
+
   /**
    * Writing functions.
    */
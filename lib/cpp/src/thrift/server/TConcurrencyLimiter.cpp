@@ -0,0 +1,113 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thrift/server/TConcurrencyLimiter.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+using apache::thrift::concurrency::Guard;
+
+TVegasConcurrencyLimiter::TVegasConcurrencyLimiter(int64_t initialLimit,
+                                                   int64_t minLimit,
+                                                   int64_t maxLimit)
+  : minLimit_(minLimit),
+    maxLimit_(maxLimit),
+    probeInterval_(30),
+    limit_(static_cast<double>((std::min)((std::max)(initialLimit, minLimit), maxLimit))),
+    noLoadLatency_(0),
+    latency_(0),
+    samples_(0),
+    sinceProbe_(0) {
+  if (minLimit < 1 || maxLimit < minLimit) {
+    throw std::invalid_argument("limits must satisfy 0 < minLimit <= maxLimit");
+  }
+}
+
+void TVegasConcurrencyLimiter::setProbeInterval(uint32_t probeInterval) {
+  if (probeInterval == 0) {
+    throw std::invalid_argument("probeInterval must be positive");
+  }
+  Guard g(mutex_);
+  probeInterval_ = probeInterval;
+}
+
+int64_t TVegasConcurrencyLimiter::getLimit() const {
+  Guard g(mutex_);
+  return static_cast<int64_t>(limit_);
+}
+
+int64_t TVegasConcurrencyLimiter::record(uint64_t usec, int64_t inflight) {
+  Guard g(mutex_);
+  latency_ = (std::max)(usec, static_cast<uint64_t>(1));
+  ++samples_;
+
+  if (++sinceProbe_ >= probeInterval_ * static_cast<uint64_t>(limit_)) {
+    // start over from the current latency, lower ones will follow
+    sinceProbe_ = 0;
+    noLoadLatency_ = latency_;
+    return static_cast<int64_t>(limit_);
+  }
+  if (noLoadLatency_ == 0 || latency_ < noLoadLatency_) {
+    noLoadLatency_ = latency_;
+    return static_cast<int64_t>(limit_);
+  }
+
+  double queue = std::ceil(limit_ * (1.0 - static_cast<double>(noLoadLatency_) / latency_));
+  double step = (std::max)(1.0, std::log10(limit_));
+  bool saturated = 2 * inflight >= static_cast<int64_t>(limit_);
+  double limit = limit_;
+  if (queue <= step) {
+    // hardly anyone waits, grow fast
+    if (saturated) {
+      limit += 6 * step;
+    }
+  } else if (queue < 3 * step) {
+    if (saturated) {
+      limit += step;
+    }
+  } else if (queue > 6 * step) {
+    limit -= step;
+  }
+  limit_ = (std::min)((std::max)(limit, static_cast<double>(minLimit_)),
+                      static_cast<double>(maxLimit_));
+  return static_cast<int64_t>(limit_);
+}
+
+uint64_t TVegasConcurrencyLimiter::getNoLoadLatency() const {
+  Guard g(mutex_);
+  return noLoadLatency_;
+}
+
+uint64_t TVegasConcurrencyLimiter::getLatency() const {
+  Guard g(mutex_);
+  return latency_;
+}
+
+uint64_t TVegasConcurrencyLimiter::getSampleCount() const {
+  Guard g(mutex_);
+  return samples_;
+}
+}
+}
+} // apache::thrift::server
@@ -0,0 +1,132 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TCONCURRENCYLIMITER_H_
+#define _THRIFT_SERVER_TCONCURRENCYLIMITER_H_ 1
+
+#include <stdint.h>
+
+#include <thrift/concurrency/Mutex.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * Decides how many clients a TServerFramework serves at once from the
+ * latency of their requests. The server reports every request once it is
+ * done and takes the limit from the result; record() may be called from
+ * several threads at once.
+ *
+ * The limit applies to connected clients, not to requests in flight: the
+ * server stops accepting connections while as many clients as the limit
+ * are connected, whether or not they have a request outstanding.
+ */
+class TConcurrencyLimiter {
+public:
+  virtual ~TConcurrencyLimiter() = default;
+
+  /**
+   * @return the current limit on concurrent clients
+   */
+  virtual int64_t getLimit() const = 0;
+
+  /**
+   * Called after a request has been processed.
+   *
+   * @param usec     microseconds from the arrival of the request, including
+   *                 any wait for a thread, until its reply was written
+   * @param inflight number of clients connected when it completed, which
+   *                 stands in for the requests in flight
+   * @return the new limit on concurrent clients
+   */
+  virtual int64_t record(uint64_t usec, int64_t inflight) = 0;
+};
+
+/**
+ * Adjusts the limit the way TCP Vegas adjusts its congestion window. The
+ * lowest latency seen stands for the server without load; the amount by
+ * which the latency of a request exceeds it estimates how many clients are
+ * queueing for the server:
+ *
+ *   queue = limit * (1 - noLoadLatency / latency)
+ *
+ * The limit grows while the queue stays below alpha and shrinks once it
+ * exceeds beta, both proportional to the logarithm of the limit, so the
+ * server keeps a small queue in front of it rather than a long one. The
+ * limit only grows while at least half of it is in use. To follow changes
+ * of the no-load latency, it is measured anew every probeInterval * limit
+ * requests.
+ */
+class TVegasConcurrencyLimiter : public TConcurrencyLimiter {
+public:
+  /**
+   * @param initialLimit limit before any request has been measured
+   * @param minLimit     the limit never falls below this
+   * @param maxLimit     the limit never grows above this
+   */
+  TVegasConcurrencyLimiter(int64_t initialLimit = 20,
+                           int64_t minLimit = 1,
+                           int64_t maxLimit = 1000);
+
+  /**
+   * Sets how often the no-load latency is measured anew, in multiples of the
+   * limit, 30 by default.
+   *
+   * @throws std::invalid_argument if probeInterval is 0
+   */
+  void setProbeInterval(uint32_t probeInterval);
+
+  int64_t getLimit() const override;
+
+  int64_t record(uint64_t usec, int64_t inflight) override;
+
+  /**
+   * @return the lowest latency measured since the last probe in
+   *         microseconds, 0 if none has been
+   */
+  uint64_t getNoLoadLatency() const;
+
+  /**
+   * @return the latency of the latest request in microseconds
+   */
+  uint64_t getLatency() const;
+
+  /**
+   * @return the number of requests recorded
+   */
+  uint64_t getSampleCount() const;
+
+private:
+  int64_t minLimit_;
+  int64_t maxLimit_;
+  uint32_t probeInterval_;
+
+  mutable concurrency::Mutex mutex_;
+  double limit_;
+  uint64_t noLoadLatency_;
+  uint64_t latency_;
+  uint64_t samples_;
+  uint64_t sinceProbe_;
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TCONCURRENCYLIMITER_H_
@@ -42,25 +42,76 @@ TConnectedClient::TConnectedClient(const shared_ptr<TProcessor>& processor,
     outputProtocol_(outputProtocol),
     eventHandler_(eventHandler),
     client_(client),
-    opaqueContext_(nullptr) {
+    opaqueContext_(nullptr),
+    parked_(false) {
 }
 
-TConnectedClient::~TConnectedClient() = default;
+TConnectedClient::~TConnectedClient() {
+  if (parked_) {
+    cleanup();
+  }
+}
+
+void TConnectedClient::setIdleHandler(const IdleHandler& idleHandler) {
+  idleHandler_ = idleHandler;
+}
+
+void TConnectedClient::setLatencyHandler(const LatencyHandler& latencyHandler) {
+  latencyHandler_ = latencyHandler;
+}
+
+void TConnectedClient::setQueueTime(const std::chrono::steady_clock::time_point& queueTime) {
+  queueTime_ = queueTime;
+}
+
+bool TConnectedClient::isInputIdle() {
+  // borrow() never blocks; it fails if the transport holds no buffered byte
+  uint32_t len = 1;
+  return inputProtocol_->getTransport()->borrow(nullptr, &len) == nullptr;
+}
 
 void TConnectedClient::run() {
-  if (eventHandler_) {
+  // a client resumed after being handed off has data to read
+  bool resumed = parked_;
+  parked_ = false;
+  std::chrono::steady_clock::time_point queueTime = queueTime_;
+  queueTime_ = std::chrono::steady_clock::time_point();
+  if (!resumed && eventHandler_) {
     opaqueContext_ = eventHandler_->createContext(inputProtocol_, outputProtocol_);
   }
 
-  for (bool done = false; !done;) {
+  for (bool done = false; !done; resumed = false) {
+    if (idleHandler_ && !resumed && isInputIdle()) {
+      parked_ = true;
+      if (idleHandler_(client_)) {
+        return; // another thread may own the client already
+      }
+      parked_ = false;
+    }
+
     if (eventHandler_) {
       eventHandler_->processContext(opaqueContext_, client_);
     }
 
     try {
+      std::chrono::steady_clock::time_point start;
+      if (latencyHandler_) {
+        if (!inputProtocol_->getTransport()->peek()) {
+          break; // the client disconnected or was interrupted
+        }
+        start = queueTime != std::chrono::steady_clock::time_point()
+                    ? queueTime
+                    : std::chrono::steady_clock::now();
+      }
+      queueTime = std::chrono::steady_clock::time_point();
       if (!processor_->process(inputProtocol_, outputProtocol_, opaqueContext_)) {
         break;
       }
+      if (latencyHandler_) {
+        latencyHandler_(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count()));
+      }
     } catch (const TTransportException& ttx) {
       switch (ttx.getType()) {
         case TTransportException::END_OF_FILE:
@@ -91,11 +142,24 @@ void TConnectedClient::run() {
   cleanup();
 }
 
+void TConnectedClient::drop() {
+  if (parked_) {
+    parked_ = false;
+    cleanup();
+  } else {
+    closeTransports();
+  }
+}
+
 void TConnectedClient::cleanup() {
   if (eventHandler_) {
     eventHandler_->deleteContext(opaqueContext_, inputProtocol_, outputProtocol_);
   }
 
+  closeTransports();
+}
+
+void TConnectedClient::closeTransports() {
   try {
     inputProtocol_->getTransport()->close();
   } catch (const TTransportException& ttx) {
@@ -20,6 +20,8 @@
 #ifndef _THRIFT_SERVER_TCONNECTEDCLIENT_H_
 #define _THRIFT_SERVER_TCONNECTEDCLIENT_H_ 1
 
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <thrift/TProcessor.h>
 #include <thrift/protocol/TProtocol.h>
@@ -56,17 +58,49 @@ public:
       const std::shared_ptr<apache::thrift::transport::TTransport>& client);
 
   /**
-   * Destructor.
+   * Destructor.  A client destroyed while handed off by the idle handler is
+   * cleaned up here.
    */
   ~TConnectedClient() override;
 
+  typedef std::function<bool(const std::shared_ptr<apache::thrift::transport::TTransport>&)>
+      IdleHandler;
+
+  /**
+   * Set a function run() calls with the client transport when no request data
+   * is buffered in the input transport between requests.  If it returns true
+   * the client has been handed off to wait for its next request elsewhere:
+   * run() returns at once without cleaning up, and must be called again to
+   * continue once data arrives.
+   */
+  void setIdleHandler(const IdleHandler& idleHandler);
+
+  typedef std::function<void(uint64_t)> LatencyHandler;
+
+  /**
+   * Set a function run() calls with the microseconds each request took, from
+   * its arrival until the reply was written.  To tell the arrival apart from
+   * the time spent waiting for it, run() peeks at the input transport before
+   * each request.
+   */
+  void setLatencyHandler(const LatencyHandler& latencyHandler);
+
+  /**
+   * Marks when the client was queued to run, so that the latency of the
+   * first request it runs includes the time it waited for a thread.
+   */
+  void setQueueTime(const std::chrono::steady_clock::time_point& queueTime);
+
   /**
    * Drive the client until it is done.
    * The client processing loop is:
    *
    * [optional] call eventHandler->createContext once
+   * [optional] call idleHandler when idle, return if it took the client
    * [optional] call eventHandler->processContext per request
+   * [optional] call peek on the input transport per request
    *            call processor->process per request
+   * [optional] call latencyHandler per request
    *              handle expected transport exceptions:
    *                END_OF_FILE means the client is gone
    *                INTERRUPTED means the client was interrupted
@@ -78,6 +112,14 @@ public:
    */
   void run() override /* override */;
 
+  /**
+   * Closes a client that was queued to run but will not be, e.g. because its
+   * task was shed, so that the peer sees the connection end at once.  A client
+   * that was handed off is cleaned up as its destructor would; one that never
+   * ran has no context to delete and only has its transports closed.
+   */
+  void drop();
+
 protected:
   /**
    * Cleanup after a client.  This happens if the client disconnects,
@@ -92,6 +134,16 @@ protected:
   virtual void cleanup();
 
 private:
+  /**
+   * \returns  true if the input transport has no request data buffered
+   */
+  bool isInputIdle();
+
+  /**
+   * Close the input, output and client transports, logging failures
+   */
+  void closeTransports();
+
   std::shared_ptr<apache::thrift::TProcessor> processor_;
   std::shared_ptr<apache::thrift::protocol::TProtocol> inputProtocol_;
   std::shared_ptr<apache::thrift::protocol::TProtocol> outputProtocol_;
@@ -102,6 +154,17 @@ private:
    * Context acquired from the eventHandler_ if one exists.
    */
   void* opaqueContext_;
+
+  IdleHandler idleHandler_;
+
+  LatencyHandler latencyHandler_;
+
+  std::chrono::steady_clock::time_point queueTime_;
+
+  /**
+   * Whether the client was handed off by the idle handler
+   */
+  bool parked_;
 };
 }
 }
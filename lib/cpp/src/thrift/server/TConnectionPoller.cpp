@@ -0,0 +1,258 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <vector>
+#include <thrift/concurrency/FunctionRunner.h>
+#include <thrift/concurrency/ThreadFactory.h>
+#include <thrift/server/TConnectionPoller.h>
+#include <thrift/transport/TTransportException.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+using apache::thrift::concurrency::FunctionRunner;
+using apache::thrift::concurrency::Guard;
+using apache::thrift::concurrency::ThreadFactory;
+using apache::thrift::transport::TTransportException;
+using std::shared_ptr;
+
+TConnectionPoller::TConnectionPoller(const ReadyCallback& ready)
+  : ready_(ready), running_(false), epollFd_(-1), wakeFd_(-1) {
+}
+
+TConnectionPoller::~TConnectionPoller() {
+  stop();
+}
+
+bool TConnectionPoller::isSupported() {
+#ifdef HAVE_SYS_EPOLL_H
+  return true;
+#else
+  return false;
+#endif
+}
+
+size_t TConnectionPoller::getParkedCount() const {
+  Guard g(mutex_);
+  return parked_.size();
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static void closeFd(int& fd) {
+  if (fd != -1) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+static void wake(int wakeFd) {
+  uint64_t one = 1;
+  if (::write(wakeFd, &one, sizeof(one)) == -1) {
+    GlobalOutput.perror("TConnectionPoller wake write() ", errno);
+  }
+}
+
+void TConnectionPoller::start() {
+  Guard g(mutex_);
+  if (running_) {
+    return;
+  }
+
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  wakeFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  struct epoll_event event;
+  std::memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = wakeFd_;
+  if (epollFd_ == -1 || wakeFd_ == -1
+      || epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &event) == -1) {
+    int errno_copy = errno;
+    GlobalOutput.perror("TConnectionPoller::start() ", errno_copy);
+    closeFd(wakeFd_);
+    closeFd(epollFd_);
+    throw TTransportException(TTransportException::UNKNOWN,
+                              "Could not create the connection poller",
+                              errno_copy);
+  }
+
+  running_ = true;
+  thread_ = ThreadFactory(false).newThread(
+      FunctionRunner::create(std::bind(&TConnectionPoller::pollClients, this)));
+  thread_->start();
+}
+
+void TConnectionPoller::stop() {
+  std::map<THRIFT_SOCKET, Parked> parked;
+  {
+    Guard g(mutex_);
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+    wake(wakeFd_);
+  }
+  thread_->join();
+  thread_.reset();
+  {
+    Guard g(mutex_);
+    for (auto& entry : parked_) {
+      epoll_ctl(epollFd_, EPOLL_CTL_DEL, entry.first, nullptr);
+    }
+    parked.swap(parked_);
+    deadlines_.clear();
+    closeFd(wakeFd_);
+    closeFd(epollFd_);
+  }
+  // the clients close as they are released here
+}
+
+bool TConnectionPoller::park(const shared_ptr<TConnectedClient>& client,
+                             THRIFT_SOCKET socket,
+                             int64_t timeout) {
+  Guard g(mutex_);
+  if (!running_) {
+    return false;
+  }
+
+  struct epoll_event event;
+  std::memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.fd = socket;
+  if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, socket, &event) == -1) {
+    GlobalOutput.perror("TConnectionPoller::park() epoll_ctl() ", errno);
+    return false;
+  }
+
+  Parked& entry = parked_[socket];
+  entry.client = client;
+  entry.deadline = TimePoint::max();
+  if (timeout > 0) {
+    entry.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    if (deadlines_.empty() || entry.deadline < deadlines_.begin()->first) {
+      wake(wakeFd_); // the poller is waiting for a later deadline
+    }
+    deadlines_.insert(std::make_pair(entry.deadline, socket));
+  }
+  return true;
+}
+
+shared_ptr<TConnectedClient> TConnectionPoller::unpark(THRIFT_SOCKET socket) {
+  shared_ptr<TConnectedClient> client;
+  auto it = parked_.find(socket);
+  if (it != parked_.end()) {
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, socket, nullptr);
+    deadlines_.erase(std::make_pair(it->second.deadline, socket));
+    client.swap(it->second.client);
+    parked_.erase(it);
+  }
+  return client;
+}
+
+void TConnectionPoller::pollClients() {
+  std::vector<struct epoll_event> events(64);
+  std::vector<shared_ptr<TConnectedClient> > clients;
+  for (;;) {
+    int timeout = -1;
+    {
+      Guard g(mutex_);
+      if (!running_) {
+        break;
+      }
+      TimePoint now = std::chrono::steady_clock::now();
+      while (!deadlines_.empty() && deadlines_.begin()->first <= now) {
+        clients.push_back(unpark(deadlines_.begin()->second));
+      }
+      if (!deadlines_.empty()) {
+        int64_t wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           deadlines_.begin()->first - now).count() + 1;
+        timeout = static_cast<int>((std::min)(wait, static_cast<int64_t>(INT_MAX)));
+      }
+    }
+    // the clients that timed out close as they are released here
+    clients.clear();
+
+    int count = epoll_wait(epollFd_, &events[0], static_cast<int>(events.size()), timeout);
+    if (count == -1) {
+      int errno_copy = errno;
+      if (errno_copy == EINTR) {
+        continue;
+      }
+      GlobalOutput.perror("TConnectionPoller epoll_wait() ", errno_copy);
+      break;
+    }
+
+    {
+      Guard g(mutex_);
+      for (int i = 0; i < count; ++i) {
+        if (events[i].data.fd == wakeFd_) {
+          uint64_t value;
+          if (::read(wakeFd_, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+            GlobalOutput.perror("TConnectionPoller wake read() ", errno);
+          }
+        } else if (shared_ptr<TConnectedClient> client = unpark(events[i].data.fd)) {
+          clients.push_back(client);
+        }
+      }
+    }
+    for (auto& client : clients) {
+      ready_(client);
+    }
+    clients.clear();
+  }
+}
+
+#else
+
+void TConnectionPoller::start() {
+}
+
+void TConnectionPoller::stop() {
+}
+
+bool TConnectionPoller::park(const shared_ptr<TConnectedClient>&, THRIFT_SOCKET, int64_t) {
+  return false;
+}
+
+shared_ptr<TConnectedClient> TConnectionPoller::unpark(THRIFT_SOCKET) {
+  return shared_ptr<TConnectedClient>();
+}
+
+void TConnectionPoller::pollClients() {
+}
+
+#endif
+
+}
+}
+} // apache::thrift::server
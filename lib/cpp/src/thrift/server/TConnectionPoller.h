@@ -0,0 +1,125 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TCONNECTIONPOLLER_H_
+#define _THRIFT_SERVER_TCONNECTIONPOLLER_H_ 1
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <utility>
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/concurrency/Thread.h>
+#include <thrift/server/TConnectedClient.h>
+#include <thrift/transport/PlatformSocket.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * Holds connected clients that are idle between requests, so that they do not
+ * occupy a thread while they wait.  A single thread waits for any of their
+ * sockets to become readable with epoll and hands the client back through the
+ * ready callback to continue.  A client parked longer than its timeout, or
+ * still parked when the poller stops, is released, which closes it.
+ *
+ * Parking is only available where epoll is; elsewhere park() always declines
+ * and clients keep their thread.
+ */
+class TConnectionPoller {
+public:
+  typedef std::function<void(const std::shared_ptr<TConnectedClient>&)> ReadyCallback;
+
+  TConnectionPoller(const ReadyCallback& ready);
+
+  ~TConnectionPoller();
+
+  /**
+   * \returns  whether clients can be parked on this platform
+   */
+  static bool isSupported();
+
+  /**
+   * Starts the polling thread.
+   * \throws TTransportException if the poller cannot be set up
+   */
+  void start();
+
+  /**
+   * Stops the polling thread and releases the clients still parked.
+   */
+  void stop();
+
+  /**
+   * Parks a client until data arrives on its socket.
+   * \param[in]  client   the client, handed to the ready callback later
+   * \param[in]  socket   the client's socket
+   * \param[in]  timeout  milliseconds to wait for data before the client is
+   *                      released, 0 to wait for as long as the poller runs
+   * \returns  false if the client could not be parked and must continue on the
+   *           calling thread
+   */
+  bool park(const std::shared_ptr<TConnectedClient>& client, THRIFT_SOCKET socket, int64_t timeout);
+
+  /**
+   * \returns  the number of clients currently parked
+   */
+  size_t getParkedCount() const;
+
+private:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  struct Parked {
+    std::shared_ptr<TConnectedClient> client;
+    TimePoint deadline;
+  };
+
+  /**
+   * The polling thread: hands on clients whose socket became readable and
+   * releases those past their deadline.
+   */
+  void pollClients();
+
+  /**
+   * Removes a client from the poller, returning it.  Needs mutex_.
+   */
+  std::shared_ptr<TConnectedClient> unpark(THRIFT_SOCKET socket);
+
+  ReadyCallback ready_;
+  mutable apache::thrift::concurrency::Mutex mutex_;
+  bool running_;
+  int epollFd_;
+  int wakeFd_;
+  std::shared_ptr<apache::thrift::concurrency::Thread> thread_;
+  std::map<THRIFT_SOCKET, Parked> parked_;
+
+  /**
+   * Deadlines of the parked clients that have a timeout, earliest first
+   */
+  std::set<std::pair<TimePoint, THRIFT_SOCKET> > deadlines_;
+};
+
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TCONNECTIONPOLLER_H_
@@ -20,12 +20,16 @@
 #include <thrift/thrift-config.h>
 
 #include <thrift/server/TNonblockingServer.h>
+#include <thrift/TApplicationException.h>
+#include <thrift/protocol/THeaderProtocol.h>
+#include <thrift/server/TRequestContext.h>
 #include <thrift/concurrency/Exception.h>
 #include <thrift/transport/TSocket.h>
 #include <thrift/concurrency/ThreadFactory.h>
 #include <thrift/transport/PlatformSocket.h>
 
 #include <algorithm>
+#include <chrono>
 #include <iostream>
 
 #ifdef HAVE_POLL_H
@@ -63,6 +67,10 @@
 #include <sched.h>
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #ifndef AF_LOCAL
 #define AF_LOCAL AF_UNIX
 #endif
@@ -86,35 +94,124 @@ using apache::thrift::transport::TSocket;
 using apache::thrift::transport::TTransportException;
 using std::shared_ptr;
 
-/// Three states for sockets: recv frame size, recv data, and send mode
-enum TSocketState { SOCKET_RECV_FRAMING, SOCKET_RECV, SOCKET_SEND };
+/**
+ * Six states for sockets: handshake, recv frame size, recv data, send mode,
+ * and with pipelining recv all available frames and send all responses
+ */
+enum TSocketState {
+  SOCKET_HANDSHAKE,
+  SOCKET_RECV_FRAMING,
+  SOCKET_RECV,
+  SOCKET_SEND,
+  SOCKET_RECV_BATCH,
+  SOCKET_SEND_BATCH
+};
 
 /**
- * Five states for the nonblocking server:
- *  1) initialize
- *  2) read 4 byte frame size
- *  3) read frame of data
- *  4) send back data (if any)
- *  5) force immediate connection close
+ * Six states for the nonblocking server:
+ *  1) establish the connection (handshake)
+ *  2) initialize
+ *  3) read 4 byte frame size
+ *  4) read frame of data
+ *  5) send back data (if any)
+ *  6) force immediate connection close
+ * With pipelining, 3) to 5) are replaced by reading until at least one frame
+ * is complete, processing all complete frames as a batch and sending back
+ * the responses of the batch. A connection whose read buffer would exceed
+ * the memory budget of the server waits for memory before reading on.
  */
 enum TAppState {
+  APP_HANDSHAKE,
+  APP_WAIT_HANDSHAKE,
   APP_INIT,
   APP_READ_FRAME_SIZE,
   APP_READ_REQUEST,
   APP_WAIT_TASK,
   APP_SEND_RESULT,
+  APP_READ_BATCH,
+  APP_WAIT_BATCH,
+  APP_SEND_BATCH,
+  APP_WAIT_MEMORY,
   APP_CLOSE_CONNECTION
 };
 
+/// Bytes read beyond the current frame to pick up pipelined requests
+static const uint32_t PIPELINE_READ_AHEAD = 4096;
+
+/// Most responses handed to one sendmsg() call
+static const int PIPELINE_MAX_IOV = 64;
+
+/**
+ * Binds the calling thread to a CPU.
+ *
+ * @return whether the thread is bound.
+ */
+static bool setCurrentThreadAffinity(int cpu) {
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (error != 0) {
+    GlobalOutput.perror("TNonblocking: pthread_setaffinity_np(): ", error);
+    return false;
+  }
+  return true;
+#else
+  THRIFT_UNUSED_VARIABLE(cpu);
+  return false;
+#endif
+}
+
+/**
+ * Creates the workers of an IO thread, which bind themselves to the CPU of
+ * their IO thread before running.
+ */
+class TPinnedThreadFactory : public ThreadFactory {
+public:
+  TPinnedThreadFactory(int cpu) : cpu_(cpu) {}
+
+  std::shared_ptr<Thread> newThread(std::shared_ptr<Runnable> runnable) const override {
+    std::shared_ptr<Thread> result = std::make_shared<PinnedThread>(isDetached(), runnable, cpu_);
+    runnable->thread(result);
+    return result;
+  }
+
+private:
+  class PinnedThread : public Thread {
+  public:
+    PinnedThread(bool detached, std::shared_ptr<Runnable> runnable, int cpu)
+      : Thread(detached, runnable), cpu_(cpu) {}
+
+  protected:
+    thread_funct_t getThreadFunc() const override { return pinnedMain; }
+
+  private:
+    static void pinnedMain(std::shared_ptr<Thread> thread) {
+      setCurrentThreadAffinity(std::static_pointer_cast<PinnedThread>(thread)->cpu_);
+      Thread::threadMain(thread);
+    }
+
+    int cpu_;
+  };
+
+  int cpu_;
+};
+
 /**
  * Represents a connection that is handled via libevent. This connection
  * essentially encapsulates a socket that has some associated libevent state.
  */
 class TNonblockingServer::TConnection {
 private:
+  friend class TNonblockingIOThread;
+
   /// Server IO Thread handling this connection
   TNonblockingIOThread* ioThread_;
 
+  /// Next connection in the completion queue of ioThread_
+  TConnection* nextCompletion_;
+
   /// Server handle
   TNonblockingServer* server_;
 
@@ -160,6 +257,12 @@ private:
   /// Largest size of write buffer seen since buffer was constructed
   size_t largestWriteBufferSize_;
 
+  /// Bytes of the buffers of this connection charged to the memory budget
+  size_t memory_;
+
+  /// Size the read buffer failed to grow to within the memory budget
+  size_t memoryWanted_;
+
   /// Count of the number of calls for use with getResizeBufferEveryN().
   int32_t callsForResize_;
 
@@ -185,6 +288,61 @@ private:
   /// Thrift call context, if any
   void* connectionContext_;
 
+  /// IO thread serving this connection once its handshake has completed
+  TNonblockingIOThread* establishedIOThread_;
+
+  /// When the connection was accepted
+  std::chrono::steady_clock::time_point handshakeStart_;
+
+  /// Outcome of the last handshake step
+  TNonblockingServerTransport::HandshakeStatus handshakeStatus_;
+
+  /// Set if the last handshake step failed
+  bool handshakeFailed_;
+
+  /// Method of the current request, if there is a placement policy
+  std::string method_;
+
+  /// Deadline of the current request, if it has one
+  std::chrono::steady_clock::time_point deadline_;
+
+  /// Transport and protocol reading the method of a request for the placement policy
+  std::shared_ptr<TMemoryBuffer> peekTransport_;
+  std::shared_ptr<TProtocol> peekProtocol_;
+
+  /// A pipelined request and the transports it is processed on
+  struct PipelinedCall {
+    std::shared_ptr<TMemoryBuffer> input;
+    std::shared_ptr<TMemoryBuffer> output;
+    std::shared_ptr<TProtocol> inputProtocol;
+    std::shared_ptr<TProtocol> outputProtocol;
+    std::string method;
+    TPlacement placement;
+    std::chrono::steady_clock::time_point deadline;
+    bool failed;
+  };
+
+  /// Requests of the current batch; later batches reuse them
+  std::vector<std::unique_ptr<PipelinedCall> > calls_;
+
+  /// Number of requests in the current batch
+  size_t numCalls_;
+
+  /// Number of requests of the current batch still being processed
+  std::atomic<size_t> pendingCalls_;
+
+  /// End of the current batch in the read buffer
+  uint32_t batchEnd_;
+
+  /// Responses of the current batch
+  std::vector<std::pair<const uint8_t*, uint32_t> > sendSegments_;
+
+  /// Response being sent
+  size_t sendSegment_;
+
+  /// How far through sending the current response are we?
+  uint32_t sendSegmentPos_;
+
   /// Go into read mode
   void setRead() { setFlags(EV_READ | EV_PERSIST); }
 
@@ -209,16 +367,103 @@ private:
    */
   void workSocket();
 
+  /**
+   * Runs the next step of the connection handshake, recording its outcome
+   * in handshakeStatus_ and handshakeFailed_. May be called from a thread of
+   * the handshake thread manager.
+   */
+  void stepHandshake();
+
+  /// Time since the connection was accepted in microseconds.
+  uint64_t getHandshakeTime() const;
+
+  /**
+   * Checks a frame size against the server limit, logging it if exceeded.
+   *
+   * @return true if the frame size is acceptable.
+   */
+  bool checkFrameSize(uint32_t frameSize);
+
+  /**
+   * Grow the read buffer by doubling until it holds at least size bytes.
+   *
+   * @return false if the memory budget does not allow it.
+   */
+  bool growReadBuffer(uint32_t size);
+
+  /// Stop reading until the memory the read buffer failed to reserve is available.
+  void waitForMemory();
+
+  /// Charge changes in the size of the buffers to the memory budget.
+  void updateMemory();
+
+  /// Size of the frame starting at pos in the read buffer.
+  uint32_t frameSizeAt(uint32_t pos) const;
+
+  /// Whether the read buffer starts with a complete frame.
+  bool hasCompleteFrame() const;
+
+  /// Create a pipelined request with its own transports and protocols.
+  std::unique_ptr<PipelinedCall> newCall();
+
+  /**
+   * Decides whether a request runs on the IO thread or the thread manager,
+   * asking the placement policy if there is one.
+   *
+   * @param input the request, which is left unread.
+   * @param method set to the method called if there is a placement policy.
+   * @param deadline set to when the client stops waiting if it sent a
+   *                 timeout and the server honors them, time_point() if not.
+   * @return T_PLACEMENT_INLINE or T_PLACEMENT_WORKER.
+   */
+  TPlacement placeCall(TMemoryBuffer& input,
+                       std::string& method,
+                       std::chrono::steady_clock::time_point& deadline);
+
+  /// Tell the placement policy, if any, how long a call started at start took.
+  void recordCall(const std::string& method,
+                  TPlacement placement,
+                  std::chrono::steady_clock::time_point start);
+
+  /**
+   * Starts processing the complete frames in the read buffer as a batch.
+   *
+   * @return true if the batch has been processed (serially), false if it is
+   *         waiting on the thread manager or the connection was closed.
+   */
+  bool startBatch();
+
+  /**
+   * Collects the responses of a processed batch into sendSegments_.
+   *
+   * @return false if a request of the batch failed.
+   */
+  bool finishBatch();
+
+  /// Process one request of a batch, marking it failed on error.
+  void processCall(PipelinedCall& call);
+
+  /// Called when a request of a batch is done, notifies the IO thread on the last one.
+  void callDone();
+
+  /// Send as much of the responses of the batch as the socket takes.
+  void writeBatch();
+
 public:
   class Task;
+  class HandshakeTask;
+  class PipelinedTask;
 
   /// Constructor
   TConnection(std::shared_ptr<TSocket> socket,
               TNonblockingIOThread* ioThread) {
     readBuffer_ = nullptr;
     readBufferSize_ = 0;
+    memory_ = 0;
+    memoryWanted_ = 0;
 
     ioThread_ = ioThread;
+    nextCompletion_ = nullptr;
     server_ = ioThread->getServer();
 
     // Allocate input and output transports these only need to be allocated
@@ -232,7 +477,10 @@ public:
     init(ioThread);
   }
 
-  ~TConnection() { std::free(readBuffer_); }
+  ~TConnection() {
+    std::free(readBuffer_);
+    server_->releaseMemory(memory_);
+  }
 
   /// Close this connection and free or reset its resources.
   void close();
@@ -251,6 +499,15 @@ public:
   /// set socket for connection
   void setSocket(std::shared_ptr<TSocket> socket);
 
+  /**
+   * Starts establishing the connection on the IO thread listening for
+   * connections. Once the handshake has completed the connection moves on to
+   * the IO thread it was created for.
+   *
+   * @param listenThread the IO thread calling this.
+   */
+  void startHandshake(TNonblockingIOThread* listenThread);
+
   /**
    * This is called when the application transitions from one state into
    * another. This means that it has finished writing the data that it needed
@@ -314,20 +571,65 @@ public:
   void* getConnectionContext() { return connectionContext_; }
 };
 
+/**
+ * Answers the request on input with an exception telling the client the
+ * server is overloaded, without processing it. Oneway requests are dropped.
+ */
+static void writeOverloaded(const std::shared_ptr<TProtocol>& input,
+                            const std::shared_ptr<TProtocol>& output) {
+  try {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    input->readMessageBegin(name, type, seqid);
+    if (type == T_ONEWAY) {
+      return;
+    }
+    TApplicationException x(TApplicationException::INTERNAL_ERROR,
+                            "TNonblockingServer: overloaded, request shed");
+    output->writeMessageBegin(name, T_EXCEPTION, seqid);
+    x.write(output.get());
+    output->writeMessageEnd();
+    output->getTransport()->writeEnd();
+    output->getTransport()->flush();
+  } catch (const TException& tx) {
+    GlobalOutput.printf("TNonblockingServer: failed to answer shed request: %s", tx.what());
+  }
+}
+
+/**
+ * Milliseconds until deadline as a task expiration, 0 if there is none. A
+ * deadline that passed already expires the task right away.
+ */
+static int64_t expirationOf(std::chrono::steady_clock::time_point deadline) {
+  if (deadline == std::chrono::steady_clock::time_point()) {
+    return 0;
+  }
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+  return left.count() > 0 ? left.count() : 1;
+}
+
 class TNonblockingServer::TConnection::Task : public Runnable {
 public:
   Task(std::shared_ptr<TProcessor> processor,
        std::shared_ptr<TProtocol> input,
        std::shared_ptr<TProtocol> output,
-       TConnection* connection)
+       TConnection* connection,
+       const std::string& method = std::string(),
+       std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point())
     : processor_(processor),
       input_(input),
       output_(output),
       connection_(connection),
       serverEventHandler_(connection_->getServerEventHandler()),
-      connectionContext_(connection_->getConnectionContext()) {}
+      connectionContext_(connection_->getConnectionContext()),
+      method_(method),
+      deadline_(deadline) {}
 
   void run() override {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TRequestContext context(deadline_);
     try {
       for (;;) {
         if (serverEventHandler_) {
@@ -350,7 +652,20 @@ public:
     } catch (...) {
       GlobalOutput.printf("TNonblockingServer: unknown exception while processing.");
     }
+    connection_->recordCall(method_, T_PLACEMENT_WORKER, start);
+    done();
+  }
+
+  /// Answer the request with an overload exception instead of processing it.
+  void shed() {
+    writeOverloaded(input_, output_);
+    done();
+  }
+
+  TConnection* getTConnection() { return connection_; }
 
+private:
+  void done() {
     // Signal completion back to the libevent thread via a pipe
     if (!connection_->notifyIOThread()) {
       GlobalOutput.printf("TNonblockingServer: failed to notifyIOThread, closing.");
@@ -360,15 +675,61 @@ public:
     }
   }
 
-  TConnection* getTConnection() { return connection_; }
-
-private:
   std::shared_ptr<TProcessor> processor_;
   std::shared_ptr<TProtocol> input_;
   std::shared_ptr<TProtocol> output_;
   TConnection* connection_;
   std::shared_ptr<TServerEventHandler> serverEventHandler_;
   void* connectionContext_;
+  std::string method_;
+  std::chrono::steady_clock::time_point deadline_;
+};
+
+class TNonblockingServer::TConnection::PipelinedTask : public Runnable {
+public:
+  PipelinedTask(TConnection* connection, PipelinedCall* call)
+    : connection_(connection), call_(call) {}
+
+  void run() override {
+    connection_->processCall(*call_);
+    connection_->callDone();
+  }
+
+  /// Fail the request without processing it, closing the connection once
+  /// the rest of its batch is done.
+  void expire() {
+    call_->failed = true;
+    connection_->callDone();
+  }
+
+  /// Answer the request with an overload exception instead of processing it.
+  void shed() {
+    writeOverloaded(call_->inputProtocol, call_->outputProtocol);
+    connection_->callDone();
+  }
+
+private:
+  TConnection* connection_;
+  PipelinedCall* call_;
+};
+
+class TNonblockingServer::TConnection::HandshakeTask : public Runnable {
+public:
+  HandshakeTask(TConnection* connection) : connection_(connection) {}
+
+  void run() override {
+    connection_->stepHandshake();
+
+    // Signal completion back to the listening libevent thread via a pipe
+    if (!connection_->notifyIOThread()) {
+      GlobalOutput.printf("TNonblockingServer: failed to notifyIOThread, closing.");
+      connection_->close();
+      throw TException("TNonblockingServer::HandshakeTask::run: failed write on notify pipe");
+    }
+  }
+
+private:
+  TConnection* connection_;
 };
 
 void TNonblockingServer::TConnection::init(TNonblockingIOThread* ioThread) {
@@ -388,6 +749,15 @@ void TNonblockingServer::TConnection::init(TNonblockingIOThread* ioThread) {
   socketState_ = SOCKET_RECV_FRAMING;
   callsForResize_ = 0;
 
+  peekTransport_.reset();
+  peekProtocol_.reset();
+
+  calls_.clear();
+  numCalls_ = 0;
+  batchEnd_ = 0;
+  sendSegments_.clear();
+  updateMemory();
+
   // get input/transports
   factoryInputTransport_ = server_->getInputTransportFactory()->getTransport(inputTransport_);
   factoryOutputTransport_ = server_->getOutputTransportFactory()->getTransport(outputTransport_);
@@ -418,12 +788,44 @@ void TNonblockingServer::TConnection::setSocket(std::shared_ptr<TSocket> socket)
   tSocket_ = socket;
 }
 
+void TNonblockingServer::TConnection::startHandshake(TNonblockingIOThread* listenThread) {
+  establishedIOThread_ = ioThread_;
+  ioThread_ = listenThread;
+  handshakeStart_ = std::chrono::steady_clock::now();
+  handshakeStatus_ = TNonblockingServerTransport::HANDSHAKE_WANT_READ;
+  handshakeFailed_ = false;
+  socketState_ = SOCKET_HANDSHAKE;
+  appState_ = APP_HANDSHAKE;
+
+  server_->handshakeStarted();
+  transition();
+}
+
+void TNonblockingServer::TConnection::stepHandshake() {
+  try {
+    handshakeStatus_ = server_->serverTransport_->handshake(tSocket_);
+  } catch (TTransportException& te) {
+    GlobalOutput.printf("TConnection::stepHandshake(): %s", te.what());
+    handshakeFailed_ = true;
+  }
+}
+
+uint64_t TNonblockingServer::TConnection::getHandshakeTime() const {
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                   std::chrono::steady_clock::now() - handshakeStart_).count());
+}
+
 void TNonblockingServer::TConnection::workSocket() {
   while (true) {
     int got = 0, left = 0, sent = 0;
     uint32_t fetch = 0;
 
     switch (socketState_) {
+    case SOCKET_HANDSHAKE:
+      // the socket is ready for the next handshake step
+      transition();
+      return;
+
     case SOCKET_RECV_FRAMING:
       union {
         uint8_t buf[sizeof(uint32_t)];
@@ -461,17 +863,7 @@ void TNonblockingServer::TConnection::workSocket() {
       }
 
       readWant_ = ntohl(framing.size);
-      if (readWant_ > server_->getMaxFrameSize()) {
-        // Don't allow giant frame sizes.  This prevents bad clients from
-        // causing us to try and allocate a giant buffer.
-        GlobalOutput.printf(
-            "TNonblockingServer: frame size too large "
-            "(%" PRIu32 " > %" PRIu64
-            ") from client %s. "
-            "Remote side not using TFramedTransport?",
-            readWant_,
-            (uint64_t)server_->getMaxFrameSize(),
-            tSocket_->getSocketInfo().c_str());
+      if (!checkFrameSize(readWant_)) {
         close();
         return;
       }
@@ -484,7 +876,7 @@ void TNonblockingServer::TConnection::workSocket() {
       // data sitting in their internal buffers and from libevent's perspective, there is no further data available. In
       // that case, not trying another processing cycle here would result in a hang as we will never get to work the socket,
       // despite having more data.
-      if (tSocket_->hasPendingDataToRead())
+      if (socketState_ == SOCKET_RECV && tSocket_->hasPendingDataToRead())
       {
           continue;
       }
@@ -569,6 +961,70 @@ void TNonblockingServer::TConnection::workSocket() {
 
       return;
 
+    case SOCKET_RECV_BATCH:
+      // Make room for the rest of the first frame and for whatever else the
+      // client sent ahead
+      if (!growReadBuffer(std::max(readBufferPos_ < 4 ? 4 : 4 + frameSizeAt(0),
+                                   readBufferPos_ + PIPELINE_READ_AHEAD))) {
+        waitForMemory();
+        return;
+      }
+
+      try {
+        got = tSocket_->read(readBuffer_ + readBufferPos_, readBufferSize_ - readBufferPos_);
+      } catch (TTransportException& te) {
+        //In Nonblocking SSLSocket some operations need to be retried again.
+        //Current approach is parsing exception message, but a better solution needs to be investigated.
+        if(!strstr(te.what(), "retry")) {
+          GlobalOutput.printf("TConnection::workSocket(): %s", te.what());
+          close();
+        }
+
+        return;
+      }
+
+      if (got <= 0) {
+        // Whenever we get here it means a remote disconnect
+        close();
+        return;
+      }
+      readBufferPos_ += got;
+
+      if (readBufferPos_ >= 4 && !checkFrameSize(frameSizeAt(0))) {
+        close();
+        return;
+      }
+
+      if (hasCompleteFrame()) {
+        transition();
+        // Unless we are reading again, the connection is busy or closed
+        if (appState_ != APP_READ_BATCH || !eventFlags_) {
+          return;
+        }
+      }
+
+      // See SOCKET_RECV_FRAMING on data buffered inside the socket
+      if (tSocket_->hasPendingDataToRead()) {
+        continue;
+      }
+      return;
+
+    case SOCKET_SEND_BATCH:
+      try {
+        writeBatch();
+      } catch (TTransportException& te) {
+        GlobalOutput.printf("TConnection::workSocket(): %s ", te.what());
+        close();
+        return;
+      }
+
+      // We are done!
+      if (sendSegment_ == sendSegments_.size()) {
+        transition();
+      }
+
+      return;
+
     default:
       GlobalOutput.printf("Unexpected Socket State %d", socketState_);
       assert(0);
@@ -597,6 +1053,61 @@ void TNonblockingServer::TConnection::transition() {
   // Switch upon the state that we are currently in and move to a new state
   switch (appState_) {
 
+  case APP_HANDSHAKE:
+    if (server_->getHandshakeThreadManager()) {
+      // Hand the step to the handshake thread manager and wait on it, with
+      // the connection idle so that libevent doesn't process it meanwhile
+      std::shared_ptr<Runnable> task = std::shared_ptr<Runnable>(new HandshakeTask(this));
+      appState_ = APP_WAIT_HANDSHAKE;
+      setIdle();
+
+      try {
+        server_->addHandshakeTask(task);
+      } catch (TException& tx) {
+        GlobalOutput.printf("TNonblockingServer: cannot run handshake: %s", tx.what());
+        close();
+      }
+
+      return;
+    }
+
+    stepHandshake();
+    // fallthrough
+
+  case APP_WAIT_HANDSHAKE:
+    if (handshakeFailed_) {
+      close();
+      return;
+    }
+
+    if (handshakeStatus_ != TNonblockingServerTransport::HANDSHAKE_DONE) {
+      // Wait for the socket to be ready for the next step
+      appState_ = APP_HANDSHAKE;
+      if (handshakeStatus_ == TNonblockingServerTransport::HANDSHAKE_WANT_WRITE) {
+        setWrite();
+      } else {
+        setRead();
+      }
+      return;
+    }
+
+    server_->handshakeDone(true, getHandshakeTime());
+
+    // The connection is established, move it to the IO thread that serves it
+    setIdle();
+    if (establishedIOThread_ != ioThread_) {
+      ioThread_ = establishedIOThread_;
+      appState_ = APP_INIT;
+      if (!notifyIOThread()) {
+        GlobalOutput.perror("[ERROR] notifyIOThread failed on established connection, closing",
+                            errno);
+        close();
+      }
+      return;
+    }
+
+    goto LABEL_APP_INIT;
+
   case APP_READ_REQUEST:
     // We are done reading the request, package the read buffer into transport
     // and get back some data from the dispatch function
@@ -617,12 +1128,12 @@ void TNonblockingServer::TConnection::transition() {
 
     server_->incrementActiveProcessors();
 
-    if (server_->isThreadPoolProcessing()) {
+    if (placeCall(*inputTransport_, method_, deadline_) == T_PLACEMENT_WORKER) {
       // We are setting up a Task to do this work and we will wait on it
 
       // Create task and dispatch to the thread manager
       std::shared_ptr<Runnable> task = std::shared_ptr<Runnable>(
-          new Task(processor_, inputProtocol_, outputProtocol_, this));
+          new Task(processor_, inputProtocol_, outputProtocol_, this, method_, deadline_));
       // The application is now waiting on the task to finish
       appState_ = APP_WAIT_TASK;
 
@@ -632,7 +1143,7 @@ void TNonblockingServer::TConnection::transition() {
       setIdle();
 
       try {
-        server_->addTask(task);
+        server_->addTask(task, ioThread_, expirationOf(deadline_));
       } catch (IllegalStateException& ise) {
         // The ThreadManager is not ready to handle any more tasks (it's probably shutting down).
         GlobalOutput.printf("IllegalStateException: Server::process() %s", ise.what());
@@ -646,12 +1157,15 @@ void TNonblockingServer::TConnection::transition() {
 
       return;
     } else {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      TRequestContext context(deadline_);
       try {
         if (serverEventHandler_) {
           serverEventHandler_->processContext(connectionContext_, getTSocket());
         }
         // Invoke the processor
         processor_->process(inputProtocol_, outputProtocol_, connectionContext_);
+        recordCall(method_, T_PLACEMENT_INLINE, start);
       } catch (const TTransportException& ttx) {
         GlobalOutput.printf(
             "TNonblockingServer transport error in "
@@ -685,6 +1199,7 @@ void TNonblockingServer::TConnection::transition() {
     // the writeBuffer_ for actual writing by the libevent thread
 
     server_->decrementActiveProcessors();
+    updateMemory();
     // Get the result of the operation
     outputTransport_->getBuffer(&writeBuffer_, &writeBufferSize_);
 
@@ -712,6 +1227,55 @@ void TNonblockingServer::TConnection::transition() {
     // right back into the read frame header state
     goto LABEL_APP_INIT;
 
+  LABEL_APP_READ_BATCH:
+  case APP_READ_BATCH:
+    // The read buffer holds at least one complete frame
+    if (!startBatch()) {
+      return;
+    }
+    // fallthrough
+
+  case APP_WAIT_BATCH:
+    // All requests of the batch are done, send back their responses in order
+    server_->decrementActiveProcessors();
+    updateMemory();
+    if (!finishBatch()) {
+      close();
+      return;
+    }
+
+    if (!sendSegments_.empty()) {
+      socketState_ = SOCKET_SEND_BATCH;
+      appState_ = APP_SEND_BATCH;
+      setWrite();
+      return;
+    }
+
+    // The batch was all oneway requests
+    goto LABEL_APP_INIT;
+
+  case APP_SEND_BATCH:
+    // it's now safe to perform buffer size housekeeping.
+    callsForResize_ += static_cast<int32_t>(numCalls_);
+    if (server_->getResizeBufferEveryN() > 0
+        && callsForResize_ >= server_->getResizeBufferEveryN()) {
+      size_t writeLimit = server_->getIdleWriteBufferLimit();
+      for (auto& call : calls_) {
+        if (writeLimit > 0 && call->output->getBufferSize() > writeLimit) {
+          call->output->resetBuffer(static_cast<uint32_t>(server_->getWriteBufferDefaultSize()));
+        }
+      }
+      // The read buffer may already hold requests of the next batch
+      if (readBufferPos_ == batchEnd_) {
+        readBufferPos_ = 0;
+        batchEnd_ = 0;
+        checkIdleBufferMemLimit(server_->getIdleReadBufferLimit(), 0);
+      }
+      updateMemory();
+      callsForResize_ = 0;
+    }
+    goto LABEL_APP_INIT;
+
   case APP_SEND_RESULT:
     // it's now safe to perform buffer size housekeeping.
     if (writeBufferSize_ > largestWriteBufferSize_) {
@@ -729,6 +1293,30 @@ void TNonblockingServer::TConnection::transition() {
 
   LABEL_APP_INIT:
   case APP_INIT:
+    if (server_->getPipelining()) {
+      // Move the requests read beyond the last batch to the front
+      if (batchEnd_ > 0) {
+        readBufferPos_ -= batchEnd_;
+        memmove(readBuffer_, readBuffer_ + batchEnd_, readBufferPos_);
+        batchEnd_ = 0;
+      }
+
+      socketState_ = SOCKET_RECV_BATCH;
+      appState_ = APP_READ_BATCH;
+
+      if (readBufferPos_ >= 4 && !checkFrameSize(frameSizeAt(0))) {
+        close();
+        return;
+      }
+
+      // Go on with the next batch if it has been read already
+      if (hasCompleteFrame()) {
+        goto LABEL_APP_READ_BATCH;
+      }
+
+      setRead();
+      return;
+    }
 
     // Clear write buffer variables
     writeBuffer_ = nullptr;
@@ -750,23 +1338,9 @@ void TNonblockingServer::TConnection::transition() {
     readWant_ += 4;
 
     // We just read the request length
-    // Double the buffer size until it is big enough
-    if (readWant_ > readBufferSize_) {
-      if (readBufferSize_ == 0) {
-        readBufferSize_ = 1;
-      }
-      uint32_t newSize = readBufferSize_;
-      while (readWant_ > newSize) {
-        newSize *= 2;
-      }
-
-      auto* newBuffer = (uint8_t*)std::realloc(readBuffer_, newSize);
-      if (newBuffer == nullptr) {
-        // nothing else to be done...
-        throw std::bad_alloc();
-      }
-      readBuffer_ = newBuffer;
-      readBufferSize_ = newSize;
+    if (!growReadBuffer(readWant_)) {
+      waitForMemory();
+      return;
     }
 
     readBufferPos_ = 4;
@@ -778,6 +1352,28 @@ void TNonblockingServer::TConnection::transition() {
 
     return;
 
+  case APP_WAIT_MEMORY:
+    // Memory has been released, try again to grow the read buffer
+    if (socketState_ == SOCKET_RECV_BATCH) {
+      appState_ = APP_READ_BATCH;
+    } else {
+      if (!growReadBuffer(readWant_)) {
+        waitForMemory();
+        return;
+      }
+      readBufferPos_ = 4;
+      *((uint32_t*)readBuffer_) = htonl(readWant_ - 4);
+      socketState_ = SOCKET_RECV;
+      appState_ = APP_READ_REQUEST;
+    }
+    setRead();
+
+    // See SOCKET_RECV_FRAMING on data buffered inside the socket
+    if (tSocket_->hasPendingDataToRead()) {
+      workSocket();
+    }
+    return;
+
   case APP_CLOSE_CONNECTION:
     server_->decrementActiveProcessors();
     close();
@@ -845,15 +1441,404 @@ void TNonblockingServer::TConnection::setFlags(short eventFlags) {
   }
 }
 
+bool TNonblockingServer::TConnection::checkFrameSize(uint32_t frameSize) {
+  if (frameSize > server_->getMaxFrameSize()) {
+    // Don't allow giant frame sizes.  This prevents bad clients from
+    // causing us to try and allocate a giant buffer.
+    GlobalOutput.printf(
+        "TNonblockingServer: frame size too large "
+        "(%" PRIu32 " > %" PRIu64
+        ") from client %s. "
+        "Remote side not using TFramedTransport?",
+        frameSize,
+        (uint64_t)server_->getMaxFrameSize(),
+        tSocket_->getSocketInfo().c_str());
+    return false;
+  }
+  return true;
+}
+
+bool TNonblockingServer::TConnection::growReadBuffer(uint32_t size) {
+  // Double the buffer size until it is big enough
+  if (size > readBufferSize_) {
+    uint32_t newSize = readBufferSize_ ? readBufferSize_ : 1;
+    while (size > newSize) {
+      newSize *= 2;
+    }
+
+    size_t growth = newSize - readBufferSize_;
+    if (!server_->reserveMemory(growth)) {
+      memoryWanted_ = newSize;
+      return false;
+    }
+    memory_ += growth;
+
+    auto* newBuffer = (uint8_t*)std::realloc(readBuffer_, newSize);
+    if (newBuffer == nullptr) {
+      memory_ -= growth;
+      server_->releaseMemory(growth);
+      // nothing else to be done...
+      throw std::bad_alloc();
+    }
+    readBuffer_ = newBuffer;
+    readBufferSize_ = newSize;
+  }
+  return true;
+}
+
+void TNonblockingServer::TConnection::waitForMemory() {
+  if (memoryWanted_ > server_->getMaxBufferMemory()) {
+    GlobalOutput.printf("TNonblockingServer: frame of %" PRIu32
+                        " bytes from client %s exceeds the memory budget",
+                        readWant_,
+                        tSocket_->getSocketInfo().c_str());
+    close();
+    return;
+  }
+
+  // A read buffer holding nothing yet is given back while waiting, or
+  // connections waiting with their buffers could use up the budget and
+  // never be woken. A frame size read on its own is kept in readWant_.
+  bool empty = socketState_ == SOCKET_RECV_FRAMING || readBufferPos_ == 0;
+  if (empty && readBuffer_ != nullptr) {
+    std::free(readBuffer_);
+    readBuffer_ = nullptr;
+    memory_ -= readBufferSize_;
+    server_->releaseMemory(readBufferSize_);
+    readBufferSize_ = 0;
+  }
+
+  // Stop reading, the client will stop sending once the socket buffers fill
+  appState_ = APP_WAIT_MEMORY;
+  setIdle();
+  server_->waitForMemory(this, memoryWanted_ - readBufferSize_);
+}
+
+void TNonblockingServer::TConnection::updateMemory() {
+  size_t memory = readBufferSize_ + outputTransport_->getBufferSize();
+  for (auto& call : calls_) {
+    memory += call->output->getBufferSize();
+  }
+  if (memory > memory_) {
+    server_->chargeMemory(memory - memory_);
+  } else if (memory < memory_) {
+    server_->releaseMemory(memory_ - memory);
+  }
+  memory_ = memory;
+}
+
+uint32_t TNonblockingServer::TConnection::frameSizeAt(uint32_t pos) const {
+  uint32_t frameSize;
+  memcpy(&frameSize, readBuffer_ + pos, sizeof(frameSize));
+  return ntohl(frameSize);
+}
+
+bool TNonblockingServer::TConnection::hasCompleteFrame() const {
+  return readBufferPos_ >= 4 && readBufferPos_ - 4 >= frameSizeAt(0);
+}
+
+std::unique_ptr<TNonblockingServer::TConnection::PipelinedCall>
+TNonblockingServer::TConnection::newCall() {
+  std::unique_ptr<PipelinedCall> call(new PipelinedCall);
+  call->input.reset(new TMemoryBuffer(nullptr, 0));
+  call->output.reset(
+      new TMemoryBuffer(static_cast<uint32_t>(server_->getWriteBufferDefaultSize())));
+  call->placement = T_PLACEMENT_INLINE;
+  call->failed = false;
+
+  std::shared_ptr<TTransport> input = server_->getInputTransportFactory()->getTransport(call->input);
+  std::shared_ptr<TTransport> output
+      = server_->getOutputTransportFactory()->getTransport(call->output);
+  if (server_->getHeaderTransport()) {
+    call->inputProtocol = server_->getInputProtocolFactory()->getProtocol(input, output);
+    call->outputProtocol = call->inputProtocol;
+  } else {
+    call->inputProtocol = server_->getInputProtocolFactory()->getProtocol(input);
+    call->outputProtocol = server_->getOutputProtocolFactory()->getProtocol(output);
+  }
+  return call;
+}
+
+bool TNonblockingServer::TConnection::startBatch() {
+  // Give each complete frame its own transports, like APP_READ_REQUEST does
+  numCalls_ = 0;
+  uint32_t pos = 0;
+  while (numCalls_ < server_->getMaxPipelinedRequests() && readBufferPos_ - pos >= 4) {
+    uint32_t frameSize = frameSizeAt(pos);
+    if (!checkFrameSize(frameSize)) {
+      close();
+      return false;
+    }
+    if (readBufferPos_ - pos - 4 < frameSize) {
+      break;
+    }
+
+    if (numCalls_ == calls_.size()) {
+      calls_.push_back(newCall());
+    }
+    PipelinedCall& call = *calls_[numCalls_++];
+    call.failed = false;
+    call.output->resetBuffer();
+    if (server_->getHeaderTransport()) {
+      call.input->resetBuffer(readBuffer_ + pos, frameSize + 4);
+    } else {
+      call.input->resetBuffer(readBuffer_ + pos + 4, frameSize);
+      call.output->getWritePtr(4);
+      call.output->wroteBytes(4);
+    }
+    pos += frameSize + 4;
+  }
+  batchEnd_ = pos;
+  assert(numCalls_ > 0);
+
+  server_->incrementActiveProcessors();
+
+  size_t numTasks = 0;
+  for (size_t i = 0; i < numCalls_; ++i) {
+    PipelinedCall& call = *calls_[i];
+    call.placement = placeCall(*call.input, call.method, call.deadline);
+    if (call.placement == T_PLACEMENT_WORKER) {
+      ++numTasks;
+    }
+  }
+
+  // Whether no task of the batch is outstanding
+  bool done = true;
+
+  if (numTasks > 0) {
+    // Wait on one task per request, with the connection idle meanwhile
+    appState_ = APP_WAIT_BATCH;
+    setIdle();
+    pendingCalls_ = numTasks;
+    done = false;
+
+    size_t added = 0;
+    for (size_t i = 0; i < numCalls_; ++i) {
+      if (calls_[i]->placement != T_PLACEMENT_WORKER) {
+        continue;
+      }
+      try {
+        server_->addTask(std::make_shared<PipelinedTask>(this, calls_[i].get()),
+                         ioThread_,
+                         expirationOf(calls_[i]->deadline));
+        ++added;
+      } catch (TException& tx) {
+        // The ThreadManager is not ready to handle any more tasks (it's
+        // probably shutting down) or timed out; fail the remaining requests
+        GlobalOutput.printf("TNonblockingServer: cannot process pipelined request: %s",
+                            tx.what());
+        for (size_t j = i; j < numCalls_; ++j) {
+          if (calls_[j]->placement == T_PLACEMENT_WORKER) {
+            calls_[j]->failed = true;
+          }
+        }
+        // Unless a task is still running, finish the batch right here
+        done = pendingCalls_.fetch_sub(numTasks - added) == numTasks - added;
+        break;
+      }
+    }
+  }
+
+  // Meanwhile process the requests placed on the IO thread
+  for (size_t i = 0; i < numCalls_; ++i) {
+    if (calls_[i]->placement == T_PLACEMENT_INLINE) {
+      processCall(*calls_[i]);
+    }
+  }
+
+  return done;
+}
+
+bool TNonblockingServer::TConnection::finishBatch() {
+  sendSegments_.clear();
+  sendSegment_ = 0;
+  sendSegmentPos_ = 0;
+
+  for (size_t i = 0; i < numCalls_; ++i) {
+    PipelinedCall& call = *calls_[i];
+    if (call.failed) {
+      return false;
+    }
+
+    uint8_t* buffer;
+    uint32_t size;
+    call.output->getBuffer(&buffer, &size);
+
+    // 4 bytes were reserved for frame size, oneway requests wrote nothing else
+    if (size > 4) {
+      auto frameSize = (int32_t)htonl(size - 4);
+      memcpy(buffer, &frameSize, 4);
+      sendSegments_.emplace_back(buffer, size);
+    }
+  }
+  return true;
+}
+
+TPlacement TNonblockingServer::TConnection::placeCall(
+    TMemoryBuffer& input,
+    std::string& method,
+    std::chrono::steady_clock::time_point& deadline) {
+  method.clear();
+  deadline = std::chrono::steady_clock::time_point();
+  TPlacement unplaced
+      = server_->isThreadPoolProcessing() ? T_PLACEMENT_WORKER : T_PLACEMENT_INLINE;
+  std::shared_ptr<TPlacementPolicy> policy
+      = unplaced == T_PLACEMENT_WORKER ? server_->getPlacementPolicy() : nullptr;
+  if (!policy && !server_->getUseClientTimeouts()) {
+    return unplaced;
+  }
+
+  // Read the method from a copy of the transport, leaving the request unread
+  if (!peekProtocol_) {
+    peekTransport_.reset(new TMemoryBuffer(nullptr, 0));
+    peekProtocol_ = server_->getInputProtocolFactory()->getProtocol(peekTransport_);
+  }
+  uint8_t* buffer;
+  uint32_t size;
+  input.getBuffer(&buffer, &size);
+  peekTransport_->resetBuffer(buffer, size);
+
+  TMessageType type;
+  int32_t seqid;
+  try {
+    peekProtocol_->readMessageBegin(method, type, seqid);
+  } catch (const TException&) {
+    // Leave the bad request to the processor
+    method.clear();
+    return unplaced;
+  }
+
+  if (server_->getUseClientTimeouts() && server_->getHeaderTransport()) {
+    // Only header protocols know the client timeout, other protocol
+    // factories may be used in header mode too
+    auto* headerProtocol = dynamic_cast<THeaderProtocol*>(peekProtocol_.get());
+    int timeout = headerProtocol ? headerProtocol->getRequestTimeout() : 0;
+    if (timeout > 0) {
+      deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    }
+  }
+
+  if (!policy) {
+    return unplaced;
+  }
+  return policy->place(method, processor_->getPlacement(method)) == T_PLACEMENT_INLINE
+             ? T_PLACEMENT_INLINE
+             : T_PLACEMENT_WORKER;
+}
+
+void TNonblockingServer::TConnection::recordCall(const std::string& method,
+                                                 TPlacement placement,
+                                                 std::chrono::steady_clock::time_point start) {
+  std::shared_ptr<TPlacementPolicy> policy = server_->getPlacementPolicy();
+  if (policy && !method.empty()) {
+    policy->record(method,
+                   placement,
+                   static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                             std::chrono::steady_clock::now() - start).count()));
+  }
+}
+
+void TNonblockingServer::TConnection::processCall(PipelinedCall& call) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  TRequestContext context(call.deadline);
+  try {
+    if (serverEventHandler_) {
+      serverEventHandler_->processContext(connectionContext_, getTSocket());
+    }
+    processor_->process(call.inputProtocol, call.outputProtocol, connectionContext_);
+    recordCall(call.method, call.placement, start);
+  } catch (const TTransportException& ttx) {
+    GlobalOutput.printf("TNonblockingServer transport error in process(): %s", ttx.what());
+    call.failed = true;
+  } catch (const std::exception& x) {
+    GlobalOutput.printf("Server::process() uncaught exception: %s: %s",
+                        typeid(x).name(),
+                        x.what());
+    call.failed = true;
+  } catch (...) {
+    GlobalOutput.printf("Server::process() unknown exception");
+    call.failed = true;
+  }
+}
+
+void TNonblockingServer::TConnection::callDone() {
+  // The last request of the batch to finish hands it back to the IO thread
+  if (pendingCalls_.fetch_sub(1) == 1 && !notifyIOThread()) {
+    GlobalOutput.printf("TNonblockingServer: failed to notifyIOThread, closing.");
+    server_->decrementActiveProcessors();
+    close();
+    throw TException("TNonblockingServer::TConnection::callDone: failed write on notify pipe");
+  }
+}
+
+void TNonblockingServer::TConnection::writeBatch() {
+  uint32_t sent = 0;
+
+#ifndef _WIN32
+  if (typeid(*tSocket_) == typeid(TSocket)) {
+    // Hand the kernel as many responses as it takes in a single call
+    struct iovec iov[PIPELINE_MAX_IOV];
+    int count = 0;
+    for (size_t i = sendSegment_; i < sendSegments_.size() && count < PIPELINE_MAX_IOV; ++i) {
+      uint32_t skip = i == sendSegment_ ? sendSegmentPos_ : 0;
+      iov[count].iov_base = const_cast<uint8_t*>(sendSegments_[i].first + skip);
+      iov[count].iov_len = sendSegments_[i].second - skip;
+      ++count;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    ssize_t b = sendmsg(tSocket_->getSocketFD(), &msg, flags);
+    if (b < 0) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      if (errno_copy == THRIFT_EWOULDBLOCK || errno_copy == THRIFT_EAGAIN
+          || errno_copy == THRIFT_EINTR) {
+        return;
+      }
+      throw TTransportException(TTransportException::UNKNOWN, "writeBatch() sendmsg()", errno_copy);
+    }
+    sent = static_cast<uint32_t>(b);
+  } else
+#endif
+  {
+    sent = tSocket_->write_partial(sendSegments_[sendSegment_].first + sendSegmentPos_,
+                                   sendSegments_[sendSegment_].second - sendSegmentPos_);
+  }
+
+  // Move past the responses sent completely
+  while (sent > 0) {
+    uint32_t left = sendSegments_[sendSegment_].second - sendSegmentPos_;
+    if (sent < left) {
+      sendSegmentPos_ += sent;
+      break;
+    }
+    sent -= left;
+    ++sendSegment_;
+    sendSegmentPos_ = 0;
+  }
+}
+
 /**
  * Closes a connection
  */
 void TNonblockingServer::TConnection::close() {
   setIdle();
 
+  if (appState_ == APP_HANDSHAKE || appState_ == APP_WAIT_HANDSHAKE) {
+    server_->handshakeDone(false, getHandshakeTime());
+  }
+
   if (serverEventHandler_) {
     serverEventHandler_->deleteContext(connectionContext_, inputProtocol_, outputProtocol_);
   }
+  TNonblockingIOThread* ioThread = ioThread_;
   ioThread_ = nullptr;
 
   // Close the socket
@@ -867,7 +1852,7 @@ void TNonblockingServer::TConnection::close() {
   processor_.reset();
 
   // Give this object back to the server that owns it
-  server_->returnConnection(this);
+  server_->returnConnection(this, ioThread);
 }
 
 void TNonblockingServer::TConnection::checkIdleBufferMemLimit(size_t readLimit, size_t writeLimit) {
@@ -882,18 +1867,31 @@ void TNonblockingServer::TConnection::checkIdleBufferMemLimit(size_t readLimit,
     outputTransport_->resetBuffer(static_cast<uint32_t>(server_->getWriteBufferDefaultSize()));
     largestWriteBufferSize_ = 0;
   }
+  updateMemory();
 }
 
 TNonblockingServer::~TNonblockingServer() {
-  // Close any active connections (moves them to the idle connection stack)
+  // Stop the workers of the IO threads, no task may run on a connection
+  // closed below
+  for (auto& ioThread : ioThreads_) {
+    if (ioThread->getThreadManager()) {
+      ioThread->getThreadManager()->stop();
+    }
+  }
+  // Connections waiting for memory are closed below
+  stalledConnections_.clear();
+  numStalledConnections_ = 0;
+  // Close any active connections (moves them to the idle connection stacks)
   while (!activeConnections_.empty()) {
     (*activeConnections_.begin())->close();
   }
-  // Clean up unused TConnection objects in connectionStack_
-  while (!connectionStack_.empty()) {
-    TConnection* connection = connectionStack_.top();
-    connectionStack_.pop();
-    delete connection;
+  // Clean up unused TConnection objects in connectionStacks_
+  for (auto& connectionStack : connectionStacks_) {
+    while (!connectionStack.empty()) {
+      TConnection* connection = connectionStack.top();
+      connectionStack.pop();
+      delete connection;
+    }
   }
   // The TNonblockingIOThread objects have shared_ptrs to the Thread
   // objects and the Thread objects have shared_ptrs to the TNonblockingIOThread
@@ -909,25 +1907,34 @@ TNonblockingServer::~TNonblockingServer() {
  * Creates a new connection either by reusing an object off the stack or
  * by allocating a new one entirely
  */
-TNonblockingServer::TConnection* TNonblockingServer::createConnection(std::shared_ptr<TSocket> socket) {
+TNonblockingServer::TConnection* TNonblockingServer::createConnection(
+    std::shared_ptr<TSocket> socket,
+    TNonblockingIOThread* listenThread) {
   // Check the stack
   Guard g(connMutex_);
 
-  // pick an IO thread to handle this connection -- currently round robin
-  assert(nextIOThread_ < ioThreads_.size());
-  int selectedThreadIdx = nextIOThread_;
-  nextIOThread_ = static_cast<uint32_t>((nextIOThread_ + 1) % ioThreads_.size());
+  // pick an IO thread to handle this connection -- the accepting one if
+  // each IO thread listens on its own socket, round robin otherwise
+  TNonblockingIOThread* ioThread = listenThread;
+  if (serverTransport_->getNumListenSockets() == 1) {
+    assert(nextIOThread_ < ioThreads_.size());
+    int selectedThreadIdx = nextIOThread_;
+    nextIOThread_ = static_cast<uint32_t>((nextIOThread_ + 1) % ioThreads_.size());
 
-  TNonblockingIOThread* ioThread = ioThreads_[selectedThreadIdx].get();
+    ioThread = ioThreads_[selectedThreadIdx].get();
+  }
 
-  // Check the connection stack to see if we can re-use
+  // Check the connection stack of the IO thread to see if we can re-use
+  std::stack<TConnection*>& connectionStack
+      = connectionStacks_[static_cast<size_t>(ioThread->getThreadNumber())];
   TConnection* result = nullptr;
-  if (connectionStack_.empty()) {
+  if (connectionStack.empty()) {
     result = new TConnection(socket, ioThread);
     ++numTConnections_;
   } else {
-    result = connectionStack_.top();
-    connectionStack_.pop();
+    result = connectionStack.top();
+    connectionStack.pop();
+    --numIdleConnections_;
     result->setSocket(socket);
     result->init(ioThread);
   }
@@ -939,16 +1946,18 @@ TNonblockingServer::TConnection* TNonblockingServer::createConnection(std::share
 /**
  * Returns a connection to the stack
  */
-void TNonblockingServer::returnConnection(TConnection* connection) {
+void TNonblockingServer::returnConnection(TConnection* connection,
+                                          TNonblockingIOThread* ioThread) {
   Guard g(connMutex_);
 
   activeConnections_.erase(connection);
-  if (connectionStackLimit_ && (connectionStack_.size() >= connectionStackLimit_)) {
+  if (connectionStackLimit_ && (numIdleConnections_ >= connectionStackLimit_)) {
     delete connection;
     --numTConnections_;
   } else {
     connection->checkIdleBufferMemLimit(idleReadBufferLimit_, idleWriteBufferLimit_);
-    connectionStack_.push(connection);
+    connectionStacks_[static_cast<size_t>(ioThread->getThreadNumber())].push(connection);
+    ++numIdleConnections_;
   }
 }
 
@@ -956,15 +1965,19 @@ void TNonblockingServer::returnConnection(TConnection* connection) {
  * Server socket had something happen.  We accept all waiting client
  * connections on fd and assign TConnection objects to handle those requests.
  */
-void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
+void TNonblockingServer::handleEvent(THRIFT_SOCKET fd,
+                                     short which,
+                                     TNonblockingIOThread* ioThread) {
   (void)which;
   // Make sure that libevent didn't mess up the socket handles
-  assert(fd == serverSocket_);
+  size_t listener = static_cast<size_t>(ioThread->getThreadNumber());
+  assert(fd == serverTransport_->getListenSocketFD(listener));
+  (void)fd;
 
   // Going to accept a new client socket
   std::shared_ptr<TSocket> clientSocket;
 
-  clientSocket = serverTransport_->accept();
+  clientSocket = serverTransport_->accept(listener);
   if (clientSocket) {
     // If we're overloaded, take action here
     if (overloadAction_ != T_OVERLOAD_NO_ACTION && serverOverloaded()) {
@@ -984,7 +1997,7 @@ void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
     }
 
     // Create a new TConnection for this client socket.
-    TConnection* clientConnection = createConnection(clientSocket);
+    TConnection* clientConnection = createConnection(clientSocket, ioThread);
 
     // Fail fast if we could not create a TConnection object
     if (clientConnection == nullptr) {
@@ -994,25 +2007,45 @@ void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
     }
 
     /*
-     * Either notify the ioThread that is assigned this connection to
-     * start processing, or if it is us, we'll just ask this
-     * connection to do its initial state change here.
+     * Establish the connection here, or on the handshake thread manager
+     * if there is one. Once established, either the ioThread that is
+     * assigned this connection is notified to start processing, or if
+     * it is us, the connection does its initial state change here.
      *
      * (We need to avoid writing to our own notification pipe, to
      * avoid possible deadlocks if the pipe is full.)
-     *
-     * The IO thread #0 is the only one that handles these listen
-     * events, so unless the connection has been assigned to thread #0
-     * we know it's not on our thread.
      */
-    if (clientConnection->getIOThreadNumber() == 0) {
-      clientConnection->transition();
-    } else {
-      if (!clientConnection->notifyIOThread()) {
-        GlobalOutput.perror("[ERROR] notifyIOThread failed on fresh connection, closing", errno);
-        clientConnection->close();
-      }
-    }
+    clientConnection->startHandshake(ioThread);
+  }
+}
+
+uint64_t TNonblockingServer::getNumCompletions() const {
+  uint64_t completions = 0;
+  for (const auto& ioThread : ioThreads_) {
+    completions += ioThread->getNumCompletions();
+  }
+  return completions;
+}
+
+uint64_t TNonblockingServer::getNumCompletionWakeups() const {
+  uint64_t wakeups = 0;
+  for (const auto& ioThread : ioThreads_) {
+    wakeups += ioThread->getNumWakeups();
+  }
+  return wakeups;
+}
+
+void TNonblockingServer::handshakeDone(bool established, uint64_t usecs) {
+  Guard g(connMutex_);
+  if (numHandshakesInProgress_ > 0) {
+    --numHandshakesInProgress_;
+  }
+  if (established) {
+    ++nTotalHandshakes_;
+    totalHandshakeTime_ += usecs;
+    maxHandshakeTime_ = (std::max)(maxHandshakeTime_, usecs);
+  } else {
+    ++nTotalHandshakesFailed_;
   }
 }
 
@@ -1020,6 +2053,7 @@ void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
  * Creates a socket to listen on and binds it to the local port.
  */
 void TNonblockingServer::createAndListenOnSocket() {
+  serverTransport_->setNumListenSockets(numIOThreads_);
   serverTransport_->listen();
   serverSocket_ = serverTransport_->getSocketFD();
 }
@@ -1032,14 +2066,87 @@ void TNonblockingServer::setThreadManager(std::shared_ptr<ThreadManager> threadM
         std::bind(&TNonblockingServer::expireClose,
                                      this,
                                      std::placeholders::_1));
-    threadPoolProcessing_ = true;
-  } else {
-    threadPoolProcessing_ = false;
+    threadManager->setShedCallback(
+        std::bind(&TNonblockingServer::shedFail, this, std::placeholders::_1));
+  }
+  threadPoolProcessing_ = threadManager_ || workersPerIOThread_;
+}
+
+bool TNonblockingServer::reserveMemory(size_t bytes) {
+  size_t used = bufferMemory_.load();
+  do {
+    if (maxBufferMemory_ && used + bytes > maxBufferMemory_) {
+      return false;
+    }
+  } while (!bufferMemory_.compare_exchange_weak(used, used + bytes));
+  return true;
+}
+
+void TNonblockingServer::releaseMemory(size_t bytes) {
+  bufferMemory_ -= bytes;
+  if (numStalledConnections_ > 0) {
+    wakeStalledConnections();
+  }
+}
+
+void TNonblockingServer::waitForMemory(TConnection* connection, size_t bytes) {
+  numMemoryStalls_.fetch_add(1, std::memory_order_relaxed);
+  {
+    Guard g(memoryMutex_);
+    stalledConnections_.push_back(connection);
+    ++numStalledConnections_;
+  }
+  // Memory released before the connection was parked did not wake it up
+  if (bufferMemory_ + bytes <= maxBufferMemory_) {
+    wakeStalledConnections();
+  }
+}
+
+void TNonblockingServer::wakeStalledConnections() {
+  std::vector<TConnection*> stalled;
+  {
+    Guard g(memoryMutex_);
+    stalled.swap(stalledConnections_);
+    numStalledConnections_ = 0;
+  }
+  for (auto connection : stalled) {
+    if (!connection->notifyIOThread()) {
+      GlobalOutput.printf("TNonblockingServer: failed to wake up connection waiting for memory");
+    }
+  }
+}
+
+void TNonblockingServer::addTask(std::shared_ptr<Runnable> task,
+                                 TNonblockingIOThread* ioThread,
+                                 int64_t expiration) {
+  std::shared_ptr<ThreadManager> threadManager = threadManager_;
+  if (ioThread && ioThread->getThreadManager()) {
+    threadManager = ioThread->getThreadManager();
+
+    // Hand the task to the least busy workers if the own ones fell behind
+    if (rebalanceThreshold_ && threadManager->pendingTaskCount() >= rebalanceThreshold_) {
+      std::shared_ptr<ThreadManager> local = threadManager;
+      size_t fewest = threadManager->pendingTaskCount();
+      for (auto& other : ioThreads_) {
+        size_t pending = other->getThreadManager()->pendingTaskCount();
+        if (pending < fewest) {
+          threadManager = other->getThreadManager();
+          fewest = pending;
+        }
+      }
+      if (threadManager != local) {
+        numRebalancedTasks_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
   }
+  if (!expiration || (taskExpireTime_ && taskExpireTime_ < expiration)) {
+    expiration = taskExpireTime_;
+  }
+  threadManager->add(task, 0LL, expiration);
 }
 
 bool TNonblockingServer::serverOverloaded() {
-  size_t activeConnections = numTConnections_ - connectionStack_.size();
+  size_t activeConnections = numTConnections_ - numIdleConnections_;
   if (numActiveProcessors_ > maxActiveProcessors_ || activeConnections > maxConnections_) {
     if (!overloaded_) {
       GlobalOutput.printf("TNonblockingServer: overload condition begun.");
@@ -1062,9 +2169,22 @@ bool TNonblockingServer::serverOverloaded() {
 }
 
 bool TNonblockingServer::drainPendingTask() {
+  std::vector<std::shared_ptr<ThreadManager> > threadManagers;
   if (threadManager_) {
-    std::shared_ptr<Runnable> task = threadManager_->removeNextPending();
+    threadManagers.push_back(threadManager_);
+  }
+  for (auto& ioThread : ioThreads_) {
+    if (ioThread->getThreadManager()) {
+      threadManagers.push_back(ioThread->getThreadManager());
+    }
+  }
+  for (auto& threadManager : threadManagers) {
+    std::shared_ptr<Runnable> task = threadManager->removeNextPending();
     if (task) {
+      if (auto* pipelined = dynamic_cast<TConnection::PipelinedTask*>(task.get())) {
+        pipelined->expire();
+        return true;
+      }
       TConnection* connection = static_cast<TConnection::Task*>(task.get())->getTConnection();
       assert(connection && connection->getServer() && connection->getState() == APP_WAIT_TASK);
       connection->forceClose();
@@ -1075,11 +2195,24 @@ bool TNonblockingServer::drainPendingTask() {
 }
 
 void TNonblockingServer::expireClose(std::shared_ptr<Runnable> task) {
+  if (auto* pipelined = dynamic_cast<TConnection::PipelinedTask*>(task.get())) {
+    pipelined->expire();
+    return;
+  }
   TConnection* connection = static_cast<TConnection::Task*>(task.get())->getTConnection();
   assert(connection && connection->getServer() && connection->getState() == APP_WAIT_TASK);
   connection->forceClose();
 }
 
+void TNonblockingServer::shedFail(std::shared_ptr<Runnable> task) {
+  numShedTasks_.fetch_add(1, std::memory_order_relaxed);
+  if (auto* pipelined = dynamic_cast<TConnection::PipelinedTask*>(task.get())) {
+    pipelined->shed();
+    return;
+  }
+  static_cast<TConnection::Task*>(task.get())->shed();
+}
+
 void TNonblockingServer::stop() {
   // Breaks the event loop in all threads so that they end ASAP.
   for (auto & ioThread : ioThreads_) {
@@ -1101,15 +2234,55 @@ void TNonblockingServer::registerEvents(event_base* user_event_base) {
   }
   // User-provided event-base doesn't works for multi-threaded servers
   assert(numIOThreads_ == 1 || !userEventBase_);
+  // Every listen socket needs an IO thread accepting on it
+  if (serverTransport_->getNumListenSockets() > numIOThreads_) {
+    throw TException("TNonblockingServer::registerEvents(): more listen sockets than IO threads");
+  }
 
   for (uint32_t id = 0; id < numIOThreads_; ++id) {
-    // the first IO thread also does the listening on server socket
-    THRIFT_SOCKET listenFd = (id == 0 ? serverSocket_ : THRIFT_INVALID_SOCKET);
+    // the first IO thread also does the listening on server socket, or
+    // every one has a socket of its own
+    THRIFT_SOCKET listenFd = (id < serverTransport_->getNumListenSockets()
+                                  ? serverTransport_->getListenSocketFD(id)
+                                  : THRIFT_INVALID_SOCKET);
 
     shared_ptr<TNonblockingIOThread> thread(
         new TNonblockingIOThread(this, id, listenFd, useHighPriorityIOThreads_));
+    int cpu = -1;
+    if (!ioThreadCpus_.empty()) {
+      cpu = ioThreadCpus_[id % ioThreadCpus_.size()];
+      thread->setCpu(cpu);
+    }
+
+    // Give the IO thread workers of its own, on its CPU
+    if (workersPerIOThread_) {
+      shared_ptr<ThreadManager> threadManager
+          = ThreadManager::newSimpleThreadManager(workersPerIOThread_);
+      if (cpu >= 0) {
+        threadManager->threadFactory(std::make_shared<TPinnedThreadFactory>(cpu));
+      } else {
+        threadManager->threadFactory(std::make_shared<ThreadFactory>());
+      }
+      threadManager->setExpireCallback(
+          std::bind(&TNonblockingServer::expireClose, this, std::placeholders::_1));
+      threadManager->setShedCallback(
+          std::bind(&TNonblockingServer::shedFail, this, std::placeholders::_1));
+      if (queueDelayTarget_) {
+        threadManager->setQueueDelayTarget(queueDelayTarget_, queueDelayInterval_);
+      }
+      threadManager->setEarliestDeadlineFirst(useClientTimeouts_);
+      threadManager->start();
+      thread->setThreadManager(threadManager);
+    }
     ioThreads_.push_back(thread);
   }
+  connectionStacks_.resize(ioThreads_.size());
+  if (threadManager_ && queueDelayTarget_) {
+    threadManager_->setQueueDelayTarget(queueDelayTarget_, queueDelayInterval_);
+  }
+  if (threadManager_ && useClientTimeouts_) {
+    threadManager_->setEarliestDeadlineFirst(true);
+  }
 
   // Notify handler of the preServe event
   if (eventHandler_) {
@@ -1173,12 +2346,19 @@ TNonblockingIOThread::TNonblockingIOThread(TNonblockingServer* server,
     threadId_{},
     listenSocket_(listenSocket),
     useHighPriority_(useHighPriority),
+    cpu_(-1),
     eventBase_(nullptr),
     ownEventBase_(false),
     serverEvent_{},
-    notificationEvent_{} {
+    notificationEvent_{},
+    completions_(nullptr),
+    stopRequested_(false),
+    numCompletions_(0),
+    numWakeups_(0) {
   notificationPipeFDs_[0] = -1;
   notificationPipeFDs_[1] = -1;
+  // Other threads may hand connections over before this one runs its loop
+  createNotificationPipe();
 }
 
 TNonblockingIOThread::~TNonblockingIOThread() {
@@ -1197,6 +2377,10 @@ TNonblockingIOThread::~TNonblockingIOThread() {
     listenSocket_ = THRIFT_INVALID_SOCKET;
   }
 
+  if (notificationPipeFDs_[1] == notificationPipeFDs_[0]) {
+    // a single eventfd
+    notificationPipeFDs_[1] = THRIFT_INVALID_SOCKET;
+  }
   for (auto notificationPipeFD : notificationPipeFDs_) {
     if (notificationPipeFD >= 0) {
       if (0 != ::THRIFT_CLOSESOCKET(notificationPipeFD)) {
@@ -1209,6 +2393,15 @@ TNonblockingIOThread::~TNonblockingIOThread() {
 }
 
 void TNonblockingIOThread::createNotificationPipe() {
+#ifdef __linux__
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    GlobalOutput.perror("TNonblockingServer::createNotificationPipe eventfd() ", errno);
+    throw TException("can't create notification eventfd");
+  }
+  notificationPipeFDs_[0] = fd;
+  notificationPipeFDs_[1] = fd;
+#else
   if (evutil_socketpair(AF_LOCAL, SOCK_STREAM, 0, notificationPipeFDs_) == -1) {
     GlobalOutput.perror("TNonblockingServer::createNotificationPipe ", EVUTIL_SOCKET_ERROR());
     throw TException("can't create notification pipe");
@@ -1234,6 +2427,7 @@ void TNonblockingIOThread::createNotificationPipe() {
           "FD_CLOEXEC");
     }
   }
+#endif
 }
 
 /**
@@ -1262,7 +2456,7 @@ void TNonblockingIOThread::registerEvents() {
               listenSocket_,
               EV_READ | EV_PERSIST,
               TNonblockingIOThread::listenHandler,
-              server_);
+              this);
     event_base_set(eventBase_, &serverEvent_);
 
     // Add the event and start up the server
@@ -1274,8 +2468,6 @@ void TNonblockingIOThread::registerEvents() {
     GlobalOutput.printf("TNonblocking: IO thread #%d registered for listen.", number_);
   }
 
-  createNotificationPipe();
-
   // Create an event to be notified when a task finishes
   event_set(&notificationEvent_,
             getNotificationRecvFD(),
@@ -1296,85 +2488,52 @@ void TNonblockingIOThread::registerEvents() {
 }
 
 bool TNonblockingIOThread::notify(TNonblockingServer::TConnection* conn) {
-  auto fd = getNotificationSendFD();
-  if (fd < 0) {
+  if (getNotificationSendFD() < 0) {
     return false;
   }
 
-  int ret = -1;
-  long kSize = sizeof(conn);
-  const char * pos = (const char *)const_cast_sockopt(&conn);
-
-#if defined(HAVE_POLL_H) || defined(HAVE_SYS_POLL_H)
-  struct pollfd pfd = {fd, POLLOUT, 0};
-
-  while (kSize > 0) {
-    pfd.revents = 0;
-    ret = poll(&pfd, 1, -1);
-    if (ret < 0) {
-      return false;
-    } else if (ret == 0) {
-      continue;
-    }
-
-    if (pfd.revents & POLLHUP || pfd.revents & POLLERR) {
-      ::THRIFT_CLOSESOCKET(fd);
-      return false;
-    }
-
-    if (pfd.revents & POLLOUT) {
-      ret = send(fd, pos, kSize, 0);
-      if (ret < 0) {
-        if (errno == EAGAIN) {
-          continue;
-        }
+  if (conn == nullptr) {
+    stopRequested_ = true;
+    return wakeup();
+  }
 
-        ::THRIFT_CLOSESOCKET(fd);
-        return false;
-      }
+  TNonblockingServer::TConnection* head = completions_.load(std::memory_order_relaxed);
+  do {
+    conn->nextCompletion_ = head;
+  } while (!completions_.compare_exchange_weak(head,
+                                               conn,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+
+  // Only the first completion after the IO thread took the queue wakes it
+  // up, the others are picked up along with it.  The completion is queued
+  // either way, so a failed wakeup must not make the caller close conn.
+  if (head == nullptr) {
+    wakeup();
+  }
+  return true;
+}
 
-      kSize -= ret;
-      pos += ret;
-    }
+bool TNonblockingIOThread::wakeup() {
+  auto fd = getNotificationSendFD();
+#ifdef __linux__
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) == sizeof(one)) {
+    return true;
   }
 #else
-  fd_set wfds, efds;
-
-  while (kSize > 0) {
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-    FD_SET(fd, &wfds);
-    FD_SET(fd, &efds);
-    ret = select(static_cast<int>(fd + 1), nullptr, &wfds, &efds, nullptr);
-    if (ret < 0) {
-      return false;
-    } else if (ret == 0) {
-      continue;
-    }
-
-    if (FD_ISSET(fd, &efds)) {
-      ::THRIFT_CLOSESOCKET(fd);
-      return false;
-    }
-
-    if (FD_ISSET(fd, &wfds)) {
-      ret = send(fd, pos, kSize, 0);
-      if (ret < 0) {
-        if (errno == EAGAIN) {
-          continue;
-        }
-
-        ::THRIFT_CLOSESOCKET(fd);
-        return false;
-      }
-
-      kSize -= ret;
-      pos += ret;
-    }
+  char one = 1;
+  if (send(fd, &one, 1, 0) == 1) {
+    return true;
   }
 #endif
-
-  return true;
+  int errno_copy = THRIFT_GET_SOCKET_ERROR;
+  if (errno_copy == THRIFT_EAGAIN || errno_copy == THRIFT_EWOULDBLOCK) {
+    // the socket buffer is full of wakeups that are yet to be consumed
+    return true;
+  }
+  GlobalOutput.perror("TNonblockingIOThread::wakeup() ", errno_copy);
+  return false;
 }
 
 /* static */
@@ -1383,38 +2542,62 @@ void TNonblockingIOThread::notifyHandler(evutil_socket_t fd, short which, void*
   assert(ioThread);
   (void)which;
 
+  // Consume the wakeup before taking the queue, so that a completion queued
+  // after we took it wakes us up again.
+#ifdef __linux__
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    GlobalOutput.perror("TNonblocking: notifyHandler read() failed: ", errno);
+    ioThread->breakLoop(true);
+    return;
+  }
+#else
   while (true) {
-    TNonblockingServer::TConnection* connection = nullptr;
-    const int kSize = sizeof(connection);
-    long nBytes = recv(fd, cast_sockopt(&connection), kSize, 0);
-    if (nBytes == kSize) {
-      if (connection == nullptr) {
-        // this is the command to stop our thread, exit the handler!
-        ioThread->breakLoop(false);
-        return;
-      }
-      connection->transition();
-    } else if (nBytes > 0) {
-      // throw away these bytes and hope that next time we get a solid read
-      GlobalOutput.printf("notifyHandler: Bad read of %d bytes, wanted %d", nBytes, kSize);
-      ioThread->breakLoop(true);
-      return;
-    } else if (nBytes == 0) {
+    char buf[64];
+    long nBytes = recv(fd, buf, sizeof(buf), 0);
+    if (nBytes == 0) {
       GlobalOutput.printf("notifyHandler: Notify socket closed!");
       ioThread->breakLoop(false);
-      // exit the loop
-      break;
-    } else { // nBytes < 0
+      return;
+    } else if (nBytes < 0) {
       if (THRIFT_GET_SOCKET_ERROR != THRIFT_EWOULDBLOCK
           && THRIFT_GET_SOCKET_ERROR != THRIFT_EAGAIN) {
         GlobalOutput.perror("TNonblocking: notifyHandler read() failed: ", THRIFT_GET_SOCKET_ERROR);
         ioThread->breakLoop(true);
         return;
       }
-      // exit the loop
       break;
     }
   }
+#endif
+  ioThread->numWakeups_.fetch_add(1, std::memory_order_relaxed);
+
+  // The queue is newest first, reverse it to keep the completion order
+  TNonblockingServer::TConnection* connection
+      = ioThread->completions_.exchange(nullptr, std::memory_order_acquire);
+  TNonblockingServer::TConnection* ordered = nullptr;
+  uint64_t numCompletions = 0;
+  while (connection != nullptr) {
+    TNonblockingServer::TConnection* next = connection->nextCompletion_;
+    connection->nextCompletion_ = ordered;
+    ordered = connection;
+    connection = next;
+    ++numCompletions;
+  }
+  ioThread->numCompletions_.fetch_add(numCompletions, std::memory_order_relaxed);
+
+  while (ordered != nullptr) {
+    // transition() may queue the connection on another IO thread
+    TNonblockingServer::TConnection* next = ordered->nextCompletion_;
+    ordered->nextCompletion_ = nullptr;
+    ordered->transition();
+    ordered = next;
+  }
+
+  if (ioThread->stopRequested_) {
+    // this is the command to stop our thread
+    ioThread->breakLoop(false);
+  }
 }
 
 void TNonblockingIOThread::breakLoop(bool error) {
@@ -1474,6 +2657,9 @@ void TNonblockingIOThread::run() {
   if (useHighPriority_) {
     setCurrentThreadHighPriority(true);
   }
+  if (cpu_ >= 0 && setCurrentThreadAffinity(cpu_)) {
+    GlobalOutput.printf("TNonblocking: IO Thread #%d bound to CPU %d", number_, cpu_);
+  }
 
   if (eventBase_ != nullptr)
   {
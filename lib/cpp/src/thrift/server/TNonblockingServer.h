@@ -22,12 +22,14 @@
 
 #include <thrift/Thrift.h>
 #include <memory>
+#include <thrift/server/TPlacementPolicy.h>
 #include <thrift/server/TServer.h>
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TSocket.h>
 #include <thrift/transport/TNonblockingServerTransport.h>
 #include <thrift/concurrency/ThreadManager.h>
+#include <atomic>
 #include <climits>
 #include <thrift/concurrency/Thread.h>
 #include <thrift/concurrency/ThreadFactory.h>
@@ -147,12 +149,36 @@ private:
   /// # of IO threads to use by default
   static const int DEFAULT_IO_THREADS = 1;
 
+  /// Default limit on requests of one connection processed as a batch
+  static const size_t MAX_PIPELINED_REQUESTS = 16;
+
   /// # of IO threads this server will use
   size_t numIOThreads_;
 
   /// Whether to set high scheduling priority for IO threads
   bool useHighPriorityIOThreads_;
 
+  /// CPUs the IO threads and their workers are bound to, none if empty
+  std::vector<int> ioThreadCpus_;
+
+  /// # of workers each IO thread owns (0 = use threadManager_)
+  size_t workersPerIOThread_;
+
+  /// Pending tasks of an IO thread from which on new ones go elsewhere (0 = never)
+  size_t rebalanceThreshold_;
+
+  /// Count of tasks run by the workers of another IO thread
+  std::atomic<uint64_t> numRebalancedTasks_;
+
+  /// Queue delay of tasks above which they are shed, in ms (0 = never)
+  int64_t queueDelayTarget_;
+
+  /// Time the queue delay must stay above target before tasks are shed, in ms
+  int64_t queueDelayInterval_;
+
+  /// Count of requests answered with an overload exception
+  std::atomic<uint64_t> numShedTasks_;
+
   /// Server socket file descriptor
   THRIFT_SOCKET serverSocket_;
 
@@ -165,6 +191,12 @@ private:
   /// Is thread pool processing?
   bool threadPoolProcessing_;
 
+  /// Decides per call whether it runs on the thread pool, may be nullptr
+  std::shared_ptr<TPlacementPolicy> placementPolicy_;
+
+  /// For running connection handshakes via thread pool, may be nullptr
+  std::shared_ptr<ThreadManager> handshakeThreadManager_;
+
   // Factory to create the IO threads
   std::shared_ptr<ThreadFactory> ioThreadFactory_;
 
@@ -181,7 +213,7 @@ private:
   size_t numTConnections_;
 
   /// Number of Connections processing or waiting to process
-  size_t numActiveProcessors_;
+  std::atomic<size_t> numActiveProcessors_;
 
   /// Limit for how many TConnection objects to cache
   size_t connectionStackLimit_;
@@ -195,9 +227,36 @@ private:
   /// Limit for frame size
   size_t maxFrameSize_;
 
+  /// Limit for bytes held by the buffers of all connections (0 = unlimited)
+  size_t maxBufferMemory_;
+
+  /// Bytes held by the buffers of all connections
+  std::atomic<size_t> bufferMemory_;
+
+  /// Count of times a connection stopped reading for lack of memory
+  std::atomic<uint64_t> numMemoryStalls_;
+
+  /// Number of connections in stalledConnections_
+  std::atomic<size_t> numStalledConnections_;
+
+  /// Guards stalledConnections_
+  Mutex memoryMutex_;
+
+  /// Connections that stopped reading until buffer memory is released
+  std::vector<TConnection*> stalledConnections_;
+
+  /// Process all requests a client sent ahead as one batch?
+  bool pipelining_;
+
+  /// Limit for number of requests of one connection processed as a batch
+  size_t maxPipelinedRequests_;
+
   /// Time in milliseconds before an unperformed task expires (0 == infinite).
   int64_t taskExpireTime_;
 
+  /// Whether requests expire when the client timeout they carry runs out
+  bool useClientTimeouts_;
+
   /**
    * Hysteresis for overload state.  This is the fraction of the overload
    * value that needs to be reached before the overload state is cleared;
@@ -216,7 +275,7 @@ private:
 
   /**
    * Max read buffer size for an idle TConnection.  When we place an idle
-   * TConnection into connectionStack_ or on every resizeBufferEveryN_ calls,
+   * TConnection into connectionStacks_ or on every resizeBufferEveryN_ calls,
    * we will free the buffer (such that it will be reinitialized by the next
    * received frame) if it has exceeded this limit.  0 disables this check.
    */
@@ -224,7 +283,7 @@ private:
 
   /**
    * Max write buffer size for an idle connection.  When we place an idle
-   * TConnection into connectionStack_ or on every resizeBufferEveryN_ calls,
+   * TConnection into connectionStacks_ or on every resizeBufferEveryN_ calls,
    * we insure that its write buffer is <= to this size; otherwise we
    * replace it with a new one of writeBufferDefaultSize_ bytes to insure that
    * idle connections don't hog memory. 0 disables this check.
@@ -246,13 +305,32 @@ private:
   /// Count of connections dropped on overload since server started
   uint64_t nTotalConnectionsDropped_;
 
+  /// Number of accepted connections whose handshake has not completed yet
+  size_t numHandshakesInProgress_;
+
+  /// Count of connections established since server started
+  uint64_t nTotalHandshakes_;
+
+  /// Count of connections whose handshake failed since server started
+  uint64_t nTotalHandshakesFailed_;
+
+  /// Sum of the handshake times of all established connections in microseconds
+  uint64_t totalHandshakeTime_;
+
+  /// Longest handshake time of an established connection in microseconds
+  uint64_t maxHandshakeTime_;
+
   /**
-   * This is a stack of all the objects that have been created but that
-   * are NOT currently in use. When we close a connection, we place it on this
-   * stack so that the object can be reused later, rather than freeing the
-   * memory and reallocating a new object later.
+   * These are stacks, one per IO thread, of all the objects that have been
+   * created but that are NOT currently in use. When we close a connection, we
+   * place it on the stack of its IO thread so that the object and its buffers
+   * can be reused later by the same thread, rather than freeing the memory and
+   * reallocating a new object later.
    */
-  std::stack<TConnection*> connectionStack_;
+  std::vector<std::stack<TConnection*> > connectionStacks_;
+
+  /// Number of TConnection objects on all the stacks
+  size_t numIdleConnections_;
 
   /**
    * This container holds pointers to all active connections. This container
@@ -272,23 +350,38 @@ private:
    * to handle those requests.
    *
    * @param which the event flag that triggered the handler.
+   * @param ioThread the IO thread listening on fd.
    */
-  void handleEvent(THRIFT_SOCKET fd, short which);
+  void handleEvent(THRIFT_SOCKET fd, short which, TNonblockingIOThread* ioThread);
 
   void init() {
     serverSocket_ = THRIFT_INVALID_SOCKET;
     numIOThreads_ = DEFAULT_IO_THREADS;
     nextIOThread_ = 0;
     useHighPriorityIOThreads_ = false;
+    workersPerIOThread_ = 0;
+    rebalanceThreshold_ = 0;
+    numRebalancedTasks_ = 0;
+    queueDelayTarget_ = 0;
+    queueDelayInterval_ = 100;
+    numShedTasks_ = 0;
     userEventBase_ = nullptr;
     threadPoolProcessing_ = false;
     numTConnections_ = 0;
     numActiveProcessors_ = 0;
+    numIdleConnections_ = 0;
     connectionStackLimit_ = CONNECTION_STACK_LIMIT;
     maxActiveProcessors_ = MAX_ACTIVE_PROCESSORS;
     maxConnections_ = MAX_CONNECTIONS;
     maxFrameSize_ = MAX_FRAME_SIZE;
+    maxBufferMemory_ = 0;
+    bufferMemory_ = 0;
+    numMemoryStalls_ = 0;
+    numStalledConnections_ = 0;
+    pipelining_ = false;
+    maxPipelinedRequests_ = MAX_PIPELINED_REQUESTS;
     taskExpireTime_ = 0;
+    useClientTimeouts_ = false;
     overloadHysteresis_ = 0.8;
     overloadAction_ = T_OVERLOAD_NO_ACTION;
     writeBufferDefaultSize_ = WRITE_BUFFER_DEFAULT_SIZE;
@@ -298,6 +391,11 @@ private:
     overloaded_ = false;
     nConnectionsDropped_ = 0;
     nTotalConnectionsDropped_ = 0;
+    numHandshakesInProgress_ = 0;
+    nTotalHandshakes_ = 0;
+    nTotalHandshakesFailed_ = 0;
+    totalHandshakeTime_ = 0;
+    maxHandshakeTime_ = 0;
   }
 
 public:
@@ -384,9 +482,37 @@ public:
 
   std::shared_ptr<ThreadManager> getThreadManager() { return threadManager_; }
 
+  /**
+   * Set the thread manager that runs the handshakes (e.g. TLS) of accepted
+   * connections. Without one the handshakes are stepped through on the IO
+   * thread listening for connections, whenever the socket is ready; with one
+   * each step runs on the thread manager instead, so expensive handshakes do
+   * not delay the connections served by that IO thread. Either way a
+   * connection is only handed to its IO thread once established.
+   *
+   * Use a thread manager of its own, not the one of setThreadManager().
+   * Can only be used before the call to serve().
+   *
+   * @param threadManager thread manager for handshakes, or nullptr.
+   */
+  void setHandshakeThreadManager(std::shared_ptr<ThreadManager> threadManager) {
+    handshakeThreadManager_ = threadManager;
+  }
+
+  std::shared_ptr<ThreadManager> getHandshakeThreadManager() const {
+    return handshakeThreadManager_;
+  }
+
+  void addHandshakeTask(std::shared_ptr<Runnable> task) { handshakeThreadManager_->add(task); }
+
   /**
    * Sets the number of IO threads used by this server. Can only be used before
    * the call to serve() and has no effect afterwards.
+   *
+   * Connections are accepted by the first IO thread and spread round robin,
+   * unless the server transport opens a listening socket per IO thread
+   * (see TNonblockingServerSocket::setReusePort()). Then every IO thread
+   * accepts and serves its own connections.
    */
   void setNumIOThreads(size_t numThreads) {
     numIOThreads_ = numThreads;
@@ -403,6 +529,95 @@ public:
   /** Return the number of IO threads used by this server. */
   size_t getNumIOThreads() const { return numIOThreads_; }
 
+  /**
+   * Binds IO thread i, and its workers if it has any, to the CPU
+   * cpus[i % cpus.size()], so that a connection is served on a single core
+   * from accept to close. Can only be used before the call to serve(). The
+   * first IO thread runs in the thread calling serve(), which is bound as
+   * well. Only supported on Linux; elsewhere the threads are not bound.
+   *
+   * A connection's buffers are grown by its IO thread and kept for reuse by
+   * the same thread once it closes, so with the kernel's default first touch
+   * policy they mostly live in memory local to that core. Listing the CPUs
+   * of one NUMA node keeps the whole server on that node.
+   *
+   * @param cpus CPU numbers as used by sched_setaffinity(), empty to not
+   *             bind the threads.
+   */
+  void setIOThreadCpus(const std::vector<int>& cpus) { ioThreadCpus_ = cpus; }
+
+  const std::vector<int>& getIOThreadCpus() const { return ioThreadCpus_; }
+
+  /**
+   * Gives every IO thread a thread pool of its own, which runs the tasks of
+   * the connections of that IO thread only. Together with one IO thread
+   * per core, setIOThreadCpus() and TNonblockingServerSocket::setReusePort()
+   * this serves each connection without sharing a queue, lock or cache line
+   * with the other cores. Takes the place of setThreadManager(). Can only be
+   * used before the call to serve().
+   *
+   * @param numWorkers # of workers per IO thread, 0 to use the thread
+   *                   manager of setThreadManager() if any.
+   */
+  void setWorkersPerIOThread(size_t numWorkers) {
+    workersPerIOThread_ = numWorkers;
+    threadPoolProcessing_ = threadManager_ || workersPerIOThread_;
+  }
+
+  size_t getWorkersPerIOThread() const { return workersPerIOThread_; }
+
+  /**
+   * With setWorkersPerIOThread(), sets how many tasks may wait for the
+   * workers of an IO thread before new ones are handed to the IO thread
+   * whose workers have the fewest tasks waiting. The connection stays with
+   * its IO thread; only the processing moves. This is the only traffic
+   * between the cores, and it is off by default.
+   *
+   * @param threshold # of waiting tasks, 0 to never hand tasks over.
+   */
+  void setRebalanceThreshold(size_t threshold) { rebalanceThreshold_ = threshold; }
+
+  size_t getRebalanceThreshold() const { return rebalanceThreshold_; }
+
+  /**
+   * Return the count of tasks handed to the workers of another IO thread
+   * since the server started, see setRebalanceThreshold().
+   *
+   * @return # of rebalanced tasks.
+   */
+  uint64_t getNumRebalancedTasks() const {
+    return numRebalancedTasks_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Sheds requests once they stand in the queue of the thread manager longer
+   * than target, see ThreadManager::setQueueDelayTarget(). A shed request is
+   * answered with a TApplicationException right away instead of being
+   * processed late, so clients of an overloaded server fail fast and may
+   * retry elsewhere. Applies to the thread manager of setThreadManager() and
+   * the workers of setWorkersPerIOThread(). Can only be used before the call
+   * to serve().
+   *
+   * @param target   acceptable queue delay in milliseconds, 0 to never shed
+   *                 (the default)
+   * @param interval milliseconds the delay must stay above target before
+   *                 requests are shed
+   */
+  void setQueueDelayTarget(int64_t target, int64_t interval = 100) {
+    queueDelayTarget_ = target;
+    queueDelayInterval_ = interval;
+  }
+
+  int64_t getQueueDelayTarget() const { return queueDelayTarget_; }
+
+  /**
+   * Return the count of requests shed because of their queue delay since the
+   * server started, see setQueueDelayTarget().
+   *
+   * @return # of shed requests.
+   */
+  uint64_t getNumShedTasks() const { return numShedTasks_.load(std::memory_order_relaxed); }
+
   /**
    * Get the maximum number of unused TConnection we will hold in reserve.
    *
@@ -419,10 +634,34 @@ public:
 
   bool isThreadPoolProcessing() const { return threadPoolProcessing_; }
 
-  void addTask(std::shared_ptr<Runnable> task) {
-    threadManager_->add(task, 0LL, taskExpireTime_);
+  /**
+   * Set the policy deciding per call whether it runs on the IO thread or on
+   * the thread manager. Without one every call goes to the thread manager if
+   * there is one; without a thread manager every call runs on the IO thread
+   * either way. The policy sees the method name and its cpp.placement
+   * annotation and is told the service time of every call.
+   *
+   * @param placementPolicy the policy, or nullptr for none.
+   */
+  void setPlacementPolicy(std::shared_ptr<TPlacementPolicy> placementPolicy) {
+    placementPolicy_ = placementPolicy;
   }
 
+  std::shared_ptr<TPlacementPolicy> getPlacementPolicy() const { return placementPolicy_; }
+
+  /**
+   * Dispatches a task to the workers of an IO thread, or to the thread
+   * manager if the IO threads have no workers of their own.
+   *
+   * @param task the task.
+   * @param ioThread the IO thread of the connection the task belongs to.
+   * @param expiration milliseconds after which the task expires, 0 to use
+   *                   the task expire time.
+   */
+  void addTask(std::shared_ptr<Runnable> task,
+               TNonblockingIOThread* ioThread = nullptr,
+               int64_t expiration = 0);
+
   /**
    * Return the count of sockets currently connected to.
    *
@@ -442,7 +681,7 @@ public:
    *
    * @return count of idle connection objects.
    */
-  size_t getNumIdleConnections() const { return connectionStack_.size(); }
+  size_t getNumIdleConnections() const { return numIdleConnections_; }
 
   /**
    * Return count of number of connections which are currently processing.
@@ -455,19 +694,143 @@ public:
   size_t getNumActiveProcessors() const { return numActiveProcessors_; }
 
   /// Increment the count of connections currently processing.
-  void incrementActiveProcessors() {
-    Guard g(connMutex_);
-    ++numActiveProcessors_;
-  }
+  void incrementActiveProcessors() { ++numActiveProcessors_; }
 
   /// Decrement the count of connections currently processing.
   void decrementActiveProcessors() {
-    Guard g(connMutex_);
-    if (numActiveProcessors_ > 0) {
-      --numActiveProcessors_;
+    size_t active = numActiveProcessors_.load();
+    while (active > 0 && !numActiveProcessors_.compare_exchange_weak(active, active - 1)) {
     }
   }
 
+  /**
+   * Return the count of accepted connections whose handshake has not
+   * completed yet.
+   *
+   * @return # of connections in handshake.
+   */
+  size_t getNumHandshakesInProgress() const {
+    Guard g(connMutex_);
+    return numHandshakesInProgress_;
+  }
+
+  /**
+   * Return the count of handshake steps waiting for a thread of the
+   * handshake thread manager.
+   *
+   * @return # of queued handshake steps, 0 without a handshake thread manager.
+   */
+  size_t getHandshakeQueueDepth() const {
+    return handshakeThreadManager_ ? handshakeThreadManager_->pendingTaskCount() : 0;
+  }
+
+  /**
+   * Return the count of connections established since the server started.
+   *
+   * @return # of completed handshakes.
+   */
+  uint64_t getNumHandshakes() const {
+    Guard g(connMutex_);
+    return nTotalHandshakes_;
+  }
+
+  /**
+   * Return the count of connections closed during their handshake since the
+   * server started.
+   *
+   * @return # of failed handshakes.
+   */
+  uint64_t getNumFailedHandshakes() const {
+    Guard g(connMutex_);
+    return nTotalHandshakesFailed_;
+  }
+
+  /**
+   * Return the mean time from accepting a connection until it was
+   * established.
+   *
+   * @return average handshake time in microseconds, 0 if there was none yet.
+   */
+  uint64_t getAverageHandshakeTime() const {
+    Guard g(connMutex_);
+    return nTotalHandshakes_ ? totalHandshakeTime_ / nTotalHandshakes_ : 0;
+  }
+
+  /**
+   * Return the longest time from accepting a connection until it was
+   * established.
+   *
+   * @return maximum handshake time in microseconds.
+   */
+  uint64_t getMaxHandshakeTime() const {
+    Guard g(connMutex_);
+    return maxHandshakeTime_;
+  }
+
+  /**
+   * Return the count of finished tasks handed back to the IO threads since
+   * the server started.
+   *
+   * @return # of task completions.
+   */
+  uint64_t getNumCompletions() const;
+
+  /**
+   * Return how often IO threads were woken up for finished tasks. Tasks
+   * finishing while their IO thread has not caught up yet share a wakeup.
+   *
+   * @return # of completion wakeups.
+   */
+  uint64_t getNumCompletionWakeups() const;
+
+  /**
+   * Get the limit on the bytes held by the buffers of all connections.
+   *
+   * @return current setting, 0 if unlimited.
+   */
+  size_t getMaxBufferMemory() const { return maxBufferMemory_; }
+
+  /**
+   * Set the limit on the bytes held by the read and write buffers of all
+   * connections, including idle ones kept for reuse. A connection that
+   * needs a larger read buffer than the remaining budget allows stops
+   * reading until other connections release enough memory; its client
+   * then sees the backpressure through TCP flow control. Write buffers grow
+   * while a request is processed and are charged afterwards, so they may
+   * exceed the limit until they are shrunk again (see
+   * setIdleWriteBufferLimit()); meanwhile no connection grows its read
+   * buffer. A frame that does not fit into the budget at all closes its
+   * connection, so the limit should be well above getMaxFrameSize().
+   * Can only be used before the call to serve().
+   *
+   * @param maxBufferMemory the new limit in bytes, 0 for no limit.
+   */
+  void setMaxBufferMemory(size_t maxBufferMemory) { maxBufferMemory_ = maxBufferMemory; }
+
+  /**
+   * Return the bytes currently held by the buffers of all connections.
+   *
+   * @return bytes in use.
+   */
+  size_t getBufferMemory() const { return bufferMemory_.load(std::memory_order_relaxed); }
+
+  /**
+   * Return how often a connection stopped reading because the limit of
+   * setMaxBufferMemory() was reached, since the server started.
+   *
+   * @return # of memory stalls.
+   */
+  uint64_t getNumMemoryStalls() const { return numMemoryStalls_.load(std::memory_order_relaxed); }
+
+  /**
+   * Return the count of connections currently waiting for buffer memory.
+   *
+   * @return # of stalled connections.
+   */
+  size_t getNumStalledConnections() const {
+    return numStalledConnections_.load(std::memory_order_relaxed);
+  }
+
   /**
    * Get the maximum # of connections allowed before overload.
    *
@@ -515,6 +878,41 @@ public:
    */
   void setMaxFrameSize(size_t maxFrameSize) { maxFrameSize_ = maxFrameSize; }
 
+  /**
+   * Get whether pipelined requests are processed as a batch.
+   *
+   * @return true if pipelining is enabled.
+   */
+  bool getPipelining() const { return pipelining_; }
+
+  /**
+   * Enable or disable pipelining, off by default. With pipelining a
+   * connection reads whatever the client sent ahead and processes all the
+   * complete frames in its read buffer as one batch: serially, or as one
+   * task per request when a thread manager is set. The responses go out in
+   * request order with a single vectored write once the whole batch is done.
+   *
+   * @param pipelining true to process pipelined requests as a batch.
+   */
+  void setPipelining(bool pipelining) { pipelining_ = pipelining; }
+
+  /**
+   * Get the maximum number of requests of one connection processed as a batch.
+   *
+   * @return Maximum number of requests in a batch.
+   */
+  size_t getMaxPipelinedRequests() const { return maxPipelinedRequests_; }
+
+  /**
+   * Set the maximum number of requests of one connection processed as a
+   * batch. Further requests already read wait for the next batch.
+   *
+   * @param maxPipelinedRequests The new limit, at least 1.
+   */
+  void setMaxPipelinedRequests(size_t maxPipelinedRequests) {
+    maxPipelinedRequests_ = maxPipelinedRequests > 0 ? maxPipelinedRequests : 1;
+  }
+
   /**
    * Get fraction of maximum limits before an overload condition is cleared.
    *
@@ -562,6 +960,21 @@ public:
    */
   void setTaskExpireTime(int64_t taskExpireTime) { taskExpireTime_ = taskExpireTime; }
 
+  /**
+   * Honor the client timeout requests carry in their
+   * THeaderTransport::CLIENT_TIMEOUT_HEADER header: a request expires like
+   * with setTaskExpireTime() once its client stopped waiting, the thread
+   * manager runs waiting requests earliest deadline first, and handlers find
+   * the time left in TRequestContext. Needs the header protocol, and costs
+   * reading the header of each request once more on the IO thread. Can only
+   * be used before the call to serve().
+   *
+   * @param useClientTimeouts whether to honor client timeouts.
+   */
+  void setUseClientTimeouts(bool useClientTimeouts) { useClientTimeouts_ = useClientTimeouts; }
+
+  bool getUseClientTimeouts() const { return useClientTimeouts_; }
+
   /**
    * Determine if the server is currently overloaded.
    * This function checks the maximums for open connections and connections
@@ -709,26 +1122,81 @@ private:
    */
   void expireClose(std::shared_ptr<Runnable> task);
 
+  /**
+   * Callback function that the threadmanager calls when it sheds a task
+   * because of its queue delay. Answers the request with an exception.
+   *
+   * @param task the runnable associated with the shed task.
+   */
+  void shedFail(std::shared_ptr<Runnable> task);
+
   /**
    * Return an initialized connection object.  Creates or recovers from
    * pool a TConnection and initializes it with the provided socket FD
    * and flags.
    *
    * @param socket FD of socket associated with this connection.
-   * @param addr the sockaddr of the client
-   * @param addrLen the length of addr
+   * @param listenThread the IO thread that accepted the connection.
    * @return pointer to initialized TConnection object.
    */
-  TConnection* createConnection(std::shared_ptr<TSocket> socket);
+  TConnection* createConnection(std::shared_ptr<TSocket> socket,
+                                TNonblockingIOThread* listenThread);
+
+  /**
+   * Takes bytes for a connection buffer from the memory budget.
+   *
+   * @param bytes the bytes the buffer grows by.
+   * @return false if they would exceed the budget, nothing is taken then.
+   */
+  bool reserveMemory(size_t bytes);
+
+  /**
+   * Takes bytes for a connection buffer that has grown already, regardless
+   * of the budget.
+   */
+  void chargeMemory(size_t bytes) { bufferMemory_ += bytes; }
+
+  /**
+   * Gives bytes of a connection buffer back and wakes up the connections
+   * waiting for memory, if any.
+   */
+  void releaseMemory(size_t bytes);
+
+  /**
+   * Parks a connection until memory is released. The connection is notified
+   * on its IO thread once it may try again to reserve bytes.
+   *
+   * @param connection the connection, which must be idle.
+   * @param bytes the bytes it failed to reserve.
+   */
+  void waitForMemory(TConnection* connection, size_t bytes);
+
+  /// Notifies all connections waiting for memory.
+  void wakeStalledConnections();
 
   /**
    * Returns a connection to pool or deletion.  If the connection pool
-   * (a stack) isn't full, place the connection object on it, otherwise
-   * just delete it.
+   * (a stack per IO thread) isn't full, place the connection object on it,
+   * otherwise just delete it.
    *
    * @param connection the TConection being returned.
+   * @param ioThread the IO thread the connection belonged to.
    */
-  void returnConnection(TConnection* connection);
+  void returnConnection(TConnection* connection, TNonblockingIOThread* ioThread);
+
+  /// Account for the start of a connection handshake.
+  void handshakeStarted() {
+    Guard g(connMutex_);
+    ++numHandshakesInProgress_;
+  }
+
+  /**
+   * Account for the end of a connection handshake.
+   *
+   * @param established whether the connection got established.
+   * @param usecs time since the connection was accepted in microseconds.
+   */
+  void handshakeDone(bool established, uint64_t usecs);
 };
 
 class TNonblockingIOThread : public Runnable {
@@ -756,19 +1224,43 @@ public:
   // only be called after the thread has been started.
   Thread::id_t getThreadId() const { return threadId_; }
 
-  // Returns the send-fd for task complete notifications.
+  // Returns the send-fd for task complete notifications.  On Linux this is
+  // the same eventfd as the read-fd.
   evutil_socket_t getNotificationSendFD() const { return notificationPipeFDs_[1]; }
 
   // Returns the read-fd for task complete notifications.
   evutil_socket_t getNotificationRecvFD() const { return notificationPipeFDs_[0]; }
 
+  // Returns the count of task completions this thread processed.
+  uint64_t getNumCompletions() const { return numCompletions_.load(std::memory_order_relaxed); }
+
+  // Returns how often this thread was woken up for task completions.
+  uint64_t getNumWakeups() const { return numWakeups_.load(std::memory_order_relaxed); }
+
   // Returns the actual thread object associated with this IO thread.
   std::shared_ptr<Thread> getThread() const { return thread_; }
 
   // Sets the actual thread object associated with this IO thread.
   void setThread(const std::shared_ptr<Thread>& t) { thread_ = t; }
 
-  // Used by TConnection objects to indicate processing has finished.
+  // Returns the CPU this thread is bound to, -1 if none.
+  int getCpu() const { return cpu_; }
+
+  // Binds this thread to a CPU once it runs, -1 for none.
+  void setCpu(int cpu) { cpu_ = cpu; }
+
+  // Returns the workers owned by this thread, nullptr if it has none.
+  std::shared_ptr<ThreadManager> getThreadManager() const { return threadManager_; }
+
+  // Sets the workers owned by this thread.
+  void setThreadManager(const std::shared_ptr<ThreadManager>& threadManager) {
+    threadManager_ = threadManager;
+  }
+
+  // Used by TConnection objects to indicate processing has finished.  The
+  // connection is queued for the IO thread, which is only woken up if the
+  // queue was empty; a nullptr conn asks the thread to stop.  A connection
+  // must not be queued again before the IO thread has processed it.
   bool notify(TNonblockingServer::TConnection* conn);
 
   // Enters the event loop and does not return until a call to stop().
@@ -786,9 +1278,9 @@ public:
 private:
   /**
    * C-callable event handler for signaling task completion.  Provides a
-   * callback that libevent can understand that will read a connection
-   * object's address from a pipe and call connection->transition() for
-   * that object.
+   * callback that libevent can understand that will consume the wakeup,
+   * take all queued connections and call connection->transition() for each
+   * of them in the order they were queued.
    *
    * @param fd the descriptor the event occurred on.
    */
@@ -800,10 +1292,11 @@ private:
    *
    * @param fd the descriptor the event occurred on.
    * @param which the flags associated with the event.
-   * @param v void* callback arg where we placed TNonblockingServer's "this".
+   * @param v void* callback arg where we placed TNonblockingIOThread's "this".
    */
   static void listenHandler(evutil_socket_t fd, short which, void* v) {
-    ((TNonblockingServer*)v)->handleEvent(fd, which);
+    auto* ioThread = (TNonblockingIOThread*)v;
+    ioThread->server_->handleEvent(fd, which, ioThread);
   }
 
   /// Exits the loop ASAP in case of shutdown or error.
@@ -812,6 +1305,9 @@ private:
   /// Create the pipe used to notify I/O process of task completion.
   void createNotificationPipe();
 
+  /// Wakes up the event loop of this thread.
+  bool wakeup();
+
   /// Unregisters our events for notification and listen sockets.
   void cleanupEvents();
 
@@ -834,6 +1330,12 @@ private:
   /// Sets a high scheduling priority when running
   bool useHighPriority_;
 
+  /// CPU to bind to when running, -1 for none
+  int cpu_;
+
+  /// Workers running the tasks of this thread's connections, may be nullptr
+  std::shared_ptr<ThreadManager> threadManager_;
+
   /// pointer to eventbase to be used for looping
   event_base* eventBase_;
 
@@ -847,9 +1349,22 @@ private:
   /// Used with eventBase_ for task completion notification
   struct event notificationEvent_;
 
-  /// File descriptors for pipe used for task completion notification.
+  /// File descriptors for pipe used for task completion notification: an
+  /// eventfd on Linux, a socketpair elsewhere.
   evutil_socket_t notificationPipeFDs_[2];
 
+  /// Connections whose task finished, newest first, linked through
+  /// TConnection::nextCompletion_.  Any thread pushes, the IO thread takes
+  /// the whole list at once.
+  std::atomic<TNonblockingServer::TConnection*> completions_;
+
+  /// Set by notify(nullptr) to stop the event loop
+  std::atomic<bool> stopRequested_;
+
+  /// Statistics of the completion queue
+  std::atomic<uint64_t> numCompletions_;
+  std::atomic<uint64_t> numWakeups_;
+
   /// Actual IO Thread
   std::shared_ptr<Thread> thread_;
 };
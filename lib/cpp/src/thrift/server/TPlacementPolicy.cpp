@@ -0,0 +1,110 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <utility>
+#include <thrift/server/TPlacementPolicy.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+using apache::thrift::concurrency::Guard;
+
+TAnnotatedPlacementPolicy::TAnnotatedPlacementPolicy(TPlacement defaultPlacement)
+  : defaultPlacement_(defaultPlacement == T_PLACEMENT_INLINE ? T_PLACEMENT_INLINE
+                                                             : T_PLACEMENT_WORKER) {
+}
+
+void TAnnotatedPlacementPolicy::setPlacement(const std::string& method, TPlacement placement) {
+  placements_[method] = placement;
+}
+
+TPlacement TAnnotatedPlacementPolicy::place(const std::string& method, TPlacement hint) {
+  auto it = placements_.find(method);
+  if (it != placements_.end() && it->second != T_PLACEMENT_ANY) {
+    return it->second;
+  }
+  return hint != T_PLACEMENT_ANY ? hint : defaultPlacement_;
+}
+
+TAdaptivePlacementPolicy::TAdaptivePlacementPolicy(uint64_t inlineThreshold, uint32_t minSamples)
+  : inlineThreshold_(inlineThreshold), minSamples_(minSamples), decay_(0.1), maxMethods_(1000) {
+}
+
+TPlacement TAdaptivePlacementPolicy::place(const std::string& method, TPlacement hint) {
+  if (hint != T_PLACEMENT_ANY) {
+    return hint;
+  }
+  return getPlacement(method);
+}
+
+void TAdaptivePlacementPolicy::record(const std::string& method,
+                                      TPlacement placement,
+                                      uint64_t usec) {
+  (void)placement;
+  Guard g(mutex_);
+  auto it = stats_.find(method);
+  if (it == stats_.end() && stats_.size() < maxMethods_) {
+    it = stats_.insert(std::make_pair(method, MethodStats())).first;
+  }
+  MethodStats& stats = it != stats_.end() ? it->second : otherStats_;
+  if (stats.samples == 0) {
+    stats.serviceTime = static_cast<double>(usec);
+  } else {
+    stats.serviceTime += decay_ * (static_cast<double>(usec) - stats.serviceTime);
+  }
+  if (stats.samples < minSamples_) {
+    ++stats.samples;
+  }
+
+  // Move a method inline once it proved cheap and back once it gets slow,
+  // with some hysteresis so it doesn't flip on every call
+  if (stats.placement == T_PLACEMENT_WORKER) {
+    if (stats.samples >= minSamples_
+        && stats.serviceTime < static_cast<double>(inlineThreshold_)) {
+      stats.placement = T_PLACEMENT_INLINE;
+    }
+  } else if (stats.serviceTime > 2.0 * static_cast<double>(inlineThreshold_)) {
+    stats.placement = T_PLACEMENT_WORKER;
+  }
+}
+
+const TAdaptivePlacementPolicy::MethodStats* TAdaptivePlacementPolicy::findStats(
+    const std::string& method) const {
+  auto it = stats_.find(method);
+  if (it != stats_.end()) {
+    return &it->second;
+  }
+  return stats_.size() < maxMethods_ ? nullptr : &otherStats_;
+}
+
+double TAdaptivePlacementPolicy::getServiceTime(const std::string& method) const {
+  Guard g(mutex_);
+  const MethodStats* stats = findStats(method);
+  return stats ? stats->serviceTime : 0;
+}
+
+TPlacement TAdaptivePlacementPolicy::getPlacement(const std::string& method) const {
+  Guard g(mutex_);
+  const MethodStats* stats = findStats(method);
+  return stats ? stats->placement : T_PLACEMENT_WORKER;
+}
+}
+}
+} // apache::thrift::server
@@ -0,0 +1,163 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TPLACEMENTPOLICY_H_
+#define _THRIFT_SERVER_TPLACEMENTPOLICY_H_ 1
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#include <thrift/TProcessor.h>
+#include <thrift/concurrency/Mutex.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * Decides per call whether a server runs it on its IO thread or hands it to
+ * its thread pool. The server asks before every call and reports how long
+ * the processor took once it is done, so a policy can learn from the
+ * service times. Both may be called from several threads at once.
+ */
+class TPlacementPolicy {
+public:
+  virtual ~TPlacementPolicy() = default;
+
+  /**
+   * Decides where a call runs.
+   *
+   * @param method name of the method called
+   * @param hint   where the processor asks the method to run, see
+   *               TProcessor::getPlacement()
+   * @return T_PLACEMENT_INLINE or T_PLACEMENT_WORKER
+   */
+  virtual TPlacement place(const std::string& method, TPlacement hint) = 0;
+
+  /**
+   * Called after a call has been processed.
+   *
+   * @param method    name of the method called
+   * @param placement where the call ran
+   * @param usec      microseconds the processor took, without queueing
+   */
+  virtual void record(const std::string& method, TPlacement placement, uint64_t usec) {
+    (void)method;
+    (void)placement;
+    (void)usec;
+  }
+};
+
+/**
+ * Runs methods where their cpp.placement annotation or an explicit
+ * setPlacement() says, and all others in a default place.
+ */
+class TAnnotatedPlacementPolicy : public TPlacementPolicy {
+public:
+  /**
+   * @param defaultPlacement where methods without a placement run
+   */
+  TAnnotatedPlacementPolicy(TPlacement defaultPlacement = T_PLACEMENT_WORKER);
+
+  /**
+   * Sets where a method runs, overriding its annotation. Must be called
+   * before the server starts.
+   */
+  void setPlacement(const std::string& method, TPlacement placement);
+
+  TPlacement place(const std::string& method, TPlacement hint) override;
+
+private:
+  TPlacement defaultPlacement_;
+  std::map<std::string, TPlacement> placements_;
+};
+
+/**
+ * Measures the service time of each method and runs the methods whose
+ * average stays below a threshold on the IO thread. Methods start out on
+ * the thread pool until enough calls have been measured; a method running
+ * inline moves back to the thread pool once its average exceeds twice the
+ * threshold. Annotated methods always run where their annotation says.
+ * Clients may send any method name, so only a limited number of methods is
+ * measured on its own; calls of any further ones share their statistics.
+ */
+class TAdaptivePlacementPolicy : public TPlacementPolicy {
+public:
+  /**
+   * @param inlineThreshold average service time in microseconds below which
+   *                        a method runs inline
+   * @param minSamples      calls measured before a method may run inline
+   */
+  TAdaptivePlacementPolicy(uint64_t inlineThreshold = 50, uint32_t minSamples = 32);
+
+  /**
+   * Sets the weight of the latest call in the moving average of the service
+   * time, 0.1 by default.
+   */
+  void setDecay(double decay) { decay_ = decay; }
+
+  /**
+   * Sets how many methods are measured on their own, 1000 by default.
+   * Must be called before the server starts.
+   */
+  void setMaxMethods(size_t maxMethods) { maxMethods_ = maxMethods; }
+
+  TPlacement place(const std::string& method, TPlacement hint) override;
+
+  void record(const std::string& method, TPlacement placement, uint64_t usec) override;
+
+  /**
+   * @return the average service time of a method in microseconds, 0 if it
+   *         has not been called.
+   */
+  double getServiceTime(const std::string& method) const;
+
+  /**
+   * @return where unannotated calls of a method currently run.
+   */
+  TPlacement getPlacement(const std::string& method) const;
+
+private:
+  struct MethodStats {
+    MethodStats() : serviceTime(0), samples(0), placement(T_PLACEMENT_WORKER) {}
+
+    double serviceTime;
+    uint32_t samples;
+    TPlacement placement;
+  };
+
+  /// The statistics of a method, those shared by the others once full. Requires mutex_.
+  const MethodStats* findStats(const std::string& method) const;
+
+  uint64_t inlineThreshold_;
+  uint32_t minSamples_;
+  double decay_;
+  size_t maxMethods_;
+
+  mutable concurrency::Mutex mutex_;
+  std::unordered_map<std::string, MethodStats> stats_;
+  MethodStats otherStats_;
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TPLACEMENTPOLICY_H_
@@ -0,0 +1,56 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/server/TRequestContext.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/// The innermost context of the calling thread
+static thread_local TRequestContext* current = nullptr;
+
+TRequestContext::TRequestContext(time_point deadline) : deadline_(deadline), previous_(current) {
+  current = this;
+}
+
+TRequestContext::~TRequestContext() {
+  current = previous_;
+}
+
+bool TRequestContext::hasDeadline() {
+  return getDeadline() != time_point();
+}
+
+TRequestContext::time_point TRequestContext::getDeadline() {
+  return current ? current->deadline_ : time_point();
+}
+
+int64_t TRequestContext::getRemainingTime() {
+  time_point deadline = getDeadline();
+  if (deadline == time_point()) {
+    return -1;
+  }
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+  return remaining.count() > 0 ? remaining.count() : 0;
+}
+}
+}
+} // apache::thrift::server
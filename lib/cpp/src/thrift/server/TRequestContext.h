@@ -0,0 +1,85 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TREQUESTCONTEXT_H_
+#define _THRIFT_SERVER_TREQUESTCONTEXT_H_ 1
+
+#include <stdint.h>
+#include <chrono>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * What the server knows about the request the calling thread processes, so
+ * that a handler can e.g. skip work its client will not wait for:
+ *
+ *   int64_t remaining = TRequestContext::getRemainingTime();
+ *   if (remaining >= 0 && remaining < 50) {
+ *     ... answer from the cache instead ...
+ *   }
+ *
+ * A server creates a TRequestContext on the stack around each call it
+ * processes; the static functions then describe the innermost one.
+ */
+class TRequestContext {
+public:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  /**
+   * Makes deadline the deadline of the request processed by the calling
+   * thread until this object is destroyed.
+   *
+   * @param deadline when the client stops waiting, time_point() for never
+   */
+  explicit TRequestContext(time_point deadline);
+
+  ~TRequestContext();
+
+  TRequestContext(const TRequestContext&) = delete;
+  TRequestContext& operator=(const TRequestContext&) = delete;
+
+  /**
+   * @return whether the request processed by the calling thread has a
+   *         deadline.
+   */
+  static bool hasDeadline();
+
+  /**
+   * @return when the client of the request processed by the calling thread
+   *         stops waiting, time_point() if it has no deadline.
+   */
+  static time_point getDeadline();
+
+  /**
+   * @return milliseconds left until the deadline of the request processed
+   *         by the calling thread, 0 once it passed, -1 if it has none.
+   */
+  static int64_t getRemainingTime();
+
+private:
+  time_point deadline_;
+  TRequestContext* previous_;
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TREQUESTCONTEXT_H_
@@ -45,7 +45,8 @@ TServerFramework::TServerFramework(const shared_ptr<TProcessorFactory>& processo
   : TServer(processorFactory, serverTransport, transportFactory, protocolFactory),
     clients_(0),
     hwm_(0),
-    limit_(INT64_MAX) {
+    limit_(INT64_MAX),
+    acceptWaiting_(false) {
 }
 
 TServerFramework::TServerFramework(const shared_ptr<TProcessor>& processor,
@@ -55,7 +56,8 @@ TServerFramework::TServerFramework(const shared_ptr<TProcessor>& processor,
   : TServer(processor, serverTransport, transportFactory, protocolFactory),
     clients_(0),
     hwm_(0),
-    limit_(INT64_MAX) {
+    limit_(INT64_MAX),
+    acceptWaiting_(false) {
 }
 
 TServerFramework::TServerFramework(const shared_ptr<TProcessorFactory>& processorFactory,
@@ -72,7 +74,8 @@ TServerFramework::TServerFramework(const shared_ptr<TProcessorFactory>& processo
             outputProtocolFactory),
     clients_(0),
     hwm_(0),
-    limit_(INT64_MAX) {
+    limit_(INT64_MAX),
+    acceptWaiting_(false) {
 }
 
 TServerFramework::TServerFramework(const shared_ptr<TProcessor>& processor,
@@ -89,7 +92,8 @@ TServerFramework::TServerFramework(const shared_ptr<TProcessor>& processor,
             outputProtocolFactory),
     clients_(0),
     hwm_(0),
-    limit_(INT64_MAX) {
+    limit_(INT64_MAX),
+    acceptWaiting_(false) {
 }
 
 TServerFramework::~TServerFramework() = default;
@@ -138,9 +142,16 @@ void TServerFramework::serve() {
       // accepting another.
       {
         Synchronized sync(mon_);
-        while (clients_ >= limit_) {
+        for (;;) {
+          // announce the wait before the limit is checked, so that a limit
+          // raised by recordLatency() is either seen here or notified
+          acceptWaiting_ = true;
+          if (clients_ < effectiveLimit()) {
+            break;
+          }
           mon_.wait();
         }
+        acceptWaiting_ = false;
       }
 
       client = serverTransport_->accept();
@@ -209,11 +220,42 @@ void TServerFramework::setConcurrentClientLimit(int64_t newLimit) {
   }
   Synchronized sync(mon_);
   limit_ = newLimit;
-  if (limit_ - clients_ > 0) {
+  if (effectiveLimit() - clients_ > 0) {
     mon_.notify();
   }
 }
 
+void TServerFramework::setConcurrencyLimiter(const shared_ptr<TConcurrencyLimiter>& limiter) {
+  Synchronized sync(mon_);
+  limiter_ = limiter;
+}
+
+shared_ptr<TConcurrencyLimiter> TServerFramework::getConcurrencyLimiter() const {
+  Synchronized sync(mon_);
+  return limiter_;
+}
+
+int64_t TServerFramework::getEffectiveConcurrentClientLimit() const {
+  Synchronized sync(mon_);
+  return effectiveLimit();
+}
+
+int64_t TServerFramework::effectiveLimit() const {
+  return limiter_ ? (std::min)(limit_, limiter_->getLimit()) : limit_;
+}
+
+void TServerFramework::recordLatency(const shared_ptr<TConcurrencyLimiter>& limiter,
+                                     uint64_t usec) {
+  // every worker comes here after every request, so mon_ is only taken when
+  // the accept loop waits for the limit to grow
+  if (limiter->record(usec, clients_) - clients_ > 0 && acceptWaiting_) {
+    Synchronized sync(mon_);
+    if (effectiveLimit() - clients_ > 0) {
+      mon_.notify();
+    }
+  }
+}
+
 void TServerFramework::stop() {
   // Order is important because serve() releases serverTransport_ when it is
   // interrupted, which closes the socket that interruptChildren uses.
@@ -225,7 +267,11 @@ void TServerFramework::newlyConnectedClient(const shared_ptr<TConnectedClient>&
   {
     Synchronized sync(mon_);
     ++clients_;
-    hwm_ = (std::max)(hwm_, clients_);
+    hwm_ = (std::max)(hwm_, clients_.load());
+    if (limiter_) {
+      pClient->setLatencyHandler(
+          bind(&TServerFramework::recordLatency, this, limiter_, std::placeholders::_1));
+    }
   }
 
   onClientConnected(pClient);
@@ -236,7 +282,7 @@ void TServerFramework::disposeConnectedClient(TConnectedClient* pClient) {
   delete pClient;
 
   Synchronized sync(mon_);
-  if (limit_ - --clients_ > 0) {
+  if (effectiveLimit() - --clients_ > 0) {
     mon_.notify();
   }
 }
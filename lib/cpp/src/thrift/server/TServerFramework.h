@@ -20,10 +20,12 @@
 #ifndef _THRIFT_SERVER_TSERVERFRAMEWORK_H_
 #define _THRIFT_SERVER_TSERVERFRAMEWORK_H_ 1
 
+#include <atomic>
 #include <memory>
 #include <stdint.h>
 #include <thrift/TProcessor.h>
 #include <thrift/concurrency/Monitor.h>
+#include <thrift/server/TConcurrencyLimiter.h>
 #include <thrift/server/TConnectedClient.h>
 #include <thrift/server/TServer.h>
 #include <thrift/transport/TServerTransport.h>
@@ -121,6 +123,30 @@ public:
    */
   virtual void setConcurrentClientLimit(int64_t newLimit);
 
+  /**
+   * Set a limiter that adjusts the limit on concurrent clients at runtime
+   * from the latency of their requests, so that the server stops accepting
+   * clients while latency rises under load.  Clients count against the
+   * limit while connected, whether or not a request of theirs is in flight,
+   * so the limit is one on connections.  Clients already connected are
+   * not disconnected.  The limit set by setConcurrentClientLimit() still
+   * caps it.  Must be called before serve().
+   * \param[in]  limiter  the limiter, or nullptr for a fixed limit
+   */
+  virtual void setConcurrencyLimiter(const std::shared_ptr<TConcurrencyLimiter>& limiter);
+
+  /**
+   * \returns  the concurrency limiter, if any
+   */
+  virtual std::shared_ptr<TConcurrencyLimiter> getConcurrencyLimiter() const;
+
+  /**
+   * Get the limit on concurrent clients currently enforced, the lower of
+   * the concurrent client limit and the limit of the concurrency limiter.
+   * \returns the effective concurrent client limit
+   */
+  virtual int64_t getEffectiveConcurrentClientLimit() const;
+
 protected:
   /**
    * A client has connected.  The implementation is responsible for managing the
@@ -157,15 +183,27 @@ private:
    */
   void disposeConnectedClient(TConnectedClient* pClient);
 
+  /**
+   * Passes the latency of a request to the concurrency limiter the client
+   * was accepted with.  Does not need mon_.
+   */
+  void recordLatency(const std::shared_ptr<TConcurrencyLimiter>& limiter, uint64_t usec);
+
+  /**
+   * The limit on concurrent clients in force.  Needs mon_.
+   */
+  int64_t effectiveLimit() const;
+
   /**
    * Monitor for limiting the number of concurrent clients.
    */
   apache::thrift::concurrency::Monitor mon_;
 
   /**
-   * The number of concurrent clients.
+   * The number of concurrent clients.  Changed under mon_, read without it
+   * by recordLatency().
    */
-  int64_t clients_;
+  std::atomic<int64_t> clients_;
 
   /**
    * The high water mark of concurrent clients.
@@ -176,6 +214,14 @@ private:
    * The limit on the number of concurrent clients.
    */
   int64_t limit_;
+
+  std::shared_ptr<TConcurrencyLimiter> limiter_;
+
+  /**
+   * Whether serve() waits on mon_ for the number of clients to fall below
+   * the limit.
+   */
+  std::atomic<bool> acceptWaiting_;
 };
 }
 }
@@ -17,16 +17,26 @@
  * under the License.
  */
 
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <typeinfo>
+#include <thrift/concurrency/Exception.h>
 #include <thrift/server/TThreadPoolServer.h>
+#include <thrift/transport/TSocket.h>
 
 namespace apache {
 namespace thrift {
 namespace server {
 
+using apache::thrift::concurrency::Runnable;
 using apache::thrift::concurrency::ThreadManager;
+using apache::thrift::concurrency::TimedOutException;
 using apache::thrift::protocol::TProtocol;
 using apache::thrift::protocol::TProtocolFactory;
+using apache::thrift::concurrency::TooManyPendingTasksException;
 using apache::thrift::transport::TServerTransport;
+using apache::thrift::transport::TSocket;
 using apache::thrift::transport::TTransport;
 using apache::thrift::transport::TTransportException;
 using apache::thrift::transport::TTransportFactory;
@@ -41,7 +51,9 @@ TThreadPoolServer::TThreadPoolServer(const shared_ptr<TProcessorFactory>& proces
   : TServerFramework(processorFactory, serverTransport, transportFactory, protocolFactory),
     threadManager_(threadManager),
     timeout_(0),
-    taskExpiration_(0) {
+    taskExpiration_(0),
+    idleConnectionParking_(false),
+    shedClients_(0) {
 }
 
 TThreadPoolServer::TThreadPoolServer(const shared_ptr<TProcessor>& processor,
@@ -52,7 +64,9 @@ TThreadPoolServer::TThreadPoolServer(const shared_ptr<TProcessor>& processor,
   : TServerFramework(processor, serverTransport, transportFactory, protocolFactory),
     threadManager_(threadManager),
     timeout_(0),
-    taskExpiration_(0) {
+    taskExpiration_(0),
+    idleConnectionParking_(false),
+    shedClients_(0) {
 }
 
 TThreadPoolServer::TThreadPoolServer(const shared_ptr<TProcessorFactory>& processorFactory,
@@ -70,7 +84,9 @@ TThreadPoolServer::TThreadPoolServer(const shared_ptr<TProcessorFactory>& proces
                      outputProtocolFactory),
     threadManager_(threadManager),
     timeout_(0),
-    taskExpiration_(0) {
+    taskExpiration_(0),
+    idleConnectionParking_(false),
+    shedClients_(0) {
 }
 
 TThreadPoolServer::TThreadPoolServer(const shared_ptr<TProcessor>& processor,
@@ -88,14 +104,30 @@ TThreadPoolServer::TThreadPoolServer(const shared_ptr<TProcessor>& processor,
                      outputProtocolFactory),
     threadManager_(threadManager),
     timeout_(0),
-    taskExpiration_(0) {
+    taskExpiration_(0),
+    idleConnectionParking_(false),
+    shedClients_(0) {
 }
 
 TThreadPoolServer::~TThreadPoolServer() = default;
 
 void TThreadPoolServer::serve() {
+  shared_ptr<TConnectionPoller> poller;
+  if (idleConnectionParking_ && TConnectionPoller::isSupported()) {
+    poller = std::make_shared<TConnectionPoller>(
+        std::bind(&TThreadPoolServer::resumeClient, this, std::placeholders::_1));
+    poller->start();
+    std::atomic_store(&poller_, poller);
+  }
+
   TServerFramework::serve();
+
+  // clients still parked are idle and get disconnected before the pool drains
+  if (poller) {
+    poller->stop();
+  }
   threadManager_->stop();
+  std::atomic_store(&poller_, shared_ptr<TConnectionPoller>());
 }
 
 int64_t TThreadPoolServer::getTimeout() const {
@@ -114,15 +146,91 @@ void TThreadPoolServer::setTaskExpiration(int64_t value) {
   taskExpiration_ = value;
 }
 
+void TThreadPoolServer::setQueueDelayTarget(int64_t target, int64_t interval) {
+  threadManager_->setShedCallback(
+      std::bind(&TThreadPoolServer::shedClient, this, std::placeholders::_1));
+  threadManager_->setQueueDelayTarget(target, interval);
+}
+
+uint64_t TThreadPoolServer::getShedClientCount() const {
+  return shedClients_;
+}
+
+void TThreadPoolServer::shedClient(const shared_ptr<Runnable>& task) {
+  // the task left the queue, so the worker running this owns the client
+  shared_ptr<TConnectedClient> pClient = std::dynamic_pointer_cast<TConnectedClient>(task);
+  if (pClient) {
+    ++shedClients_;
+    pClient->drop();
+  }
+}
+
 std::shared_ptr<apache::thrift::concurrency::ThreadManager>
 TThreadPoolServer::getThreadManager() const {
   return threadManager_;
 }
 
+void TThreadPoolServer::setIdleConnectionParking(bool enable) {
+  idleConnectionParking_ = enable;
+}
+
+bool TThreadPoolServer::getIdleConnectionParking() const {
+  return idleConnectionParking_;
+}
+
+size_t TThreadPoolServer::getParkedConnectionCount() const {
+  shared_ptr<TConnectionPoller> poller = std::atomic_load(&poller_);
+  return poller ? poller->getParkedCount() : 0;
+}
+
 void TThreadPoolServer::onClientConnected(const shared_ptr<TConnectedClient>& pClient) {
+  if (std::atomic_load(&poller_)) {
+    std::weak_ptr<TConnectedClient> weak(pClient);
+    pClient->setIdleHandler(
+        std::bind(&TThreadPoolServer::parkClient, this, weak, std::placeholders::_1));
+  }
+  pClient->setQueueTime(std::chrono::steady_clock::now());
   threadManager_->add(pClient, getTimeout(), getTaskExpiration());
 }
 
+bool TThreadPoolServer::parkClient(const std::weak_ptr<TConnectedClient>& pClient,
+                                   const shared_ptr<TTransport>& client) {
+  // other sockets, such as TSSLSocket, may buffer data the poller cannot see
+  const TTransport& transport = *client;
+  if (typeid(transport) != typeid(TSocket)) {
+    return false;
+  }
+  shared_ptr<TConnectionPoller> poller = std::atomic_load(&poller_);
+  if (!poller) {
+    return false;
+  }
+  auto* socket = static_cast<TSocket*>(client.get());
+  return poller->park(pClient.lock(), socket->getSocketFD(), socket->getRecvTimeout());
+}
+
+void TThreadPoolServer::resumeClient(const shared_ptr<TConnectedClient>& pClient) {
+  // This runs on the poller thread, which must neither block on a full queue
+  // nor die with the thread manager: the client is dropped instead. Parking
+  // it again would not help, its socket is readable.
+  try {
+    pClient->setQueueTime(std::chrono::steady_clock::now());
+    for (;;) {
+      try {
+        threadManager_->add(pClient, -1, getTaskExpiration());
+        break;
+      } catch (const TimedOutException&) {
+        // without waiting, add() also gives up when the lock is busy
+        std::this_thread::yield();
+      }
+    }
+  } catch (const TooManyPendingTasksException&) {
+    GlobalOutput("TThreadPoolServer dropped a parked client: too many pending tasks");
+  } catch (const TException& tx) {
+    string errStr = string("TThreadPoolServer dropped a parked client: ") + tx.what();
+    GlobalOutput(errStr.c_str());
+  }
+}
+
 void TThreadPoolServer::onClientDisconnected(TConnectedClient*) {
 }
 
@@ -21,7 +21,9 @@
 #define _THRIFT_SERVER_TTHREADPOOLSERVER_H_ 1
 
 #include <atomic>
+#include <memory>
 #include <thrift/concurrency/ThreadManager.h>
+#include <thrift/server/TConnectionPoller.h>
 #include <thrift/server/TServerFramework.h>
 
 namespace apache {
@@ -30,6 +32,11 @@ namespace server {
 
 /**
  * Manage clients using a thread pool.
+ *
+ * By default a client holds a worker for as long as it is connected.  With
+ * setIdleConnectionParking() a client waiting for its next request gives its
+ * worker back and is queued again when the request arrives, so the pool can
+ * be sized to the request rate instead of the connection count.
  */
 class TThreadPoolServer : public TServerFramework {
 public:
@@ -83,8 +90,40 @@ public:
   virtual int64_t getTaskExpiration() const;
   virtual void setTaskExpiration(int64_t value);
 
+  /**
+   * Sheds clients whose connection waited longer than target milliseconds
+   * for a worker, see ThreadManager::setQueueDelayTarget(). The tasks of this
+   * server are whole connections, so a shed client is disconnected without
+   * being served and can fail over at once instead of queueing behind an
+   * overloaded pool.  Replaces the shed callback of the thread manager with
+   * one that closes the client and counts it.
+   */
+  virtual void setQueueDelayTarget(int64_t target, int64_t interval = 100);
+
+  /**
+   * \returns  the number of clients disconnected because they were shed
+   */
+  virtual uint64_t getShedClientCount() const;
+
   virtual std::shared_ptr<apache::thrift::concurrency::ThreadManager> getThreadManager() const;
 
+  /**
+   * Parks clients that are idle between requests in a shared epoll poller
+   * instead of keeping a worker blocked reading from them; handlers still see
+   * the usual blocking calls.  The socket receive timeout then bounds how long
+   * a client may stay parked.  Applies to plain TSocket clients whose request
+   * data the input transport exposes through borrow(), as TBufferedTransport,
+   * TFramedTransport and THeaderTransport do, and only where epoll exists.
+   * Must be set before serve() is called.
+   */
+  virtual void setIdleConnectionParking(bool enable);
+  virtual bool getIdleConnectionParking() const;
+
+  /**
+   * \returns  the number of clients currently parked
+   */
+  virtual size_t getParkedConnectionCount() const;
+
 protected:
   void onClientConnected(const std::shared_ptr<TConnectedClient>& pClient) override /* override */;
   void onClientDisconnected(TConnectedClient* pClient) override /* override */;
@@ -92,6 +131,36 @@ protected:
   std::shared_ptr<apache::thrift::concurrency::ThreadManager> threadManager_;
   std::atomic<int64_t> timeout_;
   std::atomic<int64_t> taskExpiration_;
+
+private:
+  /**
+   * Idle handler of the clients: parks the client if it can be polled.
+   */
+  bool parkClient(const std::weak_ptr<TConnectedClient>& pClient,
+                  const std::shared_ptr<apache::thrift::transport::TTransport>& client);
+
+  /**
+   * Queues a parked client that has a request to read again, without
+   * waiting for room in the queue. A client that cannot be queued is
+   * dropped.
+   */
+  void resumeClient(const std::shared_ptr<TConnectedClient>& pClient);
+
+  /**
+   * Shed callback of the thread manager: disconnects the client.
+   */
+  void shedClient(const std::shared_ptr<apache::thrift::concurrency::Runnable>& task);
+
+  bool idleConnectionParking_;
+
+  std::atomic<uint64_t> shedClients_;
+
+  /**
+   * Set while serve() runs with parking enabled. Only accessed through
+   * std::atomic_load() and std::atomic_store(), as workers and monitoring
+   * threads read it while serve() sets and clears it.
+   */
+  std::shared_ptr<TConnectionPoller> poller_;
 };
 
 }
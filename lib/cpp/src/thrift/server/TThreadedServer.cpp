@@ -17,10 +17,13 @@
  * under the License.
  */
 
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <memory>
 #include <thrift/concurrency/ThreadFactory.h>
 #include <thrift/server/TThreadedServer.h>
+#include <thrift/transport/PlatformSocket.h>
 
 namespace apache {
 namespace thrift {
@@ -45,7 +48,10 @@ TThreadedServer::TThreadedServer(const shared_ptr<TProcessorFactory>& processorF
                                  const shared_ptr<TProtocolFactory>& protocolFactory,
                                  const shared_ptr<ThreadFactory>& threadFactory)
   : TServerFramework(processorFactory, serverTransport, transportFactory, protocolFactory),
-    threadFactory_(threadFactory) {
+    threadFactory_(threadFactory),
+    maxIdleThreads_(0),
+    idleThreadTimeout_(60000),
+    stopping_(false) {
 }
 
 TThreadedServer::TThreadedServer(const shared_ptr<TProcessor>& processor,
@@ -54,7 +60,10 @@ TThreadedServer::TThreadedServer(const shared_ptr<TProcessor>& processor,
                                  const shared_ptr<TProtocolFactory>& protocolFactory,
                                  const shared_ptr<ThreadFactory>& threadFactory)
   : TServerFramework(processor, serverTransport, transportFactory, protocolFactory),
-    threadFactory_(threadFactory) {
+    threadFactory_(threadFactory),
+    maxIdleThreads_(0),
+    idleThreadTimeout_(60000),
+    stopping_(false) {
 }
 
 TThreadedServer::TThreadedServer(const shared_ptr<TProcessorFactory>& processorFactory,
@@ -70,7 +79,10 @@ TThreadedServer::TThreadedServer(const shared_ptr<TProcessorFactory>& processorF
                      outputTransportFactory,
                      inputProtocolFactory,
                      outputProtocolFactory),
-    threadFactory_(threadFactory) {
+    threadFactory_(threadFactory),
+    maxIdleThreads_(0),
+    idleThreadTimeout_(60000),
+    stopping_(false) {
 }
 
 TThreadedServer::TThreadedServer(const shared_ptr<TProcessor>& processor,
@@ -86,7 +98,10 @@ TThreadedServer::TThreadedServer(const shared_ptr<TProcessor>& processor,
                      outputTransportFactory,
                      inputProtocolFactory,
                      outputProtocolFactory),
-    threadFactory_(threadFactory) {
+    threadFactory_(threadFactory),
+    maxIdleThreads_(0),
+    idleThreadTimeout_(60000),
+    stopping_(false) {
 }
 
 TThreadedServer::~TThreadedServer() = default;
@@ -100,7 +115,57 @@ void TThreadedServer::serve() {
     clientMonitor_.wait();
   }
 
+  // Release the parked threads and wait for those still running a client
+  stopping_ = true;
+  for (auto runner : idleThreads_) {
+    runner->parked_ = false;
+    runner->monitor_.notify();
+  }
+  idleThreads_.clear();
+  while (!cachedThreads_.empty()) {
+    clientMonitor_.wait();
+  }
+
   drainDeadClients();
+  stopping_ = false;
+}
+
+void TThreadedServer::setMaxIdleThreads(size_t maxIdleThreads) {
+  Synchronized sync(clientMonitor_);
+  maxIdleThreads_ = maxIdleThreads;
+
+  // release the threads parked beyond the limit, the longest parked first
+  while (idleThreads_.size() > maxIdleThreads_) {
+    TCachedThreadRunner* runner = idleThreads_.front();
+    idleThreads_.erase(idleThreads_.begin());
+    runner->parked_ = false;
+    runner->monitor_.notify();
+  }
+}
+
+size_t TThreadedServer::getMaxIdleThreads() const {
+  Synchronized sync(clientMonitor_);
+  return maxIdleThreads_;
+}
+
+void TThreadedServer::setIdleThreadTimeout(int64_t timeout) {
+  Synchronized sync(clientMonitor_);
+  idleThreadTimeout_ = timeout;
+
+  // parked threads wait for the new timeout from when they were parked
+  for (auto runner : idleThreads_) {
+    runner->monitor_.notify();
+  }
+}
+
+int64_t TThreadedServer::getIdleThreadTimeout() const {
+  Synchronized sync(clientMonitor_);
+  return idleThreadTimeout_;
+}
+
+size_t TThreadedServer::getNumIdleThreads() const {
+  Synchronized sync(clientMonitor_);
+  return idleThreads_.size();
 }
 
 void TThreadedServer::drainDeadClients() {
@@ -110,10 +175,32 @@ void TThreadedServer::drainDeadClients() {
     it->second->join();
     deadClientMap_.erase(it);
   }
+  while (!deadThreads_.empty()) {
+    deadThreads_.back()->join();
+    deadThreads_.pop_back();
+  }
 }
 
 void TThreadedServer::onClientConnected(const shared_ptr<TConnectedClient>& pClient) {
   Synchronized sync(clientMonitor_);
+  if (maxIdleThreads_ > 0) {
+    if (!idleThreads_.empty()) {
+      // hand the client to the most recently parked thread
+      TCachedThreadRunner* runner = idleThreads_.back();
+      idleThreads_.pop_back();
+      runner->pClient_ = pClient;
+      runner->parked_ = false;
+      runner->monitor_.notify();
+    } else {
+      shared_ptr<TCachedThreadRunner> pRunnable = make_shared<TCachedThreadRunner>(*this, pClient);
+      shared_ptr<Thread> pThread = threadFactory_->newThread(pRunnable);
+      pRunnable->thread(pThread);
+      cachedThreads_.insert(CachedThreadMap::value_type(pRunnable.get(), pThread));
+      pThread->start();
+    }
+    return;
+  }
+
   shared_ptr<TConnectedClientRunner> pRunnable = make_shared<TConnectedClientRunner>(pClient);
   shared_ptr<Thread> pThread = threadFactory_->newThread(pRunnable);
   pRunnable->thread(pThread);
@@ -135,6 +222,54 @@ void TThreadedServer::onClientDisconnected(TConnectedClient* pClient) {
   }
 }
 
+bool TThreadedServer::parkThread(TCachedThreadRunner& runner) {
+  Synchronized sync(clientMonitor_);
+  if (!stopping_ && idleThreads_.size() < maxIdleThreads_) {
+    idleThreads_.push_back(&runner);
+    runner.parked_ = true;
+    auto parkedAt = std::chrono::steady_clock::now();
+    while (runner.parked_) {
+      if (idleThreadTimeout_ == 0) {
+        runner.monitor_.waitForever();
+      } else if (runner.monitor_.waitForTime(parkedAt
+                                             + std::chrono::milliseconds(idleThreadTimeout_))
+                     == THRIFT_ETIMEDOUT
+                 && runner.parked_) {
+        idleThreads_.erase(std::find(idleThreads_.begin(), idleThreads_.end(), &runner));
+        runner.parked_ = false;
+      }
+    }
+    if (runner.pClient_) {
+      return true;
+    }
+  }
+
+  // the thread leaves the cache; it is joined by the next one to drain dead clients
+  auto it = cachedThreads_.find(&runner);
+  if (it != cachedThreads_.end()) {
+    deadThreads_.push_back(it->second);
+    cachedThreads_.erase(it);
+  }
+  if (cachedThreads_.empty()) {
+    clientMonitor_.notify();
+  }
+  return false;
+}
+
+TThreadedServer::TCachedThreadRunner::TCachedThreadRunner(TThreadedServer& server,
+                                                          const shared_ptr<TConnectedClient>& pClient)
+  : server_(server), pClient_(pClient), monitor_(&server.clientMonitor_), parked_(false) {
+}
+
+TThreadedServer::TCachedThreadRunner::~TCachedThreadRunner() = default;
+
+void TThreadedServer::TCachedThreadRunner::run() /* override */ {
+  do {
+    pClient_->run();
+    pClient_.reset(); // disconnects the client before the thread is parked
+  } while (server_.parkThread(*this));
+}
+
 TThreadedServer::TConnectedClientRunner::TConnectedClientRunner(const shared_ptr<TConnectedClient>& pClient)
   : pClient_(pClient) {
 }
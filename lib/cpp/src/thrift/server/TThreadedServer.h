@@ -21,6 +21,7 @@
 #define _THRIFT_SERVER_TTHREADEDSERVER_H_ 1
 
 #include <map>
+#include <vector>
 #include <thrift/concurrency/Monitor.h>
 #include <thrift/concurrency/ThreadFactory.h>
 #include <thrift/concurrency/Thread.h>
@@ -34,6 +35,10 @@ namespace server {
  * Manage clients using threads - threads are created one for each client and are
  * released when the client disconnects.  This server is used to make a dynamically
  * scalable server up to the concurrent connection limit.
+ *
+ * With setMaxIdleThreads() a thread whose client disconnects is parked instead
+ * and handed the next client that connects, so short-lived connections do not
+ * pay for creating a thread each.
  */
 class TThreadedServer : public TServerFramework {
 public:
@@ -85,6 +90,28 @@ public:
    */
   void serve() override;
 
+  /**
+   * Sets the number of threads kept parked for reuse once their client
+   * disconnects.  The default, 0, creates a thread for each client and joins
+   * it after the client disconnects.  Lowering it while serving lets the
+   * threads parked beyond the new limit exit.
+   */
+  void setMaxIdleThreads(size_t maxIdleThreads);
+  size_t getMaxIdleThreads() const;
+
+  /**
+   * Sets how many milliseconds a parked thread waits for a new client before
+   * it exits; 0 keeps it parked until the server stops.  Default is 60000.
+   * Threads already parked apply a new timeout from when they were parked.
+   */
+  void setIdleThreadTimeout(int64_t timeout);
+  int64_t getIdleThreadTimeout() const;
+
+  /**
+   * \returns  the number of threads currently parked waiting for a client
+   */
+  size_t getNumIdleThreads() const;
+
 protected:
   /**
    * Drain recently connected clients by joining their threads - this is done lazily because
@@ -121,6 +148,33 @@ protected:
     std::shared_ptr<TConnectedClient> pClient_;
   };
 
+  /**
+   * Runs clients one after another on a reusable thread.  Between clients the
+   * thread parks in the server's thread cache; when parkThread() declines to
+   * keep it the thread exits.
+   */
+  class TCachedThreadRunner : public apache::thrift::concurrency::Runnable
+  {
+  public:
+    TCachedThreadRunner(TThreadedServer& server, const std::shared_ptr<TConnectedClient>& pClient);
+    ~TCachedThreadRunner() override;
+    void run() override /* override */;
+  private:
+    friend class TThreadedServer;
+    TThreadedServer& server_;
+    std::shared_ptr<TConnectedClient> pClient_;
+    apache::thrift::concurrency::Monitor monitor_;
+    bool parked_;
+  };
+
+  /**
+   * Parks the thread of a runner whose client disconnected until it is handed
+   * another client.
+   * \returns  true if the runner has a new client to run, false if its thread
+   *           should exit
+   */
+  virtual bool parkThread(TCachedThreadRunner& runner);
+
   apache::thrift::concurrency::Monitor clientMonitor_;
 
   typedef std::map<TConnectedClient *, std::shared_ptr<apache::thrift::concurrency::Thread> > ClientMap;
@@ -134,6 +188,28 @@ protected:
    * A map of clients that have disconnected but their threads have not been joined
    */
   ClientMap deadClientMap_;
+
+  size_t maxIdleThreads_;
+  int64_t idleThreadTimeout_;
+
+  /**
+   * Runners parked waiting for a client, the most recently parked last
+   */
+  std::vector<TCachedThreadRunner*> idleThreads_;
+
+  typedef std::map<TCachedThreadRunner*, std::shared_ptr<apache::thrift::concurrency::Thread> > CachedThreadMap;
+
+  /**
+   * All threads of the cache, running a client or parked
+   */
+  CachedThreadMap cachedThreads_;
+
+  /**
+   * Threads that left the cache but have not been joined
+   */
+  std::vector<std::shared_ptr<apache::thrift::concurrency::Thread> > deadThreads_;
+
+  bool stopping_;
 };
 
 }
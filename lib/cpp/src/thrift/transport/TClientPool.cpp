@@ -0,0 +1,533 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <algorithm>
+#include <cstring>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <thrift/concurrency/FunctionRunner.h>
+#include <thrift/transport/PlatformSocket.h>
+#include <thrift/transport/TClientPool.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using std::chrono::steady_clock;
+using apache::thrift::concurrency::FunctionRunner;
+using apache::thrift::concurrency::Synchronized;
+using apache::thrift::concurrency::ThreadFactory;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::protocol::TProtocolFactory;
+
+TClientPoolBase::TClientPoolBase(shared_ptr<TTransportFactory> transportFactory,
+                                 shared_ptr<TProtocolFactory> protocolFactory)
+  : transportFactory_(transportFactory),
+    protocolFactory_(protocolFactory),
+    threadFactory_(new ThreadFactory(false)),
+    maintenanceMonitor_(&monitor_),
+    leased_(0),
+    minIdle_(0),
+    maxIdle_(8),
+    leaseTimeout_(0),
+    validationInterval_(0),
+    retryInterval_(60),
+    connTimeout_(0),
+    sendTimeout_(0),
+    recvTimeout_(0),
+    stopping_(false) {
+}
+
+TClientPoolBase::~TClientPoolBase() {
+  stop();
+}
+
+void TClientPoolBase::addEndpoint(const string& host, int port, size_t maxConnections) {
+  Endpoint endpoint;
+  endpoint.server = std::make_shared<TSocketPoolServer>(host, port);
+  endpoint.maxConnections = maxConnections;
+  endpoint.connections = 0;
+
+  Synchronized s(monitor_);
+  endpoints_.push_back(endpoint);
+  monitor_.notifyAll();
+}
+
+void TClientPoolBase::setMinIdle(size_t minIdle) {
+  Synchronized s(monitor_);
+  minIdle_ = minIdle;
+}
+
+void TClientPoolBase::setMaxIdle(size_t maxIdle) {
+  Synchronized s(monitor_);
+  maxIdle_ = maxIdle;
+}
+
+void TClientPoolBase::setLeaseTimeout(int leaseTimeout) {
+  Synchronized s(monitor_);
+  leaseTimeout_ = leaseTimeout;
+}
+
+void TClientPoolBase::setValidationInterval(int validationInterval) {
+  Synchronized s(monitor_);
+  validationInterval_ = validationInterval;
+}
+
+void TClientPoolBase::setRetryInterval(int retryInterval) {
+  Synchronized s(monitor_);
+  retryInterval_ = retryInterval;
+}
+
+void TClientPoolBase::setConnTimeout(int ms) {
+  Synchronized s(monitor_);
+  connTimeout_ = ms;
+}
+
+void TClientPoolBase::setSendTimeout(int ms) {
+  Synchronized s(monitor_);
+  sendTimeout_ = ms;
+}
+
+void TClientPoolBase::setRecvTimeout(int ms) {
+  Synchronized s(monitor_);
+  recvTimeout_ = ms;
+}
+
+void TClientPoolBase::setPolicy(shared_ptr<TSocketPoolPolicy> policy) {
+  Synchronized s(monitor_);
+  policy_ = policy;
+}
+
+void TClientPoolBase::setThreadFactory(shared_ptr<ThreadFactory> threadFactory) {
+  threadFactory_ = threadFactory;
+}
+
+void TClientPoolBase::start() {
+  {
+    Synchronized s(monitor_);
+    stopping_ = false;
+  }
+  fill();
+  if (validationInterval_ > 0 && !maintenanceThread_) {
+    maintenanceThread_ = threadFactory_->newThread(
+        FunctionRunner::create(std::bind(&TClientPoolBase::maintain, this)));
+    maintenanceThread_->start();
+  }
+}
+
+void TClientPoolBase::stop() {
+  std::deque<unique_ptr<Connection> > idle;
+  {
+    Synchronized s(monitor_);
+    stopping_ = true;
+    maintenanceMonitor_.notifyAll();
+  }
+  if (maintenanceThread_) {
+    maintenanceThread_->join();
+    maintenanceThread_.reset();
+  }
+  {
+    Synchronized s(monitor_);
+    idle.swap(idle_);
+    for (auto& connection : idle) {
+      --endpoints_[connection->endpoint_].connections;
+    }
+    monitor_.notifyAll();
+  }
+  for (auto& connection : idle) {
+    closeConnection(*connection);
+  }
+}
+
+size_t TClientPoolBase::getNumIdle() const {
+  Synchronized s(monitor_);
+  return idle_.size();
+}
+
+size_t TClientPoolBase::getNumLeased() const {
+  Synchronized s(monitor_);
+  return leased_;
+}
+
+size_t TClientPoolBase::getNumConnections() const {
+  Synchronized s(monitor_);
+  size_t connections = 0;
+  for (const auto& endpoint : endpoints_) {
+    connections += endpoint.connections;
+  }
+  return connections;
+}
+
+unique_ptr<TClientPoolBase::Connection> TClientPoolBase::acquire() {
+  steady_clock::time_point deadline;
+  vector<bool> failed;
+  for (;;) {
+    unique_ptr<Connection> connection;
+    size_t index = 0;
+    {
+      Synchronized s(monitor_);
+      if (deadline == steady_clock::time_point()) {
+        deadline = steady_clock::now() + std::chrono::milliseconds(leaseTimeout_);
+      }
+      for (;;) {
+        if (!idle_.empty()) {
+          connection = std::move(idle_.back());
+          idle_.pop_back();
+          break;
+        }
+        failed.resize(endpoints_.size(), false);
+        if (reserve(failed, index)) {
+          break;
+        }
+        if (std::find(failed.begin(), failed.end(), false) == failed.end()) {
+          throw TTransportException(TTransportException::NOT_OPEN,
+                                    "TClientPool: could not connect to any endpoint");
+        }
+        if (leaseTimeout_ == 0) {
+          monitor_.waitForever();
+        } else if (monitor_.waitForTime(deadline) == THRIFT_ETIMEDOUT) {
+          throw TTransportException(TTransportException::TIMED_OUT,
+                                    "TClientPool: timed out waiting for a connection");
+        }
+      }
+      ++leased_;
+    }
+
+    if (connection) {
+      if (isStale(*connection)) {
+        discard(std::move(connection));
+        continue;
+      }
+      started(*connection);
+      return connection;
+    }
+
+    try {
+      connection = connect(index);
+    } catch (const TException& e) {
+      string errStr = string("TClientPool: connect failed: ") + e.what();
+      GlobalOutput(errStr.c_str());
+      failed[index] = true;
+      {
+        Synchronized s(monitor_);
+        --leased_;
+      }
+      connectFailed(index);
+      continue;
+    }
+    started(*connection);
+    return connection;
+  }
+}
+
+void TClientPoolBase::release(unique_ptr<Connection> connection, bool reuse) {
+  steady_clock::time_point now = steady_clock::now();
+  int64_t latency
+      = std::chrono::duration_cast<std::chrono::microseconds>(now - connection->leasedAt_).count();
+  connection->server_->requestFinished(latency, reuse);
+  if (reuse && !connection->transport_->isOpen()) {
+    reuse = false;
+  }
+
+  unique_ptr<Connection> evicted;
+  {
+    Synchronized s(monitor_);
+    --leased_;
+    if (reuse) {
+      connection->idleSince_ = now;
+      idle_.push_back(std::move(connection));
+      if (idle_.size() > maxIdle_) {
+        evicted = std::move(idle_.front());
+        idle_.pop_front();
+      }
+    } else {
+      evicted = std::move(connection);
+    }
+    if (evicted) {
+      --endpoints_[evicted->endpoint_].connections;
+    }
+    monitor_.notify();
+  }
+  if (evicted) {
+    closeConnection(*evicted);
+  }
+}
+
+bool TClientPoolBase::validate(Connection& connection) {
+  (void)connection;
+  return true;
+}
+
+/**
+ * Picks the endpoint of a new connection and counts the connection against
+ * its limit. Requires monitor_.
+ */
+bool TClientPoolBase::reserve(const vector<bool>& failed, size_t& index) {
+  vector<shared_ptr<TSocketPoolServer> > candidates;
+  for (size_t i = 0; i < endpoints_.size(); ++i) {
+    const Endpoint& endpoint = endpoints_[i];
+    if (!failed[i]
+        && (endpoint.maxConnections == 0 || endpoint.connections < endpoint.maxConnections)) {
+      candidates.push_back(endpoint.server);
+    }
+  }
+  if (candidates.empty()) {
+    return false;
+  }
+
+  auto indexOf = [this](const shared_ptr<TSocketPoolServer>& server) {
+    for (size_t i = 0; i < endpoints_.size(); ++i) {
+      if (endpoints_[i].server == server) {
+        return i;
+      }
+    }
+    return endpoints_.size();
+  };
+  if (policy_) {
+    policy_->order(candidates);
+  } else {
+    std::stable_sort(candidates.begin(),
+                     candidates.end(),
+                     [this, &indexOf](const shared_ptr<TSocketPoolServer>& a,
+                                      const shared_ptr<TSocketPoolServer>& b) {
+                       return endpoints_[indexOf(a)].connections
+                              < endpoints_[indexOf(b)].connections;
+                     });
+  }
+
+  // endpoints that failed recently are the last resort
+  time_t now = time(nullptr);
+  time_t retryInterval = retryInterval_;
+  std::stable_partition(candidates.begin(),
+                        candidates.end(),
+                        [now, retryInterval](const shared_ptr<TSocketPoolServer>& server) {
+                          return server->lastFailTime_ == 0
+                                 || now - server->lastFailTime_ > retryInterval;
+                        });
+
+  index = indexOf(candidates.front());
+  ++endpoints_[index].connections;
+  return true;
+}
+
+unique_ptr<TClientPoolBase::Connection> TClientPoolBase::connect(size_t index) {
+  shared_ptr<TSocketPoolServer> server;
+  int connTimeout, sendTimeout, recvTimeout;
+  {
+    Synchronized s(monitor_);
+    server = endpoints_[index].server;
+    connTimeout = connTimeout_;
+    sendTimeout = sendTimeout_;
+    recvTimeout = recvTimeout_;
+  }
+
+  shared_ptr<TSocket> socket = std::make_shared<TSocket>(server->host_, server->port_);
+  socket->setConnTimeout(connTimeout);
+  socket->setSendTimeout(sendTimeout);
+  socket->setRecvTimeout(recvTimeout);
+  shared_ptr<TTransport> transport = transportFactory_->getTransport(socket);
+  shared_ptr<TProtocol> protocol = protocolFactory_->getProtocol(transport);
+
+  unique_ptr<Connection> connection = newConnection(protocol);
+  connection->socket_ = socket;
+  connection->transport_ = transport;
+  connection->protocol_ = protocol;
+  connection->endpoint_ = index;
+  connection->server_ = server;
+  transport->open();
+  connection->validatedAt_ = steady_clock::now();
+
+  Synchronized s(monitor_);
+  server->consecutiveFailures_ = 0;
+  server->lastFailTime_ = 0;
+  return connection;
+}
+
+void TClientPoolBase::connectFailed(size_t index) {
+  Synchronized s(monitor_);
+  Endpoint& endpoint = endpoints_[index];
+  --endpoint.connections;
+  ++endpoint.server->consecutiveFailures_;
+  endpoint.server->lastFailTime_ = time(nullptr);
+  monitor_.notify();
+}
+
+/**
+ * Closes a leased connection that will not be returned.
+ */
+void TClientPoolBase::discard(unique_ptr<Connection> connection) {
+  closeConnection(*connection);
+  Synchronized s(monitor_);
+  --leased_;
+  --endpoints_[connection->endpoint_].connections;
+  monitor_.notify();
+}
+
+/**
+ * An idle connection has nothing to read unless the server closed it or
+ * the previous lease left part of a response behind, either in the socket
+ * or in the read buffer of the transport.
+ */
+bool TClientPoolBase::isStale(Connection& connection) const {
+  if (!connection.transport_->isOpen()) {
+    return true;
+  }
+  // borrowing never blocks, it only looks at what is already buffered
+  uint32_t len = 1;
+  if (connection.transport_->borrow(nullptr, &len) != nullptr) {
+    return true;
+  }
+  struct THRIFT_POLLFD fds[1];
+  std::memset(fds, 0, sizeof(fds));
+  fds[0].fd = connection.socket_->getSocketFD();
+  fds[0].events = THRIFT_POLLIN;
+  return THRIFT_POLL(fds, 1, 0) != 0;
+}
+
+void TClientPoolBase::started(Connection& connection) {
+  connection.leasedAt_ = steady_clock::now();
+  connection.server_->requestStarted();
+}
+
+void TClientPoolBase::closeConnection(Connection& connection) {
+  try {
+    connection.transport_->close();
+  } catch (const TException& e) {
+    string errStr = string("TClientPool: close failed: ") + e.what();
+    GlobalOutput(errStr.c_str());
+  }
+}
+
+/**
+ * Validates the connections idle for at least the validation interval since
+ * they were last used or validated. They are taken out of the pool meanwhile.
+ */
+void TClientPoolBase::validateIdle() {
+  steady_clock::time_point now = steady_clock::now();
+  vector<unique_ptr<Connection> > due;
+  {
+    Synchronized s(monitor_);
+    std::chrono::milliseconds interval(validationInterval_);
+    for (auto it = idle_.begin(); it != idle_.end();) {
+      Connection& connection = **it;
+      if (now - std::max(connection.idleSince_, connection.validatedAt_) >= interval) {
+        due.push_back(std::move(*it));
+        it = idle_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  vector<unique_ptr<Connection> > valid;
+  for (auto& connection : due) {
+    bool ok = false;
+    if (!isStale(*connection)) {
+      try {
+        ok = validate(*connection);
+      } catch (const TException& e) {
+        string errStr = string("TClientPool: validation failed: ") + e.what();
+        GlobalOutput(errStr.c_str());
+      }
+    }
+    if (ok) {
+      connection->validatedAt_ = steady_clock::now();
+      valid.push_back(std::move(connection));
+    } else {
+      closeConnection(*connection);
+      Synchronized s(monitor_);
+      --endpoints_[connection->endpoint_].connections;
+      monitor_.notify();
+    }
+  }
+
+  Synchronized s(monitor_);
+  // they were the least recently used, so they go back to the front
+  for (auto it = valid.rbegin(); it != valid.rend(); ++it) {
+    idle_.push_front(std::move(*it));
+    monitor_.notify();
+  }
+}
+
+/**
+ * Opens connections until there are minIdle_ idle ones or no endpoint can
+ * take more.
+ */
+void TClientPoolBase::fill() {
+  vector<bool> failed;
+  for (;;) {
+    size_t index = 0;
+    {
+      Synchronized s(monitor_);
+      failed.resize(endpoints_.size(), false);
+      if (stopping_ || idle_.size() >= minIdle_ || !reserve(failed, index)) {
+        return;
+      }
+    }
+
+    unique_ptr<Connection> connection;
+    try {
+      connection = connect(index);
+    } catch (const TException& e) {
+      string errStr = string("TClientPool: connect failed: ") + e.what();
+      GlobalOutput(errStr.c_str());
+      failed[index] = true;
+      connectFailed(index);
+      continue;
+    }
+
+    Synchronized s(monitor_);
+    connection->idleSince_ = steady_clock::now();
+    idle_.push_back(std::move(connection));
+    monitor_.notify();
+  }
+}
+
+void TClientPoolBase::maintain() {
+  for (;;) {
+    {
+      Synchronized s(monitor_);
+      if (!stopping_) {
+        maintenanceMonitor_.waitForTimeRelative(validationInterval_);
+      }
+      if (stopping_) {
+        return;
+      }
+    }
+    validateIdle();
+    fill();
+  }
+}
+}
+}
+} // apache::thrift::transport
@@ -0,0 +1,374 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TCLIENTPOOL_H_
+#define _THRIFT_TRANSPORT_TCLIENTPOOL_H_ 1
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/ThreadFactory.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TSocket.h>
+#include <thrift/transport/TSocketPool.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * The part of TClientPool that does not depend on the client type: the
+ * endpoints, the limits, the idle connections and the keepalive thread.
+ */
+class TClientPoolBase {
+public:
+  /**
+   * A socket with the transport and protocol stack of one client on top.
+   */
+  class Connection {
+  public:
+    virtual ~Connection() = default;
+
+    std::shared_ptr<TSocket> socket_;
+    std::shared_ptr<TTransport> transport_;
+    std::shared_ptr<protocol::TProtocol> protocol_;
+
+  private:
+    friend class TClientPoolBase;
+
+    size_t endpoint_;
+    std::shared_ptr<TSocketPoolServer> server_;
+    std::chrono::steady_clock::time_point leasedAt_;
+    std::chrono::steady_clock::time_point idleSince_;
+    std::chrono::steady_clock::time_point validatedAt_;
+  };
+
+  /**
+   * @param transportFactory wraps each socket, e.g. in a TFramedTransport
+   * @param protocolFactory  creates the protocol the clients talk
+   */
+  TClientPoolBase(std::shared_ptr<TTransportFactory> transportFactory,
+                  std::shared_ptr<protocol::TProtocolFactory> protocolFactory);
+
+  virtual ~TClientPoolBase();
+
+  /**
+   * Adds a server to connect to.
+   *
+   * @param maxConnections most connections open to this server at a time,
+   *                       leased or idle, 0 for no limit
+   */
+  void addEndpoint(const std::string& host, int port, size_t maxConnections = 0);
+
+  /**
+   * Sets how many idle connections start() and the keepalive thread keep
+   * open, 0 by default.
+   */
+  void setMinIdle(size_t minIdle);
+
+  /**
+   * Sets how many idle connections are kept, 8 by default. Connections
+   * returned beyond that close the least recently used one.
+   */
+  void setMaxIdle(size_t maxIdle);
+
+  /**
+   * Sets how many milliseconds lease() waits for a connection when all
+   * endpoints are at their limit, 0 to wait forever (the default).
+   */
+  void setLeaseTimeout(int leaseTimeout);
+
+  /**
+   * Sets how often in milliseconds the keepalive thread started by start()
+   * validates connections that have been idle that long and tops up the idle
+   * connections to the minimum. 0 (the default) runs no thread.
+   */
+  void setValidationInterval(int validationInterval);
+
+  /**
+   * Sets how many seconds an endpoint that failed to connect is only tried
+   * after all others, 60 by default.
+   */
+  void setRetryInterval(int retryInterval);
+
+  /**
+   * Sets the connect timeout of new connections in milliseconds.
+   */
+  void setConnTimeout(int ms);
+
+  /**
+   * Sets the send timeout of new connections in milliseconds.
+   */
+  void setSendTimeout(int ms);
+
+  /**
+   * Sets the receive timeout of new connections in milliseconds.
+   */
+  void setRecvTimeout(int ms);
+
+  /**
+   * Sets the policy choosing the endpoint of a new connection. Each lease
+   * counts as a request of its endpoint, so the latency aware policies see
+   * how long leases last. By default the endpoint with the fewest
+   * connections is used.
+   */
+  void setPolicy(std::shared_ptr<TSocketPoolPolicy> policy);
+
+  /**
+   * Sets the factory of the keepalive thread; it must create joinable
+   * threads.
+   */
+  void setThreadFactory(std::shared_ptr<concurrency::ThreadFactory> threadFactory);
+
+  /**
+   * Opens the minimum of idle connections and starts the keepalive thread.
+   * Leasing works without calling start().
+   */
+  void start();
+
+  /**
+   * Stops the keepalive thread and closes the idle connections. Leased
+   * connections stay open and are pooled again when returned.
+   */
+  void stop();
+
+  /**
+   * @return number of idle connections.
+   */
+  size_t getNumIdle() const;
+
+  /**
+   * @return number of leased connections, including ones being opened.
+   */
+  size_t getNumLeased() const;
+
+  /**
+   * @return number of connections, leased or idle, to all endpoints.
+   */
+  size_t getNumConnections() const;
+
+protected:
+  /**
+   * Takes the most recently used idle connection or opens a new one to an
+   * endpoint below its limit, waiting up to the lease timeout for either.
+   * Idle connections the server closed meanwhile are skipped.
+   *
+   * @throws TTransportException NOT_OPEN if no endpoint can be connected to,
+   *         TIMED_OUT if the lease timeout expired
+   */
+  std::unique_ptr<Connection> acquire();
+
+  /**
+   * Returns a leased connection to the pool, or closes it if reuse is false
+   * or the transport was closed.
+   */
+  void release(std::unique_ptr<Connection> connection, bool reuse);
+
+  /**
+   * Creates the client side of a new connection on top of the protocol.
+   */
+  virtual std::unique_ptr<Connection> newConnection(
+      std::shared_ptr<protocol::TProtocol> protocol) = 0;
+
+  /**
+   * Checks that an idle connection still works, e.g. by calling a cheap
+   * method. Called by the keepalive thread without the pool locked.
+   */
+  virtual bool validate(Connection& connection);
+
+private:
+  struct Endpoint {
+    std::shared_ptr<TSocketPoolServer> server;
+    size_t maxConnections;
+    size_t connections;
+  };
+
+  bool reserve(const std::vector<bool>& failed, size_t& index);
+  std::unique_ptr<Connection> connect(size_t index);
+  void connectFailed(size_t index);
+  void discard(std::unique_ptr<Connection> connection);
+  bool isStale(Connection& connection) const;
+  void started(Connection& connection);
+  void closeConnection(Connection& connection);
+  void validateIdle();
+  void fill();
+  void maintain();
+
+  std::shared_ptr<TTransportFactory> transportFactory_;
+  std::shared_ptr<protocol::TProtocolFactory> protocolFactory_;
+  std::shared_ptr<TSocketPoolPolicy> policy_;
+  std::shared_ptr<concurrency::ThreadFactory> threadFactory_;
+  std::shared_ptr<concurrency::Thread> maintenanceThread_;
+
+  /** Guards everything below; lease() waits on it */
+  concurrency::Monitor monitor_;
+
+  /** The keepalive thread waits on this, sharing the mutex of monitor_ */
+  concurrency::Monitor maintenanceMonitor_;
+
+  std::vector<Endpoint> endpoints_;
+
+  /** Idle connections, the most recently used at the back */
+  std::deque<std::unique_ptr<Connection> > idle_;
+
+  size_t leased_;
+  size_t minIdle_;
+  size_t maxIdle_;
+  int leaseTimeout_;
+  int validationInterval_;
+  time_t retryInterval_;
+  int connTimeout_;
+  int sendTimeout_;
+  int recvTimeout_;
+  bool stopping_;
+};
+
+/**
+ * A thread safe pool of connections for a generated client. Threads lease a
+ * client together with its transport stack and give it back when done, so
+ * a few connections serve many threads without reconnecting:
+ *
+ *   TClientPool<CalculatorClient> pool(std::make_shared<TFramedTransportFactory>());
+ *   pool.addEndpoint("calc1", 9090, 16);
+ *   pool.addEndpoint("calc2", 9090, 16);
+ *   ...
+ *   int32_t sum = pool.lease()->add(1, 2);
+ *
+ * A lease whose call threw might have left a half read response behind;
+ * call invalidate() on it so its connection is closed instead of reused.
+ * The pool must outlive its leases.
+ */
+template <class Client_>
+class TClientPool : public TClientPoolBase {
+public:
+  typedef Client_ Client;
+
+  /**
+   * A client leased from the pool, returned when the lease is destroyed or
+   * released.
+   */
+  class Lease {
+  public:
+    Lease() : pool_(nullptr), reuse_(true) {}
+
+    Lease(Lease&& other) noexcept
+      : pool_(other.pool_), connection_(std::move(other.connection_)), reuse_(other.reuse_) {}
+
+    Lease& operator=(Lease&& other) noexcept {
+      if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        connection_ = std::move(other.connection_);
+        reuse_ = other.reuse_;
+      }
+      return *this;
+    }
+
+    ~Lease() { release(); }
+
+    Client_* operator->() const { return get(); }
+
+    Client_& operator*() const { return *get(); }
+
+    Client_* get() const {
+      return connection_ ? static_cast<ClientConnection*>(connection_.get())->client_.get()
+                         : nullptr;
+    }
+
+    explicit operator bool() const { return connection_ != nullptr; }
+
+    std::shared_ptr<TTransport> getTransport() const { return connection_->transport_; }
+
+    std::shared_ptr<protocol::TProtocol> getProtocol() const { return connection_->protocol_; }
+
+    /**
+     * Closes the connection on return instead of pooling it.
+     */
+    void invalidate() { reuse_ = false; }
+
+    /**
+     * Returns the client to the pool before the lease is destroyed.
+     */
+    void release() {
+      if (connection_) {
+        pool_->release(std::move(connection_), reuse_);
+      }
+    }
+
+  private:
+    friend class TClientPool;
+
+    Lease(TClientPool* pool, std::unique_ptr<Connection> connection)
+      : pool_(pool), connection_(std::move(connection)), reuse_(true) {}
+
+    TClientPool* pool_;
+    std::unique_ptr<Connection> connection_;
+    bool reuse_;
+  };
+
+  TClientPool(std::shared_ptr<TTransportFactory> transportFactory
+              = std::make_shared<TTransportFactory>(),
+              std::shared_ptr<protocol::TProtocolFactory> protocolFactory
+              = std::make_shared<protocol::TBinaryProtocolFactory>())
+    : TClientPoolBase(transportFactory, protocolFactory) {}
+
+  ~TClientPool() override { stop(); }
+
+  /**
+   * Leases a client, see TClientPoolBase::acquire().
+   */
+  Lease lease() { return Lease(this, acquire()); }
+
+  /**
+   * Sets the check the keepalive thread runs on idle clients, e.g. calling a
+   * ping method. Must be set before start().
+   */
+  void setValidator(std::function<bool(Client_&)> validator) { validator_ = validator; }
+
+protected:
+  std::unique_ptr<Connection> newConnection(
+      std::shared_ptr<protocol::TProtocol> protocol) override {
+    ClientConnection* connection = new ClientConnection;
+    std::unique_ptr<Connection> owner(connection);
+    connection->client_.reset(new Client_(protocol));
+    return owner;
+  }
+
+  bool validate(Connection& connection) override {
+    return !validator_ || validator_(*static_cast<ClientConnection&>(connection).client_);
+  }
+
+private:
+  class ClientConnection : public Connection {
+  public:
+    std::unique_ptr<Client_> client_;
+  };
+
+  std::function<bool(Client_&)> validator_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TCLIENTPOOL_H_
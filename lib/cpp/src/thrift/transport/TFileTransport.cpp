@@ -31,11 +31,17 @@
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <thread>
+#include <vector>
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
@@ -45,6 +51,9 @@
 #endif
 
 #include <thrift/transport/TFileTransport.h>
+#ifndef _WIN32
+#include <thrift/transport/TMappedFileTransport.h>
+#endif
 #include <thrift/transport/TTransportUtils.h>
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/concurrency/FunctionRunner.h>
@@ -59,6 +68,65 @@ using std::string;
 using namespace apache::thrift::protocol;
 using namespace apache::thrift::concurrency;
 
+namespace {
+
+int64_t currentTimeUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int openFile(const std::string& path, bool write) {
+#ifndef _WIN32
+  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+  int flags = write ? O_RDWR | O_CREAT : O_RDONLY;
+#else
+  int mode = _S_IREAD | _S_IWRITE;
+  int flags = write ? _O_RDWR | _O_CREAT | _O_BINARY : _O_RDONLY | _O_BINARY;
+#endif
+  return ::THRIFT_OPEN(path.c_str(), flags, mode);
+}
+
+bool readFully(int fd, off_t offset, void* buf, size_t len) {
+  if (::THRIFT_LSEEK(fd, offset, SEEK_SET) != offset) {
+    return false;
+  }
+  auto* p = static_cast<uint8_t*>(buf);
+  while (len > 0) {
+    auto n = ::THRIFT_READ(fd, p, static_cast<uint32_t>((std::min)(len, static_cast<size_t>(1 << 30))));
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+/**
+ * Calls f(offset) for every complete event in [begin, end), which was read
+ * into buf and lies within one chunk. Stops at a corrupt event.
+ */
+template <typename F>
+void scanEvents(const uint8_t* buf, uint64_t begin, uint64_t end, uint32_t chunkSize, F f) {
+  uint64_t chunkEnd = (begin / chunkSize + 1) * chunkSize;
+  uint64_t pos = begin;
+  while (pos + 4 <= end && pos + 4 <= chunkEnd) {
+    uint32_t eventSize;
+    memcpy(&eventSize, buf + (pos - begin), 4);
+    if (eventSize == 0) {
+      // padding
+      pos += 4;
+      continue;
+    }
+    if (pos + 4 + eventSize > chunkEnd || pos + 4 + eventSize > end) {
+      break;
+    }
+    f(pos);
+    pos += 4 + eventSize;
+  }
+}
+}
+
 TFileTransport::TFileTransport(string path, bool readOnly, std::shared_ptr<TConfiguration> config)
   : TTransport(config),
     readState_(),
@@ -68,6 +136,17 @@ TFileTransport::TFileTransport(string path, bool readOnly, std::shared_ptr<TConf
     readTimeout_(NO_TAIL_READ_TIMEOUT),
     chunkSize_(DEFAULT_CHUNK_SIZE),
     eventBufferSize_(DEFAULT_EVENT_BUFFER_SIZE),
+    preallocate_(false),
+    preallocatedEnd_(0),
+    directIO_(false),
+    directFd_(0),
+    directBuf_(nullptr),
+    directSize_(0),
+    directOffset_(0),
+    indexInterval_(0),
+    indexFd_(0),
+    numEvents_(0),
+    indexTime_(0),
     flushMaxUs_(DEFAULT_FLUSH_MAX_US),
     flushMaxBytes_(DEFAULT_FLUSH_MAX_BYTES),
     maxEventSize_(DEFAULT_MAX_EVENT_SIZE),
@@ -75,13 +154,14 @@ TFileTransport::TFileTransport(string path, bool readOnly, std::shared_ptr<TConf
     eofSleepTime_(DEFAULT_EOF_SLEEP_TIME_US),
     corruptedEventSleepTime_(DEFAULT_CORRUPTED_SLEEP_TIME_US),
     writerThreadIOErrorSleepTime_(DEFAULT_WRITER_THREAD_SLEEP_TIME_US),
-    dequeueBuffer_(nullptr),
-    enqueueBuffer_(nullptr),
     notFull_(&mutex_),
     notEmpty_(&mutex_),
     closing_(false),
+    writerWaiting_(false),
+    producersWaiting_(0),
     flushed_(&mutex_),
-    forceFlush_(false),
+    flushRequested_(0),
+    syncedEvents_(0),
     filename_(path),
     fd_(0),
     bufferAndThreadInitialized_(false),
@@ -125,26 +205,22 @@ void TFileTransport::resetOutputFile(int fd, string filename, off_t offset) {
 TFileTransport::~TFileTransport() {
   // flush the buffer if a writer thread is active
   if (writerThread_.get()) {
-    // set state to closing
-    closing_ = true;
+    {
+      Guard g(mutex_);
+      // set state to closing
+      closing_ = true;
 
-    // wake up the writer thread
-    // Since closing_ is true, it will attempt to flush all data, then exit.
-    notEmpty_.notify();
+      // wake up the writer thread
+      // Since closing_ is true, it will attempt to flush all data, then exit.
+      notEmpty_.notify();
+    }
 
     writerThread_->join();
     writerThread_.reset();
   }
 
-  if (dequeueBuffer_) {
-    delete dequeueBuffer_;
-    dequeueBuffer_ = nullptr;
-  }
-
-  if (enqueueBuffer_) {
-    delete enqueueBuffer_;
-    enqueueBuffer_ = nullptr;
-  }
+  closeDirectIO();
+  closeIndex();
 
   if (readBuff_) {
     delete[] readBuff_;
@@ -173,128 +249,102 @@ bool TFileTransport::initBufferAndWriteThread() {
     return false;
   }
 
+  queue_.reset(new TFileTransportQueue(eventBufferSize_));
+
   if (!writerThread_.get()) {
     writerThread_ = threadFactory_.newThread(
         apache::thrift::concurrency::FunctionRunner::create(startWriterThread, this));
     writerThread_->start();
   }
 
-  dequeueBuffer_ = new TFileTransportBuffer(eventBufferSize_);
-  enqueueBuffer_ = new TFileTransportBuffer(eventBufferSize_);
   bufferAndThreadInitialized_ = true;
 
   return true;
 }
 
 void TFileTransport::write(const uint8_t* buf, uint32_t len) {
+  writeEvent(buf, len);
+}
+
+uint64_t TFileTransport::writeEvent(const uint8_t* buf, uint32_t len) {
   if (readOnly_) {
     throw TTransportException("TFileTransport: attempting to write to file opened readonly");
   }
 
-  enqueueEvent(buf, len);
+  return enqueueEvent(buf, len);
 }
 
-template <class _T>
-struct uniqueDeleter
-{
-  void operator()(_T *ptr) const { delete ptr; }
-};
-
-void TFileTransport::enqueueEvent(const uint8_t* buf, uint32_t eventLen) {
+uint64_t TFileTransport::enqueueEvent(const uint8_t* buf, uint32_t eventLen) {
   // can't enqueue more events if file is going to close
   if (closing_) {
-    return;
+    return 0;
   }
 
   // make sure that event size is valid
   if ((maxEventSize_ > 0) && (eventLen > maxEventSize_)) {
     T_ERROR("msg size is greater than max event size: %u > %u\n", eventLen, maxEventSize_);
-    return;
+    return 0;
   }
 
   if (eventLen == 0) {
     T_ERROR("%s", "cannot enqueue an empty event");
-    return;
+    return 0;
   }
 
-  std::unique_ptr<eventInfo, uniqueDeleter<eventInfo> > toEnqueue(new eventInfo());
-  toEnqueue->eventBuff_ = new uint8_t[(sizeof(uint8_t) * eventLen) + 4];
-
-  // first 4 bytes is the event length
-  memcpy(toEnqueue->eventBuff_, (void*)(&eventLen), 4);
-  // actual event contents
-  memcpy(toEnqueue->eventBuff_ + 4, buf, eventLen);
-  toEnqueue->eventSize_ = eventLen + 4;
-
-  // lock mutex
-  Guard g(mutex_);
-
-  // make sure that enqueue buffer is initialized and writer thread is running
+  // make sure that the queue is initialized and writer thread is running
   if (!bufferAndThreadInitialized_) {
-    if (!initBufferAndWriteThread()) {
-      return;
+    Guard g(mutex_);
+    if (!bufferAndThreadInitialized_ && !initBufferAndWriteThread()) {
+      return 0;
     }
   }
 
-  // Can't enqueue while buffer is full
-  while (enqueueBuffer_->isFull()) {
-    notFull_.wait();
+  uint64_t position;
+  while (!queue_->tryEnqueue(buf, eventLen, &position)) {
+    // The queue is full, sleep until the writer thread makes room. The
+    // writer checks producersWaiting_ after releasing slots, the fences
+    // make sure one of us sees the other's update.
+    Guard g(mutex_);
+    producersWaiting_++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (queue_->isFull() && !closing_) {
+      notFull_.waitForever();
+    }
+    producersWaiting_--;
+    if (closing_) {
+      return 0;
+    }
   }
 
-  // We shouldn't be trying to enqueue new data while a forced flush is
-  // requested.  (Otherwise the writer thread might not ever be able to finish
-  // the flush if more data keeps being enqueued.)
-  assert(!forceFlush_);
-
-  // add to the buffer
-  eventInfo* pEvent = toEnqueue.release();
-  if (!enqueueBuffer_->addEvent(pEvent)) {
-    delete pEvent;
-    return;
+  // wake up the writer thread if it is waiting for events
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (writerWaiting_) {
+    Guard g(mutex_);
+    notEmpty_.notify();
   }
 
-  // signal anybody who's waiting for the buffer to be non-empty
-  notEmpty_.notify();
-
-  // this really should be a loop where it makes sure it got flushed
-  // because condition variables can get triggered by the os for no reason
-  // it is probably a non-factor for the time being
+  return position + 1;
 }
 
-bool TFileTransport::swapEventBuffers(const std::chrono::time_point<std::chrono::steady_clock> *deadline) {
-  bool swap;
-  Guard g(mutex_);
-
-  if (!enqueueBuffer_->isEmpty()) {
-    swap = true;
-  } else if (closing_) {
-    // even though there is no data to write,
-    // return immediately if the transport is closing
-    swap = false;
-  } else {
-    if (deadline != nullptr) {
-      // if we were handed a deadline time struct, do a timed wait
-      notEmpty_.waitForTime(*deadline);
-    } else {
-      // just wait until the buffer gets an item
-      notEmpty_.wait();
-    }
-
-    // could be empty if we timed out
-    swap = enqueueBuffer_->isEmpty();
-  }
-
-  if (swap) {
-    TFileTransportBuffer* temp = enqueueBuffer_;
-    enqueueBuffer_ = dequeueBuffer_;
-    dequeueBuffer_ = temp;
+bool TFileTransport::waitForEvents(
+    const std::chrono::time_point<std::chrono::steady_clock>& deadline) {
+  const uint8_t* data;
+  uint32_t size;
+  if (queue_->front(&data, &size)) {
+    return true;
   }
 
-  if (swap) {
-    notFull_.notify();
+  Guard g(mutex_);
+  writerWaiting_ = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  // check again, an event may have been published before we said we wait
+  bool flushDue = flushRequested_ > syncedEvents_ && queue_->getDequeued() >= flushRequested_;
+  if (!queue_->front(&data, &size) && !closing_ && !flushDue) {
+    notEmpty_.waitForTime(deadline);
   }
+  writerWaiting_ = false;
 
-  return swap;
+  return queue_->front(&data, &size);
 }
 
 void TFileTransport::writerThread() {
@@ -320,6 +370,8 @@ void TFileTransport::writerThread() {
       offset_ += readState_.lastDispatchPtr_;
       if (0 == THRIFT_FTRUNCATE(fd_, offset_)) {
         readState_.resetAllValues();
+        initDirectIO();
+        initIndex();
       } else {
         int errno_copy = THRIFT_ERRNO;
         GlobalOutput.perror("TFileTransport: writerThread() truncate ", errno_copy);
@@ -336,6 +388,12 @@ void TFileTransport::writerThread() {
   auto ts_next_flush = getNextFlushTime();
   uint32_t unflushed = 0;
 
+  // events are copied here and written to the file together
+  std::unique_ptr<uint8_t[]> batch(new uint8_t[WRITE_BATCH_SIZE]);
+  uint32_t batchCapacity = WRITE_BATCH_SIZE;
+  // index entries of the events in the batch
+  std::vector<TFileTransportIndex::Entry> indexEntries;
+
   while (1) {
     // this will only be true when the destructor is being invoked
     if (closing_) {
@@ -343,9 +401,13 @@ void TFileTransport::writerThread() {
         return;
       }
 
-      // Try to empty buffers before exit
-      if (enqueueBuffer_->isEmpty() && dequeueBuffer_->isEmpty()) {
-        ::THRIFT_FSYNC(fd_);
+      // Try to empty the queue before exit
+      const uint8_t* data;
+      uint32_t size;
+      if (!queue_->front(&data, &size)) {
+        syncFile();
+        closeDirectIO();
+        closeIndex();
         if (-1 == ::THRIFT_CLOSE(fd_)) {
           int errno_copy = THRIFT_ERRNO;
           GlobalOutput.perror("TFileTransport: writerThread() ::close() ", errno_copy);
@@ -357,129 +419,152 @@ void TFileTransport::writerThread() {
       }
     }
 
-    if (swapEventBuffers(&ts_next_flush)) {
-      eventInfo* outEvent;
-      while (nullptr != (outEvent = dequeueBuffer_->getNext())) {
-        // Remove an event from the buffer and write it out to disk. If there is any IO error, for
-        // instance,
-        // the output file is unmounted or deleted, then this event is dropped. However, the writer
-        // thread
-        // will: (1) sleep for a short while; (2) try to reopen the file; (3) if successful then
-        // start writing
-        // from the end.
-
-        while (hasIOError) {
-          T_ERROR(
-              "TFileTransport: writer thread going to sleep for %u microseconds due to IO errors",
-              writerThreadIOErrorSleepTime_);
-          THRIFT_SLEEP_USEC(writerThreadIOErrorSleepTime_);
-          if (closing_) {
-            return;
-          }
-          if (!fd_) {
-            ::THRIFT_CLOSE(fd_);
-            fd_ = 0;
-          }
-          try {
-            openLogFile();
-            seekToEnd();
-            unflushed = 0;
-            hasIOError = false;
-            T_LOG_OPER(
-                "TFileTransport: log file %s reopened by writer thread during error recovery",
-                filename_.c_str());
-          } catch (...) {
-            T_ERROR("TFileTransport: unable to reopen log file %s during error recovery",
-                    filename_.c_str());
-          }
+    if (waitForEvents(ts_next_flush)) {
+      // If there is any IO error, for instance, the output file is unmounted
+      // or deleted, then the events are dropped. However, the writer thread
+      // will: (1) sleep for a short while; (2) try to reopen the file; (3) if
+      // successful then start writing from the end.
+      while (hasIOError) {
+        T_ERROR(
+            "TFileTransport: writer thread going to sleep for %u microseconds due to IO errors",
+            writerThreadIOErrorSleepTime_);
+        THRIFT_SLEEP_USEC(writerThreadIOErrorSleepTime_);
+        if (closing_) {
+          return;
+        }
+        if (!fd_) {
+          ::THRIFT_CLOSE(fd_);
+          fd_ = 0;
+        }
+        closeDirectIO();
+        try {
+          openLogFile();
+          seekToEnd();
+          initDirectIO();
+          initIndex();
+          unflushed = 0;
+          hasIOError = false;
+          T_LOG_OPER(
+              "TFileTransport: log file %s reopened by writer thread during error recovery",
+              filename_.c_str());
+        } catch (...) {
+          T_ERROR("TFileTransport: unable to reopen log file %s during error recovery",
+                  filename_.c_str());
+        }
+      }
+
+      // Copy the queued events into the batch, releasing each slot right
+      // away so producers can reuse it.
+      uint32_t batchSize = 0;
+      const uint8_t* event;
+      uint32_t eventSize;
+      while (batchSize < WRITE_BATCH_SIZE && queue_->front(&event, &eventSize)) {
+        // the producer of an empty slot failed to allocate room for its event
+        if (eventSize == 0) {
+          queue_->pop();
+          continue;
         }
 
         // sanity check on event
-        if ((maxEventSize_ > 0) && (outEvent->eventSize_ > maxEventSize_)) {
-          T_ERROR("msg size is greater than max event size: %u > %u\n",
-                  outEvent->eventSize_,
-                  maxEventSize_);
+        if ((maxEventSize_ > 0) && (eventSize > maxEventSize_)) {
+          T_ERROR("msg size is greater than max event size: %u > %u\n", eventSize, maxEventSize_);
+          queue_->pop();
           continue;
         }
 
         // If chunking is required, then make sure that msg does not cross chunk boundary
-        if ((outEvent->eventSize_ > 0) && (chunkSize_ != 0)) {
+        uint32_t padding = 0;
+        if ((eventSize > 0) && (chunkSize_ != 0)) {
           // event size must be less than chunk size
-          if (outEvent->eventSize_ > chunkSize_) {
+          if (eventSize > chunkSize_) {
             T_ERROR("TFileTransport: event size(%u) > chunk size(%u): skipping event",
-                    outEvent->eventSize_,
+                    eventSize,
                     chunkSize_);
+            queue_->pop();
             continue;
           }
 
-          int64_t chunk1 = offset_ / chunkSize_;
-          int64_t chunk2 = (offset_ + outEvent->eventSize_ - 1) / chunkSize_;
+          off_t position = offset_ + batchSize;
+          int64_t chunk1 = position / chunkSize_;
+          int64_t chunk2 = (position + eventSize - 1) / chunkSize_;
 
           // if adding this event will cross a chunk boundary, pad the chunk with zeros
           if (chunk1 != chunk2) {
-            // refetch the offset to keep in sync
-            offset_ = THRIFT_LSEEK(fd_, 0, SEEK_CUR);
-            auto padding = (int32_t)((offset_ / chunkSize_ + 1) * chunkSize_ - offset_);
-
-            auto* zeros = new uint8_t[padding];
-            memset(zeros, '\0', padding);
-            std::unique_ptr<uint8_t[]> array(zeros);
-            if (-1 == ::THRIFT_WRITE(fd_, zeros, padding)) {
-              int errno_copy = THRIFT_ERRNO;
-              GlobalOutput.perror("TFileTransport: writerThread() error while padding zeros ",
-                                  errno_copy);
-              hasIOError = true;
-              continue;
+            padding = (uint32_t)((position / chunkSize_ + 1) * chunkSize_ - position);
+          }
+        }
+
+        if (batchSize + padding + eventSize > batchCapacity) {
+          // only a single large event gets here, grow the batch
+          batchCapacity = batchSize + padding + eventSize;
+          std::unique_ptr<uint8_t[]> grown(new uint8_t[batchCapacity]);
+          memcpy(grown.get(), batch.get(), batchSize);
+          batch.swap(grown);
+        }
+        if (indexFd_ > 0) {
+          if (numEvents_ % indexInterval_ == 0) {
+            TFileTransportIndex::Entry entry;
+            entry.event = numEvents_;
+            entry.offset = static_cast<uint64_t>(offset_ + batchSize + padding);
+            if (indexEntries.empty()) {
+              // entries added by a rebuild may be ahead of the clock
+              indexTime_ = (std::max)(indexTime_, currentTimeUs());
             }
-            unflushed += padding;
-            offset_ += padding;
+            entry.timestamp = indexTime_;
+            indexEntries.push_back(entry);
           }
+          ++numEvents_;
         }
 
-        // write the dequeued event to the file
-        if (outEvent->eventSize_ > 0) {
-          if (-1 == ::THRIFT_WRITE(fd_, outEvent->eventBuff_, outEvent->eventSize_)) {
-            int errno_copy = THRIFT_ERRNO;
-            GlobalOutput.perror("TFileTransport: error while writing event ", errno_copy);
-            hasIOError = true;
-            continue;
+        memset(batch.get() + batchSize, '\0', padding);
+        memcpy(batch.get() + batchSize + padding, event, eventSize);
+        batchSize += padding + eventSize;
+        queue_->pop();
+      }
+
+      // wake up producers waiting for room
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (producersWaiting_ > 0) {
+        Guard g(mutex_);
+        notFull_.notifyAll();
+      }
+
+      // write the batch to the file
+      if (batchSize > 0) {
+        if (!writeToFile(batch.get(), batchSize)) {
+          int errno_copy = THRIFT_ERRNO;
+          GlobalOutput.perror("TFileTransport: error while writing events ", errno_copy);
+          hasIOError = true;
+        } else {
+          unflushed += batchSize;
+          // the index only points at events that are in the log
+          if (!indexEntries.empty()) {
+            auto len = static_cast<uint32_t>(indexEntries.size() * sizeof(TFileTransportIndex::Entry));
+            if (-1 == ::THRIFT_WRITE(indexFd_, indexEntries.data(), len)) {
+              int errno_copy = THRIFT_ERRNO;
+              GlobalOutput.perror("TFileTransport: error while writing index, disabling it ",
+                                  errno_copy);
+              closeIndex();
+            }
           }
-          unflushed += outEvent->eventSize_;
-          offset_ += outEvent->eventSize_;
         }
+        indexEntries.clear();
+      }
+      if (batchCapacity > WRITE_BATCH_SIZE) {
+        batch.reset(new uint8_t[WRITE_BATCH_SIZE]);
+        batchCapacity = WRITE_BATCH_SIZE;
       }
-      dequeueBuffer_->reset();
     }
 
     if (hasIOError) {
       continue;
     }
 
-    // Local variable to cache the state of forceFlush_.
-    //
-    // We only want to check the value of forceFlush_ once each time around the
-    // loop.  If we check it more than once without holding the lock the entire
-    // time, it could have changed state in between.  This will result in us
-    // making inconsistent decisions.
-    bool forced_flush = false;
-    {
-      Guard g(mutex_);
-      if (forceFlush_) {
-        if (!enqueueBuffer_->isEmpty()) {
-          // If forceFlush_ is true, we need to flush all available data.
-          // If enqueueBuffer_ is not empty, go back to the start of the loop to
-          // write it out.
-          //
-          // We know the main thread is waiting on forceFlush_ to be cleared,
-          // so no new events will be added to enqueueBuffer_ until we clear
-          // forceFlush_.  Therefore the next time around the loop enqueueBuffer_
-          // is guaranteed to be empty.  (I.e., we're guaranteed to make progress
-          // and clear forceFlush_ the next time around the loop.)
-          continue;
-        }
-        forced_flush = true;
-      }
-    }
+    // Flushes wait for the events enqueued before them. Events that are
+    // claimed but not yet published are picked up the next time around.
+    uint64_t written = queue_->getDequeued();
+    uint64_t requested = flushRequested_;
+    bool forced_flush = requested > syncedEvents_ && written >= requested;
 
     // determine if we need to perform an fsync
     bool flush = false;
@@ -499,16 +584,14 @@ void TFileTransport::writerThread() {
 
     if (flush) {
       // sync (force flush) file to disk
-      THRIFT_FSYNC(fd_);
+      syncFile();
       unflushed = 0;
       ts_next_flush = getNextFlushTime();
 
       // notify anybody waiting for flush completion
-      if (forced_flush) {
-        Guard g(mutex_);
-        forceFlush_ = false;
-        assert(enqueueBuffer_->isEmpty());
-        assert(dequeueBuffer_->isEmpty());
+      Guard g(mutex_);
+      syncedEvents_ = written;
+      if (requested > 0) {
         flushed_.notifyAll();
       }
     }
@@ -521,17 +604,188 @@ void TFileTransport::flush() {
   if (!writerThread_.get()) {
     return;
   }
+  // everything enqueued so far has to be written and synced
+  waitForSync(queue_->getEnqueued());
+}
+
+void TFileTransport::waitForSync(uint64_t ticket) {
+  if (!bufferAndThreadInitialized_) {
+    return;
+  }
+
   // wait for flush to take place
   Guard g(mutex_);
+  if (syncedEvents_ >= ticket) {
+    return;
+  }
 
-  // Indicate that we are requesting a flush
-  forceFlush_ = true;
+  // Indicate that we are requesting a flush. Requests arriving while the
+  // writer thread syncs are served together by its next sync.
+  if (flushRequested_ < ticket) {
+    flushRequested_ = ticket;
+  }
   // Wake up the writer thread so it will perform the flush immediately
   notEmpty_.notify();
 
-  while (forceFlush_) {
-    flushed_.wait();
+  while (syncedEvents_ < ticket) {
+    flushed_.waitForever();
+  }
+}
+
+bool TFileTransport::writeToFile(const uint8_t* buf, uint32_t len) {
+  preallocate(offset_ + len);
+
+#ifdef O_DIRECT
+  if (directFd_ > 0) {
+    // Stage the data behind the partial block from the last write and
+    // write every block that is complete.
+    const uint8_t* end = buf + len;
+    while (buf < end) {
+      auto n = static_cast<uint32_t>((std::min)(static_cast<size_t>(end - buf),
+                                                 static_cast<size_t>(WRITE_BATCH_SIZE - directSize_)));
+      memcpy(directBuf_ + directSize_, buf, n);
+      directSize_ += n;
+      buf += n;
+
+      uint32_t whole = directSize_ / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+      if (whole > 0 && (directSize_ == WRITE_BATCH_SIZE || buf == end)) {
+        if (::pwrite(directFd_, directBuf_, whole, directOffset_) != static_cast<ssize_t>(whole)) {
+          return false;
+        }
+        directOffset_ += whole;
+        directSize_ -= whole;
+        memmove(directBuf_, directBuf_ + whole, directSize_);
+      }
+    }
+
+    // The partial block at the end goes through the page cache, so readers
+    // and fdatasync see it. Only the part not yet in the file is appended.
+    off_t fileEnd = (std::max)(offset_, directOffset_);
+    off_t newEnd = directOffset_ + directSize_;
+    if (newEnd > fileEnd) {
+      auto tail = static_cast<uint32_t>(newEnd - fileEnd);
+      if (-1 == ::THRIFT_WRITE(fd_, directBuf_ + (directSize_ - tail), tail)) {
+        return false;
+      }
+    }
+    offset_ = newEnd;
+    return true;
+  }
+#endif
+
+  if (-1 == ::THRIFT_WRITE(fd_, buf, len)) {
+    return false;
+  }
+  offset_ += len;
+  return true;
+}
+
+void TFileTransport::syncFile() {
+#ifdef HAVE_FDATASYNC
+  // the size is the only metadata needed to read the log back
+  ::fdatasync(fd_);
+#else
+  ::THRIFT_FSYNC(fd_);
+#endif
+}
+
+void TFileTransport::preallocate(off_t end) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  if (!preallocate_ || end <= preallocatedEnd_) {
+    return;
+  }
+  // reserve up to the end of the chunk the write ends in
+  off_t start = (std::max)(preallocatedEnd_, offset_);
+  off_t chunkEnd = ((end - 1) / chunkSize_ + 1) * chunkSize_;
+  if (-1 == ::fallocate(fd_, FALLOC_FL_KEEP_SIZE, start, chunkEnd - start)) {
+    int errno_copy = THRIFT_ERRNO;
+    GlobalOutput.perror("TFileTransport: fallocate() failed, disabling preallocation ", errno_copy);
+    preallocate_ = false;
+    return;
+  }
+  preallocatedEnd_ = chunkEnd;
+#else
+  (void)end;
+#endif
+}
+
+void TFileTransport::initDirectIO() {
+#ifdef O_DIRECT
+  if (!directIO_) {
+    return;
+  }
+  directFd_ = ::open(filename_.c_str(), O_WRONLY | O_DIRECT);
+  if (directFd_ == -1) {
+    int errno_copy = THRIFT_ERRNO;
+    GlobalOutput.perror("TFileTransport: O_DIRECT not available, using normal writes ", errno_copy);
+    directFd_ = 0;
+    return;
+  }
+  if (!directBuf_) {
+    void* buf;
+    if (posix_memalign(&buf, DIRECT_IO_ALIGNMENT, WRITE_BATCH_SIZE) != 0) {
+      closeDirectIO();
+      return;
+    }
+    directBuf_ = static_cast<uint8_t*>(buf);
+  }
+
+  // stage the partial block at the end of the log
+  directOffset_ = offset_ / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+  directSize_ = static_cast<uint32_t>(offset_ - directOffset_);
+  if (directSize_ > 0
+      && ::pread(fd_, directBuf_, directSize_, directOffset_)
+             != static_cast<ssize_t>(directSize_)) {
+    int errno_copy = THRIFT_ERRNO;
+    GlobalOutput.perror("TFileTransport: initDirectIO() pread ", errno_copy);
+    closeDirectIO();
+  }
+#endif
+}
+
+void TFileTransport::initIndex() {
+  closeIndex();
+  if (indexInterval_ == 0) {
+    return;
+  }
+  try {
+    numEvents_ = TFileTransportIndex::rebuild(filename_, chunkSize_, indexInterval_);
+  } catch (TException& te) {
+    GlobalOutput.printf("TFileTransport: not indexing %s: %s", filename_.c_str(), te.what());
+    return;
+  }
+  TFileTransportIndex::Entry last;
+  indexTime_ = TFileTransportIndex::find(filename_,
+                                         [](const TFileTransportIndex::Entry&) { return true; },
+                                         &last)
+                   ? last.timestamp
+                   : 0;
+
+  indexFd_ = openFile(TFileTransportIndex::getPath(filename_), true);
+  if (indexFd_ == -1 || ::THRIFT_LSEEK(indexFd_, 0, SEEK_END) == -1) {
+    int errno_copy = THRIFT_ERRNO;
+    GlobalOutput.perror("TFileTransport: initIndex() ", errno_copy);
+    closeIndex();
+  }
+}
+
+void TFileTransport::closeIndex() {
+  if (indexFd_ > 0) {
+    ::THRIFT_CLOSE(indexFd_);
   }
+  indexFd_ = 0;
+}
+
+void TFileTransport::closeDirectIO() {
+#ifdef O_DIRECT
+  if (directFd_ > 0) {
+    ::close(directFd_);
+  }
+  directFd_ = 0;
+  free(directBuf_);
+  directBuf_ = nullptr;
+  directSize_ = 0;
+#endif
 }
 
 uint32_t TFileTransport::readAll(uint8_t* buf, uint32_t len) {
@@ -853,6 +1107,57 @@ void TFileTransport::seekToEnd() {
   seekToChunk(getNumChunks());
 }
 
+void TFileTransport::seekToOffset(off_t offset) {
+  if (fd_ <= 0) {
+    throw TTransportException("File not open");
+  }
+
+  offset_ = ::THRIFT_LSEEK(fd_, offset, SEEK_SET);
+  readState_.resetAllValues();
+  delete currentEvent_;
+  currentEvent_ = nullptr;
+  if (offset_ == -1) {
+    GlobalOutput("TFileTransport: lseek error in seekToOffset");
+    throw TTransportException("TFileTransport: lseek error in seekToOffset");
+  }
+}
+
+void TFileTransport::seekToEvent(uint64_t event) {
+  TFileTransportIndex::Entry entry;
+  if (!TFileTransportIndex::find(filename_,
+                                 [event](const TFileTransportIndex::Entry& e) {
+                                   return e.event <= event;
+                                 },
+                                 &entry)) {
+    entry.event = 0;
+    entry.offset = 0;
+  }
+  seekToOffset(static_cast<off_t>(entry.offset));
+
+  // read up to the event, without waiting for more data
+  int32_t oldReadTimeout = getReadTimeout();
+  setReadTimeout(NO_TAIL_READ_TIMEOUT);
+  for (uint64_t n = entry.event; n < event; ++n) {
+    std::unique_ptr<eventInfo> skipped(readEvent());
+    if (!skipped) {
+      break;
+    }
+  }
+  setReadTimeout(oldReadTimeout);
+}
+
+void TFileTransport::seekToTime(int64_t timestamp) {
+  TFileTransportIndex::Entry entry;
+  if (!TFileTransportIndex::find(filename_,
+                                 [timestamp](const TFileTransportIndex::Entry& e) {
+                                   return e.timestamp <= timestamp;
+                                 },
+                                 &entry)) {
+    entry.offset = 0;
+  }
+  seekToOffset(static_cast<off_t>(entry.offset));
+}
+
 uint32_t TFileTransport::getNumChunks() {
   if (fd_ <= 0) {
     return 0;
@@ -894,6 +1199,7 @@ void TFileTransport::openLogFile() {
 #endif
   fd_ = ::THRIFT_OPEN(filename_.c_str(), flags, mode);
   offset_ = 0;
+  preallocatedEnd_ = 0;
 
   // make sure open call was successful
   if (fd_ == -1) {
@@ -907,65 +1213,307 @@ std::chrono::time_point<std::chrono::steady_clock> TFileTransport::getNextFlushT
   return std::chrono::steady_clock::now() + std::chrono::microseconds(flushMaxUs_);
 }
 
-TFileTransportBuffer::TFileTransportBuffer(uint32_t size)
-  : bufferMode_(WRITE), writePoint_(0), readPoint_(0), size_(size) {
-  buffer_ = new eventInfo* [size];
+TFileTransportQueue::TFileTransportQueue(uint32_t size)
+  : slots_(nullptr), enqueuePos_(0), dequeuePos_(0) {
+  uint64_t capacity = 2;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+  mask_ = capacity - 1;
+  slots_ = new Slot[capacity];
+  for (uint64_t i = 0; i < capacity; i++) {
+    slots_[i].sequence_.store(i, std::memory_order_relaxed);
+    slots_[i].data_ = nullptr;
+    slots_[i].size_ = 0;
+    slots_[i].capacity_ = 0;
+  }
 }
 
-TFileTransportBuffer::~TFileTransportBuffer() {
-  if (buffer_) {
-    for (uint32_t i = 0; i < writePoint_; i++) {
-      delete buffer_[i];
-    }
-    delete[] buffer_;
-    buffer_ = nullptr;
+TFileTransportQueue::~TFileTransportQueue() {
+  for (uint64_t i = 0; i <= mask_; i++) {
+    delete[] slots_[i].data_;
   }
+  delete[] slots_;
 }
 
-bool TFileTransportBuffer::addEvent(eventInfo* event) {
-  if (bufferMode_ == READ) {
-    GlobalOutput("Trying to write to a buffer in read mode");
+bool TFileTransportQueue::tryEnqueue(const uint8_t* buf, uint32_t len, uint64_t* position) {
+  // claim the slot at the enqueue position
+  uint64_t pos = enqueuePos_.load(std::memory_order_relaxed);
+  Slot* slot;
+  while (true) {
+    slot = &slots_[pos & mask_];
+    uint64_t sequence = slot->sequence_.load(std::memory_order_acquire);
+    auto diff = static_cast<int64_t>(sequence - pos);
+    if (diff == 0) {
+      if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // the consumer has not released this slot yet
+      return false;
+    } else {
+      pos = enqueuePos_.load(std::memory_order_relaxed);
+    }
   }
-  if (writePoint_ < size_) {
-    buffer_[writePoint_++] = event;
-    return true;
-  } else {
-    // buffer is full
-    return false;
+
+  // the event is stored as it goes to disk, the length first
+  uint32_t size = len + 4;
+  if (slot->capacity_ < size) {
+    delete[] slot->data_;
+    slot->data_ = nullptr;
+    slot->capacity_ = 0;
+    try {
+      slot->data_ = new uint8_t[size];
+    } catch (...) {
+      // publish the slot empty, the consumer would wait for it forever and
+      // skips it instead
+      slot->size_ = 0;
+      slot->sequence_.store(pos + 1, std::memory_order_release);
+      throw;
+    }
+    slot->capacity_ = size;
   }
+  memcpy(slot->data_, &len, 4);
+  memcpy(slot->data_ + 4, buf, len);
+  slot->size_ = size;
+
+  slot->sequence_.store(pos + 1, std::memory_order_release);
+  *position = pos;
+  return true;
 }
 
-eventInfo* TFileTransportBuffer::getNext() {
-  if (bufferMode_ == WRITE) {
-    bufferMode_ = READ;
+bool TFileTransportQueue::front(const uint8_t** data, uint32_t* size) const {
+  uint64_t pos = dequeuePos_.load(std::memory_order_relaxed);
+  const Slot* slot = &slots_[pos & mask_];
+  if (slot->sequence_.load(std::memory_order_acquire) != pos + 1) {
+    return false;
   }
-  if (readPoint_ < writePoint_) {
-    return buffer_[readPoint_++];
-  } else {
-    // no more entries
-    return nullptr;
+  *data = slot->data_;
+  *size = slot->size_;
+  return true;
+}
+
+void TFileTransportQueue::pop() {
+  uint64_t pos = dequeuePos_.load(std::memory_order_relaxed);
+  Slot* slot = &slots_[pos & mask_];
+  if (slot->capacity_ > MAX_RETAINED_SLOT_SIZE) {
+    delete[] slot->data_;
+    slot->data_ = nullptr;
+    slot->capacity_ = 0;
   }
+  dequeuePos_.store(pos + 1, std::memory_order_relaxed);
+  // hand the slot to the producer one lap ahead
+  slot->sequence_.store(pos + mask_ + 1, std::memory_order_release);
+}
+
+bool TFileTransportQueue::isFull() const {
+  uint64_t pos = enqueuePos_.load(std::memory_order_relaxed);
+  uint64_t sequence = slots_[pos & mask_].sequence_.load(std::memory_order_acquire);
+  return static_cast<int64_t>(sequence - pos) < 0;
 }
 
-void TFileTransportBuffer::reset() {
-  if (bufferMode_ == WRITE || writePoint_ > readPoint_) {
-    T_DEBUG("%s", "Resetting a buffer with unread entries");
+bool TFileTransportIndex::find(const std::string& logPath,
+                               const std::function<bool(const Entry&)>& before,
+                               Entry* entry) {
+  int fd = openFile(getPath(logPath), false);
+  if (fd == -1) {
+    return false;
   }
-  // Clean up the old entries
-  for (uint32_t i = 0; i < writePoint_; i++) {
-    delete buffer_[i];
+
+  struct THRIFT_STAT st;
+  bool found = false;
+  if (0 == ::THRIFT_FSTAT(fd, &st)) {
+    // binary search for the first entry that is not before
+    uint64_t low = 0;
+    uint64_t high = static_cast<uint64_t>(st.st_size) / sizeof(Entry);
+    while (low < high) {
+      uint64_t middle = low + (high - low) / 2;
+      Entry candidate;
+      if (!readFully(fd, static_cast<off_t>(middle * sizeof(Entry)), &candidate, sizeof(Entry))) {
+        found = false;
+        break;
+      }
+      if (before(candidate)) {
+        *entry = candidate;
+        found = true;
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
   }
-  bufferMode_ = WRITE;
-  writePoint_ = 0;
-  readPoint_ = 0;
+  ::THRIFT_CLOSE(fd);
+  return found;
 }
 
-bool TFileTransportBuffer::isFull() {
-  return writePoint_ == size_;
+std::vector<TFileTransportIndex::Entry> TFileTransportIndex::load(const std::string& logPath) {
+  std::vector<Entry> entries;
+  int fd = openFile(getPath(logPath), false);
+  if (fd == -1) {
+    return entries;
+  }
+  struct THRIFT_STAT st;
+  if (0 == ::THRIFT_FSTAT(fd, &st)) {
+    entries.resize(static_cast<size_t>(st.st_size) / sizeof(Entry));
+    if (!readFully(fd, 0, entries.data(), entries.size() * sizeof(Entry))) {
+      entries.clear();
+    }
+  }
+  ::THRIFT_CLOSE(fd);
+  return entries;
 }
 
-bool TFileTransportBuffer::isEmpty() {
-  return writePoint_ == 0;
+uint64_t TFileTransportIndex::rebuild(const std::string& logPath,
+                                      uint32_t chunkSize,
+                                      uint32_t interval,
+                                      uint32_t numThreads) {
+  static_assert(sizeof(Entry) == 24, "index entries are written as they are");
+  if (chunkSize == 0 || interval == 0) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "TFileTransportIndex: chunk size and interval must not be 0");
+  }
+
+  int logFd = openFile(logPath, false);
+  if (logFd == -1) {
+    int errno_copy = THRIFT_ERRNO;
+    throw TTransportException(TTransportException::NOT_OPEN, logPath, errno_copy);
+  }
+  int indexFd = openFile(getPath(logPath), true);
+  if (indexFd == -1) {
+    int errno_copy = THRIFT_ERRNO;
+    ::THRIFT_CLOSE(logFd);
+    throw TTransportException(TTransportException::NOT_OPEN, getPath(logPath), errno_copy);
+  }
+
+  struct THRIFT_STAT logStat;
+  struct THRIFT_STAT indexStat;
+  if (0 != ::THRIFT_FSTAT(logFd, &logStat) || 0 != ::THRIFT_FSTAT(indexFd, &indexStat)) {
+    int errno_copy = THRIFT_ERRNO;
+    ::THRIFT_CLOSE(logFd);
+    ::THRIFT_CLOSE(indexFd);
+    throw TTransportException(TTransportException::UNKNOWN,
+                              "TFileTransportIndex::rebuild() (fstat)",
+                              errno_copy);
+  }
+  auto logSize = static_cast<uint64_t>(logStat.st_size);
+  // an upper bound of the write times of every event in the log
+  int64_t timestamp = (static_cast<int64_t>(logStat.st_mtime) + 1) * 1000 * 1000;
+
+  // drop entries that do not point at a complete event, they were written
+  // before the log lost its end or got truncated
+  uint64_t numEntries = static_cast<uint64_t>(indexStat.st_size) / sizeof(Entry);
+  Entry last;
+  bool haveLast = false;
+  while (numEntries > 0 && !haveLast) {
+    uint32_t eventSize = 0;
+    haveLast = readFully(indexFd, static_cast<off_t>((numEntries - 1) * sizeof(Entry)), &last,
+                         sizeof(Entry))
+               && last.offset + 4 <= logSize
+               && readFully(logFd, static_cast<off_t>(last.offset), &eventSize, 4)
+               && eventSize > 0 && last.offset + 4 + eventSize <= logSize;
+    if (!haveLast) {
+      --numEntries;
+    }
+  }
+  ::THRIFT_CLOSE(logFd);
+
+  // scan the log from the last entry on, in two passes over the chunks:
+  // count the events of every chunk, then add the entries
+  uint64_t begin = haveLast ? last.offset : 0;
+  uint64_t firstEvent = haveLast ? last.event : 0;
+  uint64_t firstChunk = begin / chunkSize;
+  uint64_t numChunks = logSize > begin ? (logSize - 1) / chunkSize + 1 - firstChunk : 0;
+  std::vector<uint64_t> counts(numChunks, 0);
+  std::vector<std::vector<Entry> > added(numChunks);
+
+  if (numThreads == 0) {
+    numThreads = (std::max)(std::thread::hardware_concurrency(), 1u);
+  }
+  numThreads = static_cast<uint32_t>((std::min)(static_cast<uint64_t>(numThreads), numChunks));
+
+  auto forEachChunk = [&](const std::function<void(uint64_t, const uint8_t*, uint64_t, uint64_t)>& f) {
+    std::atomic<uint64_t> next(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+      int fd = openFile(logPath, false);
+      std::vector<uint8_t> buf;
+      for (uint64_t i = next++; fd != -1 && i < numChunks && !failed; i = next++) {
+        uint64_t chunkBegin = (std::max)((firstChunk + i) * chunkSize, begin);
+        uint64_t chunkEnd = (std::min)((firstChunk + i + 1) * chunkSize, logSize);
+        buf.resize(static_cast<size_t>(chunkEnd - chunkBegin));
+        if (!readFully(fd, static_cast<off_t>(chunkBegin), buf.data(), buf.size())) {
+          failed = true;
+        } else {
+          f(i, buf.data(), chunkBegin, chunkEnd);
+        }
+      }
+      failed = failed || fd == -1;
+      if (fd != -1) {
+        ::THRIFT_CLOSE(fd);
+      }
+    };
+
+    if (numThreads <= 1) {
+      worker();
+    } else {
+      ThreadFactory factory(false);
+      std::vector<shared_ptr<Thread> > threads;
+      for (uint32_t t = 0; t < numThreads; ++t) {
+        threads.push_back(factory.newThread(FunctionRunner::create(worker)));
+        threads.back()->start();
+      }
+      for (auto& thread : threads) {
+        thread->join();
+      }
+    }
+    if (failed) {
+      ::THRIFT_CLOSE(indexFd);
+      throw TTransportException(TTransportException::UNKNOWN,
+                                "TFileTransportIndex::rebuild() failed to read " + logPath);
+    }
+  };
+
+  forEachChunk([&](uint64_t i, const uint8_t* buf, uint64_t chunkBegin, uint64_t chunkEnd) {
+    scanEvents(buf, chunkBegin, chunkEnd, chunkSize, [&](uint64_t) { ++counts[i]; });
+  });
+
+  std::vector<uint64_t> firstEvents(numChunks);
+  uint64_t numEvents = firstEvent;
+  for (uint64_t i = 0; i < numChunks; ++i) {
+    firstEvents[i] = numEvents;
+    numEvents += counts[i];
+  }
+
+  forEachChunk([&](uint64_t i, const uint8_t* buf, uint64_t chunkBegin, uint64_t chunkEnd) {
+    uint64_t event = firstEvents[i];
+    scanEvents(buf, chunkBegin, chunkEnd, chunkSize, [&](uint64_t offset) {
+      // the event of the last entry is indexed already
+      if (event % interval == 0 && !(haveLast && offset == last.offset)) {
+        Entry entry;
+        entry.event = event;
+        entry.offset = offset;
+        entry.timestamp = timestamp;
+        added[i].push_back(entry);
+      }
+      ++event;
+    });
+  });
+
+  // replace the entries after the last valid one
+  bool ok = 0 == ::THRIFT_FTRUNCATE(indexFd, static_cast<off_t>(numEntries * sizeof(Entry)))
+            && ::THRIFT_LSEEK(indexFd, 0, SEEK_END) != -1;
+  for (uint64_t i = 0; ok && i < numChunks; ++i) {
+    auto len = static_cast<uint32_t>(added[i].size() * sizeof(Entry));
+    ok = len == 0 || ::THRIFT_WRITE(indexFd, added[i].data(), len) == static_cast<ssize_t>(len);
+  }
+  int errno_copy = THRIFT_ERRNO;
+  ::THRIFT_CLOSE(indexFd);
+  if (!ok) {
+    throw TTransportException(TTransportException::UNKNOWN,
+                              "TFileTransportIndex::rebuild() failed to write the index",
+                              errno_copy);
+  }
+  return numEvents;
 }
 
 TFileProcessor::TFileProcessor(shared_ptr<TProcessor> processor,
@@ -1063,6 +1611,293 @@ void TFileProcessor::processChunk() {
     }
   }
 }
+
+/**
+ * Shared state of processParallel(). Runs events on the thread manager,
+ * keeps each lane serial and bounds the number of batches in flight.
+ */
+class TFileProcessor::Replay {
+public:
+  typedef std::vector<std::pair<const uint8_t*, uint32_t> > Batch;
+
+  Replay(TFileProcessor& owner,
+         shared_ptr<ThreadManager> threadManager,
+         size_t numLanes,
+         size_t maxInFlight)
+    : owner_(owner),
+      threadManager_(threadManager),
+      lanes_(numLanes),
+      inFlight_(0),
+      maxInFlight_(maxInFlight),
+      failed_(false),
+      discardOutput_(std::dynamic_pointer_cast<TNullTransport>(owner.outputTransport_) != nullptr),
+      monitor_(&mutex_) {}
+
+  /**
+   * Blocks while too many batches are in flight, returns false once an
+   * event failed.
+   */
+  bool waitForRoom() {
+    Guard g(mutex_);
+    while (inFlight_ >= maxInFlight_ && !failed_) {
+      monitor_.waitForever();
+    }
+    return !failed_;
+  }
+
+  void waitForAll() {
+    Guard g(mutex_);
+    while (inFlight_ > 0) {
+      monitor_.waitForever();
+    }
+  }
+
+#ifndef _WIN32
+  void addChunk(const TMappedFileTransport& transport, uint32_t chunk) {
+    begin();
+    add([this, &transport, chunk]() {
+      ScopeExit exit([this] { done(); });
+      try {
+        Context context(*this);
+        transport.forEachEvent(chunk, [&context](const uint8_t* event, uint32_t size) {
+          context.process(event, size);
+        });
+      } catch (...) {
+        fail();
+      }
+    });
+  }
+#endif
+
+  void addBatch(size_t lane, Batch&& batch) {
+    bool schedule;
+    {
+      Guard g(mutex_);
+      ++inFlight_;
+      lanes_[lane].pending.push_back(std::move(batch));
+      schedule = !lanes_[lane].running;
+      lanes_[lane].running = true;
+    }
+    // a running lane picks the batch up itself
+    if (schedule) {
+      add([this, lane]() { drainLane(lane); });
+    }
+  }
+
+private:
+  struct Lane {
+    Lane() : running(false) {}
+    std::deque<Batch> pending;
+    bool running;
+  };
+
+  /**
+   * Calls a function when it goes out of scope, whichever way it leaves.
+   */
+  class ScopeExit {
+  public:
+    explicit ScopeExit(std::function<void()> f) : f_(std::move(f)) {}
+    ~ScopeExit() { f_(); }
+
+  private:
+    std::function<void()> f_;
+  };
+
+  /**
+   * Transports and protocols of one task, events are processed straight
+   * from the log.
+   */
+  class Context {
+  public:
+    Context(Replay& replay)
+      : replay_(replay),
+        input_(std::make_shared<TMemoryBuffer>()),
+        output_(std::make_shared<TMemoryBuffer>()),
+        inputProtocol_(replay.owner_.inputProtocolFactory_->getProtocol(input_)),
+        outputProtocol_(replay.owner_.outputProtocolFactory_->getProtocol(output_)) {}
+
+    void process(const uint8_t* event, uint32_t size) {
+      if (replay_.failed_) {
+        return;
+      }
+      input_->resetBuffer(const_cast<uint8_t*>(event), size);
+      try {
+        while (input_->available_read() > 0) {
+          replay_.owner_.processor_->process(inputProtocol_, outputProtocol_, nullptr);
+        }
+
+        if (output_->available_read() > 0) {
+          if (!replay_.discardOutput_) {
+            uint8_t* buf;
+            uint32_t len;
+            output_->getBuffer(&buf, &len);
+            Guard g(replay_.outputMutex_);
+            replay_.owner_.outputTransport_->write(buf, len);
+          }
+          output_->resetBuffer();
+        }
+      } catch (...) {
+        // handlers may throw anything, none of it may leave the task
+        output_->resetBuffer();
+        replay_.fail();
+      }
+    }
+
+  private:
+    Replay& replay_;
+    shared_ptr<TMemoryBuffer> input_;
+    shared_ptr<TMemoryBuffer> output_;
+    shared_ptr<TProtocol> inputProtocol_;
+    shared_ptr<TProtocol> outputProtocol_;
+  };
+
+  void add(std::function<void()> task) {
+    try {
+      threadManager_->add(std::make_shared<FunctionRunner>(task));
+    } catch (...) {
+      done();
+      throw;
+    }
+  }
+
+  void begin() {
+    Guard g(mutex_);
+    ++inFlight_;
+  }
+
+  void done() {
+    Guard g(mutex_);
+    --inFlight_;
+    monitor_.notifyAll();
+  }
+
+  /**
+   * Stops the replay because of the exception being handled.
+   */
+  void fail() {
+    try {
+      throw;
+    } catch (std::exception& e) {
+      fail(e.what());
+    } catch (...) {
+      fail("TFileProcessor: unknown exception while replaying an event");
+    }
+  }
+
+  void fail(const char* what) {
+    Guard g(mutex_);
+    if (!failed_) {
+      cerr << what << '\n';
+      failed_ = true;
+    }
+    monitor_.notifyAll();
+  }
+
+  void drainLane(size_t lane) {
+    // processParallel() may return as soon as the last batch is done, so
+    // the lane must not touch the replay after that. Should the lane stop
+    // early, the batches it holds count as done.
+    bool inBatch = false;
+    bool released = false;
+    ScopeExit exit([&] {
+      if (!released) {
+        Guard g(mutex_);
+        inFlight_ -= lanes_[lane].pending.size() + (inBatch ? 1 : 0);
+        lanes_[lane].pending.clear();
+        lanes_[lane].running = false;
+        monitor_.notifyAll();
+      }
+    });
+
+    try {
+      Context context(*this);
+      Batch batch;
+      {
+        Guard g(mutex_);
+        batch = std::move(lanes_[lane].pending.front());
+        lanes_[lane].pending.pop_front();
+        inBatch = true;
+      }
+      while (true) {
+        for (auto& event : batch) {
+          context.process(event.first, event.second);
+        }
+
+        Guard g(mutex_);
+        --inFlight_;
+        inBatch = false;
+        monitor_.notifyAll();
+        if (lanes_[lane].pending.empty()) {
+          lanes_[lane].running = false;
+          released = true;
+          return;
+        }
+        batch = std::move(lanes_[lane].pending.front());
+        lanes_[lane].pending.pop_front();
+        inBatch = true;
+      }
+    } catch (...) {
+      fail();
+    }
+  }
+
+  TFileProcessor& owner_;
+  shared_ptr<ThreadManager> threadManager_;
+  std::vector<Lane> lanes_;
+  size_t inFlight_;
+  size_t maxInFlight_;
+  std::atomic<bool> failed_;
+  bool discardOutput_;
+  Mutex mutex_;
+  Monitor monitor_;
+  Mutex outputMutex_;
+};
+
+void TFileProcessor::processParallel(shared_ptr<ThreadManager> threadManager, KeyFunction key) {
+#ifndef _WIN32
+  auto transport = std::dynamic_pointer_cast<TMappedFileTransport>(inputTransport_);
+  if (!transport) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "TFileProcessor: processParallel() needs a TMappedFileTransport");
+  }
+
+  size_t workers = (std::max)(threadManager->workerCount(), static_cast<size_t>(1));
+  size_t numLanes = key ? 4 * workers : 0;
+  Replay replay(*this, threadManager, numLanes, 2 * (key ? numLanes : workers));
+
+  uint32_t numChunks = transport->getNumChunks();
+  try {
+    for (uint32_t chunk = 0; chunk < numChunks && replay.waitForRoom(); ++chunk) {
+      if (!key) {
+        replay.addChunk(*transport, chunk);
+        continue;
+      }
+
+      std::vector<Replay::Batch> batches(numLanes);
+      transport->forEachEvent(chunk, [&](const uint8_t* event, uint32_t size) {
+        // spread keys that only differ in their high or low bits
+        uint64_t hash = key(event, size) * 0x9E3779B97F4A7C15ULL;
+        batches[(hash >> 32) % numLanes].push_back(std::make_pair(event, size));
+      });
+      for (size_t lane = 0; lane < numLanes; ++lane) {
+        if (!batches[lane].empty()) {
+          replay.addBatch(lane, std::move(batches[lane]));
+        }
+      }
+    }
+  } catch (...) {
+    // the tasks still refer to replay
+    replay.waitForAll();
+    throw;
+  }
+  replay.waitForAll();
+#else
+  (void)threadManager;
+  (void)key;
+  throw TTransportException(TTransportException::BAD_ARGS,
+                            "TFileProcessor: processParallel() is not supported on Windows");
+#endif
+}
 }
 }
 } // apache::thrift::transport
@@ -25,13 +25,17 @@
 #include <thrift/TProcessor.h>
 
 #include <atomic>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 #include <stdio.h>
 
 #include <thrift/concurrency/Mutex.h>
 #include <thrift/concurrency/Monitor.h>
 #include <thrift/concurrency/ThreadFactory.h>
 #include <thrift/concurrency/Thread.h>
+#include <thrift/concurrency/ThreadManager.h>
 
 namespace apache {
 namespace thrift {
@@ -107,40 +111,124 @@ typedef struct readState {
 } readState;
 
 /**
- * TFileTransportBuffer - buffer class used by TFileTransport for queueing up events
- * to be written to disk.  Should be used in the following way:
- *  1) Buffer created
- *  2) Buffer written to (addEvent)
- *  3) Buffer read from (getNext)
- *  4) Buffer reset (reset)
- *  5) Go back to 2, or destroy buffer
+ * TFileTransportQueue - bounded queue of events waiting to be written to
+ * disk, filled by any number of threads and drained by the TFileTransport
+ * writer thread.
  *
- * The buffer should never be written to after it is read from, unless it is reset first.
- * Note: The above rules are enforced mainly for debugging its sole client TFileTransport
- *       which uses the buffer in this way.
+ * The queue is a ring of preallocated slots (the bounded queue design of
+ * Dmitry Vyukov). A producer claims a slot with a compare-and-swap on the
+ * enqueue position and copies its event into the slot's buffer in place;
+ * slot buffers are kept between uses, so steady state logging does not
+ * allocate. Each slot carries a sequence number telling producers and the
+ * consumer whose turn it is, no locks are taken.
  *
+ * The size is rounded up to a power of two.
  */
-class TFileTransportBuffer {
+class TFileTransportQueue {
 public:
-  TFileTransportBuffer(uint32_t size);
-  ~TFileTransportBuffer();
+  TFileTransportQueue(uint32_t size);
+  ~TFileTransportQueue();
 
-  bool addEvent(eventInfo* event);
-  eventInfo* getNext();
-  void reset();
-  bool isFull();
-  bool isEmpty();
+  /**
+   * Copies an event, preceded by its 4 byte length, into a free slot and
+   * stores the event's position in the queue. Returns false if the queue
+   * is full. Safe to call from any thread.
+   */
+  bool tryEnqueue(const uint8_t* buf, uint32_t len, uint64_t* position);
+
+  /**
+   * Gets the oldest event and its size including the length. Returns false
+   * if the next event has not been published yet. A size of 0 marks a slot
+   * whose event could not be stored, it is popped like any other. Consumer
+   * thread only.
+   */
+  bool front(const uint8_t** data, uint32_t* size) const;
+
+  /**
+   * Releases the slot returned by front(). Consumer thread only.
+   */
+  void pop();
+
+  bool isFull() const;
+
+  // number of events claimed by producers and released by the consumer
+  uint64_t getEnqueued() const { return enqueuePos_.load(std::memory_order_relaxed); }
+  uint64_t getDequeued() const { return dequeuePos_.load(std::memory_order_relaxed); }
 
 private:
-  TFileTransportBuffer(); // should not be used
+  TFileTransportQueue(const TFileTransportQueue&) = delete;
+  TFileTransportQueue& operator=(const TFileTransportQueue&) = delete;
+
+  // slot buffers larger than this are freed after use
+  static const uint32_t MAX_RETAINED_SLOT_SIZE = 64 * 1024;
+
+  struct Slot {
+    std::atomic<uint64_t> sequence_;
+    uint8_t* data_;
+    uint32_t size_;
+    uint32_t capacity_;
+    // keep neighbouring slots on separate cache lines
+    char pad_[64 - sizeof(std::atomic<uint64_t>) - sizeof(uint8_t*) - 2 * sizeof(uint32_t)];
+  };
+
+  Slot* slots_;
+  uint64_t mask_;
+
+  char pad0_[64];
+  std::atomic<uint64_t> enqueuePos_;
+  char pad1_[64 - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> dequeuePos_;
+  char pad2_[64 - sizeof(std::atomic<uint64_t>)];
+};
+
+/**
+ * Index of a TFileTransport log, kept in "<log>.idx" next to it. Every
+ * interval-th event of the log has an entry with its ordinal, its offset
+ * and the time the writer thread wrote it, so readers can seek by event
+ * number or by time with a binary search over the index file.
+ */
+class TFileTransportIndex {
+public:
+  struct Entry {
+    // ordinal of the event in the log, the first event is 0
+    uint64_t event;
+    // offset of the event's size field in the log
+    uint64_t offset;
+    // write time in microseconds since the epoch
+    int64_t timestamp;
+  };
+
+  static std::string getPath(const std::string& logPath) { return logPath + ".idx"; }
+
+  /**
+   * Finds the last entry for which before(entry) is true. Entries are
+   * ordered by all three fields, so before() has to be true for a prefix
+   * of the index.
+   *
+   * @return false if there is no such entry or no index
+   */
+  static bool find(const std::string& logPath,
+                   const std::function<bool(const Entry&)>& before,
+                   Entry* entry);
 
-  enum mode { WRITE, READ };
-  mode bufferMode_;
+  /**
+   * Brings the index of a log up to date: drops entries past the end of the
+   * log and adds the missing ones, scanning the chunks of the log on
+   * numThreads threads (0 for one per core). The log does not record write
+   * times, so added entries get the modification time of the log; seeking
+   * by time stays correct but lands further back.
+   *
+   * @return the number of events in the log
+   */
+  static uint64_t rebuild(const std::string& logPath,
+                          uint32_t chunkSize,
+                          uint32_t interval,
+                          uint32_t numThreads = 0);
 
-  uint32_t writePoint_;
-  uint32_t readPoint_;
-  uint32_t size_;
-  eventInfo** buffer_;
+  /**
+   * Returns the index entries of a log.
+   */
+  static std::vector<Entry> load(const std::string& logPath);
 };
 
 /**
@@ -183,6 +271,26 @@ public:
   void write(const uint8_t* buf, uint32_t len);
   void flush() override;
 
+  /**
+   * Writes an event like write() and returns a ticket for it. Tickets grow
+   * with every event written, from any thread; 0 means the event was
+   * dropped.
+   */
+  uint64_t writeEvent(const uint8_t* buf, uint32_t len);
+
+  /**
+   * Blocks until the event with the given ticket, and every event written
+   * before it, is synced to disk. Threads waiting at the same time share a
+   * single fdatasync (group commit), so waiting on every event is cheap
+   * under load.
+   */
+  void waitForSync(uint64_t ticket);
+
+  /**
+   * Whether the event with the given ticket has been synced to disk.
+   */
+  bool isSynced(uint64_t ticket) const { return syncedEvents_ >= ticket; }
+
   uint32_t readAll(uint8_t* buf, uint32_t len);
   uint32_t read(uint8_t* buf, uint32_t len);
   bool peek() override;
@@ -193,6 +301,21 @@ public:
   uint32_t getNumChunks() override;
   uint32_t getCurChunk() override;
 
+  /**
+   * Moves the reader to an event, 0 being the first event of the log, using
+   * the index (see setIndexInterval()) to skip ahead. Without an index the
+   * log is read from the start.
+   */
+  void seekToEvent(uint64_t event);
+
+  /**
+   * Moves the reader to the last indexed event written at or before a time
+   * in microseconds since the epoch. Reading from there returns every event
+   * written after that time, and no more than an index interval of older
+   * events. Without an index the reader moves to the start of the log.
+   */
+  void seekToTime(int64_t timestamp);
+
   // for changing the output file
   void resetOutputFile(int fd, std::string filename, off_t offset);
 
@@ -255,6 +378,46 @@ public:
   }
   uint32_t getEofSleepTimeUs() { return eofSleepTime_; }
 
+  /**
+   * Allocates disk space for the log one chunk at a time ahead of the
+   * writes, with fallocate(FALLOC_FL_KEEP_SIZE) so readers do not see the
+   * reserved space. Appends then do not allocate blocks, which makes the
+   * syncs cheaper. Ignored where fallocate is not available.
+   */
+  void setPreallocate(bool preallocate) { preallocate_ = preallocate; }
+  bool getPreallocate() { return preallocate_; }
+
+  /**
+   * Writes whole blocks of the log with O_DIRECT, bypassing the page cache.
+   * The partial block at the end of the log is still written through the
+   * page cache so readers see every event, and rewritten directly once it
+   * fills up. Must be set before the first write; falls back to normal
+   * writes if the file system does not support O_DIRECT.
+   */
+  void setDirectIO(bool directIO) {
+    if (bufferAndThreadInitialized_) {
+      GlobalOutput("Cannot change direct IO after writer thread started");
+      return;
+    }
+    directIO_ = directIO;
+  }
+  bool getDirectIO() { return directIO_; }
+
+  /**
+   * Makes the writer thread add every interval-th event to the index of the
+   * log (see TFileTransportIndex), 0 disables the index. When the writer
+   * thread starts it adds what is missing from the index, so existing logs
+   * are indexed as well. Must be set before the first write.
+   */
+  void setIndexInterval(uint32_t interval) {
+    if (bufferAndThreadInitialized_) {
+      GlobalOutput("Cannot change the index interval after writer thread started");
+      return;
+    }
+    indexInterval_ = interval;
+  }
+  uint32_t getIndexInterval() { return indexInterval_; }
+
   /*
    * Override TTransport *_virt() functions to invoke our implementations.
    * We cannot use TVirtualTransport to provide these, since we need to inherit
@@ -266,8 +429,16 @@ public:
 
 private:
   // helper functions for writing to a file
-  void enqueueEvent(const uint8_t* buf, uint32_t eventLen);
-  bool swapEventBuffers(const std::chrono::time_point<std::chrono::steady_clock> *deadline);
+  uint64_t enqueueEvent(const uint8_t* buf, uint32_t eventLen);
+  bool writeToFile(const uint8_t* buf, uint32_t len);
+  void syncFile();
+  void preallocate(off_t end);
+  void initDirectIO();
+  void closeDirectIO();
+  void initIndex();
+  void closeIndex();
+  void seekToOffset(off_t offset);
+  bool waitForEvents(const std::chrono::time_point<std::chrono::steady_clock>& deadline);
   bool initBufferAndWriteThread();
 
   // control for writer thread
@@ -303,10 +474,34 @@ private:
   uint32_t chunkSize_;
   static const uint32_t DEFAULT_CHUNK_SIZE = 16 * 1024 * 1024;
 
-  // size of event buffers
+  // number of events that can be queued for the writer thread
   uint32_t eventBufferSize_;
   static const uint32_t DEFAULT_EVENT_BUFFER_SIZE = 10000;
 
+  // the writer thread writes events to the file in batches of this many bytes
+  static const uint32_t WRITE_BATCH_SIZE = 256 * 1024;
+
+  // space allocated ahead of the writes
+  bool preallocate_;
+  off_t preallocatedEnd_;
+
+  // O_DIRECT writes: the log from directOffset_ on is staged in the aligned
+  // directBuf_ until it fills whole blocks
+  static const uint32_t DIRECT_IO_ALIGNMENT = 4096;
+  bool directIO_;
+  int directFd_;
+  uint8_t* directBuf_;
+  uint32_t directSize_;
+  off_t directOffset_;
+
+  // index entries are added by the writer thread every indexInterval_
+  // events, numEvents_ counts the events in the log and indexTime_ is the
+  // timestamp of the last entry
+  uint32_t indexInterval_;
+  int indexFd_;
+  uint64_t numEvents_;
+  int64_t indexTime_;
+
   // max number of microseconds that can pass without flushing
   uint32_t flushMaxUs_;
   static const uint32_t DEFAULT_FLUSH_MAX_US = 3000000;
@@ -339,28 +534,31 @@ private:
   apache::thrift::concurrency::ThreadFactory threadFactory_;
   std::shared_ptr<apache::thrift::concurrency::Thread> writerThread_;
 
-  // buffers to hold data before it is flushed. Each element of the buffer stores a msg that
-  // needs to be written to the file.  The buffers are swapped by the writer thread.
-  TFileTransportBuffer* dequeueBuffer_;
-  TFileTransportBuffer* enqueueBuffer_;
+  // events waiting to be written to the file by the writer thread
+  std::unique_ptr<TFileTransportQueue> queue_;
 
-  // conditions used to block when the buffer is full or empty
+  // Conditions used to sleep when the queue is full or empty. Producers and
+  // the writer thread only take mutex_ when one side may be sleeping.
   Monitor notFull_, notEmpty_;
   std::atomic<bool> closing_;
+  std::atomic<bool> writerWaiting_;
+  std::atomic<uint32_t> producersWaiting_;
 
-  // To keep track of whether the buffer has been flushed
+  // flush() waits until the writer thread has synced the events enqueued
+  // before it was called
   Monitor flushed_;
-  std::atomic<bool> forceFlush_;
+  std::atomic<uint64_t> flushRequested_;
+  std::atomic<uint64_t> syncedEvents_;
 
-  // Mutex that is grabbed when enqueueing and swapping the read/write buffers
+  // Mutex for the monitors and initialization of the writer thread
   Mutex mutex_;
 
   // File information
   std::string filename_;
   int fd_;
 
-  // Whether the writer thread and buffers have been initialized
-  bool bufferAndThreadInitialized_;
+  // Whether the writer thread and queue have been initialized
+  std::atomic<bool> bufferAndThreadInitialized_;
 
   // Offset within the file
   off_t offset_;
@@ -424,7 +622,30 @@ public:
    */
   void processChunk();
 
+  /**
+   * Returns the ordering key of an event, see processParallel().
+   */
+  typedef std::function<uint64_t(const uint8_t* event, uint32_t size)> KeyFunction;
+
+  /**
+   * Replays the whole log on the workers of a started ThreadManager and
+   * returns once every event has been processed. The input transport has to
+   * be a TMappedFileTransport, and every event has to hold whole messages.
+   *
+   * Without a key function every chunk is processed as one task, so events
+   * run in no particular order. With one, events are spread by key over a
+   * few lanes per worker; each lane processes its events in log order, so
+   * events with the same key keep their order.
+   *
+   * The processor is called from several threads at once. Responses are
+   * written to the output transport one event at a time.
+   */
+  void processParallel(std::shared_ptr<apache::thrift::concurrency::ThreadManager> threadManager,
+                       KeyFunction key = KeyFunction());
+
 private:
+  class Replay;
+
   std::shared_ptr<TProcessor> processor_;
   std::shared_ptr<TProtocolFactory> inputProtocolFactory_;
   std::shared_ptr<TProtocolFactory> outputProtocolFactory_;
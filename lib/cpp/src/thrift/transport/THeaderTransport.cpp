@@ -22,12 +22,20 @@
 #include <thrift/protocol/TProtocolTypes.h>
 #include <thrift/protocol/TBinaryProtocol.h>
 #include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/transport/TSocket.h>
 
+#include <algorithm>
 #include <limits>
 #include <utility>
 #include <string>
 #include <string.h>
 #include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 using std::map;
 using std::string;
@@ -43,6 +51,13 @@ namespace transport {
 using namespace apache::thrift::protocol;
 using apache::thrift::protocol::TBinaryProtocol;
 
+THeaderTransport::~THeaderTransport() {
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(zstdCCtx_);
+  ZSTD_freeDCtx(zstdDCtx_);
+#endif
+}
+
 uint32_t THeaderTransport::readSlow(uint8_t* buf, uint32_t len) {
   if (clientType == THRIFT_UNFRAMED_BINARY || clientType == THRIFT_UNFRAMED_COMPACT) {
     return transport_->read(buf, len);
@@ -260,9 +275,14 @@ void THeaderTransport::readHeaderFormat(uint16_t headerSize, uint32_t sz) {
   untransform(data, safe_numeric_cast<uint32_t>(static_cast<ptrdiff_t>(sz) - (data - rBuf_.get())));
 }
 
+void THeaderTransport::checkUntransformedSize(uint64_t sz) {
+  if (sz > static_cast<uint64_t>(getConfiguration()->getMaxMessageSize())) {
+    throw TTransportException(TTransportException::END_OF_FILE, "MaxMessageSize reached");
+  }
+}
+
 void THeaderTransport::untransform(uint8_t* ptr, uint32_t sz) {
-  // Update the transform buffer size if needed
-  resizeTransformBuffer();
+  haveReadFrame_ = true;
 
   for (vector<uint16_t>::const_iterator it = readTrans_.begin(); it != readTrans_.end(); ++it) {
     const uint16_t transId = *it;
@@ -283,10 +303,55 @@ void THeaderTransport::untransform(uint8_t* ptr, uint32_t sz) {
         throw TApplicationException(TApplicationException::MISSING_RESULT,
                                     "Error while zlib deflateInit");
       }
+      // zlib does not record the inflated size, start with a guess
+      ensureTransformBuffer(static_cast<uint32_t>((std::min)(
+          (std::max)(4 * static_cast<uint64_t>(sz), static_cast<uint64_t>(DEFAULT_BUFFER_SIZE)),
+          static_cast<uint64_t>(getConfiguration()->getMaxMessageSize()) + 1)));
       stream.next_out = tBuf_.get();
       stream.avail_out = tBufSize_;
       err = inflate(&stream, Z_FINISH);
-      if (err != Z_STREAM_END || stream.avail_out == 0) {
+      uint32_t dictId = 0;
+      if (err == Z_NEED_DICT) {
+        dictId = static_cast<uint32_t>(stream.adler);
+        std::shared_ptr<const TZlibDictionary> dictionary;
+        if (dictionaries_) {
+          dictionary = dictionaries_->find(dictId);
+        }
+        if (!dictionary) {
+          inflateEnd(&stream);
+          throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                      "Unknown zlib dictionary");
+        }
+        err = inflateSetDictionary(&stream,
+                                   reinterpret_cast<const Bytef*>(dictionary->getData().data()),
+                                   static_cast<uInt>(dictionary->getData().size()));
+        if (err != Z_OK) {
+          inflateEnd(&stream);
+          throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                    "zlib dictionary does not match the one of the frame");
+        }
+        err = inflate(&stream, Z_FINISH);
+      }
+      peerDictId_ = dictId;
+      peerDictKnown_ = true;
+      // grow the buffer until the frame fits
+      while ((err == Z_OK || err == Z_BUF_ERROR) && stream.avail_out == 0) {
+        try {
+          checkUntransformedSize(stream.total_out);
+        } catch (...) {
+          inflateEnd(&stream);
+          throw;
+        }
+        std::unique_ptr<uint8_t[]> grown(new uint8_t[2 * tBufSize_]);
+        memcpy(grown.get(), tBuf_.get(), stream.total_out);
+        tBuf_.swap(grown);
+        tBufSize_ *= 2;
+        stream.next_out = tBuf_.get() + stream.total_out;
+        stream.avail_out = tBufSize_ - static_cast<uint32_t>(stream.total_out);
+        err = inflate(&stream, Z_FINISH);
+      }
+      if (err != Z_STREAM_END) {
+        inflateEnd(&stream);
         throw TApplicationException(TApplicationException::MISSING_RESULT,
                                     "Error while zlib deflate");
       }
@@ -297,22 +362,72 @@ void THeaderTransport::untransform(uint8_t* ptr, uint32_t sz) {
         throw TApplicationException(TApplicationException::MISSING_RESULT,
                                     "Error while zlib deflateEnd");
       }
-
-      memcpy(ptr, tBuf_.get(), sz);
+    } else if (transId == ZSTD_TRANSFORM) {
+#ifdef HAVE_ZSTD
+      unsigned long long contentSize = ZSTD_getFrameContentSize(ptr, sz);
+      if (contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize == ZSTD_CONTENTSIZE_UNKNOWN) {
+        throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                    "Error while zstd decompress");
+      }
+      checkUntransformedSize(contentSize);
+      ensureTransformBuffer(static_cast<uint32_t>(contentSize));
+      if (!zstdDCtx_) {
+        zstdDCtx_ = ZSTD_createDCtx();
+        if (!zstdDCtx_) {
+          throw std::bad_alloc();
+        }
+      }
+      size_t rv = ZSTD_decompressDCtx(zstdDCtx_, tBuf_.get(), tBufSize_, ptr, sz);
+      if (ZSTD_isError(rv) || rv != contentSize) {
+        throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                    "Error while zstd decompress");
+      }
+      sz = static_cast<uint32_t>(rv);
+#else
+      throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                  "zstd transform not supported");
+#endif
+    } else if (transId == LZ4_TRANSFORM) {
+#ifdef HAVE_LZ4
+      // 4 byte uncompressed size, then an LZ4 block
+      uint32_t contentSizeN;
+      if (sz < sizeof(contentSizeN)) {
+        throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                    "Error while lz4 decompress");
+      }
+      memcpy(&contentSizeN, ptr, sizeof(contentSizeN));
+      uint32_t contentSize = ntohl(contentSizeN);
+      checkUntransformedSize(contentSize);
+      ensureTransformBuffer(contentSize);
+      int rv = LZ4_decompress_safe(reinterpret_cast<const char*>(ptr) + sizeof(contentSizeN),
+                                   reinterpret_cast<char*>(tBuf_.get()),
+                                   static_cast<int>(sz - sizeof(contentSizeN)),
+                                   static_cast<int>(contentSize));
+      if (rv < 0 || static_cast<uint32_t>(rv) != contentSize) {
+        throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                    "Error while lz4 decompress");
+      }
+      sz = contentSize;
+#else
+      throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                  "lz4 transform not supported");
+#endif
     } else {
       throw TApplicationException(TApplicationException::MISSING_RESULT, "Unknown transform");
     }
+
+    // The headers are parsed, the untransformed data becomes the read buffer
+    rBuf_.swap(tBuf_);
+    std::swap(rBufSize_, tBufSize_);
+    ptr = rBuf_.get();
   }
 
   setReadBuffer(ptr, sz);
 }
 
 /**
- * We may have updated the wBuf size, update the tBuf size to match.
- * Should be called in transform.
- *
- * The buffer should be slightly larger than write buffer size due to
- * compression transforms (that may slightly grow on small frame sizes)
+ * Deprecated, transform() and untransform() grow the buffer with
+ * ensureTransformBuffer() as each frame needs.
  */
 void THeaderTransport::resizeTransformBuffer(uint32_t additionalSize) {
   if (tBufSize_ < wBufSize_ + DEFAULT_BUFFER_SIZE) {
@@ -323,11 +438,61 @@ void THeaderTransport::resizeTransformBuffer(uint32_t additionalSize) {
   }
 }
 
-void THeaderTransport::transform(uint8_t* ptr, uint32_t sz) {
-  // Update the transform buffer size if needed
-  resizeTransformBuffer();
+void THeaderTransport::ensureTransformBuffer(uint32_t sz) {
+  if (tBufSize_ < sz) {
+    tBuf_.reset(new uint8_t[sz]);
+    tBufSize_ = sz;
+  }
+}
 
-  for (vector<uint16_t>::const_iterator it = writeTrans_.begin(); it != writeTrans_.end(); ++it) {
+std::shared_ptr<const TZlibDictionary> THeaderTransport::getWriteDictionary() const {
+  if (!dictionaries_) {
+    return nullptr;
+  }
+  if (peerDictKnown_) {
+    return peerDictId_ == 0 ? nullptr : dictionaries_->find(peerDictId_);
+  }
+  return dictionaries_->getWriteDictionary();
+}
+
+bool THeaderTransport::isTransformSupported(uint16_t transId) {
+  switch (transId) {
+  case ZLIB_TRANSFORM:
+    return true;
+#ifdef HAVE_ZSTD
+  case ZSTD_TRANSFORM:
+    return true;
+#endif
+#ifdef HAVE_LZ4
+  case LZ4_TRANSFORM:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+void THeaderTransport::setTransform(uint16_t transId) {
+  if (!isTransformSupported(transId)) {
+    throw TTransportException(TTransportException::BAD_ARGS, "Unsupported transform");
+  }
+  writeTrans_.push_back(transId);
+}
+
+const vector<uint16_t>& THeaderTransport::getFrameTransforms(uint32_t sz) const {
+  static const vector<uint16_t> none;
+  if (sz < minCompressBytes_) {
+    return none;
+  }
+  if (mirrorTransforms_ && haveReadFrame_) {
+    return readTrans_;
+  }
+  return writeTrans_;
+}
+
+void THeaderTransport::transform(uint8_t* ptr, uint32_t sz) {
+  const vector<uint16_t>& frameTrans = getFrameTransforms(sz);
+  for (vector<uint16_t>::const_iterator it = frameTrans.begin(); it != frameTrans.end(); ++it) {
     const uint16_t transId = *it;
 
     if (transId == ZLIB_TRANSFORM) {
@@ -345,30 +510,81 @@ void THeaderTransport::transform(uint8_t* ptr, uint32_t sz) {
         throw TTransportException(TTransportException::CORRUPTED_DATA,
                                   "Error while zlib deflateInit");
       }
-      uint32_t tbuf_size = 0;
-      while (err == Z_OK) {
-        resizeTransformBuffer(tbuf_size);
-
-        stream.next_out = tBuf_.get();
-        stream.avail_out = tBufSize_;
-        err = deflate(&stream, Z_FINISH);
-        tbuf_size += DEFAULT_BUFFER_SIZE;
+      std::shared_ptr<const TZlibDictionary> dictionary = getWriteDictionary();
+      if (dictionary) {
+        err = deflateSetDictionary(&stream,
+                                   reinterpret_cast<const Bytef*>(dictionary->getData().data()),
+                                   static_cast<uInt>(dictionary->getData().size()));
+        if (err != Z_OK) {
+          deflateEnd(&stream);
+          throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                    "Error while setting the zlib dictionary");
+        }
       }
+      ensureTransformBuffer(WRITE_HEADROOM + static_cast<uint32_t>(deflateBound(&stream, sz)));
+      stream.next_out = tBuf_.get() + WRITE_HEADROOM;
+      stream.avail_out = tBufSize_ - WRITE_HEADROOM;
+      err = deflate(&stream, Z_FINISH);
       sz = stream.total_out;
-
-      err = deflateEnd(&stream);
-      if (err != Z_OK) {
+      if (deflateEnd(&stream) != Z_OK || err != Z_STREAM_END) {
         throw TTransportException(TTransportException::CORRUPTED_DATA,
-                                  "Error while zlib deflateEnd");
+                                  "Error while zlib deflate");
       }
-
-      memcpy(ptr, tBuf_.get(), sz);
+    } else if (transId == ZSTD_TRANSFORM) {
+#ifdef HAVE_ZSTD
+      if (!zstdCCtx_) {
+        zstdCCtx_ = ZSTD_createCCtx();
+        if (!zstdCCtx_) {
+          throw std::bad_alloc();
+        }
+      }
+      ensureTransformBuffer(WRITE_HEADROOM + static_cast<uint32_t>(ZSTD_compressBound(sz)));
+      size_t rv = ZSTD_compressCCtx(zstdCCtx_,
+                                    tBuf_.get() + WRITE_HEADROOM,
+                                    tBufSize_ - WRITE_HEADROOM,
+                                    ptr,
+                                    sz,
+                                    zstdLevel_);
+      if (ZSTD_isError(rv)) {
+        throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                  string("Error while zstd compress: ") + ZSTD_getErrorName(rv));
+      }
+      sz = static_cast<uint32_t>(rv);
+#else
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "zstd transform not supported");
+#endif
+    } else if (transId == LZ4_TRANSFORM) {
+#ifdef HAVE_LZ4
+      uint32_t contentSizeN = htonl(sz);
+      const uint32_t offset = WRITE_HEADROOM + sizeof(contentSizeN);
+      ensureTransformBuffer(offset + LZ4_compressBound(static_cast<int>(sz)));
+      memcpy(tBuf_.get() + WRITE_HEADROOM, &contentSizeN, sizeof(contentSizeN));
+      int rv = LZ4_compress_default(reinterpret_cast<const char*>(ptr),
+                                    reinterpret_cast<char*>(tBuf_.get()) + offset,
+                                    static_cast<int>(sz),
+                                    static_cast<int>(tBufSize_ - offset));
+      if (rv <= 0) {
+        throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                  "Error while lz4 compress");
+      }
+      sz = static_cast<uint32_t>(sizeof(contentSizeN) + rv);
+#else
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "lz4 transform not supported");
+#endif
     } else {
       throw TTransportException(TTransportException::CORRUPTED_DATA, "Unknown transform");
     }
+
+    // The transformed data becomes the write buffer
+    wBuf_.swap(tBuf_);
+    std::swap(wBufSize_, tBufSize_);
+    setWriteBuffer(wBuf_.get(), wBufSize_);
+    ptr = wBuf_.get() + WRITE_HEADROOM;
   }
 
-  wBase_ = wBuf_.get() + sz;
+  wBase_ = ptr + sz;
 }
 
 void THeaderTransport::resetProtocol() {
@@ -380,7 +596,7 @@ void THeaderTransport::resetProtocol() {
 }
 
 uint32_t THeaderTransport::getWriteBytes() {
-  return safe_numeric_cast<uint32_t>(wBase_ - wBuf_.get());
+  return safe_numeric_cast<uint32_t>(wBase_ - (wBuf_.get() + WRITE_HEADROOM));
 }
 
 /**
@@ -414,20 +630,32 @@ void THeaderTransport::clearHeaders() {
   writeHeaders_.clear();
 }
 
+constexpr const char* THeaderTransport::CLIENT_TIMEOUT_HEADER;
+
+int THeaderTransport::getClientTimeout() const {
+  if (clientTimeout_) {
+    return (std::max)(clientTimeout_, 0);
+  }
+  auto* socket = dynamic_cast<TSocket*>(outTransport_.get());
+  return socket ? socket->getRecvTimeout() : 0;
+}
+
 void THeaderTransport::flush() {
   resetConsumedMessageSize();
   // Write out any data waiting in the write buffer.
   uint32_t haveBytes = getWriteBytes();
+  const vector<uint16_t>& frameTrans = getFrameTransforms(haveBytes);
 
   if (clientType == THRIFT_HEADER_CLIENT_TYPE) {
-    transform(wBuf_.get(), haveBytes);
+    transform(wBuf_.get() + WRITE_HEADROOM, haveBytes);
     haveBytes = getWriteBytes(); // transform may have changed the size
   }
 
   // Note that we reset wBase_ prior to the underlying write
   // to ensure we're in a sane state (i.e. internal buffer cleaned)
   // if the underlying write throws up an exception
-  wBase_ = wBuf_.get();
+  uint8_t* payload = wBuf_.get() + WRITE_HEADROOM;
+  wBase_ = payload;
 
   if (haveBytes > MAX_FRAME_SIZE) {
     throw TTransportException(TTransportException::CORRUPTED_DATA,
@@ -437,23 +665,28 @@ void THeaderTransport::flush() {
   if (clientType == THRIFT_HEADER_CLIENT_TYPE) {
     // header size will need to be updated at the end because of varints.
     // Make it big enough here for max varint size, plus 4 for padding.
-    uint32_t headerSize = (2 + getNumTransforms()) * THRIFT_MAX_VARINT32_BYTES + 4;
+    uint32_t headerSize = (2 + safe_numeric_cast<uint32_t>(frameTrans.size()))
+                              * THRIFT_MAX_VARINT32_BYTES
+                          + 4;
     // add approximate size of info headers
     headerSize += getMaxWriteHeadersSize();
 
-    // Pkt size
-    uint32_t maxSzHbo = headerSize + haveBytes // thrift header + payload
-                        + 10;                  // common header section
-    uint8_t* pkt = tBuf_.get();
+    // frame size + common header section + thrift header
+    uint32_t maxHeaderBytes = 4 + 10 + headerSize;
+
+    // Build the header in the headroom in front of the payload if it fits,
+    // otherwise in the transform buffer.
+    uint8_t* pkt;
+    if (maxHeaderBytes <= WRITE_HEADROOM) {
+      pkt = wBuf_.get();
+    } else {
+      ensureTransformBuffer(maxHeaderBytes);
+      pkt = tBuf_.get();
+    }
     uint8_t* headerStart;
     uint8_t* headerSizePtr;
     uint8_t* pktStart = pkt;
 
-    if (maxSzHbo > tBufSize_) {
-      throw TTransportException(TTransportException::CORRUPTED_DATA,
-                                "Attempting to header frame that is too large");
-    }
-
     uint32_t szHbo;
     uint32_t szNbo;
     uint16_t headerSizeN;
@@ -475,10 +708,10 @@ void THeaderTransport::flush() {
     headerStart = pkt;
 
     pkt += writeVarint32(protoId, pkt);
-    pkt += writeVarint32(getNumTransforms(), pkt);
+    pkt += writeVarint32(safe_numeric_cast<int32_t>(frameTrans.size()), pkt);
 
     // For now, each transform is only the ID, no following data.
-    for (vector<uint16_t>::const_iterator it = writeTrans_.begin(); it != writeTrans_.end(); ++it) {
+    for (vector<uint16_t>::const_iterator it = frameTrans.begin(); it != frameTrans.end(); ++it) {
       pkt += writeVarint32(*it, pkt);
     }
 
@@ -524,16 +757,23 @@ void THeaderTransport::flush() {
     szNbo = htonl(szHbo);
     memcpy(pktStart, &szNbo, sizeof(szNbo));
 
-    outTransport_->write(pktStart, szHbo - haveBytes + 4);
-    outTransport_->write(wBuf_.get(), haveBytes);
+    auto headerBytes = safe_numeric_cast<uint32_t>(pkt - pktStart);
+    if (pktStart == wBuf_.get()) {
+      // Move the header up against the payload and send the frame at once
+      memmove(payload - headerBytes, pktStart, headerBytes);
+      outTransport_->write(payload - headerBytes, headerBytes + haveBytes);
+    } else {
+      outTransport_->write(pktStart, headerBytes);
+      outTransport_->write(payload, haveBytes);
+    }
   } else if (clientType == THRIFT_FRAMED_BINARY || clientType == THRIFT_FRAMED_COMPACT) {
     auto szHbo = (uint32_t)haveBytes;
     uint32_t szNbo = htonl(szHbo);
 
-    outTransport_->write(reinterpret_cast<uint8_t*>(&szNbo), 4);
-    outTransport_->write(wBuf_.get(), haveBytes);
+    memcpy(payload - sizeof(szNbo), &szNbo, sizeof(szNbo));
+    outTransport_->write(payload - sizeof(szNbo), haveBytes + sizeof(szNbo));
   } else if (clientType == THRIFT_UNFRAMED_BINARY || clientType == THRIFT_UNFRAMED_COMPACT) {
-    outTransport_->write(wBuf_.get(), haveBytes);
+    outTransport_->write(payload, haveBytes);
   } else {
     throw TTransportException(TTransportException::BAD_ARGS, "Unknown client type");
   }
@@ -21,6 +21,7 @@
 #define THRIFT_TRANSPORT_THEADERTRANSPORT_H_ 1
 
 #include <bitset>
+#include <cstdlib>
 #include <limits>
 #include <vector>
 #include <stdexcept>
@@ -37,6 +38,10 @@
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TTransport.h>
 #include <thrift/transport/TVirtualTransport.h>
+#include <thrift/transport/TZlibDictionary.h>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
 
 enum CLIENT_TYPE {
   THRIFT_HEADER_CLIENT_TYPE = 0,
@@ -81,7 +86,16 @@ public:
       seqId(0),
       flags(0),
       tBufSize_(0),
-      tBuf_(nullptr) {
+      tBuf_(nullptr),
+      peerDictId_(0),
+      peerDictKnown_(false),
+      zstdLevel_(DEFAULT_ZSTD_LEVEL),
+      minCompressBytes_(0),
+      mirrorTransforms_(false),
+      haveReadFrame_(false),
+      clientTimeout_(0),
+      zstdCCtx_(nullptr),
+      zstdDCtx_(nullptr) {
     if (!transport_) throw std::invalid_argument("transport is empty");
     initBuffers();
   }
@@ -96,15 +110,32 @@ public:
       seqId(0),
       flags(0),
       tBufSize_(0),
-      tBuf_(nullptr) {
+      tBuf_(nullptr),
+      peerDictId_(0),
+      peerDictKnown_(false),
+      zstdLevel_(DEFAULT_ZSTD_LEVEL),
+      minCompressBytes_(0),
+      mirrorTransforms_(false),
+      haveReadFrame_(false),
+      clientTimeout_(0),
+      zstdCCtx_(nullptr),
+      zstdDCtx_(nullptr) {
     if (!transport_) throw std::invalid_argument("inTransport is empty");
     if (!outTransport_) throw std::invalid_argument("outTransport is empty");
     initBuffers();
   }
 
+  ~THeaderTransport() override;
+
   uint32_t readSlow(uint8_t* buf, uint32_t len) override;
   void flush() override;
+  uint32_t writeEnd() override { return getWriteBytes(); }
 
+  /**
+   * @deprecated The transforms size their buffer to each frame themselves,
+   *             nothing needs to call this any more. It only preallocates
+   *             the buffer and will be removed in a future release.
+   */
   void resizeTransformBuffer(uint32_t additionalSize = 0);
 
   uint16_t getProtocolId() const;
@@ -133,7 +164,8 @@ public:
   /**
    * Transform the data based on our write transform flags
    * At conclusion of function the write buffer is set to the
-   * transformed data.
+   * transformed data. Each transform writes into the transform buffer,
+   * which is then swapped with the write buffer rather than copied back.
    *
    * @param ptr Ptr to data to transform
    * @param sz Size of data buffer
@@ -144,7 +176,61 @@ public:
     return safe_numeric_cast<uint16_t>(writeTrans_.size());
   }
 
-  void setTransform(uint16_t transId) { writeTrans_.push_back(transId); }
+  /**
+   * Adds a transform to apply to outgoing frames. Transforms this build
+   * cannot apply are rejected here rather than failing every flush().
+   *
+   * @throws TTransportException BAD_ARGS if this build does not support it,
+   *         see isTransformSupported()
+   */
+  void setTransform(uint16_t transId);
+
+  /**
+   * Whether this build can apply and undo the given transform. ZLIB is
+   * always available, ZSTD and LZ4 only if their libraries were found when
+   * thrift was built.
+   */
+  static bool isTransformSupported(uint16_t transId);
+
+  /**
+   * Compression level of the ZSTD transform, see ZSTD_compress().
+   */
+  void setZstdLevel(int level) { zstdLevel_ = level; }
+  int getZstdLevel() const { return zstdLevel_; }
+
+  /**
+   * Frames with a payload smaller than this are sent without transforms,
+   * small messages rarely compress enough to pay for the CPU. The default
+   * of 0 transforms every frame.
+   */
+  void setMinCompressBytes(uint32_t bytes) { minCompressBytes_ = bytes; }
+  uint32_t getMinCompressBytes() const { return minCompressBytes_; }
+
+  /**
+   * When enabled, each frame is written with the transforms of the last
+   * frame received rather than those added with setTransform(), so a server
+   * answers every request with the codec the client picked for it. The
+   * transforms added with setTransform() are used until a frame arrives.
+   */
+  void setMirrorTransforms(bool mirror) { mirrorTransforms_ = mirror; }
+
+  /**
+   * The transforms the last received frame was sent with.
+   */
+  const std::vector<uint16_t>& getReadTransforms() const { return readTrans_; }
+
+  /**
+   * Preset dictionaries for the ZLIB transform.
+   *
+   * A received frame names its dictionary by the id in the zlib stream
+   * header. Outgoing frames use the dictionary the peer compressed its last
+   * frame with, or none if it used none, so a server never picks a
+   * dictionary its client does not have. Until a compressed frame has been
+   * received the write dictionary of the set is used.
+   */
+  void setDictionaries(std::shared_ptr<const TZlibDictionarySet> dictionaries) {
+    dictionaries_ = dictionaries;
+  }
 
   // Info headers
 
@@ -160,14 +246,53 @@ public:
   // these work with read headers
   const StringToStringMap& getHeaders() const { return readHeaders_; }
 
+  /**
+   * Key of the header carrying the milliseconds a client waits for the
+   * response to a request, sent by THeaderProtocol with each request that
+   * has a client timeout and left out otherwise. Servers use it to drop
+   * requests whose client has given up already.
+   */
+  static constexpr const char* CLIENT_TIMEOUT_HEADER = "client_timeout";
+
+  /**
+   * Sets the client timeout sent with each request in milliseconds. By
+   * default the receive timeout of the underlying TSocket is sent, if it has
+   * one; a negative value sends none.
+   */
+  void setClientTimeout(int ms) { clientTimeout_ = ms; }
+
+  /**
+   * The client timeout to send with the next request in milliseconds, 0 for
+   * none.
+   */
+  int getClientTimeout() const;
+
+  /**
+   * The client timeout the last request read was sent with in milliseconds,
+   * 0 if it had none.
+   */
+  int getRequestTimeout() const {
+    auto it = readHeaders_.find(CLIENT_TIMEOUT_HEADER);
+    if (it == readHeaders_.end()) {
+      return 0;
+    }
+    long timeout = strtol(it->second.c_str(), nullptr, 10);
+    return timeout > 0 && timeout <= (std::numeric_limits<int>::max)() ? static_cast<int>(timeout)
+                                                                        : 0;
+  }
+
   // accessors for seqId
   int32_t getSequenceNumber() const { return seqId; }
   void setSequenceNumber(int32_t seqId) { this->seqId = seqId; }
 
   enum TRANSFORMS {
     ZLIB_TRANSFORM = 0x01,
+    ZSTD_TRANSFORM = 0x05,
+    LZ4_TRANSFORM = 0x06,
   };
 
+  static const int DEFAULT_ZSTD_LEVEL = 3;
+
 protected:
   /**
    * Reads a frame of input from the underlying stream.
@@ -183,6 +308,7 @@ protected:
   void initBuffers() {
     setReadBuffer(nullptr, 0);
     setWriteBuffer(wBuf_.get(), wBufSize_);
+    wBase_ = wBuf_.get() + WRITE_HEADROOM;
   }
 
   std::shared_ptr<TTransport> outTransport_;
@@ -194,6 +320,13 @@ protected:
 
   static const uint32_t MAX_FRAME_SIZE = 0x3FFFFFFF;
 
+  /**
+   * Space kept free in front of the payload in the write buffer. flush()
+   * puts the frame size and header there when they fit, so the frame goes
+   * out in a single write without copying the payload.
+   */
+  static const uint32_t WRITE_HEADROOM = 128;
+
   int16_t protoId;
   uint16_t clientType;
   uint32_t seqId;
@@ -223,6 +356,42 @@ protected:
   uint32_t tBufSize_;
   std::unique_ptr<uint8_t[]> tBuf_;
 
+  // Preset dictionaries for the ZLIB transform
+  std::shared_ptr<const TZlibDictionarySet> dictionaries_;
+  uint32_t peerDictId_;
+  bool peerDictKnown_;
+
+  /**
+   * Returns the dictionary to compress the next frame with, if any.
+   */
+  std::shared_ptr<const TZlibDictionary> getWriteDictionary() const;
+
+  int zstdLevel_;
+  uint32_t minCompressBytes_;
+  bool mirrorTransforms_;
+  bool haveReadFrame_;
+  int clientTimeout_;
+
+  // Codec state reused across frames
+  ZSTD_CCtx_s* zstdCCtx_;
+  ZSTD_DCtx_s* zstdDCtx_;
+
+  /**
+   * Returns the transforms to apply to a frame with a payload of sz bytes.
+   */
+  const std::vector<uint16_t>& getFrameTransforms(uint32_t sz) const;
+
+  /**
+   * Grows the transform buffer to hold at least sz bytes.
+   */
+  void ensureTransformBuffer(uint32_t sz);
+
+  /**
+   * Throws if a frame would inflate to more than the configured maximum
+   * message size.
+   */
+  void checkUntransformedSize(uint64_t sz);
+
   void readString(uint8_t*& ptr, /* out */ std::string& str, uint8_t const* headerBoundary);
 
   void writeString(uint8_t*& ptr, const std::string& str);
@@ -265,8 +434,20 @@ public:
    * Wraps the transport into a header one.
    */
   std::shared_ptr<TTransport> getTransport(std::shared_ptr<TTransport> trans) override {
-    return std::shared_ptr<TTransport>(new THeaderTransport(trans));
+    std::shared_ptr<THeaderTransport> headerTrans(new THeaderTransport(trans));
+    headerTrans->setDictionaries(dictionaries_);
+    return headerTrans;
+  }
+
+  /**
+   * Preset dictionaries for the transports created from now on.
+   */
+  void setDictionaries(std::shared_ptr<const TZlibDictionarySet> dictionaries) {
+    dictionaries_ = dictionaries;
   }
+
+private:
+  std::shared_ptr<const TZlibDictionarySet> dictionaries_;
 };
 }
 }
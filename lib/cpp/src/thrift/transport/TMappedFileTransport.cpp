@@ -0,0 +1,323 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <thrift/transport/TMappedFileTransport.h>
+#include <thrift/transport/PlatformSocket.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+TMappedFileTransport::TMappedFileTransport(const std::string& path,
+                                           std::shared_ptr<TConfiguration> config)
+  : TTransport(config),
+    filename_(path),
+    fd_(-1),
+    data_(nullptr),
+    size_(0),
+    offset_(0),
+    event_(nullptr),
+    eventRemaining_(0),
+    readTimeout_(TFileTransport::NO_TAIL_READ_TIMEOUT),
+    eofSleepTime_(500 * 1000),
+    chunkSize_(16 * 1024 * 1024),
+    maxEventSize_(0) {
+  fd_ = ::open(filename_.c_str(), O_RDONLY);
+  if (fd_ == -1) {
+    int errno_copy = THRIFT_ERRNO;
+    GlobalOutput.perror("TMappedFileTransport: open() file: " + filename_, errno_copy);
+    throw TTransportException(TTransportException::NOT_OPEN, filename_, errno_copy);
+  }
+  try {
+    map();
+  } catch (...) {
+    ::close(fd_);
+    throw;
+  }
+}
+
+TMappedFileTransport::~TMappedFileTransport() {
+  unmap();
+  ::close(fd_);
+}
+
+bool TMappedFileTransport::map() {
+  struct stat st;
+  if (::fstat(fd_, &st) == -1) {
+    int errno_copy = THRIFT_ERRNO;
+    throw TTransportException(TTransportException::UNKNOWN,
+                              "TMappedFileTransport: fstat()",
+                              errno_copy);
+  }
+  auto size = static_cast<uint64_t>(st.st_size);
+  if (size <= size_) {
+    return false;
+  }
+
+  void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    int errno_copy = THRIFT_ERRNO;
+    throw TTransportException(TTransportException::UNKNOWN,
+                              "TMappedFileTransport: mmap()",
+                              errno_copy);
+  }
+#ifdef MADV_SEQUENTIAL
+  ::madvise(data, size, MADV_SEQUENTIAL);
+#endif
+
+  // keep the position of a partly read event
+  if (event_) {
+    event_ = static_cast<const uint8_t*>(data) + (event_ - data_);
+  }
+  unmap();
+  data_ = static_cast<const uint8_t*>(data);
+  size_ = size;
+  return true;
+}
+
+void TMappedFileTransport::unmap() {
+  if (data_) {
+    ::munmap(const_cast<uint8_t*>(data_), size_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+}
+
+bool TMappedFileTransport::findEvent(uint64_t* pos,
+                                     uint64_t end,
+                                     const uint8_t** event,
+                                     uint32_t* size) const {
+  while (*pos + 4 <= end) {
+    uint64_t chunk = *pos / chunkSize_;
+    uint64_t nextChunk = (chunk + 1) * chunkSize_;
+
+    // event sizes never cross a chunk boundary, the bytes before it are padding
+    if ((*pos + 3) / chunkSize_ != chunk) {
+      *pos = nextChunk;
+      continue;
+    }
+
+    uint32_t eventSize;
+    memcpy(&eventSize, data_ + *pos, 4);
+    if (eventSize == 0) {
+      // padding
+      *pos += 4;
+      continue;
+    }
+
+    if ((maxEventSize_ > 0 && eventSize > maxEventSize_) || *pos + 4 + eventSize > nextChunk) {
+      T_ERROR("TMappedFileTransport: corrupt event of size %u at offset %lu, skipping chunk %lu",
+              eventSize,
+              static_cast<unsigned long>(*pos),
+              static_cast<unsigned long>(chunk));
+      *pos = nextChunk;
+      continue;
+    }
+
+    if (*pos + 4 + eventSize > end) {
+      // not written completely yet
+      return false;
+    }
+
+    *event = data_ + *pos + 4;
+    *size = eventSize;
+    *pos += 4 + eventSize;
+    return true;
+  }
+  return false;
+}
+
+bool TMappedFileTransport::nextEvent() {
+  int readTries = 0;
+  while (!findEvent(&offset_, size_, &event_, &eventRemaining_)) {
+    if (readTimeout_ == TFileTransport::NO_TAIL_READ_TIMEOUT) {
+      return false;
+    }
+    if (map()) {
+      continue;
+    }
+    if (readTimeout_ == TFileTransport::TAIL_READ_TIMEOUT) {
+      THRIFT_SLEEP_USEC(eofSleepTime_);
+    } else if (readTries++ > 0) {
+      return false;
+    } else {
+      THRIFT_SLEEP_USEC(readTimeout_ * 1000);
+    }
+  }
+  return true;
+}
+
+bool TMappedFileTransport::peek() {
+  return eventRemaining_ > 0 || nextEvent();
+}
+
+uint32_t TMappedFileTransport::read(uint8_t* buf, uint32_t len) {
+  checkReadBytesAvailable(len);
+  if (eventRemaining_ == 0 && !nextEvent()) {
+    return 0;
+  }
+
+  uint32_t n = (std::min)(len, eventRemaining_);
+  memcpy(buf, event_, n);
+  event_ += n;
+  eventRemaining_ -= n;
+  return n;
+}
+
+uint32_t TMappedFileTransport::readAll(uint8_t* buf, uint32_t len) {
+  uint32_t have = 0;
+  while (have < len) {
+    uint32_t get = read(buf + have, len - have);
+    if (get == 0) {
+      throw TEOFException();
+    }
+    have += get;
+  }
+  return have;
+}
+
+bool TMappedFileTransport::readEvent(const uint8_t** event, uint32_t* size) {
+  if (eventRemaining_ == 0 && !nextEvent()) {
+    return false;
+  }
+  *event = event_;
+  *size = eventRemaining_;
+  event_ += eventRemaining_;
+  eventRemaining_ = 0;
+  return true;
+}
+
+const uint8_t* TMappedFileTransport::borrow_virt(uint8_t* buf, uint32_t* len) {
+  (void)buf;
+  if (eventRemaining_ == 0 && !nextEvent()) {
+    return nullptr;
+  }
+  if (*len > eventRemaining_) {
+    return nullptr;
+  }
+  *len = eventRemaining_;
+  return event_;
+}
+
+void TMappedFileTransport::consume_virt(uint32_t len) {
+  if (len > eventRemaining_) {
+    throw TTransportException(TTransportException::BAD_ARGS, "consume did not follow a borrow.");
+  }
+  event_ += len;
+  eventRemaining_ -= len;
+}
+
+void TMappedFileTransport::forEachEvent(
+    uint32_t chunk,
+    const std::function<void(const uint8_t* event, uint32_t size)>& f) const {
+  uint64_t pos = static_cast<uint64_t>(chunk) * chunkSize_;
+  uint64_t end = (std::min)(pos + chunkSize_, size_);
+  const uint8_t* event;
+  uint32_t size;
+  while (findEvent(&pos, end, &event, &size)) {
+    f(event, size);
+  }
+}
+
+uint32_t TMappedFileTransport::getNumChunks() {
+  if (size_ == 0) {
+    return 0;
+  }
+  return static_cast<uint32_t>(size_ / chunkSize_ + 1);
+}
+
+uint32_t TMappedFileTransport::getCurChunk() {
+  return static_cast<uint32_t>(offset_ / chunkSize_);
+}
+
+void TMappedFileTransport::seekToChunk(int32_t chunk) {
+  map();
+  auto numChunks = static_cast<int32_t>(getNumChunks());
+
+  // negative indicates reverse seek (from the end)
+  if (chunk < 0) {
+    chunk = (std::max)(chunk + numChunks, 0);
+  }
+
+  event_ = nullptr;
+  eventRemaining_ = 0;
+  if (chunk >= numChunks) {
+    // skip to the end of the last complete event
+    offset_ = numChunks > 0 ? static_cast<uint64_t>(numChunks - 1) * chunkSize_ : 0;
+    const uint8_t* event;
+    uint32_t size;
+    while (findEvent(&offset_, size_, &event, &size)) {
+    }
+  } else {
+    offset_ = static_cast<uint64_t>(chunk) * chunkSize_;
+  }
+}
+
+void TMappedFileTransport::seekToEnd() {
+  seekToChunk(static_cast<int32_t>(getNumChunks()));
+}
+
+void TMappedFileTransport::seekToEvent(uint64_t event) {
+  TFileTransportIndex::Entry entry;
+  if (!TFileTransportIndex::find(filename_,
+                                 [event](const TFileTransportIndex::Entry& e) {
+                                   return e.event <= event;
+                                 },
+                                 &entry)) {
+    entry.event = 0;
+    entry.offset = 0;
+  }
+  map();
+  offset_ = entry.offset;
+  event_ = nullptr;
+  eventRemaining_ = 0;
+
+  const uint8_t* skipped;
+  uint32_t size;
+  for (uint64_t n = entry.event; n < event && findEvent(&offset_, size_, &skipped, &size); ++n) {
+  }
+}
+
+void TMappedFileTransport::seekToTime(int64_t timestamp) {
+  TFileTransportIndex::Entry entry;
+  if (!TFileTransportIndex::find(filename_,
+                                 [timestamp](const TFileTransportIndex::Entry& e) {
+                                   return e.timestamp <= timestamp;
+                                 },
+                                 &entry)) {
+    entry.offset = 0;
+  }
+  map();
+  offset_ = entry.offset;
+  event_ = nullptr;
+  eventRemaining_ = 0;
+}
+}
+}
+} // apache::thrift::transport
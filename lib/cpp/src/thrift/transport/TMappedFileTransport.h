@@ -0,0 +1,157 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TMAPPEDFILETRANSPORT_H_
+#define _THRIFT_TRANSPORT_TMAPPEDFILETRANSPORT_H_ 1
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <thrift/transport/TFileTransport.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * Reads a log written by TFileTransport through a read-only memory map of
+ * the file. Events are handed out as pointers into the mapping, so nothing
+ * is copied: readEvent() returns whole events, and borrow() lets protocols
+ * deserialize straight from the mapping. read() behaves like
+ * TFileTransport::read(), it never returns more than the rest of the
+ * current event.
+ *
+ * A corrupted event skips the rest of its chunk. TFileTransport retries the
+ * chunk first, which only helps with read errors.
+ *
+ * When tailing (see setReadTimeout()) the file is mapped again once it has
+ * grown, which invalidates the pointers handed out so far.
+ *
+ * Only available on POSIX systems.
+ */
+class TMappedFileTransport : public TFileReaderTransport {
+public:
+  TMappedFileTransport(const std::string& path,
+                       std::shared_ptr<TConfiguration> config = nullptr);
+  ~TMappedFileTransport() override;
+
+  bool isOpen() const override { return true; }
+
+  bool peek() override;
+
+  uint32_t read(uint8_t* buf, uint32_t len);
+
+  /**
+   * Throws TEOFException at the end of the log, like TFileTransport.
+   */
+  uint32_t readAll(uint8_t* buf, uint32_t len);
+
+  /**
+   * Returns the rest of the current event, or the next event if the current
+   * one has been read. The data stays valid until the file is mapped again.
+   *
+   * @return false at the end of the log
+   */
+  bool readEvent(const uint8_t** event, uint32_t* size);
+
+  /**
+   * Calls f for every complete event in a chunk. Does not change the read
+   * position, and may be called from several threads at once as long as
+   * nothing reads the transport sequentially at the same time.
+   */
+  void forEachEvent(uint32_t chunk,
+                    const std::function<void(const uint8_t* event, uint32_t size)>& f) const;
+
+  int32_t getReadTimeout() override { return readTimeout_; }
+  void setReadTimeout(int32_t readTimeout) override { readTimeout_ = readTimeout; }
+
+  uint32_t getEofSleepTimeUs() { return eofSleepTime_; }
+  void setEofSleepTimeUs(uint32_t eofSleepTime) {
+    if (eofSleepTime) {
+      eofSleepTime_ = eofSleepTime;
+    }
+  }
+
+  /**
+   * Has to match the chunk size the log was written with.
+   */
+  uint32_t getChunkSize() { return chunkSize_; }
+  void setChunkSize(uint32_t chunkSize) {
+    if (chunkSize) {
+      chunkSize_ = chunkSize;
+    }
+  }
+
+  uint32_t getMaxEventSize() { return maxEventSize_; }
+  void setMaxEventSize(uint32_t maxEventSize) { maxEventSize_ = maxEventSize; }
+
+  uint32_t getNumChunks() override;
+  uint32_t getCurChunk() override;
+  void seekToChunk(int32_t chunk) override;
+  void seekToEnd() override;
+
+  /**
+   * Same as TFileTransport::seekToEvent() and TFileTransport::seekToTime().
+   */
+  void seekToEvent(uint64_t event);
+  void seekToTime(int64_t timestamp);
+
+  /*
+   * Override TTransport *_virt() functions to invoke our implementations.
+   * We cannot use TVirtualTransport to provide these, since we need to inherit
+   * virtually from TTransport.
+   */
+  uint32_t read_virt(uint8_t* buf, uint32_t len) override { return this->read(buf, len); }
+  uint32_t readAll_virt(uint8_t* buf, uint32_t len) override { return this->readAll(buf, len); }
+  const uint8_t* borrow_virt(uint8_t* buf, uint32_t* len) override;
+  void consume_virt(uint32_t len) override;
+
+private:
+  // maps the file, or maps it again if it has grown
+  bool map();
+  void unmap();
+
+  // finds the next complete event in [*pos, end)
+  bool findEvent(uint64_t* pos, uint64_t end, const uint8_t** event, uint32_t* size) const;
+  // finds the next event at the read position, waiting according to readTimeout_
+  bool nextEvent();
+
+  std::string filename_;
+  int fd_;
+
+  const uint8_t* data_;
+  uint64_t size_;
+
+  // offset of the next event header
+  uint64_t offset_;
+  // the unread part of the current event
+  const uint8_t* event_;
+  uint32_t eventRemaining_;
+
+  int32_t readTimeout_;
+  uint32_t eofSleepTime_;
+  uint32_t chunkSize_;
+  uint32_t maxEventSize_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // _THRIFT_TRANSPORT_TMAPPEDFILETRANSPORT_H_
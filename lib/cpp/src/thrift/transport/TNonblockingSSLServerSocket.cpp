@@ -53,6 +53,15 @@ std::shared_ptr<TSocket> TNonblockingSSLServerSocket::createSocket(THRIFT_SOCKET
   tSSLSocket->setLibeventSafe();
   return tSSLSocket;
 }
+
+TNonblockingServerTransport::HandshakeStatus TNonblockingSSLServerSocket::handshake(
+    std::shared_ptr<TSocket> socket) {
+  std::shared_ptr<TSSLSocket> tSSLSocket = std::static_pointer_cast<TSSLSocket>(socket);
+  if (tSSLSocket->advanceHandshake()) {
+    return HANDSHAKE_DONE;
+  }
+  return tSSLSocket->handshakeWantsWrite() ? HANDSHAKE_WANT_WRITE : HANDSHAKE_WANT_READ;
+}
 }
 }
 }
@@ -65,6 +65,11 @@ public:
                    int recvTimeout,
                    std::shared_ptr<TSSLSocketFactory> factory);
 
+  /**
+   * Runs the SSL handshake of an accepted socket until it would block.
+   */
+  HandshakeStatus handshake(std::shared_ptr<TSocket> socket) override;
+
 protected:
   std::shared_ptr<TSocket> createSocket(THRIFT_SOCKET socket) override;
   std::shared_ptr<TSSLSocketFactory> factory_;
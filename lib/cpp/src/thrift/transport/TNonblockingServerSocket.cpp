@@ -49,6 +49,9 @@
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/transport/TNonblockingServerSocket.h>
@@ -97,7 +100,10 @@ TNonblockingServerSocket::TNonblockingServerSocket(int port)
     tcpSendBuffer_(0),
     tcpRecvBuffer_(0),
     keepAlive_(false),
-    listening_(false) {
+    listening_(false),
+    reusePort_(false),
+    reusePortSteering_(false),
+    numListenSockets_(1) {
 }
 
 TNonblockingServerSocket::TNonblockingServerSocket(int port, int sendTimeout, int recvTimeout)
@@ -112,7 +118,10 @@ TNonblockingServerSocket::TNonblockingServerSocket(int port, int sendTimeout, in
     tcpSendBuffer_(0),
     tcpRecvBuffer_(0),
     keepAlive_(false),
-    listening_(false) {
+    listening_(false),
+    reusePort_(false),
+    reusePortSteering_(false),
+    numListenSockets_(1) {
 }
 
 TNonblockingServerSocket::TNonblockingServerSocket(const string& address, int port)
@@ -128,7 +137,10 @@ TNonblockingServerSocket::TNonblockingServerSocket(const string& address, int po
     tcpSendBuffer_(0),
     tcpRecvBuffer_(0),
     keepAlive_(false),
-    listening_(false) {
+    listening_(false),
+    reusePort_(false),
+    reusePortSteering_(false),
+    numListenSockets_(1) {
 }
 
 TNonblockingServerSocket::TNonblockingServerSocket(const string& path)
@@ -144,7 +156,10 @@ TNonblockingServerSocket::TNonblockingServerSocket(const string& path)
     tcpSendBuffer_(0),
     tcpRecvBuffer_(0),
     keepAlive_(false),
-    listening_(false) {
+    listening_(false),
+    reusePort_(false),
+    reusePortSteering_(false),
+    numListenSockets_(1) {
 }
 
 TNonblockingServerSocket::~TNonblockingServerSocket() {
@@ -208,14 +223,14 @@ void TNonblockingServerSocket::setTcpRecvBuffer(int tcpRecvBuffer) {
   tcpRecvBuffer_ = tcpRecvBuffer;
 }
 
-void TNonblockingServerSocket::_setup_sockopts() {
+void TNonblockingServerSocket::_setup_sockopts(THRIFT_SOCKET s) {
   int one = 1;
   if (!isUnixDomainSocket()) {
     // Set THRIFT_NO_SOCKET_CACHING to prevent 2MSL delay on accept.
     // This does not work with Domain sockets on most platforms. And
     // on Windows it completely breaks the socket. Therefore do not
     // use this on Domain sockets.
-    if (-1 == setsockopt(serverSocket_,
+    if (-1 == setsockopt(s,
                          SOL_SOCKET,
                          THRIFT_NO_SOCKET_CACHING,
                          cast_sockopt(&one),
@@ -233,9 +248,22 @@ void TNonblockingServerSocket::_setup_sockopts() {
     }
   }
 
+#ifdef SO_REUSEPORT
+  if (reusePort_ && !isUnixDomainSocket()) {
+    if (-1 == setsockopt(s, SOL_SOCKET, SO_REUSEPORT, cast_sockopt(&one), sizeof(one))) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      GlobalOutput.perror("TNonblockingServerSocket::listen() setsockopt() SO_REUSEPORT ", errno_copy);
+      close();
+      throw TTransportException(TTransportException::NOT_OPEN,
+                                "Could not set SO_REUSEPORT",
+                                errno_copy);
+    }
+  }
+#endif
+
   // Set TCP buffer sizes
   if (tcpSendBuffer_ > 0) {
-    if (-1 == setsockopt(serverSocket_,
+    if (-1 == setsockopt(s,
                          SOL_SOCKET,
                          SO_SNDBUF,
                          cast_sockopt(&tcpSendBuffer_),
@@ -250,7 +278,7 @@ void TNonblockingServerSocket::_setup_sockopts() {
   }
 
   if (tcpRecvBuffer_ > 0) {
-    if (-1 == setsockopt(serverSocket_,
+    if (-1 == setsockopt(s,
                          SOL_SOCKET,
                          SO_RCVBUF,
                          cast_sockopt(&tcpRecvBuffer_),
@@ -266,7 +294,7 @@ void TNonblockingServerSocket::_setup_sockopts() {
 
   // Turn linger off, don't want to block on calls to close
   struct linger ling = {0, 0};
-  if (-1 == setsockopt(serverSocket_, SOL_SOCKET, SO_LINGER, cast_sockopt(&ling), sizeof(ling))) {
+  if (-1 == setsockopt(s, SOL_SOCKET, SO_LINGER, cast_sockopt(&ling), sizeof(ling))) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
     GlobalOutput.perror("TNonblockingServerSocket::listen() setsockopt() SO_LINGER ", errno_copy);
     close();
@@ -274,7 +302,7 @@ void TNonblockingServerSocket::_setup_sockopts() {
   }
 
   // Keepalive to ensure full result flushing
-  if (-1 == setsockopt(serverSocket_, SOL_SOCKET, SO_KEEPALIVE, const_cast_sockopt(&one), sizeof(one))) {
+  if (-1 == setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, const_cast_sockopt(&one), sizeof(one))) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
     GlobalOutput.perror("TNonblockingServerSocket::listen() setsockopt() SO_KEEPALIVE ", errno_copy);
     close();
@@ -284,7 +312,7 @@ void TNonblockingServerSocket::_setup_sockopts() {
   }
 
 #ifdef SO_NOSIGPIPE
-  if (-1 == setsockopt(serverSocket_, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one))) {
+  if (-1 == setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one))) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
     GlobalOutput.perror("TNonblockingServerSocket::listen() setsockopt() SO_NOSIGPIPE", errno_copy);
     close();
@@ -295,7 +323,7 @@ void TNonblockingServerSocket::_setup_sockopts() {
 #endif
 
   // Set NONBLOCK on the accept socket
-  int flags = THRIFT_FCNTL(serverSocket_, THRIFT_F_GETFL, 0);
+  int flags = THRIFT_FCNTL(s, THRIFT_F_GETFL, 0);
   if (flags == -1) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
     GlobalOutput.perror("TNonblockingServerSocket::listen() THRIFT_FCNTL() THRIFT_F_GETFL ", errno_copy);
@@ -305,7 +333,7 @@ void TNonblockingServerSocket::_setup_sockopts() {
                               errno_copy);
   }
 
-  if (-1 == THRIFT_FCNTL(serverSocket_, THRIFT_F_SETFL, flags | THRIFT_O_NONBLOCK)) {
+  if (-1 == THRIFT_FCNTL(s, THRIFT_F_SETFL, flags | THRIFT_O_NONBLOCK)) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
     GlobalOutput.perror("TNonblockingServerSocket::listen() THRIFT_FCNTL() THRIFT_O_NONBLOCK ", errno_copy);
     close();
@@ -315,10 +343,11 @@ void TNonblockingServerSocket::_setup_sockopts() {
   }
 }
 
-void TNonblockingServerSocket::_setup_unixdomain_sockopts() {
+void TNonblockingServerSocket::_setup_unixdomain_sockopts(THRIFT_SOCKET s) {
+  (void)s;
 }
 
-void TNonblockingServerSocket::_setup_tcp_sockopts() {
+void TNonblockingServerSocket::_setup_tcp_sockopts(THRIFT_SOCKET s) {
   int one = 1;
 
   // Set TCP nodelay if available, MAC OS X Hack
@@ -326,7 +355,7 @@ void TNonblockingServerSocket::_setup_tcp_sockopts() {
 #ifndef TCP_NOPUSH
   // TCP Nodelay, speed over bandwidth
   if (-1
-      == setsockopt(serverSocket_, IPPROTO_TCP, TCP_NODELAY, cast_sockopt(&one), sizeof(one))) {
+      == setsockopt(s, IPPROTO_TCP, TCP_NODELAY, cast_sockopt(&one), sizeof(one))) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
     GlobalOutput.perror("TNonblockingServerSocket::listen() setsockopt() TCP_NODELAY ", errno_copy);
     close();
@@ -399,8 +428,8 @@ void TNonblockingServerSocket::listen() {
                                 errno_copy);
     }
 
-    _setup_sockopts();
-    _setup_unixdomain_sockopts();
+    _setup_sockopts(serverSocket_);
+    _setup_unixdomain_sockopts(serverSocket_);
 
     // Windows supports Unix domain sockets since it ships the header
     // HAVE_AF_UNIX_H (see https://devblogs.microsoft.com/commandline/af_unix-comes-to-windows/)
@@ -441,8 +470,8 @@ void TNonblockingServerSocket::listen() {
         continue;
       }
 
-      _setup_sockopts();
-      _setup_tcp_sockopts();
+      _setup_sockopts(serverSocket_);
+      _setup_tcp_sockopts(serverSocket_);
 
 #ifdef IPV6_V6ONLY
       if (trybind->ai_family == AF_INET6) {
@@ -514,21 +543,99 @@ void TNonblockingServerSocket::listen() {
                               errno_copy);
   }
 
-  if (listenCallback_)
-    listenCallback_(serverSocket_);
+#ifdef SO_REUSEPORT
+  if (reusePort_ && !isUnixDomainSocket() && numListenSockets_ > 1) {
+    _open_reuseport_sockets();
+  }
+#endif
 
-  // Call listen
-  if (-1 == ::listen(serverSocket_, acceptBacklog_)) {
-    errno_copy = THRIFT_GET_SOCKET_ERROR;
-    GlobalOutput.perror("TNonblockingServerSocket::listen() listen() ", errno_copy);
-    close();
-    throw TTransportException(TTransportException::NOT_OPEN, "Could not listen", errno_copy);
+  for (size_t i = 0; i < getNumListenSockets(); ++i) {
+    THRIFT_SOCKET s = getListenSocketFD(i);
+
+    if (listenCallback_)
+      listenCallback_(s);
+
+    // Call listen
+    if (-1 == ::listen(s, acceptBacklog_)) {
+      errno_copy = THRIFT_GET_SOCKET_ERROR;
+      GlobalOutput.perror("TNonblockingServerSocket::listen() listen() ", errno_copy);
+      close();
+      throw TTransportException(TTransportException::NOT_OPEN, "Could not listen", errno_copy);
+    }
   }
 
   // The socket is now listening!
   listening_ = true;
 }
 
+void TNonblockingServerSocket::_open_reuseport_sockets() {
+  // The other sockets bind to the very address the first one got
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  std::memset(&sa, 0, len);
+  if (::getsockname(serverSocket_, reinterpret_cast<struct sockaddr*>(&sa), &len) < 0) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    GlobalOutput.perror("TNonblockingServerSocket::listen() getsockname() ", errno_copy);
+    close();
+    throw TTransportException(TTransportException::NOT_OPEN, "Could not bind", errno_copy);
+  }
+
+  while (getNumListenSockets() < numListenSockets_) {
+    THRIFT_SOCKET s = socket(sa.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == THRIFT_INVALID_SOCKET) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      GlobalOutput.perror("TNonblockingServerSocket::listen() socket() ", errno_copy);
+      close();
+      throw TTransportException(TTransportException::NOT_OPEN,
+                                "Could not create server socket.",
+                                errno_copy);
+    }
+    reusePortSockets_.push_back(s);
+
+    _setup_sockopts(s);
+    _setup_tcp_sockopts(s);
+
+#ifdef IPV6_V6ONLY
+    if (sa.ss_family == AF_INET6) {
+      int zero = 0;
+      if (-1 == setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, cast_sockopt(&zero), sizeof(zero))) {
+        GlobalOutput.perror("TNonblockingServerSocket::listen() IPV6_V6ONLY ", THRIFT_GET_SOCKET_ERROR);
+      }
+    }
+#endif // #ifdef IPV6_V6ONLY
+
+    if (0 != ::bind(s, reinterpret_cast<struct sockaddr*>(&sa), len)) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      GlobalOutput.perror("TNonblockingServerSocket::listen() bind() SO_REUSEPORT ", errno_copy);
+      close();
+      throw TTransportException(TTransportException::NOT_OPEN, "Could not bind", errno_copy);
+    }
+  }
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  if (reusePortSteering_) {
+    // A = receiving CPU; return A % #sockets as the index into the group,
+    // which is ordered by bind()
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(numListenSockets_)},
+        {BPF_RET | BPF_A, 0, 0, 0}};
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (-1 == setsockopt(serverSocket_,
+                         SOL_SOCKET,
+                         SO_ATTACH_REUSEPORT_CBPF,
+                         cast_sockopt(&prog),
+                         sizeof(prog))) {
+      // not fatal, the kernel keeps hashing connections over the sockets
+      GlobalOutput.perror("TNonblockingServerSocket::listen() setsockopt() SO_ATTACH_REUSEPORT_CBPF ",
+                          THRIFT_GET_SOCKET_ERROR);
+    }
+  }
+#endif
+}
+
 int TNonblockingServerSocket::getPort() {
   return port_;
 }
@@ -546,7 +653,11 @@ bool TNonblockingServerSocket::isUnixDomainSocket() const {
 }
 
 shared_ptr<TSocket> TNonblockingServerSocket::acceptImpl() {
-  if (serverSocket_ == THRIFT_INVALID_SOCKET) {
+  return acceptListenerImpl(0);
+}
+
+shared_ptr<TSocket> TNonblockingServerSocket::acceptListenerImpl(size_t index) {
+  if (serverSocket_ == THRIFT_INVALID_SOCKET || index >= getNumListenSockets()) {
     throw TTransportException(TTransportException::NOT_OPEN,
                               "TNonblockingServerSocket not listening");
   }
@@ -554,7 +665,7 @@ shared_ptr<TSocket> TNonblockingServerSocket::acceptImpl() {
   struct sockaddr_storage clientAddress;
   int size = sizeof(clientAddress);
   THRIFT_SOCKET clientSocket
-      = ::accept(serverSocket_, (struct sockaddr*)&clientAddress, (socklen_t*)&size);
+      = ::accept(getListenSocketFD(index), (struct sockaddr*)&clientAddress, (socklen_t*)&size);
 
   if (clientSocket == THRIFT_INVALID_SOCKET) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
@@ -613,6 +724,11 @@ void TNonblockingServerSocket::close() {
     ::THRIFT_CLOSESOCKET(serverSocket_);
   }
   serverSocket_ = THRIFT_INVALID_SOCKET;
+  for (auto s : reusePortSockets_) {
+    shutdown(s, THRIFT_SHUT_RDWR);
+    ::THRIFT_CLOSESOCKET(s);
+  }
+  reusePortSockets_.clear();
   listening_ = false;
 }
 } // namespace transport
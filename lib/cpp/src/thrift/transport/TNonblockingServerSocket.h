@@ -23,6 +23,8 @@
 #include <thrift/transport/TNonblockingServerTransport.h>
 #include <thrift/transport/PlatformSocket.h>
 
+#include <vector>
+
 namespace apache {
 namespace thrift {
 namespace transport {
@@ -88,6 +90,32 @@ public:
   void setTcpSendBuffer(int tcpSendBuffer);
   void setTcpRecvBuffer(int tcpRecvBuffer);
 
+  /**
+   * Listen on one SO_REUSEPORT socket per IO thread of the server instead
+   * of a single socket. The kernel then spreads new connections over the
+   * sockets, so every IO thread accepts and serves its own connections.
+   * Ignored for unix domain sockets and where SO_REUSEPORT is unavailable.
+   */
+  void setReusePort(bool reusePort) { reusePort_ = reusePort; }
+
+  /**
+   * With setReusePort(), attach a BPF program that hands each connection to
+   * socket (receiving CPU % number of sockets) rather than to one picked by
+   * hashing its address. Pinning IO thread n and the NIC queue interrupts
+   * to CPU n then keeps a connection on one CPU. Linux only.
+   */
+  void setReusePortSteering(bool steering) { reusePortSteering_ = steering; }
+
+  void setNumListenSockets(size_t numListenSockets) override {
+    numListenSockets_ = numListenSockets;
+  }
+
+  size_t getNumListenSockets() const override { return 1 + reusePortSockets_.size(); }
+
+  THRIFT_SOCKET getListenSocketFD(size_t index) override {
+    return index == 0 ? serverSocket_ : reusePortSockets_[index - 1];
+  }
+
   // listenCallback gets called just before listen, and after all Thrift
   // setsockopt calls have been made.  If you have custom setsockopt
   // things that need to happen on the listening socket, this is the place to do it.
@@ -114,12 +142,14 @@ public:
 
 protected:
   std::shared_ptr<TSocket> acceptImpl() override;
+  std::shared_ptr<TSocket> acceptListenerImpl(size_t index) override;
   virtual std::shared_ptr<TSocket> createSocket(THRIFT_SOCKET client);
 
 private:
-  void _setup_sockopts();
-  void _setup_unixdomain_sockopts();
-  void _setup_tcp_sockopts();
+  void _setup_sockopts(THRIFT_SOCKET s);
+  void _setup_unixdomain_sockopts(THRIFT_SOCKET s);
+  void _setup_tcp_sockopts(THRIFT_SOCKET s);
+  void _open_reuseport_sockets();
 
   int port_;
   int listenPort_;
@@ -135,6 +165,12 @@ private:
   int tcpRecvBuffer_;
   bool keepAlive_;
   bool listening_;
+  bool reusePort_;
+  bool reusePortSteering_;
+  size_t numListenSockets_;
+
+  /// Listening sockets besides serverSocket_ with setReusePort()
+  std::vector<THRIFT_SOCKET> reusePortSockets_;
 
   socket_func_t listenCallback_;
   socket_func_t acceptCallback_;
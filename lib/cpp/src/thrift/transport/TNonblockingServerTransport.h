@@ -35,6 +35,9 @@ namespace transport {
  */
 class TNonblockingServerTransport {
 public:
+  /// Progress of the handshake of an accepted socket, see handshake()
+  enum HandshakeStatus { HANDSHAKE_DONE, HANDSHAKE_WANT_READ, HANDSHAKE_WANT_WRITE };
+
   virtual ~TNonblockingServerTransport() = default;
 
   /**
@@ -63,6 +66,60 @@ public:
     return result;
   }
 
+  /**
+   * Like accept(), but takes the connection from one of several listening
+   * sockets (see setNumListenSockets()).
+   *
+   * @param index listening socket to accept from, < getNumListenSockets()
+   * @return A new TTransport object
+   * @throws TTransportException if there is an error
+   */
+  std::shared_ptr<TSocket> accept(size_t index) {
+    std::shared_ptr<TSocket> result = acceptListenerImpl(index);
+    if (!result) {
+      throw TTransportException("accept() may not return nullptr");
+    }
+    return result;
+  }
+
+  /**
+   * Sets how many listening sockets the server would like, one per IO
+   * thread. Must be called before listen(). Transports that can have the
+   * kernel spread connections over several sockets (see
+   * TNonblockingServerSocket::setReusePort()) open that many, all others
+   * keep listening on a single socket.
+   */
+  virtual void setNumListenSockets(size_t numListenSockets) { (void)numListenSockets; }
+
+  /**
+   * @return number of sockets listen() opened.
+   */
+  virtual size_t getNumListenSockets() const { return 1; }
+
+  /**
+   * @param index listening socket, < getNumListenSockets()
+   * @return its file descriptor, the first one is getSocketFD()
+   */
+  virtual THRIFT_SOCKET getListenSocketFD(size_t index) {
+    (void)index;
+    return getSocketFD();
+  }
+
+  /**
+   * Advances the handshake (e.g. TLS) of a socket returned by accept()
+   * without blocking. Servers call it again whenever the socket becomes ready
+   * for the wanted event, until it returns HANDSHAKE_DONE. Plain sockets have
+   * nothing to negotiate.
+   *
+   * @param socket a socket returned by accept()
+   * @return HANDSHAKE_DONE once the connection is established
+   * @throw TTransportException if the handshake failed
+   */
+  virtual HandshakeStatus handshake(std::shared_ptr<TSocket> socket) {
+    (void)socket;
+    return HANDSHAKE_DONE;
+  }
+
   /**
   * Utility method
   * 
@@ -92,6 +149,15 @@ protected:
    */
   virtual std::shared_ptr<TSocket> acceptImpl() = 0;
 
+  /**
+   * Subclasses with several listening sockets implement this function for
+   * accept(index).
+   */
+  virtual std::shared_ptr<TSocket> acceptListenerImpl(size_t index) {
+    (void)index;
+    return acceptImpl();
+  }
+
 };
 }
 }
@@ -19,6 +19,7 @@
 
 #include <thrift/thrift-config.h>
 
+#include <algorithm>
 #include <cstring>
 #include <errno.h>
 #include <memory>
@@ -39,6 +40,9 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #define OPENSSL_VERSION_NO_THREAD_ID_BEFORE    0x10000000L
 #define OPENSSL_ENGINE_CLEANUP_REQUIRED_BEFORE 0x10100000L
@@ -49,9 +53,15 @@
 #include <openssl/engine.h>
 #endif
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #include <thrift/concurrency/Mutex.h>
 #include <thrift/transport/TSSLSocket.h>
 #include <thrift/transport/PlatformSocket.h>
@@ -173,6 +183,83 @@ static void buildErrors(string& message, int errno_copy = 0, int sslerrno = 0);
 static bool matchName(const char* host, const char* pattern, int size);
 static char uppercase(char c);
 
+static void upRef(SSL_SESSION* session) {
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+  SSL_SESSION_up_ref(session);
+#else
+  CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+}
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+typedef EVP_MAC_CTX TicketMac;
+
+static bool initTicketMac(TicketMac* mac, unsigned char* key, size_t size) {
+  char digest[] = "SHA256";
+  OSSL_PARAM params[] = {OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, size),
+                         OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+                         OSSL_PARAM_construct_end()};
+  return EVP_MAC_CTX_set_params(mac, params) == 1;
+}
+#else
+typedef HMAC_CTX TicketMac;
+
+static bool initTicketMac(TicketMac* mac, unsigned char* key, size_t size) {
+  return HMAC_Init_ex(mac, key, static_cast<int>(size), EVP_sha256(), nullptr) == 1;
+}
+#endif
+
+/**
+ * Encrypts new session tickets with the current key of the context's
+ * TSSLSessionTicketKeys, and finds the key to decrypt received ones with.
+ */
+static int ticketKeyCallback(SSL* ssl,
+                             unsigned char* name,
+                             unsigned char* iv,
+                             EVP_CIPHER_CTX* cipher,
+                             TicketMac* mac,
+                             int encrypt) {
+  auto* context = static_cast<SSLContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  std::shared_ptr<TSSLSessionTicketKeys> keys;
+  if (context != nullptr) {
+    keys = context->getSessionTicketKeys();
+  }
+  if (!keys) {
+    return -1;
+  }
+
+  TSSLSessionTicketKeys::Key key;
+  int rc = 1;
+  if (encrypt) {
+    key = keys->current();
+    memcpy(name, key.name, sizeof(key.name));
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1
+        || EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aesKey, iv) != 1) {
+      return -1;
+    }
+  } else {
+    bool isCurrent;
+    if (!keys->find(name, &key, &isCurrent)) {
+      // unknown or expired key, do a full handshake
+      return 0;
+    }
+    if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aesKey, iv) != 1) {
+      return -1;
+    }
+    // 2 makes OpenSSL issue a new ticket with the current key, which TLS 1.3
+    // always needs as clients use each ticket only once
+    rc = isCurrent ? 1 : 2;
+#ifdef TLS1_3_VERSION
+    if (SSL_version(ssl) >= TLS1_3_VERSION) {
+      rc = 2;
+    }
+#endif
+  }
+  bool macInitialized = initTicketMac(mac, key.hmacKey, sizeof(key.hmacKey));
+  OPENSSL_cleanse(&key, sizeof(key));
+  return macInitialized ? rc : -1;
+}
+
 // SSLContext implementation
 SSLContext::SSLContext(const SSLProtocol& protocol) {
   if (protocol == SSLTLS) {
@@ -205,6 +292,12 @@ SSLContext::SSLContext(const SSLProtocol& protocol) {
       SSL_CTX_set_options(ctx_, SSL_OP_NO_SSLv2);
       SSL_CTX_set_options(ctx_, SSL_OP_NO_SSLv3);   // THRIFT-3164
   }
+
+  // lets servers resume the sessions of clients they verified the
+  // certificate of, see SSL_CTX_set_session_id_context()
+  static const unsigned char sessionIdContext[] = "thrift";
+  SSL_CTX_set_session_id_context(ctx_, sessionIdContext, sizeof(sessionIdContext) - 1);
+  SSL_CTX_set_app_data(ctx_, this);
 }
 
 SSLContext::~SSLContext() {
@@ -214,6 +307,34 @@ SSLContext::~SSLContext() {
   }
 }
 
+void SSLContext::setSessionCache(std::shared_ptr<TSSLSessionCache> cache) {
+  sessionCache_ = cache;
+  long mode = SSL_CTX_get_session_cache_mode(ctx_)
+              & ~(SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  if (cache) {
+    // sessions are only kept in the cache, which may be shared
+    mode |= SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE;
+    SSL_CTX_sess_set_new_cb(ctx_, TSSLSocket::newSessionCallback);
+  } else {
+    SSL_CTX_sess_set_new_cb(ctx_, nullptr);
+  }
+  SSL_CTX_set_session_cache_mode(ctx_, mode);
+}
+
+void SSLContext::setSessionTicketKeys(std::shared_ptr<TSSLSessionTicketKeys> keys) {
+  ticketKeys_ = keys;
+  if (keys) {
+    SSL_CTX_clear_options(ctx_, SSL_OP_NO_TICKET);
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx_, ticketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx_, ticketKeyCallback);
+#endif
+  } else {
+    SSL_CTX_set_options(ctx_, SSL_OP_NO_TICKET);
+  }
+}
+
 SSL* SSLContext::createSSL() {
   SSL* ssl = SSL_new(ctx_);
   if (ssl == nullptr) {
@@ -224,6 +345,142 @@ SSL* SSLContext::createSSL() {
   return ssl;
 }
 
+// TSSLSessionCache implementation
+TSSLSessionCache::TSSLSessionCache(size_t maxSize) : maxSize_(maxSize) {
+}
+
+TSSLSessionCache::~TSSLSessionCache() {
+  for (auto& entry : entries_) {
+    SSL_SESSION_free(entry.second);
+  }
+}
+
+SSL_SESSION* TSSLSessionCache::get(const string& key) {
+  Guard guard(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  SSL_SESSION* session = it->second->second;
+  bool expired = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(nullptr);
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+  // TLS 1.3 sessions can be resumed only once
+  expired = expired || !SSL_SESSION_is_resumable(session);
+#endif
+  if (expired) {
+    SSL_SESSION_free(session);
+    entries_.erase(it->second);
+    index_.erase(it);
+    return nullptr;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  upRef(session);
+  return session;
+}
+
+void TSSLSessionCache::put(const string& key, SSL_SESSION* session) {
+  Guard guard(mutex_);
+  upRef(session);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    SSL_SESSION_free(it->second->second);
+    it->second->second = session;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+  entries_.emplace_front(key, session);
+  index_[key] = entries_.begin();
+  while (entries_.size() > maxSize_) {
+    SSL_SESSION_free(entries_.back().second);
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+}
+
+void TSSLSessionCache::remove(const string& key) {
+  Guard guard(mutex_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    SSL_SESSION_free(it->second->second);
+    entries_.erase(it->second);
+    index_.erase(it);
+  }
+}
+
+size_t TSSLSessionCache::size() {
+  Guard guard(mutex_);
+  return entries_.size();
+}
+
+// TSSLSessionTicketKeys implementation
+TSSLSessionTicketKeys::TSSLSessionTicketKeys(int rotationInterval, int gracePeriod)
+  : rotationInterval_(rotationInterval), gracePeriod_(gracePeriod) {
+  keys_.push_front(create(time(nullptr)));
+}
+
+TSSLSessionTicketKeys::~TSSLSessionTicketKeys() {
+  for (auto& key : keys_) {
+    OPENSSL_cleanse(&key, sizeof(key));
+  }
+}
+
+TSSLSessionTicketKeys::Key TSSLSessionTicketKeys::create(time_t now) {
+  Key key;
+  if (RAND_bytes(key.name, sizeof(key.name)) != 1
+      || RAND_bytes(key.aesKey, sizeof(key.aesKey)) != 1
+      || RAND_bytes(key.hmacKey, sizeof(key.hmacKey)) != 1) {
+    string errors;
+    buildErrors(errors);
+    throw TSSLException("RAND_bytes: " + errors);
+  }
+  key.created = now;
+  key.retired = 0;
+  return key;
+}
+
+void TSSLSessionTicketKeys::expire(time_t now) {
+  while (keys_.size() > 1 && now - keys_.back().retired >= gracePeriod_) {
+    OPENSSL_cleanse(&keys_.back(), sizeof(Key));
+    keys_.pop_back();
+  }
+}
+
+void TSSLSessionTicketKeys::rotate() {
+  Guard guard(mutex_);
+  time_t now = time(nullptr);
+  Key key = create(now);
+  keys_.front().retired = now;
+  keys_.push_front(key);
+  OPENSSL_cleanse(&key, sizeof(key));
+  expire(now);
+}
+
+TSSLSessionTicketKeys::Key TSSLSessionTicketKeys::current() {
+  Guard guard(mutex_);
+  time_t now = time(nullptr);
+  if (rotationInterval_ > 0 && now - keys_.front().created >= rotationInterval_) {
+    Key key = create(now);
+    keys_.front().retired = now;
+    keys_.push_front(key);
+    OPENSSL_cleanse(&key, sizeof(key));
+    expire(now);
+  }
+  return keys_.front();
+}
+
+bool TSSLSessionTicketKeys::find(const unsigned char* name, Key* key, bool* isCurrent) {
+  Guard guard(mutex_);
+  expire(time(nullptr));
+  for (size_t i = 0; i < keys_.size(); ++i) {
+    if (memcmp(keys_[i].name, name, sizeof(keys_[i].name)) == 0) {
+      *key = keys_[i];
+      *isCurrent = (i == 0);
+      return true;
+    }
+  }
+  return false;
+}
+
 // TSSLSocket implementation
 TSSLSocket::TSSLSocket(std::shared_ptr<SSLContext> ctx, std::shared_ptr<TConfiguration> config)
   : TSocket(config), server_(false), ssl_(nullptr), ctx_(ctx) {
@@ -277,6 +534,7 @@ bool TSSLSocket::hasPendingDataToRead() {
 
 void TSSLSocket::init() {
   handshakeCompleted_ = false;
+  handshakeWantWrite_ = false;
   readRetryCount_ = 0;
   eventSafe_ = false;
 }
@@ -596,6 +854,107 @@ void TSSLSocket::flush() {
   }
 }
 
+bool TSSLSocket::isKernelTLSSend() const {
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ssl_ != nullptr && handshakeCompleted_) {
+    BIO* bio = SSL_get_wbio(ssl_);
+    return bio != nullptr && BIO_get_ktls_send(bio);
+  }
+#endif
+  return false;
+}
+
+bool TSSLSocket::isKernelTLSRecv() const {
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ssl_ != nullptr && handshakeCompleted_) {
+    BIO* bio = SSL_get_rbio(ssl_);
+    return bio != nullptr && BIO_get_ktls_recv(bio);
+  }
+#endif
+  return false;
+}
+
+bool TSSLSocket::isSessionReused() const {
+  return ssl_ != nullptr && handshakeCompleted_ && SSL_session_reused(ssl_);
+}
+
+string TSSLSocket::getSessionKey() const {
+  if (!path_.empty()) {
+    return path_;
+  }
+  if (!host_.empty()) {
+    return host_ + ":" + std::to_string(port_);
+  }
+  return getPeerAddress() + ":" + std::to_string(getPeerPort());
+}
+
+int TSSLSocket::newSessionCallback(SSL* ssl, SSL_SESSION* session) {
+  auto* socket = static_cast<TSSLSocket*>(SSL_get_app_data(ssl));
+  if (socket != nullptr && !socket->server()) {
+    std::shared_ptr<TSSLSessionCache> cache = socket->ctx_->getSessionCache();
+    if (cache) {
+      cache->put(socket->sessionKey_, session);
+    }
+  }
+  // the cache takes a reference of its own
+  return 0;
+}
+
+#ifndef _WIN32
+void TSSLSocket::sendFile(int fd, off_t offset, size_t size) {
+  initializeHandshake();
+  if (!checkHandshake())
+    throw TSSLException("sendFile: Handshake is not completed");
+#ifdef SSL_OP_ENABLE_KTLS
+  if (isKernelTLSSend()) {
+    while (size > 0) {
+      ERR_clear_error();
+      ossl_ssize_t bytes = SSL_sendfile(ssl_, fd, offset, size, 0);
+      if (bytes <= 0) {
+        int errno_copy = THRIFT_GET_SOCKET_ERROR;
+        int error = SSL_get_error(ssl_, static_cast<int>(bytes));
+        switch (error) {
+          case SSL_ERROR_SYSCALL:
+            if ((errno_copy != THRIFT_EINTR)
+                && (errno_copy != THRIFT_EAGAIN)) {
+              break;
+            }
+          // fallthrough
+          case SSL_ERROR_WANT_READ:
+          case SSL_ERROR_WANT_WRITE:
+            waitForEvent(error == SSL_ERROR_WANT_READ);
+            continue;
+          default:;// do nothing
+        }
+        string errors;
+        buildErrors(errors, errno_copy, error);
+        throw TSSLException("SSL_sendfile: " + errors);
+      }
+      offset += bytes;
+      size -= static_cast<size_t>(bytes);
+    }
+    return;
+  }
+#endif
+  uint8_t buf[16 * 1024];
+  while (size > 0) {
+    ssize_t bytes = ::pread(fd, buf, (std::min)(size, sizeof(buf)), offset);
+    if (bytes < 0) {
+      int errno_copy = errno;
+      if (errno_copy == EINTR) {
+        continue;
+      }
+      throw TTransportException(TTransportException::UNKNOWN, "sendFile: pread()", errno_copy);
+    } else if (bytes == 0) {
+      throw TTransportException(TTransportException::END_OF_FILE, "sendFile: file is too short");
+    }
+    write(buf, static_cast<uint32_t>(bytes));
+    offset += bytes;
+    size -= static_cast<size_t>(bytes);
+  }
+}
+#endif
+
 void TSSLSocket::initializeHandshakeParams() {
   // set underlying socket to non-blocking
   int flags;
@@ -609,12 +968,28 @@ void TSSLSocket::initializeHandshakeParams() {
   ssl_ = ctx_->createSSL();
 
   SSL_set_fd(ssl_, static_cast<int>(socket_));
+  SSL_set_app_data(ssl_, this);
+
+  std::shared_ptr<TSSLSessionCache> cache = ctx_->getSessionCache();
+  if (!server() && cache) {
+    sessionKey_ = getSessionKey();
+    SSL_SESSION* session = cache->get(sessionKey_);
+    if (session != nullptr) {
+      SSL_set_session(ssl_, session);
+      SSL_SESSION_free(session);
+    }
+  }
 }
 
 bool TSSLSocket::checkHandshake() {
   return handshakeCompleted_;
 }
 
+bool TSSLSocket::advanceHandshake() {
+  initializeHandshake();
+  return checkHandshake();
+}
+
 void TSSLSocket::initializeHandshake() {
   if (!TSocket::isOpen()) {
     throw TTransportException(TTransportException::NOT_OPEN);
@@ -646,6 +1021,7 @@ void TSSLSocket::initializeHandshake() {
           case SSL_ERROR_WANT_READ:
           case SSL_ERROR_WANT_WRITE:
             if (isLibeventSafe()) {
+              handshakeWantWrite_ = (error == SSL_ERROR_WANT_WRITE);
               return;
             }
             else {
@@ -679,6 +1055,7 @@ void TSSLSocket::initializeHandshake() {
           case SSL_ERROR_WANT_READ:
           case SSL_ERROR_WANT_WRITE:
             if (isLibeventSafe()) {
+              handshakeWantWrite_ = (error == SSL_ERROR_WANT_WRITE);
               return;
             }
             else {
@@ -693,6 +1070,11 @@ void TSSLSocket::initializeHandshake() {
     } while (rc == 2);
   }
   if (rc <= 0) {
+    std::shared_ptr<TSSLSessionCache> cache = ctx_->getSessionCache();
+    if (!server() && cache) {
+      // don't offer the session again
+      cache->remove(sessionKey_);
+    }
     string fname(server() ? "SSL_accept" : "SSL_connect");
     string errors;
     buildErrors(errors, errno_copy, error);
@@ -964,6 +1346,54 @@ void TSSLSocketFactory::authenticate(bool required) {
   SSL_CTX_set_verify(ctx_->get(), mode, nullptr);
 }
 
+void TSSLSocketFactory::kernelTLS(bool enable) {
+#ifdef SSL_OP_ENABLE_KTLS
+  if (enable) {
+    SSL_CTX_set_options(ctx_->get(), SSL_OP_ENABLE_KTLS);
+  } else {
+    SSL_CTX_clear_options(ctx_->get(), SSL_OP_ENABLE_KTLS);
+  }
+#else
+  if (enable) {
+    GlobalOutput("TSSLSocketFactory::kernelTLS: not supported by this OpenSSL version");
+  }
+#endif
+}
+
+bool TSSLSocketFactory::kernelTLS() const {
+#ifdef SSL_OP_ENABLE_KTLS
+  return (SSL_CTX_get_options(ctx_->get()) & SSL_OP_ENABLE_KTLS) != 0;
+#else
+  return false;
+#endif
+}
+
+void TSSLSocketFactory::sessionCache(std::shared_ptr<TSSLSessionCache> cache) {
+  ctx_->setSessionCache(cache);
+}
+
+std::shared_ptr<TSSLSessionCache> TSSLSocketFactory::sessionCache() const {
+  return ctx_->getSessionCache();
+}
+
+void TSSLSocketFactory::serverSessionCache(long size, long timeout) {
+  long mode = SSL_CTX_get_session_cache_mode(ctx_->get())
+              & ~(SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL_LOOKUP);
+  if (size > 0) {
+    mode |= SSL_SESS_CACHE_SERVER;
+    SSL_CTX_sess_set_cache_size(ctx_->get(), size);
+  } else {
+    // neither store nor look up sessions
+    mode |= SSL_SESS_CACHE_NO_INTERNAL_LOOKUP;
+  }
+  SSL_CTX_set_session_cache_mode(ctx_->get(), mode);
+  SSL_CTX_set_timeout(ctx_->get(), timeout);
+}
+
+void TSSLSocketFactory::sessionTicketKeys(std::shared_ptr<TSSLSessionTicketKeys> keys) {
+  ctx_->setSessionTicketKeys(keys);
+}
+
 void TSSLSocketFactory::loadCertificate(const char* path, const char* format) {
   if (path == nullptr || format == nullptr) {
     throw TTransportException(TTransportException::BAD_ARGS,
@@ -24,7 +24,11 @@
 #include <thrift/transport/TSocket.h>
 
 #include <openssl/ssl.h>
+#include <ctime>
+#include <deque>
+#include <list>
 #include <string>
+#include <unordered_map>
 #include <thrift/concurrency/Mutex.h>
 
 namespace apache {
@@ -33,6 +37,8 @@ namespace transport {
 
 class AccessManager;
 class SSLContext;
+class TSSLSessionCache;
+class TSSLSessionTicketKeys;
 
 enum SSLProtocol {
   SSLTLS  = 0,  // Supports SSLv2 and SSLv3 handshake but only negotiates at TLSv1_0 or later.
@@ -106,6 +112,49 @@ public:
    * Determines whether SSL Socket is libevent safe or not.
    */
   bool isLibeventSafe() const { return eventSafe_; }
+  /**
+   * Advances the handshake of a libevent safe socket as far as possible
+   * without blocking.
+   *
+   * @return true once the handshake has completed; otherwise it has to be
+   *         called again when the socket becomes readable, or writable if
+   *         handshakeWantsWrite() is set.
+   * @throw TSSLException if the handshake failed.
+   */
+  bool advanceHandshake();
+  /**
+   * Determines whether the last advanceHandshake() stopped waiting for the
+   * socket to become writable rather than readable.
+   */
+  bool handshakeWantsWrite() const { return handshakeWantWrite_; }
+  /**
+   * Determines whether the kernel encrypts the records sent on this
+   * connection (see TSSLSocketFactory::kernelTLS()). Known once the handshake has
+   * completed, false before. Once true, data may also be written to the
+   * socket descriptor directly with send() or sendfile().
+   */
+  bool isKernelTLSSend() const;
+  /**
+   * Determines whether the kernel decrypts the records received on this
+   * connection. Reads should still go through read(), which also handles
+   * alerts and other control records.
+   */
+  bool isKernelTLSRecv() const;
+  /**
+   * Determines whether the handshake resumed an earlier session instead of
+   * doing a full handshake (see TSSLSocketFactory::sessionCache()).
+   */
+  bool isSessionReused() const;
+#ifndef _WIN32
+  /**
+   * Sends size bytes of the file fd starting at offset. With kernel TLS on
+   * the sending side the file goes through SSL_sendfile() and never enters
+   * user space, otherwise it is read in blocks and passed to write().
+   *
+   * Note: This method is not libevent safe.
+   */
+  void sendFile(int fd, off_t offset, size_t size);
+#endif
 
 protected:
   /**
@@ -171,18 +220,29 @@ protected:
    */
   unsigned int waitForEvent(bool wantRead);
 
+  /**
+   * Key of the session cache entry of a client socket: host:port as
+   * connected to, or the peer address for sockets created from an existing
+   * descriptor.
+   */
+  virtual std::string getSessionKey() const;
+
   bool server_;
   SSL* ssl_;
   std::shared_ptr<SSLContext> ctx_;
   std::shared_ptr<AccessManager> access_;
   friend class TSSLSocketFactory;
+  friend class SSLContext;
 
 private:
   bool handshakeCompleted_;
+  bool handshakeWantWrite_;
   int readRetryCount_;
   bool eventSafe_;
+  std::string sessionKey_;
 
   void init();
+  static int newSessionCallback(SSL* ssl, SSL_SESSION* session);
 };
 
 /**
@@ -257,6 +317,48 @@ public:
    * @param required Require peer to present valid certificate if true
    */
   virtual void authenticate(bool required);
+  /**
+   * Enable/Disable kernel TLS offload (Linux kTLS, OpenSSL 3.0 or later).
+   * Once the handshake has completed the record layer of a connection moves
+   * into the kernel, if the kernel and the negotiated cipher support it, and
+   * stays in OpenSSL otherwise. Applies to sockets that have not started
+   * their handshake yet.
+   *
+   * @param enable Use kernel TLS where possible if true
+   */
+  virtual void kernelTLS(bool enable);
+  /**
+   * Determine whether kernel TLS offload is enabled.
+   */
+  virtual bool kernelTLS() const;
+  /**
+   * Set the cache client sockets keep their TLS sessions in, so reconnects
+   * to the same host:port resume the session instead of doing a full
+   * handshake. The same cache may be shared by several factories.
+   *
+   * @param cache The session cache, nullptr disables resumption
+   */
+  virtual void sessionCache(std::shared_ptr<TSSLSessionCache> cache);
+  /**
+   * Get the client session cache, nullptr if there is none.
+   */
+  virtual std::shared_ptr<TSSLSessionCache> sessionCache() const;
+  /**
+   * Configure the server side session cache, used by clients that resume
+   * by session id rather than with a ticket.
+   *
+   * @param size    Maximum number of cached sessions, 0 disables the cache
+   * @param timeout Seconds a session can be resumed for
+   */
+  virtual void serverSessionCache(long size, long timeout);
+  /**
+   * Set the keys the server encrypts session tickets with. Servers sharing
+   * the keys accept each other's tickets. Without keys OpenSSL uses a random
+   * key per factory that never changes.
+   *
+   * @param keys The ticket keys, nullptr disables session tickets
+   */
+  virtual void sessionTicketKeys(std::shared_ptr<TSSLSessionTicketKeys> keys);
   /**
    * Load server certificate.
    *
@@ -349,6 +451,83 @@ public:
   }
 };
 
+/**
+ * Client side cache of TLS sessions, keyed by host:port. Keeps at most
+ * maxSize sessions and evicts the least recently used one. Thread safe.
+ */
+class TSSLSessionCache {
+public:
+  TSSLSessionCache(size_t maxSize = 1024);
+  virtual ~TSSLSessionCache();
+  /**
+   * Get the session for a key, nullptr if there is none or it has expired.
+   * The caller owns the returned reference and has to SSL_SESSION_free() it.
+   */
+  SSL_SESSION* get(const std::string& key);
+  /**
+   * Store a session, replacing the one stored for the key. Takes a
+   * reference of its own.
+   */
+  void put(const std::string& key, SSL_SESSION* session);
+  void remove(const std::string& key);
+  size_t size();
+
+private:
+  typedef std::list<std::pair<std::string, SSL_SESSION*> > Entries;
+
+  concurrency::Mutex mutex_;
+  size_t maxSize_;
+  // most recently used first
+  Entries entries_;
+  std::unordered_map<std::string, Entries::iterator> index_;
+};
+
+/**
+ * Keys a server encrypts its session tickets with. A new key is created
+ * every rotationInterval seconds, or on rotate(), and used for new tickets.
+ * Retired keys still decrypt tickets for gracePeriod seconds; a client
+ * resuming with one of those gets a fresh ticket. Thread safe.
+ */
+class TSSLSessionTicketKeys {
+public:
+  TSSLSessionTicketKeys(int rotationInterval = 3600, int gracePeriod = 3600);
+  virtual ~TSSLSessionTicketKeys();
+  /**
+   * Retire the current key and create a new one.
+   */
+  void rotate();
+
+  struct Key {
+    unsigned char name[16];
+    unsigned char aesKey[32];
+    unsigned char hmacKey[32];
+    time_t created;
+    time_t retired;
+  };
+
+  /**
+   * Get the key new tickets are encrypted with, rotating it when it is due.
+   */
+  Key current();
+  /**
+   * Find the key a ticket was encrypted with.
+   *
+   * @return false if there is no such key or its grace period is over
+   */
+  bool find(const unsigned char* name, Key* key, bool* isCurrent);
+
+private:
+  Key create(time_t now);
+  // drops the keys whose grace period is over, needs mutex_
+  void expire(time_t now);
+
+  concurrency::Mutex mutex_;
+  int rotationInterval_;
+  int gracePeriod_;
+  // current key first
+  std::deque<Key> keys_;
+};
+
 /**
  * Wrap OpenSSL SSL_CTX into a class.
  */
@@ -359,8 +538,15 @@ public:
   SSL* createSSL();
   SSL_CTX* get() { return ctx_; }
 
+  std::shared_ptr<TSSLSessionCache> getSessionCache() const { return sessionCache_; }
+  void setSessionCache(std::shared_ptr<TSSLSessionCache> cache);
+  std::shared_ptr<TSSLSessionTicketKeys> getSessionTicketKeys() const { return ticketKeys_; }
+  void setSessionTicketKeys(std::shared_ptr<TSSLSessionTicketKeys> keys);
+
 private:
   SSL_CTX* ctx_;
+  std::shared_ptr<TSSLSessionCache> sessionCache_;
+  std::shared_ptr<TSSLSessionTicketKeys> ticketKeys_;
 };
 
 /**
@@ -0,0 +1,61 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#ifdef __linux__
+
+#include <thrift/transport/TSharedMemoryServerTransport.h>
+#include <thrift/transport/TSharedMemoryTransport.h>
+#include <thrift/transport/TSocket.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+using std::shared_ptr;
+
+const uint32_t TSharedMemoryServerTransport::DEFAULT_RING_SIZE;
+
+TSharedMemoryServerTransport::TSharedMemoryServerTransport(const std::string& path,
+                                                           uint32_t ringSize)
+  : TServerSocket(path), ringSize_(ringSize) {
+}
+
+shared_ptr<TTransport> TSharedMemoryServerTransport::acceptImpl() {
+  shared_ptr<TSocket> socket = std::dynamic_pointer_cast<TSocket>(TServerSocket::acceptImpl());
+  if (!socket) {
+    throw TTransportException(TTransportException::UNKNOWN,
+                              "TSharedMemoryServerTransport: accepted transport is not a TSocket");
+  }
+  try {
+    return TSharedMemoryTransport::accept(socket, ringSize_, pChildInterruptSockReader_,
+                                          socket->getConfiguration());
+  } catch (TTransportException& ttx) {
+    // only this client is affected, keep the server accepting
+    GlobalOutput.printf("TSharedMemoryServerTransport::acceptImpl() %s", ttx.what());
+    socket->close();
+    throw TTransportException(TTransportException::CLIENT_DISCONNECT, ttx.what());
+  }
+}
+}
+}
+} // apache::thrift::transport
+
+#endif // __linux__
@@ -0,0 +1,63 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TSHAREDMEMORYSERVERTRANSPORT_H_
+#define _THRIFT_TRANSPORT_TSHAREDMEMORYSERVERTRANSPORT_H_ 1
+
+#include <thrift/transport/TServerSocket.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * Server side of TSharedMemoryTransport. Listens on a unix domain socket
+ * and, for every accepted connection, creates a shared memory segment with
+ * one ring buffer per direction and passes it to the client. The returned
+ * children are TSharedMemoryTransport instances, so this can be used with
+ * any of the TServer implementations in place of a TServerSocket.
+ *
+ * Only available on Linux.
+ */
+class TSharedMemoryServerTransport : public TServerSocket {
+public:
+  const static uint32_t DEFAULT_RING_SIZE = 1024 * 1024;
+
+  /**
+   * Constructor.
+   *
+   * @param path     Pathname for the rendezvous unix socket
+   * @param ringSize Capacity of each direction's ring, rounded up to a
+   *                 power of two
+   */
+  TSharedMemoryServerTransport(const std::string& path, uint32_t ringSize = DEFAULT_RING_SIZE);
+
+  uint32_t getRingSize() const { return ringSize_; }
+
+protected:
+  std::shared_ptr<TTransport> acceptImpl() override;
+
+private:
+  uint32_t ringSize_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TSHAREDMEMORYSERVERTRANSPORT_H_
@@ -0,0 +1,562 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <thrift/transport/TSharedMemoryTransport.h>
+#include <thrift/transport/TTransportException.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+namespace {
+const uint32_t SHM_MAGIC = 0x54534852; // "TSHR"
+const uint32_t SHM_VERSION = 1;
+const int SHM_NUM_FDS = 5;
+const size_t SHM_CACHELINE = 64;
+} // namespace
+
+/**
+ * Control block of one direction. head is only written by the consumer,
+ * tail only by the producer; they live on separate cache lines so the two
+ * sides do not false-share.
+ */
+struct TSharedMemoryRing {
+  alignas(SHM_CACHELINE) std::atomic<uint64_t> head;
+  alignas(SHM_CACHELINE) std::atomic<uint64_t> tail;
+  alignas(SHM_CACHELINE) std::atomic<uint32_t> readerWaiting;
+  std::atomic<uint32_t> writerWaiting;
+  std::atomic<uint32_t> writerClosed;
+  std::atomic<uint32_t> readerClosed;
+};
+
+struct TSharedMemoryHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ringSize;
+  TSharedMemoryRing rings[2];
+};
+
+/**
+ * The mapping plus the eventfds of both rings. Ring 0 carries server to
+ * client traffic, ring 1 client to server.
+ */
+struct TSharedMemorySegment {
+  TSharedMemorySegment() : memFd(-1), base(nullptr), length(0), header(nullptr) {
+    for (int& fd : dataFds) {
+      fd = -1;
+    }
+    for (int& fd : spaceFds) {
+      fd = -1;
+    }
+  }
+
+  ~TSharedMemorySegment() {
+    if (base != nullptr) {
+      ::munmap(base, length);
+    }
+    for (int fd : {memFd, dataFds[0], dataFds[1], spaceFds[0], spaceFds[1]}) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+
+  static size_t dataOffset() {
+    size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return (sizeof(TSharedMemoryHeader) + page - 1) / page * page;
+  }
+
+  void map() {
+    void* p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (p == MAP_FAILED) {
+      int errno_copy = errno;
+      throw TTransportException(TTransportException::UNKNOWN, "TSharedMemoryTransport mmap()",
+                                errno_copy);
+    }
+    base = static_cast<uint8_t*>(p);
+    header = reinterpret_cast<TSharedMemoryHeader*>(base);
+  }
+
+  uint8_t* data(int ring) const { return base + dataOffset() + ring * header->ringSize; }
+
+  int memFd;
+  int dataFds[2];
+  int spaceFds[2];
+  uint8_t* base;
+  size_t length;
+  TSharedMemoryHeader* header;
+};
+
+static uint32_t roundUpToPowerOfTwo(uint32_t v) {
+  uint32_t r = 4096;
+  while (r < v && r < (1u << 30)) {
+    r <<= 1;
+  }
+  return r;
+}
+
+static void signalEventFd(int fd) {
+  uint64_t one = 1;
+  // EAGAIN means the counter is saturated, which still wakes the peer
+  ssize_t rv = ::write(fd, &one, sizeof(one));
+  (void)rv;
+}
+
+TSharedMemoryTransport::TSharedMemoryTransport(const std::string& path,
+                                               std::shared_ptr<TConfiguration> config)
+  : TVirtualTransport(config),
+    path_(path),
+    rx_(nullptr),
+    tx_(nullptr),
+    rxData_(nullptr),
+    txData_(nullptr),
+    ringMask_(0),
+    rxDataFd_(-1),
+    rxSpaceFd_(-1),
+    txDataFd_(-1),
+    txSpaceFd_(-1),
+    peerGone_(false),
+    recvTimeout_(0),
+    sendTimeout_(0) {
+}
+
+TSharedMemoryTransport::~TSharedMemoryTransport() {
+  try {
+    close();
+  } catch (TTransportException& ex) {
+    GlobalOutput.printf("~TSharedMemoryTransport TTransportException: '%s'", ex.what());
+  }
+}
+
+std::shared_ptr<TSharedMemoryTransport> TSharedMemoryTransport::accept(
+    std::shared_ptr<TSocket> socket,
+    uint32_t ringSize,
+    std::shared_ptr<int> interruptListener,
+    std::shared_ptr<TConfiguration> config) {
+  std::shared_ptr<TSharedMemorySegment> segment(new TSharedMemorySegment());
+  ringSize = roundUpToPowerOfTwo(ringSize);
+  segment->length = TSharedMemorySegment::dataOffset() + 2 * static_cast<size_t>(ringSize);
+
+  segment->memFd = ::memfd_create("thrift-shm", MFD_CLOEXEC);
+  if (segment->memFd < 0 || ::ftruncate(segment->memFd, static_cast<off_t>(segment->length)) < 0) {
+    int errno_copy = errno;
+    throw TTransportException(TTransportException::UNKNOWN, "TSharedMemoryTransport memfd_create()",
+                              errno_copy);
+  }
+  for (int i = 0; i < 2; ++i) {
+    segment->dataFds[i] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    segment->spaceFds[i] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (segment->dataFds[i] < 0 || segment->spaceFds[i] < 0) {
+      int errno_copy = errno;
+      throw TTransportException(TTransportException::UNKNOWN, "TSharedMemoryTransport eventfd()",
+                                errno_copy);
+    }
+  }
+  segment->map();
+  TSharedMemoryHeader* header = new (segment->base) TSharedMemoryHeader();
+  header->magic = SHM_MAGIC;
+  header->version = SHM_VERSION;
+  header->ringSize = ringSize;
+  for (TSharedMemoryRing& ring : header->rings) {
+    ring.head.store(0, std::memory_order_relaxed);
+    ring.tail.store(0, std::memory_order_relaxed);
+    ring.readerWaiting.store(0, std::memory_order_relaxed);
+    ring.writerWaiting.store(0, std::memory_order_relaxed);
+    ring.writerClosed.store(0, std::memory_order_relaxed);
+    ring.readerClosed.store(0, std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  int fds[SHM_NUM_FDS] = {segment->memFd,
+                          segment->dataFds[0],
+                          segment->spaceFds[0],
+                          segment->dataFds[1],
+                          segment->spaceFds[1]};
+  char tag = 'S';
+  struct iovec iov;
+  iov.iov_base = &tag;
+  iov.iov_len = 1;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  std::memset(&control, 0, sizeof(control));
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (::sendmsg(socket->getSocketFD(), &msg, MSG_NOSIGNAL) != 1) {
+    int errno_copy = errno;
+    throw TTransportException(TTransportException::NOT_OPEN, "TSharedMemoryTransport sendmsg()",
+                              errno_copy);
+  }
+
+  std::shared_ptr<TSharedMemoryTransport> result(new TSharedMemoryTransport(socket->getPath(), config));
+  result->socket_ = socket;
+  result->interruptListener_ = interruptListener;
+  result->attach(segment, true);
+  return result;
+}
+
+void TSharedMemoryTransport::open() {
+  if (isOpen()) {
+    return;
+  }
+  std::shared_ptr<TSocket> socket(new TSocket(path_, getConfiguration()));
+  socket->setRecvTimeout(recvTimeout_);
+  socket->open();
+
+  std::shared_ptr<TSharedMemorySegment> segment(new TSharedMemorySegment());
+  char tag = 0;
+  struct iovec iov;
+  iov.iov_base = &tag;
+  iov.iov_len = 1;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * SHM_NUM_FDS)];
+  } control;
+  std::memset(&control, 0, sizeof(control));
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t got;
+  do {
+    got = ::recvmsg(socket->getSocketFD(), &msg, MSG_CMSG_CLOEXEC);
+  } while (got < 0 && errno == EINTR);
+  if (got < 0) {
+    int errno_copy = errno;
+    if (errno_copy == EAGAIN) {
+      throw TTransportException(TTransportException::TIMED_OUT,
+                                "TSharedMemoryTransport::open() timed out waiting for server");
+    }
+    throw TTransportException(TTransportException::NOT_OPEN, "TSharedMemoryTransport recvmsg()",
+                              errno_copy);
+  }
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (got != 1 || tag != 'S' || cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SHM_NUM_FDS)) {
+    if (cmsg != nullptr && cmsg->cmsg_type == SCM_RIGHTS) {
+      int* received = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; ++i) {
+        ::close(received[i]);
+      }
+    }
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TSharedMemoryTransport::open() bad handshake from " + path_);
+  }
+  int fds[SHM_NUM_FDS];
+  std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  segment->memFd = fds[0];
+  segment->dataFds[0] = fds[1];
+  segment->spaceFds[0] = fds[2];
+  segment->dataFds[1] = fds[3];
+  segment->spaceFds[1] = fds[4];
+
+  struct stat st;
+  if (::fstat(segment->memFd, &st) < 0) {
+    int errno_copy = errno;
+    throw TTransportException(TTransportException::NOT_OPEN, "TSharedMemoryTransport fstat()",
+                              errno_copy);
+  }
+  segment->length = static_cast<size_t>(st.st_size);
+  if (segment->length < TSharedMemorySegment::dataOffset()) {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TSharedMemoryTransport::open() segment too small");
+  }
+  segment->map();
+  const TSharedMemoryHeader* header = segment->header;
+  // the ring size is used as a mask, it must be a power of two
+  if (header->magic != SHM_MAGIC || header->version != SHM_VERSION
+      || header->ringSize == 0 || (header->ringSize & (header->ringSize - 1)) != 0
+      || TSharedMemorySegment::dataOffset() + 2 * static_cast<size_t>(header->ringSize)
+             != segment->length) {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TSharedMemoryTransport::open() incompatible segment");
+  }
+
+  socket_ = socket;
+  attach(segment, false);
+}
+
+void TSharedMemoryTransport::attach(std::shared_ptr<TSharedMemorySegment> segment,
+                                    bool serverSide) {
+  int in = serverSide ? 1 : 0;
+  int out = serverSide ? 0 : 1;
+  segment_ = segment;
+  rx_ = &segment->header->rings[in];
+  tx_ = &segment->header->rings[out];
+  rxData_ = segment->data(in);
+  txData_ = segment->data(out);
+  ringMask_ = segment->header->ringSize - 1;
+  rxDataFd_ = segment->dataFds[in];
+  rxSpaceFd_ = segment->spaceFds[in];
+  txDataFd_ = segment->dataFds[out];
+  txSpaceFd_ = segment->spaceFds[out];
+  peerGone_ = false;
+}
+
+void TSharedMemoryTransport::detach() {
+  segment_.reset();
+  rx_ = tx_ = nullptr;
+  rxData_ = txData_ = nullptr;
+  ringMask_ = 0;
+  rxDataFd_ = rxSpaceFd_ = txDataFd_ = txSpaceFd_ = -1;
+}
+
+bool TSharedMemoryTransport::isOpen() const {
+  return segment_ != nullptr;
+}
+
+void TSharedMemoryTransport::close() {
+  if (!isOpen()) {
+    return;
+  }
+  tx_->writerClosed.store(1, std::memory_order_release);
+  rx_->readerClosed.store(1, std::memory_order_release);
+  signalEventFd(txDataFd_);
+  signalEventFd(rxSpaceFd_);
+  detach();
+  if (socket_) {
+    socket_->close();
+    socket_.reset();
+  }
+}
+
+uint32_t TSharedMemoryTransport::getRingSize() const {
+  return isOpen() ? ringMask_ + 1 : 0;
+}
+
+const std::string TSharedMemoryTransport::getOrigin() const {
+  return "shm:" + path_;
+}
+
+TSharedMemoryTransport::WaitResult TSharedMemoryTransport::wait(int eventFd, int timeoutMs) {
+  struct pollfd fds[3];
+  nfds_t nfds = 0;
+  fds[nfds].fd = eventFd;
+  fds[nfds].events = POLLIN;
+  ++nfds;
+  if (!peerGone_ && socket_) {
+    fds[nfds].fd = socket_->getSocketFD();
+    fds[nfds].events = POLLIN;
+    ++nfds;
+  }
+  if (interruptListener_) {
+    fds[nfds].fd = *interruptListener_;
+    fds[nfds].events = POLLIN;
+    ++nfds;
+  }
+  for (nfds_t i = 0; i < nfds; ++i) {
+    fds[i].revents = 0;
+  }
+
+  int ret;
+  do {
+    ret = ::poll(fds, nfds, timeoutMs == 0 ? -1 : timeoutMs);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    int errno_copy = errno;
+    throw TTransportException(TTransportException::UNKNOWN, "TSharedMemoryTransport poll()",
+                              errno_copy);
+  }
+  if (ret == 0) {
+    return WAIT_TIMEOUT;
+  }
+  for (nfds_t i = 1; i < nfds; ++i) {
+    if (fds[i].revents == 0) {
+      continue;
+    }
+    if (interruptListener_ && fds[i].fd == *interruptListener_) {
+      return WAIT_INTERRUPTED;
+    }
+    // Nothing is ever sent over the rendezvous socket after the handshake,
+    // so any activity there means the peer closed it or died.
+    peerGone_ = true;
+  }
+  if (fds[0].revents & POLLIN) {
+    uint64_t count;
+    ssize_t rv = ::read(eventFd, &count, sizeof(count));
+    (void)rv;
+  }
+  return WAIT_WOKEN;
+}
+
+bool TSharedMemoryTransport::waitForData() {
+  for (;;) {
+    uint64_t head = rx_->head.load(std::memory_order_relaxed);
+    if (rx_->tail.load(std::memory_order_acquire) != head) {
+      return true;
+    }
+    if (rx_->writerClosed.load(std::memory_order_acquire) || peerGone_) {
+      // the peer may have published data right before closing
+      return rx_->tail.load(std::memory_order_acquire) != head;
+    }
+
+    rx_->readerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (rx_->tail.load(std::memory_order_relaxed) != head
+        || rx_->writerClosed.load(std::memory_order_relaxed)) {
+      rx_->readerWaiting.store(0, std::memory_order_relaxed);
+      continue;
+    }
+    WaitResult result = wait(rxDataFd_, recvTimeout_);
+    rx_->readerWaiting.store(0, std::memory_order_relaxed);
+    if (result == WAIT_TIMEOUT) {
+      throw TTransportException(TTransportException::TIMED_OUT,
+                                "TSharedMemoryTransport::read() timed out");
+    } else if (result == WAIT_INTERRUPTED) {
+      throw TTransportException(TTransportException::INTERRUPTED, "Interrupted");
+    }
+  }
+}
+
+bool TSharedMemoryTransport::peek() {
+  if (!isOpen()) {
+    return false;
+  }
+  try {
+    return waitForData();
+  } catch (TTransportException& ex) {
+    if (ex.getType() == TTransportException::TIMED_OUT
+        || ex.getType() == TTransportException::INTERRUPTED) {
+      return false;
+    }
+    throw;
+  }
+}
+
+uint32_t TSharedMemoryTransport::read(uint8_t* buf, uint32_t len) {
+  checkReadBytesAvailable(len);
+  if (!isOpen()) {
+    throw TTransportException(TTransportException::NOT_OPEN, "Called read on non-open socket");
+  }
+  if (len == 0 || !waitForData()) {
+    return 0;
+  }
+
+  uint64_t head = rx_->head.load(std::memory_order_relaxed);
+  uint64_t tail = rx_->tail.load(std::memory_order_acquire);
+  uint32_t n = static_cast<uint32_t>(std::min<uint64_t>(len, tail - head));
+  uint32_t offset = static_cast<uint32_t>(head) & ringMask_;
+  uint32_t first = std::min(n, ringMask_ + 1 - offset);
+  std::memcpy(buf, rxData_ + offset, first);
+  std::memcpy(buf + first, rxData_, n - first);
+  rx_->head.store(head + n, std::memory_order_release);
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (rx_->writerWaiting.load(std::memory_order_relaxed)) {
+    signalEventFd(rxSpaceFd_);
+  }
+  return n;
+}
+
+void TSharedMemoryTransport::write(const uint8_t* buf, uint32_t len) {
+  if (!isOpen()) {
+    throw TTransportException(TTransportException::NOT_OPEN, "Called write on non-open socket");
+  }
+  const uint32_t size = ringMask_ + 1;
+  while (len > 0) {
+    if (peerGone_ || tx_->readerClosed.load(std::memory_order_acquire)) {
+      throw TTransportException(TTransportException::END_OF_FILE,
+                                "TSharedMemoryTransport::write() peer closed");
+    }
+    uint64_t tail = tx_->tail.load(std::memory_order_relaxed);
+    uint64_t head = tx_->head.load(std::memory_order_acquire);
+    uint32_t space = size - static_cast<uint32_t>(tail - head);
+    if (space == 0) {
+      // the reader has to drain before we can go on, make sure it is awake
+      wakeReader();
+      tx_->writerWaiting.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (tx_->head.load(std::memory_order_relaxed) != head
+          || tx_->readerClosed.load(std::memory_order_relaxed)) {
+        tx_->writerWaiting.store(0, std::memory_order_relaxed);
+        continue;
+      }
+      WaitResult result = wait(txSpaceFd_, sendTimeout_);
+      tx_->writerWaiting.store(0, std::memory_order_relaxed);
+      if (result == WAIT_TIMEOUT) {
+        throw TTransportException(TTransportException::TIMED_OUT,
+                                  "TSharedMemoryTransport::write() timed out");
+      } else if (result == WAIT_INTERRUPTED) {
+        throw TTransportException(TTransportException::INTERRUPTED, "Interrupted");
+      }
+      continue;
+    }
+
+    uint32_t n = std::min(len, space);
+    uint32_t offset = static_cast<uint32_t>(tail) & ringMask_;
+    uint32_t first = std::min(n, size - offset);
+    std::memcpy(txData_ + offset, buf, first);
+    std::memcpy(txData_, buf + first, n - first);
+    tx_->tail.store(tail + n, std::memory_order_release);
+    buf += n;
+    len -= n;
+  }
+}
+
+void TSharedMemoryTransport::wakeReader() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (tx_->readerWaiting.load(std::memory_order_relaxed)) {
+    signalEventFd(txDataFd_);
+  }
+}
+
+void TSharedMemoryTransport::flush() {
+  if (!isOpen()) {
+    throw TTransportException(TTransportException::NOT_OPEN, "Called flush on non-open socket");
+  }
+  wakeReader();
+  resetConsumedMessageSize();
+}
+}
+}
+} // apache::thrift::transport
+
+#endif // __linux__
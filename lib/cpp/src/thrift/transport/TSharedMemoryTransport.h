@@ -0,0 +1,160 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TSHAREDMEMORYTRANSPORT_H_
+#define _THRIFT_TRANSPORT_TSHAREDMEMORYTRANSPORT_H_ 1
+
+#include <memory>
+#include <string>
+
+#include <thrift/transport/TSocket.h>
+#include <thrift/transport/TVirtualTransport.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+struct TSharedMemorySegment;
+struct TSharedMemoryRing;
+
+/**
+ * Transport for processes living on the same host. Data is exchanged through
+ * a pair of single-producer/single-consumer ring buffers (one per direction)
+ * placed in an anonymous shared memory segment, with eventfd wakeups when a
+ * reader or writer has to sleep. A unix domain socket is only used to hand
+ * the segment and eventfds to the peer on open() and to detect that the peer
+ * went away; no payload bytes travel over it.
+ *
+ * Written bytes become visible to the peer immediately, flush() only wakes
+ * the peer up if it is blocked waiting for data. As with TSocket the
+ * transport is a byte stream, so it is normally wrapped in a
+ * TFramedTransport or TBufferedTransport.
+ *
+ * Only available on Linux.
+ */
+class TSharedMemoryTransport : public TVirtualTransport<TSharedMemoryTransport> {
+public:
+  /**
+   * Constructs a client side transport that will rendezvous with a
+   * TSharedMemoryServerTransport listening on the given unix socket path.
+   *
+   * @param path The unix domain socket path of the server
+   */
+  TSharedMemoryTransport(const std::string& path,
+                         std::shared_ptr<TConfiguration> config = nullptr);
+
+  ~TSharedMemoryTransport() override;
+
+  bool isOpen() const override;
+
+  /**
+   * Blocks until data is available or the peer closed the connection.
+   */
+  bool peek() override;
+
+  void open() override;
+
+  void close() override;
+
+  uint32_t read(uint8_t* buf, uint32_t len);
+
+  void write(const uint8_t* buf, uint32_t len);
+
+  void flush() override;
+
+  const std::string getOrigin() const override;
+
+  /**
+   * Set the receive timeout in milliseconds, 0 waits forever.
+   */
+  void setRecvTimeout(int ms) { recvTimeout_ = ms; }
+
+  /**
+   * Set the send timeout in milliseconds, 0 waits forever. A send only
+   * blocks when the outgoing ring is full.
+   */
+  void setSendTimeout(int ms) { sendTimeout_ = ms; }
+
+  /**
+   * Capacity in bytes of each direction's ring buffer.
+   */
+  uint32_t getRingSize() const;
+
+  /**
+   * The rendezvous socket, can be used to identify the peer.
+   */
+  std::shared_ptr<TSocket> getSocket() const { return socket_; }
+
+protected:
+  friend class TSharedMemoryServerTransport;
+
+  /**
+   * Creates the shared segment for a freshly accepted rendezvous socket,
+   * hands its descriptors to the client and returns the server side end.
+   */
+  static std::shared_ptr<TSharedMemoryTransport> accept(std::shared_ptr<TSocket> socket,
+                                                        uint32_t ringSize,
+                                                        std::shared_ptr<int> interruptListener,
+                                                        std::shared_ptr<TConfiguration> config);
+
+private:
+  enum WaitResult { WAIT_TIMEOUT = 0, WAIT_WOKEN = 1, WAIT_INTERRUPTED = 2 };
+
+  /**
+   * Sleeps on an eventfd until it is signalled, the rendezvous socket shows
+   * the peer went away, the server interrupts us or the timeout expires.
+   */
+  WaitResult wait(int eventFd, int timeoutMs);
+
+  /**
+   * Waits until the incoming ring holds data.
+   *
+   * @return false if the peer closed and the ring is drained
+   * @throws TTransportException on timeout or interruption
+   */
+  bool waitForData();
+
+  void wakeReader();
+
+  void attach(std::shared_ptr<TSharedMemorySegment> segment, bool serverSide);
+
+  void detach();
+
+  std::string path_;
+  std::shared_ptr<TSocket> socket_;
+  std::shared_ptr<TSharedMemorySegment> segment_;
+  std::shared_ptr<int> interruptListener_;
+  TSharedMemoryRing* rx_;
+  TSharedMemoryRing* tx_;
+  uint8_t* rxData_;
+  uint8_t* txData_;
+  uint32_t ringMask_;
+  int rxDataFd_;
+  int rxSpaceFd_;
+  int txDataFd_;
+  int txSpaceFd_;
+  bool peerGone_;
+  int recvTimeout_;
+  int sendTimeout_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TSHAREDMEMORYTRANSPORT_H_
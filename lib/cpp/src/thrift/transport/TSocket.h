@@ -212,6 +212,11 @@ public:
    */
   void setRecvTimeout(int ms);
 
+  /**
+   * Get the receive timeout
+   */
+  int getRecvTimeout() const { return recvTimeout_; }
+
   /**
    * Set the send timeout
    */
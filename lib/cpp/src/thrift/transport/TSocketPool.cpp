@@ -22,9 +22,7 @@
 #include <algorithm>
 #include <iostream>
 #include <memory>
-#if __cplusplus >= 201703L
 #include <random>
-#endif
 
 #include <thrift/transport/TSocketPool.h>
 
@@ -37,13 +35,22 @@ namespace thrift {
 namespace transport {
 
 using std::shared_ptr;
+using apache::thrift::concurrency::Guard;
 
 /**
  * TSocketPoolServer implementation
  *
  */
 TSocketPoolServer::TSocketPoolServer()
-  : host_(""), port_(0), socket_(THRIFT_INVALID_SOCKET), lastFailTime_(0), consecutiveFailures_(0) {
+  : host_(""),
+    port_(0),
+    socket_(THRIFT_INVALID_SOCKET),
+    lastFailTime_(0),
+    consecutiveFailures_(0),
+    latencyWeight_(0.2),
+    latency_(0.0),
+    outstanding_(0),
+    ejectedUntil_(0) {
 }
 
 /**
@@ -54,7 +61,103 @@ TSocketPoolServer::TSocketPoolServer(const string& host, int port)
     port_(port),
     socket_(THRIFT_INVALID_SOCKET),
     lastFailTime_(0),
-    consecutiveFailures_(0) {
+    consecutiveFailures_(0),
+    latencyWeight_(0.2),
+    latency_(0.0),
+    outstanding_(0),
+    ejectedUntil_(0) {
+}
+
+void TSocketPoolServer::requestStarted() {
+  Guard g(mutex_);
+  ++outstanding_;
+}
+
+void TSocketPoolServer::requestFinished(int64_t latency, bool success) {
+  Guard g(mutex_);
+  if (outstanding_ > 0) {
+    --outstanding_;
+  }
+  if (success) {
+    if (latency_ == 0.0) {
+      latency_ = static_cast<double>(latency);
+    } else {
+      latency_ += latencyWeight_ * (static_cast<double>(latency) - latency_);
+    }
+  }
+}
+
+double TSocketPoolServer::getLatency() const {
+  Guard g(mutex_);
+  return latency_;
+}
+
+int TSocketPoolServer::getOutstanding() const {
+  Guard g(mutex_);
+  return outstanding_;
+}
+
+void TSocketPoolServer::eject(time_t until) {
+  Guard g(mutex_);
+  ejectedUntil_ = until;
+}
+
+bool TSocketPoolServer::isEjected(time_t now) {
+  Guard g(mutex_);
+  if (ejectedUntil_ == 0) {
+    return false;
+  }
+  if (now < ejectedUntil_) {
+    return true;
+  }
+  // back in rotation, judge it by new samples only
+  ejectedUntil_ = 0;
+  latency_ = 0.0;
+  return false;
+}
+
+/**
+ * Selection policies
+ */
+
+void TSocketPoolPowerOfTwoPolicy::order(vector<shared_ptr<TSocketPoolServer> >& servers) {
+  if (servers.size() < 2) {
+    return;
+  }
+  std::random_device rng;
+  std::mt19937 urng(rng());
+  std::shuffle(servers.begin(), servers.end(), urng);
+
+  // the first two are a random pick, put the cheaper one in front
+  double cost0 = servers[0]->getLatency() * (servers[0]->getOutstanding() + 1);
+  double cost1 = servers[1]->getLatency() * (servers[1]->getOutstanding() + 1);
+  if (cost1 < cost0) {
+    std::swap(servers[0], servers[1]);
+  }
+}
+
+void TSocketPoolLeastOutstandingPolicy::order(vector<shared_ptr<TSocketPoolServer> >& servers) {
+  if (servers.size() < 2) {
+    return;
+  }
+  std::random_device rng;
+  std::mt19937 urng(rng());
+  std::shuffle(servers.begin(), servers.end(), urng);
+
+  vector<std::pair<int, shared_ptr<TSocketPoolServer> > > byOutstanding;
+  byOutstanding.reserve(servers.size());
+  for (const auto& server : servers) {
+    byOutstanding.emplace_back(server->getOutstanding(), server);
+  }
+  std::stable_sort(byOutstanding.begin(),
+                   byOutstanding.end(),
+                   [](const std::pair<int, shared_ptr<TSocketPoolServer> >& a,
+                      const std::pair<int, shared_ptr<TSocketPoolServer> >& b) {
+                     return a.first < b.first;
+                   });
+  for (size_t i = 0; i < servers.size(); ++i) {
+    servers[i] = byOutstanding[i].second;
+  }
 }
 
 /**
@@ -68,7 +171,11 @@ TSocketPool::TSocketPool()
     retryInterval_(60),
     maxConsecutiveFailures_(1),
     randomize_(true),
-    alwaysTryLast_(true) {
+    alwaysTryLast_(true),
+    ejectionFactor_(0.0),
+    ejectionInterval_(60),
+    inRequest_(false),
+    requestSent_(false) {
 }
 
 TSocketPool::TSocketPool(const vector<string>& hosts, const vector<int>& ports)
@@ -77,7 +184,11 @@ TSocketPool::TSocketPool(const vector<string>& hosts, const vector<int>& ports)
     retryInterval_(60),
     maxConsecutiveFailures_(1),
     randomize_(true),
-    alwaysTryLast_(true) {
+    alwaysTryLast_(true),
+    ejectionFactor_(0.0),
+    ejectionInterval_(60),
+    inRequest_(false),
+    requestSent_(false) {
   if (hosts.size() != ports.size()) {
     GlobalOutput("TSocketPool::TSocketPool: hosts.size != ports.size");
     throw TTransportException(TTransportException::BAD_ARGS);
@@ -94,7 +205,11 @@ TSocketPool::TSocketPool(const vector<pair<string, int> >& servers)
     retryInterval_(60),
     maxConsecutiveFailures_(1),
     randomize_(true),
-    alwaysTryLast_(true) {
+    alwaysTryLast_(true),
+    ejectionFactor_(0.0),
+    ejectionInterval_(60),
+    inRequest_(false),
+    requestSent_(false) {
   for (const auto & server : servers) {
     addServer(server.first, server.second);
   }
@@ -107,7 +222,11 @@ TSocketPool::TSocketPool(const vector<shared_ptr<TSocketPoolServer> >& servers)
     retryInterval_(60),
     maxConsecutiveFailures_(1),
     randomize_(true),
-    alwaysTryLast_(true) {
+    alwaysTryLast_(true),
+    ejectionFactor_(0.0),
+    ejectionInterval_(60),
+    inRequest_(false),
+    requestSent_(false) {
 }
 
 TSocketPool::TSocketPool(const string& host, int port)
@@ -116,7 +235,11 @@ TSocketPool::TSocketPool(const string& host, int port)
     retryInterval_(60),
     maxConsecutiveFailures_(1),
     randomize_(true),
-    alwaysTryLast_(true) {
+    alwaysTryLast_(true),
+    ejectionFactor_(0.0),
+    ejectionInterval_(60),
+    inRequest_(false),
+    requestSent_(false) {
   addServer(host, port);
 }
 
@@ -167,6 +290,45 @@ void TSocketPool::setAlwaysTryLast(bool alwaysTryLast) {
   alwaysTryLast_ = alwaysTryLast;
 }
 
+void TSocketPool::setPolicy(shared_ptr<TSocketPoolPolicy> policy) {
+  policy_ = policy;
+}
+
+void TSocketPool::setEjectionFactor(double factor) {
+  ejectionFactor_ = factor;
+}
+
+void TSocketPool::setEjectionInterval(int ejectionInterval) {
+  ejectionInterval_ = ejectionInterval;
+}
+
+void TSocketPool::ejectOutliers(time_t now) {
+  vector<double> latencies;
+  for (const auto& server : servers_) {
+    double latency = server->getLatency();
+    if (latency > 0.0 && !server->isEjected(now)) {
+      latencies.push_back(latency);
+    }
+  }
+  if (latencies.size() < 2) {
+    return;
+  }
+
+  // the lower median, so that of two servers the slower one is measured
+  // against the faster one rather than itself
+  size_t median = (latencies.size() - 1) / 2;
+  std::nth_element(latencies.begin(), latencies.begin() + median, latencies.end());
+  double limit = ejectionFactor_ * latencies[median];
+  for (const auto& server : servers_) {
+    if (server->getLatency() > limit && !server->isEjected(now)) {
+      GlobalOutput.printf("TSocketPool: ejecting slow server %s:%d",
+                          server->host_.c_str(),
+                          server->port_);
+      server->eject(now + ejectionInterval_);
+    }
+  }
+}
+
 void TSocketPool::setCurrentServer(const shared_ptr<TSocketPoolServer>& server) {
   currentServer_ = server;
   host_ = server->host_;
@@ -191,7 +353,9 @@ void TSocketPool::open() {
     return;
   }
 
-  if (randomize_ && numServers > 1) {
+  if (policy_) {
+    policy_->order(servers_);
+  } else if (randomize_ && numServers > 1) {
 #if __cplusplus >= 201703L
     std::random_device rng;
     std::mt19937 urng(rng());
@@ -201,6 +365,17 @@ void TSocketPool::open() {
 #endif
   }
 
+  if (ejectionFactor_ > 0.0) {
+    time_t now = time(nullptr);
+    ejectOutliers(now);
+    // ejected servers are the last resort
+    std::stable_partition(servers_.begin(),
+                          servers_.end(),
+                          [now](const shared_ptr<TSocketPoolServer>& server) {
+                            return !server->isEjected(now);
+                          });
+  }
+
   for (size_t i = 0; i < numServers; ++i) {
 
     shared_ptr<TSocketPoolServer>& server = servers_[i];
@@ -255,7 +430,59 @@ void TSocketPool::open() {
   throw TTransportException(TTransportException::NOT_OPEN);
 }
 
+uint32_t TSocketPool::read(uint8_t* buf, uint32_t len) {
+  uint32_t got;
+  try {
+    got = TSocket::read(buf, len);
+  } catch (const TTransportException&) {
+    finishRequest(false);
+    throw;
+  }
+  if (inRequest_) {
+    finishRequest(got > 0);
+  }
+  return got;
+}
+
+uint32_t TSocketPool::write_partial(const uint8_t* buf, uint32_t len) {
+  if (requestSent_) {
+    // the request sent before got no response, like a oneway call, and
+    // leaves no sample: the wait for the next one is not its latency
+    finishRequest(false);
+  }
+  if (!inRequest_ && currentServer_) {
+    inRequest_ = true;
+    requestStart_ = std::chrono::steady_clock::now();
+    currentServer_->requestStarted();
+  }
+  try {
+    return TSocket::write_partial(buf, len);
+  } catch (const TTransportException&) {
+    finishRequest(false);
+    throw;
+  }
+}
+
+void TSocketPool::flush() {
+  TSocket::flush();
+  requestSent_ = inRequest_;
+}
+
+void TSocketPool::finishRequest(bool success) {
+  if (!inRequest_) {
+    return;
+  }
+  inRequest_ = false;
+  requestSent_ = false;
+  if (currentServer_) {
+    int64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - requestStart_).count();
+    currentServer_->requestFinished(latency, success);
+  }
+}
+
 void TSocketPool::close() {
+  finishRequest(false);
   TSocket::close();
   if (currentServer_) {
     currentServer_->socket_ = THRIFT_INVALID_SOCKET;
@@ -20,7 +20,9 @@
 #ifndef _THRIFT_TRANSPORT_TSOCKETPOOL_H_
 #define _THRIFT_TRANSPORT_TSOCKETPOOL_H_ 1
 
+#include <chrono>
 #include <vector>
+#include <thrift/concurrency/Mutex.h>
 #include <thrift/transport/TSocket.h>
 
 namespace apache {
@@ -58,6 +60,86 @@ public:
 
   // Number of consecutive times connecting to this server failed
   int consecutiveFailures_;
+
+  // Weight of the newest sample in the latency average, in (0, 1]
+  double latencyWeight_;
+
+  /**
+   * Records that a request to this server was sent. Pools sharing this
+   * object (see TSocketPool::setServers()) add up their requests.
+   */
+  void requestStarted();
+
+  /**
+   * Records that a request to this server got its response or failed.
+   *
+   * @param latency microseconds from sending the request to the first byte
+   *                of the response, ignored for failed requests
+   * @param success whether a response arrived
+   */
+  void requestFinished(int64_t latency, bool success);
+
+  /**
+   * @return exponentially weighted moving average of the request latency in
+   *         microseconds, 0 until the first response.
+   */
+  double getLatency() const;
+
+  /**
+   * @return number of requests sent but not yet answered.
+   */
+  int getOutstanding() const;
+
+  /**
+   * Takes the server out of rotation until the given time. Pools then only
+   * connect to it if all other servers fail.
+   */
+  void eject(time_t until);
+
+  /**
+   * Determines whether the server is ejected. Once the ejection ends the
+   * server starts over with no latency samples.
+   */
+  bool isEjected(time_t now);
+
+private:
+  mutable apache::thrift::concurrency::Mutex mutex_;
+  double latency_;
+  int outstanding_;
+  time_t ejectedUntil_;
+};
+
+/**
+ * Decides which servers of a TSocketPool to connect to first.
+ */
+class TSocketPoolPolicy {
+public:
+  virtual ~TSocketPoolPolicy() = default;
+
+  /**
+   * Puts the servers in the order the pool tries to connect to them.
+   */
+  virtual void order(std::vector<std::shared_ptr<TSocketPoolServer> >& servers) = 0;
+};
+
+/**
+ * Power of two choices on latency: of two servers picked at random, the one
+ * with the lower cost -- average latency times (outstanding requests + 1) --
+ * is tried first, the others follow in random order. Servers without latency
+ * samples yet cost nothing, so new servers get probed.
+ */
+class TSocketPoolPowerOfTwoPolicy : public TSocketPoolPolicy {
+public:
+  void order(std::vector<std::shared_ptr<TSocketPoolServer> >& servers) override;
+};
+
+/**
+ * Servers with the fewest outstanding requests are tried first, ties in
+ * random order.
+ */
+class TSocketPoolLeastOutstandingPolicy : public TSocketPoolPolicy {
+public:
+  void order(std::vector<std::shared_ptr<TSocketPoolServer> >& servers) override;
 };
 
 /**
@@ -152,6 +234,43 @@ public:
    */
   void setAlwaysTryLast(bool alwaysTryLast);
 
+  /**
+   * Sets the policy ordering the servers on open(), replacing setRandomize().
+   * nullptr restores the default behavior.
+   */
+  void setPolicy(std::shared_ptr<TSocketPoolPolicy> policy);
+
+  /**
+   * Ejects servers whose average latency exceeds factor times the lower
+   * median of all servers for setEjectionInterval() seconds, so traffic
+   * drains away from slow servers before they fail. 0 turns ejection off
+   * (the default).
+   */
+  void setEjectionFactor(double factor);
+
+  /**
+   * Sets how many seconds a slow server stays ejected.
+   */
+  void setEjectionInterval(int ejectionInterval);
+
+  /**
+   * Reads from the current server. The first bytes after a request complete
+   * its latency sample.
+   */
+  uint32_t read(uint8_t* buf, uint32_t len) override;
+
+  /**
+   * Writes to the current server. The first write after a response starts
+   * a new request. A request that was flushed and got no response before
+   * the next write, such as a oneway call, ends without a latency sample.
+   */
+  uint32_t write_partial(const uint8_t* buf, uint32_t len) override;
+
+  /**
+   * Marks the request being written as sent.
+   */
+  void flush() override;
+
   /**
    * Creates and opens the UNIX socket.
    */
@@ -165,6 +284,12 @@ public:
 protected:
   void setCurrentServer(const std::shared_ptr<TSocketPoolServer>& server);
 
+  /** Ejects the servers that are slow compared to the others */
+  void ejectOutliers(time_t now);
+
+  /** Ends the request in flight, if any, on the current server */
+  void finishRequest(bool success);
+
   /** List of servers to connect to */
   std::vector<std::shared_ptr<TSocketPoolServer> > servers_;
 
@@ -187,6 +312,24 @@ protected:
 
   /** Always try last host, even if marked down? */
   bool alwaysTryLast_;
+
+  /** Orders the servers on open(), nullptr for the default order */
+  std::shared_ptr<TSocketPoolPolicy> policy_;
+
+  /** Latency relative to the median that gets a server ejected, 0 for never */
+  double ejectionFactor_;
+
+  /** Seconds a slow server stays ejected */
+  time_t ejectionInterval_;
+
+  /** Is a request to the current server waiting for its response? */
+  bool inRequest_;
+
+  /** Was the request in flight flushed? */
+  bool requestSent_;
+
+  /** When the request in flight was sent */
+  std::chrono::steady_clock::time_point requestStart_;
 };
 }
 }
@@ -0,0 +1,236 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+
+#include <zlib.h>
+
+#include <thrift/transport/TTransportException.h>
+#include <thrift/transport/TZlibDictionary.h>
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+const uint32_t TZlibDictionary::MAX_SIZE;
+
+TZlibDictionary::TZlibDictionary(string data) : data_(std::move(data)) {
+  if (data_.size() > MAX_SIZE) {
+    // zlib only keeps the tail within its window anyway
+    data_.erase(0, data_.size() - MAX_SIZE);
+  }
+  id_ = static_cast<uint32_t>(adler32(adler32(0L, Z_NULL, 0),
+                                      reinterpret_cast<const Bytef*>(data_.data()),
+                                      static_cast<uInt>(data_.size())));
+}
+
+// TRAINING
+//
+// This is a simplified version of the "cover" algorithm used by zstd's
+// dictionary builder. Every 8 byte substring (k-mer) is scored by the number
+// of samples it occurs in. The concatenated samples are split into epochs, one
+// per segment the dictionary has room for, and from each epoch the segment
+// with the highest sum of k-mer scores is picked. The k-mers of a picked
+// segment are then scored zero so later epochs don't pick the same content
+// again. Segments never span two samples and are trimmed to the k-mers that
+// still had a score.
+
+namespace {
+
+const uint32_t KMER_SIZE = 8;
+const uint32_t SEGMENT_SIZE = 64;
+
+inline uint64_t kmerAt(const string& sample, size_t pos) {
+  uint64_t kmer;
+  memcpy(&kmer, sample.data() + pos, sizeof(kmer));
+  return kmer;
+}
+
+struct KmerCount {
+  KmerCount() : samples(0), lastSample(0) {}
+  uint32_t samples;
+  size_t lastSample;
+};
+
+struct Segment {
+  uint64_t score;
+  size_t sample;
+  size_t begin;
+  size_t end;
+};
+}
+
+shared_ptr<TZlibDictionary> TZlibDictionary::train(const vector<string>& samples,
+                                                   uint32_t maxSize) {
+  maxSize = (std::min)(maxSize, MAX_SIZE);
+
+  // count the samples each k-mer occurs in, lastSample is 1-based
+  std::unordered_map<uint64_t, KmerCount> counts;
+  vector<size_t> starts; // offset of each sample in the concatenation
+  size_t total = 0;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    starts.push_back(total);
+    total += samples[i].size();
+    for (size_t pos = 0; pos + KMER_SIZE <= samples[i].size(); ++pos) {
+      KmerCount& count = counts[kmerAt(samples[i], pos)];
+      if (count.lastSample != i + 1) {
+        count.lastSample = i + 1;
+        ++count.samples;
+      }
+    }
+  }
+
+  // k-mers found in only a few samples will rarely help compress a message
+  const uint32_t minSamples = (std::max)(2u, static_cast<uint32_t>(samples.size() / 100));
+  auto score = [&counts, minSamples](uint64_t kmer) -> uint32_t {
+    auto it = counts.find(kmer);
+    return (it == counts.end() || it->second.samples < minSamples) ? 0 : it->second.samples;
+  };
+
+  vector<Segment> picked;
+  size_t epochs = (std::max)(static_cast<size_t>(1), static_cast<size_t>(maxSize / SEGMENT_SIZE));
+  size_t epochSize = (std::max)(static_cast<size_t>(1), total / epochs);
+  for (size_t epochBegin = 0; epochBegin < total; epochBegin += epochSize) {
+    size_t epochEnd = (std::min)(total, epochBegin + epochSize);
+    Segment best = {0, 0, 0, 0};
+
+    // visit the samples overlapping this epoch
+    size_t i = std::upper_bound(starts.begin(), starts.end(), epochBegin) - starts.begin() - 1;
+    for (; i < samples.size() && starts[i] < epochEnd; ++i) {
+      const string& sample = samples[i];
+      if (sample.size() < KMER_SIZE) {
+        continue;
+      }
+      size_t first = epochBegin > starts[i] ? epochBegin - starts[i] : 0;
+      size_t last = (std::min)(sample.size() - KMER_SIZE + 1, epochEnd - starts[i]);
+
+      // sliding window over the k-mers of segments starting in [first, last)
+      uint64_t window = 0;
+      size_t windowEnd = first;
+      for (size_t begin = first; begin < last; ++begin) {
+        size_t kmersEnd = (std::min)(begin + SEGMENT_SIZE - KMER_SIZE + 1,
+                                     sample.size() - KMER_SIZE + 1);
+        for (; windowEnd < kmersEnd; ++windowEnd) {
+          window += score(kmerAt(sample, windowEnd));
+        }
+        if (window > best.score) {
+          best.score = window;
+          best.sample = i;
+          best.begin = begin;
+          best.end = kmersEnd + KMER_SIZE - 1;
+        }
+        window -= score(kmerAt(sample, begin));
+      }
+    }
+
+    if (best.score == 0) {
+      continue;
+    }
+    // drop content that is already covered from both ends
+    const string& sample = samples[best.sample];
+    while (score(kmerAt(sample, best.begin)) == 0) {
+      ++best.begin;
+    }
+    while (score(kmerAt(sample, best.end - KMER_SIZE)) == 0) {
+      --best.end;
+    }
+    for (size_t pos = best.begin; pos + KMER_SIZE <= best.end; ++pos) {
+      counts.erase(kmerAt(samples[best.sample], pos));
+    }
+    picked.push_back(best);
+  }
+
+  // keep the best segments that fit, most valuable at the end
+  std::stable_sort(picked.begin(), picked.end(), [](const Segment& a, const Segment& b) {
+    return a.score > b.score;
+  });
+  size_t size = 0;
+  size_t count = 0;
+  for (; count < picked.size() && size + picked[count].end - picked[count].begin <= maxSize;
+       ++count) {
+    size += picked[count].end - picked[count].begin;
+  }
+  if (count == 0) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "TZlibDictionary: samples have no content in common");
+  }
+  string data;
+  data.reserve(size);
+  while (count-- > 0) {
+    const Segment& segment = picked[count];
+    data.append(samples[segment.sample], segment.begin, segment.end - segment.begin);
+  }
+  return std::make_shared<TZlibDictionary>(std::move(data));
+}
+
+shared_ptr<TZlibDictionary> TZlibDictionary::load(const string& path) {
+  std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+  if (!in) {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TZlibDictionary: cannot open " + path);
+  }
+  std::ostringstream data;
+  data << in.rdbuf();
+  return std::make_shared<TZlibDictionary>(data.str());
+}
+
+void TZlibDictionary::save(const string& path) const {
+  std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  out.write(data_.data(), data_.size());
+  out.close();
+  if (!out) {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TZlibDictionary: cannot write " + path);
+  }
+}
+
+void TZlibDictionarySet::add(shared_ptr<const TZlibDictionary> dictionary) {
+  if (!dictionary) {
+    throw TTransportException(TTransportException::BAD_ARGS, "TZlibDictionarySet: null dictionary");
+  }
+  if (dictionaries_.empty()) {
+    writeId_ = dictionary->getId();
+  }
+  dictionaries_[dictionary->getId()] = dictionary;
+}
+
+shared_ptr<const TZlibDictionary> TZlibDictionarySet::find(uint32_t id) const {
+  auto it = dictionaries_.find(id);
+  return it == dictionaries_.end() ? nullptr : it->second;
+}
+
+void TZlibDictionarySet::setWriteDictionary(uint32_t id) {
+  if (dictionaries_.find(id) == dictionaries_.end()) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "TZlibDictionarySet: unknown dictionary id");
+  }
+  writeId_ = id;
+}
+}
+}
+} // apache::thrift::transport
@@ -0,0 +1,123 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TZLIBDICTIONARY_H_
+#define _THRIFT_TRANSPORT_TZLIBDICTIONARY_H_ 1
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <thrift/Thrift.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * A preset dictionary for zlib compression.
+ *
+ * Priming the compressor with content that is typical for the messages being
+ * sent (field names, enum strings, common struct layouts) lets even messages
+ * of a few hundred bytes compress well, which they otherwise don't because
+ * zlib has no history to refer back to.
+ *
+ * A dictionary is identified by its id, the adler32 checksum zlib records in
+ * the header of a stream compressed with it. The reading side uses that id to
+ * pick the matching dictionary, so both ends must have been given the same
+ * dictionary data.
+ */
+class TZlibDictionary {
+public:
+  /**
+   * zlib's window size, longer dictionaries are only partially used.
+   */
+  static const uint32_t MAX_SIZE = 32768;
+
+  explicit TZlibDictionary(std::string data);
+
+  uint32_t getId() const { return id_; }
+
+  const std::string& getData() const { return data_; }
+
+  /**
+   * Builds a dictionary from sample messages.
+   *
+   * Substrings that occur in many different samples are collected, the most
+   * valuable ones last as zlib encodes close matches more cheaply. Content
+   * that occurs in a single sample only is never picked.
+   *
+   * @param samples Representative messages, e.g. read from a request log
+   * @param maxSize Maximum size of the dictionary in bytes
+   * @throws TTransportException if the samples have nothing in common
+   */
+  static std::shared_ptr<TZlibDictionary> train(const std::vector<std::string>& samples,
+                                                uint32_t maxSize = MAX_SIZE);
+
+  /**
+   * Loads a dictionary previously saved with save().
+   */
+  static std::shared_ptr<TZlibDictionary> load(const std::string& path);
+
+  void save(const std::string& path) const;
+
+private:
+  std::string data_;
+  uint32_t id_;
+};
+
+/**
+ * The dictionaries a transport knows about, keyed by id.
+ *
+ * Incoming streams may use any dictionary in the set, outgoing ones are
+ * compressed with the write dictionary, which is the first one added unless
+ * chosen otherwise. Populate the set before handing it to transports, it may
+ * then be shared by any number of them.
+ */
+class TZlibDictionarySet {
+public:
+  TZlibDictionarySet() : writeId_(0) {}
+
+  void add(std::shared_ptr<const TZlibDictionary> dictionary);
+
+  /**
+   * Returns the dictionary with the given id, or nullptr if it is unknown.
+   */
+  std::shared_ptr<const TZlibDictionary> find(uint32_t id) const;
+
+  /**
+   * Returns the dictionary to compress with, or nullptr if the set is empty.
+   */
+  std::shared_ptr<const TZlibDictionary> getWriteDictionary() const { return find(writeId_); }
+
+  /**
+   * Selects the dictionary to compress with, it must have been added before.
+   */
+  void setWriteDictionary(uint32_t id);
+
+private:
+  std::map<uint32_t, std::shared_ptr<const TZlibDictionary> > dictionaries_;
+  uint32_t writeId_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TZLIBDICTIONARY_H_
@@ -202,6 +202,14 @@ bool TZlibTransport::readFromZlib() {
 
   // We have some compressed data now.  Uncompress it.
   int zlib_rv = inflate(rstream_, Z_SYNC_FLUSH);
+  if (zlib_rv == Z_NEED_DICT) {
+    setInflateDictionary();
+    if (rstream_->avail_in == 0) {
+      // only the stream header has arrived so far
+      return true;
+    }
+    zlib_rv = inflate(rstream_, Z_SYNC_FLUSH);
+  }
 
   if (zlib_rv == Z_STREAM_END) {
     input_ended_ = true;
@@ -212,6 +220,41 @@ bool TZlibTransport::readFromZlib() {
   return true;
 }
 
+// The stream header asked for a preset dictionary, rstream_->adler holds its id.
+void TZlibTransport::setInflateDictionary() {
+  std::shared_ptr<const TZlibDictionary> dictionary;
+  if (dictionaries_) {
+    dictionary = dictionaries_->find(static_cast<uint32_t>(rstream_->adler));
+  }
+  if (!dictionary) {
+    throw TZlibTransportException(Z_NEED_DICT, "unknown preset dictionary");
+  }
+  int zlib_rv = inflateSetDictionary(rstream_,
+                                     reinterpret_cast<const Bytef*>(dictionary->getData().data()),
+                                     static_cast<uInt>(dictionary->getData().size()));
+  checkZlibRv(zlib_rv, rstream_->msg);
+}
+
+void TZlibTransport::setDictionaries(std::shared_ptr<const TZlibDictionarySet> dictionaries) {
+  if (rstream_->total_in > 0 || wstream_->total_in > 0 || uwpos_ > 0) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "setDictionaries() called after data was transferred");
+  }
+  dictionaries_ = dictionaries;
+
+  std::shared_ptr<const TZlibDictionary> dictionary;
+  if (dictionaries_) {
+    dictionary = dictionaries_->getWriteDictionary();
+  }
+  if (dictionary) {
+    int zlib_rv = deflateSetDictionary(wstream_,
+                                       reinterpret_cast<const Bytef*>(dictionary->getData().data()),
+                                       static_cast<uInt>(dictionary->getData().size()));
+    checkZlibRv(zlib_rv, wstream_->msg);
+    keep_history_ = true;
+  }
+}
+
 // WRITING STRATEGY
 //
 // We buffer up small writes before sending them to zlib, so our logic is:
@@ -265,7 +308,7 @@ void TZlibTransport::flush() {
     wstream_->avail_out = cwbuf_size_;
   }
 
-  flushToTransport(Z_FULL_FLUSH);
+  flushToTransport(keep_history_ ? Z_SYNC_FLUSH : Z_FULL_FLUSH);
   resetConsumedMessageSize();
 }
 
@@ -406,11 +449,16 @@ TZlibTransportFactory::TZlibTransportFactory(std::shared_ptr<TTransportFactory>
 }
 
 std::shared_ptr<TTransport> TZlibTransportFactory::getTransport(std::shared_ptr<TTransport> trans) {
+  std::shared_ptr<TZlibTransport> zlibTrans;
   if (transportFactory_) {
-    return std::shared_ptr<TTransport>(new TZlibTransport(transportFactory_->getTransport(trans)));
+    zlibTrans.reset(new TZlibTransport(transportFactory_->getTransport(trans)));
   } else {
-    return std::shared_ptr<TTransport>(new TZlibTransport(trans));
+    zlibTrans.reset(new TZlibTransport(trans));
+  }
+  if (dictionaries_) {
+    zlibTrans->setDictionaries(dictionaries_);
   }
+  return zlibTrans;
 }
 }
 }
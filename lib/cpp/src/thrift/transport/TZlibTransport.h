@@ -22,6 +22,7 @@
 
 #include <thrift/transport/TTransport.h>
 #include <thrift/transport/TVirtualTransport.h>
+#include <thrift/transport/TZlibDictionary.h>
 #include <thrift/TToString.h>
 #include <zlib.h>
 
@@ -101,7 +102,8 @@ public:
       cwbuf_(nullptr),
       rstream_(nullptr),
       wstream_(nullptr),
-      comp_level_(comp_level) {
+      comp_level_(comp_level),
+      keep_history_(false) {
     if (uwbuf_size_ < MIN_DIRECT_DEFLATE_SIZE) {
       // Have to copy this into a local because of a linking issue.
       int minimum = MIN_DIRECT_DEFLATE_SIZE;
@@ -174,6 +176,20 @@ public:
    */
   void verifyChecksum();
 
+  /**
+   * Use preset dictionaries.
+   *
+   * The write dictionary of the set primes the compressor, and the id
+   * recorded in the stream header tells the reading side which dictionary
+   * of its own set to use. Since a dictionary can only be applied at the
+   * start of a zlib stream, flush() then keeps the compression history
+   * (Z_SYNC_FLUSH instead of Z_FULL_FLUSH) so that later messages benefit
+   * from it too.
+   *
+   * Must be called before any data is read or written.
+   */
+  void setDictionaries(std::shared_ptr<const TZlibDictionarySet> dictionaries);
+
   /**
    * TODO(someone_smart): Choose smart defaults.
    */
@@ -191,6 +207,7 @@ protected:
   void flushToTransport(int flush);
   void flushToZlib(const uint8_t* buf, int len, int flush);
   bool readFromZlib();
+  void setInflateDictionary();
 
 protected:
   // Writes smaller than this are buffered up.
@@ -221,6 +238,10 @@ protected:
   struct z_stream_s* wstream_;
 
   const int comp_level_;
+
+  std::shared_ptr<const TZlibDictionarySet> dictionaries_;
+  /// True iff flush() must not reset the compression history.
+  bool keep_history_;
 };
 
 /**
@@ -240,8 +261,16 @@ public:
 
   std::shared_ptr<TTransport> getTransport(std::shared_ptr<TTransport> trans) override;
 
+  /**
+   * Preset dictionaries for the transports created from now on.
+   */
+  void setDictionaries(std::shared_ptr<const TZlibDictionarySet> dictionaries) {
+    dictionaries_ = dictionaries;
+  }
+
 protected:
   std::shared_ptr<TTransportFactory> transportFactory_;
+  std::shared_ptr<const TZlibDictionarySet> dictionaries_;
 };
 
 }
@@ -0,0 +1,301 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE TClientPoolTest
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TThreadedServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TClientPool.h>
+#include <thrift/transport/TServerSocket.h>
+#include "gen-cpp/ParentService.h"
+
+using apache::thrift::concurrency::Monitor;
+using apache::thrift::concurrency::Synchronized;
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::server::TServerEventHandler;
+using apache::thrift::server::TThreadedServer;
+using apache::thrift::test::ParentServiceClient;
+using apache::thrift::test::ParentServiceIf;
+using apache::thrift::test::ParentServiceProcessor;
+using apache::thrift::transport::TClientPool;
+using apache::thrift::transport::TFramedTransportFactory;
+using apache::thrift::transport::TServerSocket;
+using apache::thrift::transport::TTransportException;
+using std::make_shared;
+using std::shared_ptr;
+
+typedef TClientPool<ParentServiceClient> ParentClientPool;
+
+class Handler : public ParentServiceIf {
+public:
+  Handler() : generation_(0) {}
+
+  int32_t incrementGeneration() override { return ++generation_; }
+  int32_t getGeneration() override { return generation_; }
+  void addString(const std::string& s) override { THRIFT_UNUSED_VARIABLE(s); }
+  void getStrings(std::vector<std::string>& _return) override { THRIFT_UNUSED_VARIABLE(_return); }
+  void getDataWait(std::string& _return, const int32_t length) override {
+    THRIFT_UNUSED_VARIABLE(_return);
+    THRIFT_UNUSED_VARIABLE(length);
+  }
+  void onewayWait() override {}
+  void exceptionWait(const std::string& message) override { THRIFT_UNUSED_VARIABLE(message); }
+  void unexpectedExceptionWait(const std::string& message) override {
+    THRIFT_UNUSED_VARIABLE(message);
+  }
+
+  std::atomic<int32_t> generation_;
+};
+
+class EventHandler : public TServerEventHandler, public Monitor {
+public:
+  EventHandler() : listening_(false), accepted_(0) {}
+  void preServe() override {
+    Synchronized s(*this);
+    listening_ = true;
+    notifyAll();
+  }
+  void* createContext(shared_ptr<TProtocol> input, shared_ptr<TProtocol> output) override {
+    THRIFT_UNUSED_VARIABLE(input);
+    THRIFT_UNUSED_VARIABLE(output);
+    ++accepted_;
+    return nullptr;
+  }
+
+  bool listening_;
+  std::atomic<int> accepted_;
+};
+
+struct Fixture {
+  Fixture() : handler(make_shared<Handler>()), port(0) {}
+
+  ~Fixture() { stopServer(); }
+
+  void startServer() {
+    eventHandler = make_shared<EventHandler>();
+    server = make_shared<TThreadedServer>(make_shared<ParentServiceProcessor>(handler),
+                                          make_shared<TServerSocket>("localhost", port),
+                                          make_shared<TFramedTransportFactory>(),
+                                          make_shared<TBinaryProtocolFactory>());
+    server->setServerEventHandler(eventHandler);
+    thread = std::thread([this] { server->serve(); });
+    Synchronized s(*eventHandler);
+    while (!eventHandler->listening_) {
+      eventHandler->wait();
+    }
+    port = std::static_pointer_cast<TServerSocket>(server->getServerTransport())->getPort();
+  }
+
+  void stopServer() {
+    if (thread.joinable()) {
+      server->stop();
+      thread.join();
+    }
+  }
+
+  shared_ptr<ParentClientPool> makePool(size_t maxConnections = 0) {
+    shared_ptr<ParentClientPool> pool
+        = make_shared<ParentClientPool>(make_shared<TFramedTransportFactory>());
+    pool->addEndpoint("localhost", port, maxConnections);
+    return pool;
+  }
+
+  shared_ptr<Handler> handler;
+  shared_ptr<EventHandler> eventHandler;
+  shared_ptr<TThreadedServer> server;
+  std::thread thread;
+  int port;
+};
+
+BOOST_FIXTURE_TEST_SUITE(TClientPoolTest, Fixture)
+
+BOOST_AUTO_TEST_CASE(reuses_connections) {
+  startServer();
+  shared_ptr<ParentClientPool> pool = makePool();
+  for (int i = 1; i <= 5; ++i) {
+    BOOST_CHECK_EQUAL(pool->lease()->incrementGeneration(), i);
+    BOOST_CHECK_EQUAL(pool->getNumIdle(), 1u);
+    BOOST_CHECK_EQUAL(pool->getNumLeased(), 0u);
+  }
+  BOOST_CHECK_EQUAL(pool->getNumConnections(), 1u);
+  BOOST_CHECK_EQUAL(eventHandler->accepted_, 1);
+
+  {
+    ParentClientPool::Lease lease1 = pool->lease();
+    ParentClientPool::Lease lease2 = pool->lease();
+    BOOST_CHECK(lease1.get() != lease2.get());
+    BOOST_CHECK_EQUAL(pool->getNumLeased(), 2u);
+    lease2.invalidate();
+  }
+  BOOST_CHECK_EQUAL(pool->getNumConnections(), 1u);
+  BOOST_CHECK_EQUAL(pool->getNumLeased(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(max_idle) {
+  startServer();
+  shared_ptr<ParentClientPool> pool = makePool();
+  pool->setMaxIdle(2);
+  {
+    std::vector<ParentClientPool::Lease> leases;
+    for (int i = 0; i < 4; ++i) {
+      leases.push_back(pool->lease());
+    }
+    BOOST_CHECK_EQUAL(pool->getNumConnections(), 4u);
+  }
+  BOOST_CHECK_EQUAL(pool->getNumIdle(), 2u);
+  BOOST_CHECK_EQUAL(pool->getNumConnections(), 2u);
+}
+
+BOOST_AUTO_TEST_CASE(endpoint_limit_and_lease_timeout) {
+  startServer();
+  shared_ptr<ParentClientPool> pool = makePool(2);
+  pool->setLeaseTimeout(50);
+  ParentClientPool::Lease lease1 = pool->lease();
+  ParentClientPool::Lease lease2 = pool->lease();
+  try {
+    pool->lease();
+    BOOST_ERROR("lease beyond the endpoint limit did not time out");
+  } catch (const TTransportException& e) {
+    BOOST_CHECK_EQUAL(e.getType(), TTransportException::TIMED_OUT);
+  }
+
+  std::thread releaser([&lease1] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    lease1.release();
+  });
+  pool->setLeaseTimeout(0);
+  BOOST_CHECK_EQUAL(pool->lease()->incrementGeneration(), 1);
+  releaser.join();
+  BOOST_CHECK_EQUAL(pool->getNumConnections(), 2u);
+}
+
+BOOST_AUTO_TEST_CASE(replaces_stale_connections) {
+  startServer();
+  shared_ptr<ParentClientPool> pool = makePool();
+  BOOST_CHECK_EQUAL(pool->lease()->incrementGeneration(), 1);
+
+  // the server closes the idle connection
+  stopServer();
+  startServer();
+  BOOST_CHECK_EQUAL(pool->lease()->incrementGeneration(), 2);
+  BOOST_CHECK_EQUAL(pool->getNumConnections(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(replaces_connections_with_buffered_responses) {
+  startServer();
+  shared_ptr<ParentClientPool> pool = makePool();
+  {
+    ParentClientPool::Lease lease = pool->lease();
+    lease->send_incrementGeneration();
+    // the framed transport buffers the whole response, the socket is drained
+    uint8_t byte;
+    lease->getInputProtocol()->getTransport()->read(&byte, 1);
+  }
+  BOOST_CHECK_EQUAL(pool->lease()->incrementGeneration(), 2);
+  BOOST_CHECK_EQUAL(pool->getNumConnections(), 1u);
+  BOOST_CHECK_EQUAL(eventHandler->accepted_, 2);
+}
+
+BOOST_AUTO_TEST_CASE(fails_over_between_endpoints) {
+  startServer();
+  // a port nobody listens on
+  TServerSocket unused("localhost", 0);
+  unused.listen();
+  int deadPort = unused.getPort();
+  unused.close();
+
+  shared_ptr<ParentClientPool> pool
+      = make_shared<ParentClientPool>(make_shared<TFramedTransportFactory>());
+  pool->addEndpoint("localhost", deadPort);
+  pool->addEndpoint("localhost", port);
+  for (int i = 1; i <= 3; ++i) {
+    ParentClientPool::Lease lease1 = pool->lease();
+    ParentClientPool::Lease lease2 = pool->lease();
+    BOOST_CHECK_EQUAL(lease1->incrementGeneration() + lease2->incrementGeneration(), 4 * i - 1);
+  }
+  BOOST_CHECK_EQUAL(pool->getNumConnections(), 2u);
+
+  shared_ptr<ParentClientPool> deadPool
+      = make_shared<ParentClientPool>(make_shared<TFramedTransportFactory>());
+  deadPool->addEndpoint("localhost", deadPort);
+  try {
+    deadPool->lease();
+    BOOST_ERROR("lease from an unreachable endpoint succeeded");
+  } catch (const TTransportException& e) {
+    BOOST_CHECK_EQUAL(e.getType(), TTransportException::NOT_OPEN);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(keepalive_validation) {
+  startServer();
+  shared_ptr<ParentClientPool> pool = makePool();
+  std::atomic<int> validations(0);
+  std::atomic<bool> healthy(true);
+  pool->setValidator([&](ParentServiceClient& client) {
+    ++validations;
+    client.getGeneration();
+    return healthy.load();
+  });
+  pool->setMinIdle(2);
+  pool->setValidationInterval(20);
+  pool->start();
+  BOOST_CHECK_EQUAL(pool->getNumIdle(), 2u);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  BOOST_CHECK_GE(validations, 2);
+  BOOST_CHECK_EQUAL(eventHandler->accepted_, 2);
+
+  // failed validations get the connections replaced
+  healthy = false;
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  pool->stop();
+  BOOST_CHECK_GT(eventHandler->accepted_, 2);
+  BOOST_CHECK_EQUAL(pool->getNumIdle(), 0u);
+  BOOST_CHECK_EQUAL(pool->getNumConnections(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_leases) {
+  startServer();
+  shared_ptr<ParentClientPool> pool = makePool(4);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 16; ++i) {
+    threads.emplace_back([pool] {
+      for (int j = 0; j < 100; ++j) {
+        pool->lease()->incrementGeneration();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  BOOST_CHECK_EQUAL(handler->generation_, 1600);
+  BOOST_CHECK_LE(pool->getNumConnections(), 4u);
+  BOOST_CHECK_LE(eventHandler->accepted_, 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -25,10 +25,27 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#include <sys/stat.h>
 #include <getopt.h>
 #include <boost/test/unit_test.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <thrift/concurrency/ThreadFactory.h>
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TFileTransport.h>
+#ifndef _WIN32
+#include <thrift/transport/TMappedFileTransport.h>
+#endif
 
 #ifdef __MINGW32__
   #include <io.h>
@@ -48,6 +65,8 @@ static const char* tmp_dir = "/tmp";
 
 class FsyncLog;
 FsyncLog* fsync_log;
+// simulated disk latency of fsync() and fdatasync(), in microseconds
+uint32_t fsync_delay_us = 0;
 
 /**************************************************************************
  * Helper code
@@ -148,9 +167,19 @@ extern "C" int fsync(int fd) {
   if (fsync_log) {
     fsync_log->fsync(fd);
   }
+  if (fsync_delay_us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(fsync_delay_us));
+  }
   return 0;
 }
 
+#ifdef HAVE_FDATASYNC
+// TFileTransport prefers fdatasync() where it is available.
+extern "C" int fdatasync(int fd) {
+  return fsync(fd);
+}
+#endif
+
 int time_diff(const struct timeval* t1, const struct timeval* t2) {
   return (t2->tv_usec - t1->tv_usec) + (t2->tv_sec - t1->tv_sec) * 1000000;
 }
@@ -336,6 +365,543 @@ BOOST_AUTO_TEST_CASE(test_noop_flush) {
   }
 }
 
+/**
+ * Write events from several threads through a small queue, so producers
+ * have to wait for the writer thread, and read them back.
+ */
+BOOST_AUTO_TEST_CASE(test_concurrent_writers) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+
+  const uint32_t NUM_THREADS = 8;
+  const uint32_t NUM_EVENTS = 2000;
+  const uint32_t EVENT_SIZE = 100;
+  const uint32_t CHUNK_SIZE = 4096;
+  {
+    TFileTransport transport(f.getPath());
+    transport.setEventBufferSize(16);
+    transport.setChunkSize(CHUNK_SIZE);
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < NUM_THREADS; ++t) {
+      threads.push_back(std::thread([&transport, t, NUM_EVENTS, EVENT_SIZE]() {
+        uint32_t event[EVENT_SIZE / sizeof(uint32_t)] = {t};
+        for (uint32_t n = 0; n < NUM_EVENTS; ++n) {
+          event[1] = n;
+          transport.write(reinterpret_cast<const uint8_t*>(event), EVENT_SIZE);
+        }
+      }));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    transport.flush();
+  }
+
+  // every event arrives once, in order per thread, and none crosses a chunk
+  TFileTransport reader(f.getPath(), true);
+  reader.setChunkSize(CHUNK_SIZE);
+  std::vector<uint32_t> next(NUM_THREADS, 0);
+  uint32_t event[EVENT_SIZE / sizeof(uint32_t)];
+  uint32_t total = 0;
+  while (reader.read(reinterpret_cast<uint8_t*>(event), EVENT_SIZE) == EVENT_SIZE) {
+    BOOST_REQUIRE_LT(event[0], NUM_THREADS);
+    BOOST_CHECK_EQUAL(next[event[0]]++, event[1]);
+    ++total;
+  }
+  BOOST_CHECK_EQUAL(NUM_THREADS * NUM_EVENTS, total);
+}
+
+/**
+ * Write events from several threads that each wait for their own event to
+ * be durable. Waiters that arrive while the writer thread syncs share the
+ * next sync, so there are far fewer syncs than events.
+ */
+BOOST_AUTO_TEST_CASE(test_group_commit) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+
+  const uint32_t NUM_THREADS = 8;
+  const uint32_t NUM_EVENTS = 50;
+  const uint32_t EVENT_SIZE = 64;
+
+  FsyncLog log;
+  {
+    TFileTransport transport(f.getPath());
+    transport.setFlushMaxUs(10 * 1000 * 1000);
+    // start the writer thread before logging syncs
+    uint8_t event[EVENT_SIZE] = {0};
+    transport.waitForSync(transport.writeEvent(event, EVENT_SIZE));
+
+    fsync_log = &log;
+    fsync_delay_us = 1000;
+    std::atomic<uint32_t> synced(0);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < NUM_THREADS; ++t) {
+      threads.push_back(std::thread([&transport, &synced, NUM_EVENTS, EVENT_SIZE]() {
+        uint8_t event[EVENT_SIZE] = {1};
+        for (uint32_t n = 0; n < NUM_EVENTS; ++n) {
+          uint64_t ticket = transport.writeEvent(event, EVENT_SIZE);
+          transport.waitForSync(ticket);
+          if (ticket != 0 && transport.isSynced(ticket)) {
+            ++synced;
+          }
+        }
+      }));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    fsync_log = nullptr;
+    fsync_delay_us = 0;
+    BOOST_CHECK_EQUAL(NUM_THREADS * NUM_EVENTS, synced);
+  }
+
+  size_t syncs = log.getCalls()->size();
+  BOOST_CHECK_GT(syncs, 0u);
+  BOOST_CHECK_LT(syncs, NUM_THREADS * NUM_EVENTS / 2);
+}
+
+/**
+ * Read a log written with setPreallocate() or setDirectIO() back.
+ */
+void check_log(const char* path, uint32_t numEvents, uint32_t (*eventSize)(uint32_t)) {
+  TFileTransport reader(path, true);
+  std::vector<uint8_t> buf(64 * 1024);
+  for (uint32_t n = 0; n < numEvents; ++n) {
+    uint32_t size = eventSize(n);
+    BOOST_REQUIRE_EQUAL(size, reader.read(buf.data(), static_cast<uint32_t>(buf.size())));
+    BOOST_CHECK_EQUAL(static_cast<uint8_t>(n), buf[0]);
+    BOOST_CHECK_EQUAL(static_cast<uint8_t>(n), buf[size - 1]);
+  }
+  BOOST_CHECK_EQUAL(0u, reader.read(buf.data(), static_cast<uint32_t>(buf.size())));
+}
+
+void write_log(TFileTransport& transport, uint32_t first, uint32_t numEvents,
+               uint32_t (*eventSize)(uint32_t)) {
+  std::vector<uint8_t> buf(64 * 1024);
+  for (uint32_t n = first; n < first + numEvents; ++n) {
+    memset(buf.data(), static_cast<uint8_t>(n), eventSize(n));
+    transport.write(buf.data(), eventSize(n));
+  }
+  transport.flush();
+}
+
+uint32_t mixed_event_size(uint32_t n) {
+  return 1 + (n * 7919) % 20000;
+}
+
+BOOST_AUTO_TEST_CASE(test_preallocate) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t CHUNK_SIZE = 1024 * 1024;
+  {
+    TFileTransport transport(f.getPath());
+    transport.setChunkSize(CHUNK_SIZE);
+    transport.setPreallocate(true);
+    write_log(transport, 0, 10, mixed_event_size);
+
+    // the file keeps its size, but the rest of the chunk is reserved
+    struct stat st;
+    BOOST_REQUIRE_EQUAL(0, stat(f.getPath(), &st));
+    BOOST_CHECK_LT(st.st_size, static_cast<off_t>(CHUNK_SIZE));
+    BOOST_WARN_GE(st.st_blocks * 512, static_cast<off_t>(CHUNK_SIZE));
+  }
+  check_log(f.getPath(), 10, mixed_event_size);
+}
+
+BOOST_AUTO_TEST_CASE(test_direct_io) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  {
+    TFileTransport transport(f.getPath());
+    transport.setDirectIO(true);
+    write_log(transport, 0, 300, mixed_event_size);
+  }
+  // reopening stages the partial block at the end of the log again
+  {
+    TFileTransport transport(f.getPath());
+    transport.setDirectIO(true);
+    write_log(transport, 300, 300, mixed_event_size);
+  }
+  check_log(f.getPath(), 600, mixed_event_size);
+}
+
+/**
+ * Writes events that start with their ordinal, of 8 to 907 bytes.
+ */
+void write_numbered_events(TFileTransport& transport, uint32_t first, uint32_t count) {
+  std::vector<uint8_t> buf(1000, 0);
+  for (uint32_t n = first; n < first + count; ++n) {
+    memcpy(buf.data(), &n, 4);
+    transport.write(buf.data(), 8 + (n * 37) % 900);
+  }
+  transport.flush();
+}
+
+uint32_t read_event_number(TFileReaderTransport& transport) {
+  uint8_t buf[1000];
+  uint32_t n = (std::numeric_limits<uint32_t>::max)();
+  if (transport.read(buf, sizeof(buf)) >= 4) {
+    memcpy(&n, buf, 4);
+  }
+  return n;
+}
+
+/**
+ * Checks seeking in a log of numbered events, where the first half was
+ * written before middle and the second half after it.
+ */
+template <typename Transport>
+void check_index_seek(Transport& transport, uint32_t numEvents, uint32_t interval, int64_t middle) {
+  for (uint32_t event : {0u, 1u, 15u, 16u, 17u, 500u, 777u, 998u}) {
+    transport.seekToEvent(event);
+    BOOST_CHECK_EQUAL(event, read_event_number(transport));
+    BOOST_CHECK_EQUAL(event + 1, read_event_number(transport));
+  }
+  transport.seekToEvent(numEvents);
+  uint8_t buf[1000];
+  BOOST_CHECK_EQUAL(0u, transport.read(buf, sizeof(buf)));
+
+  // lands on the last indexed event written before the time
+  transport.seekToTime(middle);
+  uint32_t first = read_event_number(transport);
+  BOOST_CHECK_LE(first, numEvents / 2);
+  BOOST_CHECK_GT(first + interval, numEvents / 2);
+  transport.seekToTime(0);
+  BOOST_CHECK_EQUAL(0u, read_event_number(transport));
+}
+
+BOOST_AUTO_TEST_CASE(test_index_seek) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t CHUNK_SIZE = 4096;
+  const uint32_t NUM_EVENTS = 1000;
+  const uint32_t INTERVAL = 16;
+
+  int64_t middle;
+  {
+    TFileTransport transport(f.getPath());
+    transport.setChunkSize(CHUNK_SIZE);
+    transport.setIndexInterval(INTERVAL);
+    write_numbered_events(transport, 0, NUM_EVENTS / 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    middle = std::chrono::duration_cast<std::chrono::microseconds>(
+                 std::chrono::system_clock::now().time_since_epoch()).count();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    write_numbered_events(transport, NUM_EVENTS / 2, NUM_EVENTS / 2);
+  }
+  std::vector<TFileTransportIndex::Entry> entries = TFileTransportIndex::load(f.getPath());
+  BOOST_CHECK_EQUAL((NUM_EVENTS + INTERVAL - 1) / INTERVAL, entries.size());
+
+  TFileTransport reader(f.getPath(), true);
+  reader.setChunkSize(CHUNK_SIZE);
+  check_index_seek(reader, NUM_EVENTS, INTERVAL, middle);
+#ifndef _WIN32
+  TMappedFileTransport mapped(f.getPath());
+  mapped.setChunkSize(CHUNK_SIZE);
+  check_index_seek(mapped, NUM_EVENTS, INTERVAL, middle);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(test_index_rebuild) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t CHUNK_SIZE = 4096;
+  const uint32_t NUM_EVENTS = 1000;
+  const uint32_t INTERVAL = 16;
+  {
+    TFileTransport transport(f.getPath());
+    transport.setChunkSize(CHUNK_SIZE);
+    transport.setIndexInterval(INTERVAL);
+    write_numbered_events(transport, 0, NUM_EVENTS);
+  }
+  std::vector<TFileTransportIndex::Entry> original = TFileTransportIndex::load(f.getPath());
+  std::string indexPath = TFileTransportIndex::getPath(f.getPath());
+
+  // a missing index is rebuilt by scanning the chunks in parallel
+  BOOST_REQUIRE_EQUAL(0, unlink(indexPath.c_str()));
+  BOOST_CHECK_EQUAL(NUM_EVENTS, TFileTransportIndex::rebuild(f.getPath(), CHUNK_SIZE, INTERVAL, 4));
+  std::vector<TFileTransportIndex::Entry> rebuilt = TFileTransportIndex::load(f.getPath());
+  BOOST_REQUIRE_EQUAL(original.size(), rebuilt.size());
+  for (size_t i = 0; i < original.size(); ++i) {
+    BOOST_CHECK_EQUAL(original[i].event, rebuilt[i].event);
+    BOOST_CHECK_EQUAL(original[i].offset, rebuilt[i].offset);
+    BOOST_CHECK_GE(rebuilt[i].timestamp, original[i].timestamp);
+  }
+
+  // the writer completes an index that lost its end
+  BOOST_REQUIRE_EQUAL(0, truncate(indexPath.c_str(), 10 * sizeof(TFileTransportIndex::Entry) + 5));
+  {
+    TFileTransport transport(f.getPath());
+    transport.setChunkSize(CHUNK_SIZE);
+    transport.setIndexInterval(INTERVAL);
+    write_numbered_events(transport, NUM_EVENTS, 200);
+  }
+  std::vector<TFileTransportIndex::Entry> completed = TFileTransportIndex::load(f.getPath());
+  BOOST_REQUIRE_EQUAL((NUM_EVENTS + 200 + INTERVAL - 1) / INTERVAL, completed.size());
+  for (size_t i = 0; i < completed.size(); ++i) {
+    BOOST_CHECK_EQUAL(i * INTERVAL, completed[i].event);
+    if (i < original.size()) {
+      BOOST_CHECK_EQUAL(original[i].offset, completed[i].offset);
+    }
+    if (i > 0) {
+      BOOST_CHECK_GE(completed[i].timestamp, completed[i - 1].timestamp);
+    }
+  }
+
+  TFileTransport reader(f.getPath(), true);
+  reader.setChunkSize(CHUNK_SIZE);
+  reader.seekToEvent(1100);
+  BOOST_CHECK_EQUAL(1100u, read_event_number(reader));
+}
+
+#ifndef _WIN32
+/**
+ * Processor for the replay tests. Every message carries a key and the
+ * event's sequence number for that key; the processor counts events and
+ * events that arrived out of order for their key.
+ */
+class ReplayProcessor : public apache::thrift::TProcessor {
+public:
+  explicit ReplayProcessor(uint32_t delayUs = 0) : delayUs_(delayUs), processed_(0), outOfOrder_(0) {}
+
+  bool process(std::shared_ptr<apache::thrift::protocol::TProtocol> in,
+               std::shared_ptr<apache::thrift::protocol::TProtocol> out,
+               void* connectionContext) override {
+    (void)out;
+    (void)connectionContext;
+    std::string name;
+    apache::thrift::protocol::TMessageType type;
+    std::string payload;
+    int32_t seqid, key, seq;
+    in->readMessageBegin(name, type, seqid);
+    in->readI32(key);
+    in->readI32(seq);
+    in->readString(payload);
+    in->readMessageEnd();
+    in->getTransport()->readEnd();
+
+    if (delayUs_) {
+      std::this_thread::sleep_for(std::chrono::microseconds(delayUs_));
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (next_[key]++ != seq) {
+      ++outOfOrder_;
+    }
+    ++processed_;
+    return true;
+  }
+
+  uint32_t getProcessed() const { return processed_; }
+  uint32_t getOutOfOrder() const { return outOfOrder_; }
+
+private:
+  uint32_t delayUs_;
+  std::mutex mutex_;
+  std::map<int32_t, int32_t> next_;
+  uint32_t processed_;
+  uint32_t outOfOrder_;
+};
+
+/**
+ * Counts events like ReplayProcessor but throws a std::runtime_error, which
+ * is not a TException, on the given event.
+ */
+class ThrowingReplayProcessor : public ReplayProcessor {
+public:
+  explicit ThrowingReplayProcessor(uint32_t throwAt) : throwAt_(throwAt), seen_(0) {}
+
+  bool process(std::shared_ptr<apache::thrift::protocol::TProtocol> in,
+               std::shared_ptr<apache::thrift::protocol::TProtocol> out,
+               void* connectionContext) override {
+    ReplayProcessor::process(in, out, connectionContext);
+    if (++seen_ == throwAt_) {
+      throw std::runtime_error("handler failed");
+    }
+    return true;
+  }
+
+private:
+  uint32_t throwAt_;
+  std::atomic<uint32_t> seen_;
+};
+
+/**
+ * Writes numEvents messages for numKeys keys to a log, one message per
+ * event, with payloads of up to 900 bytes.
+ */
+void write_replay_log(const char* path, uint32_t chunkSize, uint32_t numEvents, uint32_t numKeys) {
+  using apache::thrift::protocol::TBinaryProtocol;
+  TFileTransport transport(path);
+  transport.setChunkSize(chunkSize);
+  auto buffer = std::make_shared<TMemoryBuffer>();
+  TBinaryProtocol protocol(buffer);
+  std::vector<int32_t> seq(numKeys, 0);
+  for (uint32_t n = 0; n < numEvents; ++n) {
+    int32_t key = static_cast<int32_t>((n * 7) % numKeys);
+    protocol.writeMessageBegin("replay", apache::thrift::protocol::T_ONEWAY, 0);
+    protocol.writeI32(key);
+    protocol.writeI32(seq[key]++);
+    protocol.writeString(std::string((n * 37) % 900, 'x'));
+    protocol.writeMessageEnd();
+
+    uint8_t* buf;
+    uint32_t len;
+    buffer->getBuffer(&buf, &len);
+    transport.write(buf, len);
+    buffer->resetBuffer();
+  }
+}
+
+int32_t replay_key(const uint8_t* event, uint32_t size) {
+  // the big endian key follows the version, the name "replay" and the seqid
+  if (size < 22) {
+    return 0;
+  }
+  const uint8_t* key = event + 18;
+  return static_cast<int32_t>((static_cast<uint32_t>(key[0]) << 24) | (key[1] << 16)
+                              | (key[2] << 8) | key[3]);
+}
+
+BOOST_AUTO_TEST_CASE(test_mapped_read) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t CHUNK_SIZE = 4096;
+  const uint32_t NUM_EVENTS = 500;
+  write_replay_log(f.getPath(), CHUNK_SIZE, NUM_EVENTS, 8);
+
+  // read() returns the same events as TFileTransport
+  TFileTransport file(f.getPath(), true);
+  file.setChunkSize(CHUNK_SIZE);
+  TMappedFileTransport mapped(f.getPath());
+  mapped.setChunkSize(CHUNK_SIZE);
+  BOOST_CHECK_EQUAL(file.getNumChunks(), mapped.getNumChunks());
+  BOOST_CHECK_GT(mapped.getNumChunks(), 10u);
+
+  uint8_t expected[1000];
+  uint8_t got[1000];
+  for (uint32_t n = 0; n < NUM_EVENTS; ++n) {
+    uint32_t len = file.read(expected, sizeof(expected));
+    BOOST_REQUIRE_GT(len, 0u);
+    BOOST_REQUIRE_EQUAL(len, mapped.read(got, sizeof(got)));
+    BOOST_REQUIRE(memcmp(expected, got, len) == 0);
+  }
+  BOOST_CHECK_EQUAL(0u, mapped.read(got, sizeof(got)));
+
+  // seeking lands on the same event
+  file.seekToChunk(5);
+  mapped.seekToChunk(5);
+  BOOST_CHECK_EQUAL(5u, mapped.getCurChunk());
+  uint32_t len = file.read(expected, sizeof(expected));
+  const uint8_t* event;
+  uint32_t size;
+  BOOST_REQUIRE(mapped.readEvent(&event, &size));
+  BOOST_REQUIRE_EQUAL(len, size);
+  BOOST_CHECK(memcmp(expected, event, len) == 0);
+
+  // borrow() hands out the rest of the event without copying
+  mapped.seekToChunk(5);
+  BOOST_REQUIRE_EQUAL(8u, mapped.read(got, 8));
+  uint32_t want = 4;
+  const uint8_t* borrowed = mapped.borrow(nullptr, &want);
+  BOOST_CHECK(borrowed == event + 8);
+  BOOST_CHECK_EQUAL(size - 8, want);
+  mapped.consume(want);
+
+  // every event is visited once by forEachEvent()
+  uint32_t total = 0;
+  for (uint32_t chunk = 0; chunk < mapped.getNumChunks(); ++chunk) {
+    mapped.forEachEvent(chunk, [&total](const uint8_t*, uint32_t) { ++total; });
+  }
+  BOOST_CHECK_EQUAL(NUM_EVENTS, total);
+
+  mapped.seekToEnd();
+  BOOST_CHECK(!mapped.peek());
+}
+
+BOOST_AUTO_TEST_CASE(test_parallel_replay) {
+  using apache::thrift::concurrency::ThreadManager;
+  using apache::thrift::concurrency::ThreadFactory;
+  using apache::thrift::protocol::TBinaryProtocolFactory;
+
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t CHUNK_SIZE = 4096;
+  const uint32_t NUM_EVENTS = 4000;
+  write_replay_log(f.getPath(), CHUNK_SIZE, NUM_EVENTS, 16);
+
+  std::shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(4);
+  threadManager->threadFactory(std::make_shared<ThreadFactory>());
+  threadManager->start();
+
+  for (bool keyed : {false, true}) {
+    auto mapped = std::make_shared<TMappedFileTransport>(f.getPath());
+    mapped->setChunkSize(CHUNK_SIZE);
+    auto processor = std::make_shared<ReplayProcessor>(keyed ? 10 : 0);
+    TFileProcessor fileProcessor(processor, std::make_shared<TBinaryProtocolFactory>(), mapped);
+    if (keyed) {
+      fileProcessor.processParallel(threadManager, [](const uint8_t* event, uint32_t size) {
+        return static_cast<uint64_t>(replay_key(event, size));
+      });
+      BOOST_CHECK_EQUAL(0u, processor->getOutOfOrder());
+    } else {
+      fileProcessor.processParallel(threadManager);
+    }
+    BOOST_CHECK_EQUAL(NUM_EVENTS, processor->getProcessed());
+  }
+
+  // the sequential mode works on the mapped transport as well
+  auto mapped = std::make_shared<TMappedFileTransport>(f.getPath());
+  mapped->setChunkSize(CHUNK_SIZE);
+  auto processor = std::make_shared<ReplayProcessor>();
+  TFileProcessor fileProcessor(processor, std::make_shared<TBinaryProtocolFactory>(), mapped);
+  fileProcessor.process(0, false);
+  BOOST_CHECK_EQUAL(NUM_EVENTS, processor->getProcessed());
+  BOOST_CHECK_EQUAL(0u, processor->getOutOfOrder());
+
+  // only the mapped transport supports parallel replay
+  auto file = std::make_shared<TFileTransport>(f.getPath(), true);
+  TFileProcessor unsupported(processor, std::make_shared<TBinaryProtocolFactory>(), file);
+  BOOST_CHECK_THROW(unsupported.processParallel(threadManager), TTransportException);
+  threadManager->stop();
+}
+
+BOOST_AUTO_TEST_CASE(test_parallel_replay_handler_throws) {
+  using apache::thrift::concurrency::ThreadManager;
+  using apache::thrift::concurrency::ThreadFactory;
+  using apache::thrift::protocol::TBinaryProtocolFactory;
+
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t CHUNK_SIZE = 4096;
+  const uint32_t NUM_EVENTS = 4000;
+  write_replay_log(f.getPath(), CHUNK_SIZE, NUM_EVENTS, 16);
+
+  std::shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(4);
+  threadManager->threadFactory(std::make_shared<ThreadFactory>());
+  threadManager->start();
+
+  // the replay stops early instead of waiting forever for the failed task
+  for (bool keyed : {false, true}) {
+    auto mapped = std::make_shared<TMappedFileTransport>(f.getPath());
+    mapped->setChunkSize(CHUNK_SIZE);
+    auto processor = std::make_shared<ThrowingReplayProcessor>(100);
+    TFileProcessor fileProcessor(processor, std::make_shared<TBinaryProtocolFactory>(), mapped);
+    if (keyed) {
+      fileProcessor.processParallel(threadManager, [](const uint8_t* event, uint32_t size) {
+        return static_cast<uint64_t>(replay_key(event, size));
+      });
+    } else {
+      fileProcessor.processParallel(threadManager);
+    }
+    BOOST_CHECK_GE(processor->getProcessed(), 100u);
+    BOOST_CHECK_LT(processor->getProcessed(), NUM_EVENTS);
+  }
+
+  // and leaves the workers to the next one
+  auto mapped = std::make_shared<TMappedFileTransport>(f.getPath());
+  mapped->setChunkSize(CHUNK_SIZE);
+  auto processor = std::make_shared<ReplayProcessor>();
+  TFileProcessor fileProcessor(processor, std::make_shared<TBinaryProtocolFactory>(), mapped);
+  fileProcessor.processParallel(threadManager);
+  BOOST_CHECK_EQUAL(NUM_EVENTS, processor->getProcessed());
+  BOOST_CHECK_EQUAL(4u, threadManager->workerCount());
+  threadManager->stop();
+}
+#endif
+
 /**************************************************************************
  * General Initialization
  **************************************************************************/
@@ -0,0 +1,376 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE THeaderTransportTest
+#include <boost/test/unit_test.hpp>
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/protocol/THeaderProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/THeaderTransport.h>
+#include <thrift/transport/TSocket.h>
+#include <thrift/transport/TVirtualTransport.h>
+
+using apache::thrift::protocol::TCompactProtocol;
+using apache::thrift::protocol::THeaderProtocol;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::T_CALL;
+using apache::thrift::protocol::T_DOUBLE;
+using apache::thrift::protocol::T_I64;
+using apache::thrift::protocol::T_LIST;
+using apache::thrift::protocol::T_REPLY;
+using apache::thrift::protocol::T_STRING;
+using apache::thrift::protocol::T_STRUCT;
+using apache::thrift::transport::TFramedTransport;
+using apache::thrift::transport::THeaderTransport;
+using apache::thrift::transport::TMemoryBuffer;
+using apache::thrift::transport::TSocket;
+using apache::thrift::transport::TTransportException;
+using apache::thrift::transport::TVirtualTransport;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+/**
+ * A list of records in the compact protocol, the kind of payload a typical
+ * query returns: repeated field layouts, short strings, varying numbers.
+ */
+static string makePayload(uint32_t records, std::mt19937& rng) {
+  static const char* const statuses[] = {"ACTIVE", "SUSPENDED", "PENDING_REVIEW", "CLOSED"};
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TCompactProtocol proto(buffer);
+  proto.writeStructBegin("response");
+  proto.writeFieldBegin("records", T_LIST, 1);
+  proto.writeListBegin(T_STRUCT, records);
+  for (uint32_t i = 0; i < records; ++i) {
+    proto.writeStructBegin("record");
+    proto.writeFieldBegin("id", T_I64, 1);
+    proto.writeI64(1000000 + i);
+    proto.writeFieldEnd();
+    proto.writeFieldBegin("owner", T_STRING, 2);
+    proto.writeString("user" + std::to_string(rng() % 1000) + "@example.com");
+    proto.writeFieldEnd();
+    proto.writeFieldBegin("status", T_STRING, 3);
+    proto.writeString(string(statuses[rng() % 4]));
+    proto.writeFieldEnd();
+    proto.writeFieldBegin("score", T_DOUBLE, 4);
+    proto.writeDouble(static_cast<double>(rng() % 10000) / 100);
+    proto.writeFieldEnd();
+    proto.writeFieldStop();
+    proto.writeStructEnd();
+  }
+  proto.writeListEnd();
+  proto.writeFieldEnd();
+  proto.writeFieldStop();
+  proto.writeStructEnd();
+  return buffer->getBufferAsString();
+}
+
+static string makeRandom(uint32_t len, std::mt19937& rng) {
+  string data(len, '\0');
+  for (char& c : data) {
+    c = static_cast<char>(rng());
+  }
+  return data;
+}
+
+/**
+ * Forwards to a memory buffer and counts the calls to write().
+ */
+class CountingTransport : public TVirtualTransport<CountingTransport> {
+public:
+  CountingTransport() : buffer_(new TMemoryBuffer()), writes_(0) {}
+
+  uint32_t read(uint8_t* buf, uint32_t len) { return buffer_->read(buf, len); }
+
+  void write(const uint8_t* buf, uint32_t len) {
+    ++writes_;
+    buffer_->write(buf, len);
+  }
+
+  std::shared_ptr<TMemoryBuffer> buffer_;
+  uint32_t writes_;
+};
+
+static void send(THeaderTransport& trans, const string& msg) {
+  trans.write(reinterpret_cast<const uint8_t*>(msg.data()), static_cast<uint32_t>(msg.size()));
+  trans.flush();
+}
+
+static string receive(THeaderTransport& trans, size_t len) {
+  trans.resetProtocol();
+  string msg(len, '\0');
+  trans.readAll(reinterpret_cast<uint8_t*>(&msg[0]), static_cast<uint32_t>(len));
+  trans.readEnd();
+  return msg;
+}
+
+static vector<uint16_t> supportedTransforms() {
+  vector<uint16_t> result;
+  for (uint16_t transId : {THeaderTransport::ZLIB_TRANSFORM,
+                           THeaderTransport::ZSTD_TRANSFORM,
+                           THeaderTransport::LZ4_TRANSFORM}) {
+    if (THeaderTransport::isTransformSupported(transId)) {
+      result.push_back(transId);
+    } else {
+      BOOST_TEST_MESSAGE("transform " << transId << " not supported by this build");
+    }
+  }
+  return result;
+}
+
+BOOST_AUTO_TEST_SUITE(THeaderTransportTest)
+
+BOOST_AUTO_TEST_CASE(test_transform_roundtrip) {
+  std::mt19937 rng(1);
+  vector<string> messages;
+  messages.push_back(makePayload(1, rng));
+  messages.push_back(makePayload(1000, rng));
+  // incompressible and larger than the write buffer
+  messages.push_back(makeRandom(100000, rng));
+
+  for (uint16_t transId : supportedTransforms()) {
+    shared_ptr<TMemoryBuffer> wire(new TMemoryBuffer());
+    THeaderTransport writer(wire);
+    THeaderTransport reader(wire);
+    writer.setTransform(transId);
+    for (const string& msg : messages) {
+      send(writer, msg);
+      BOOST_CHECK(receive(reader, msg.size()) == msg);
+      BOOST_REQUIRE_EQUAL(1u, reader.getReadTransforms().size());
+      BOOST_CHECK_EQUAL(transId, reader.getReadTransforms()[0]);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_unsupported_transform) {
+  shared_ptr<TMemoryBuffer> wire(new TMemoryBuffer());
+  THeaderTransport trans(wire);
+  BOOST_CHECK(!THeaderTransport::isTransformSupported(0x7f));
+  BOOST_CHECK_THROW(trans.setTransform(0x7f), TTransportException);
+  BOOST_CHECK_EQUAL(0, trans.getNumTransforms());
+
+  // the optional codecs are accepted exactly when this build has them
+  BOOST_CHECK(THeaderTransport::isTransformSupported(THeaderTransport::ZLIB_TRANSFORM));
+  uint16_t expected = 0;
+  for (uint16_t transId : {THeaderTransport::ZLIB_TRANSFORM,
+                           THeaderTransport::ZSTD_TRANSFORM,
+                           THeaderTransport::LZ4_TRANSFORM}) {
+    if (THeaderTransport::isTransformSupported(transId)) {
+      trans.setTransform(transId);
+      ++expected;
+    } else {
+      try {
+        trans.setTransform(transId);
+        BOOST_ERROR("transform " << transId << " accepted by a build without it");
+      } catch (const TTransportException& e) {
+        BOOST_CHECK_EQUAL(TTransportException::BAD_ARGS, e.getType());
+      }
+    }
+    BOOST_CHECK_EQUAL(expected, trans.getNumTransforms());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_min_compress_bytes) {
+  std::mt19937 rng(2);
+  string small = makePayload(2, rng);
+  string large = makePayload(100, rng);
+
+  shared_ptr<TMemoryBuffer> wire(new TMemoryBuffer());
+  THeaderTransport writer(wire);
+  THeaderTransport reader(wire);
+  writer.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  writer.setMinCompressBytes(static_cast<uint32_t>(small.size() + 1));
+
+  send(writer, small);
+  BOOST_CHECK(receive(reader, small.size()) == small);
+  BOOST_CHECK(reader.getReadTransforms().empty());
+
+  send(writer, large);
+  BOOST_CHECK(receive(reader, large.size()) == large);
+  BOOST_CHECK_EQUAL(1u, reader.getReadTransforms().size());
+}
+
+BOOST_AUTO_TEST_CASE(test_mirror_transforms) {
+  std::mt19937 rng(3);
+  string request = makePayload(10, rng);
+  string response = makePayload(20, rng);
+  shared_ptr<TMemoryBuffer> toServer(new TMemoryBuffer());
+  shared_ptr<TMemoryBuffer> toClient(new TMemoryBuffer());
+  THeaderTransport server(toServer, toClient);
+  server.setMirrorTransforms(true);
+
+  // each request is answered with the codec it came with, or none
+  vector<uint16_t> codecs = supportedTransforms();
+  codecs.push_back(0);
+  for (uint16_t transId : codecs) {
+    THeaderTransport client(toClient, toServer);
+    if (transId != 0) {
+      client.setTransform(transId);
+    }
+    send(client, request);
+    BOOST_CHECK(receive(server, request.size()) == request);
+    send(server, response);
+    BOOST_CHECK(receive(client, response.size()) == response);
+    BOOST_CHECK(client.getReadTransforms() == server.getReadTransforms());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_single_write_per_frame) {
+  std::mt19937 rng(5);
+  string msg = makePayload(50, rng);
+  shared_ptr<CountingTransport> wire(new CountingTransport());
+  THeaderTransport writer(wire);
+  THeaderTransport reader(wire->buffer_);
+
+  // header and payload go out together, like a TFramedTransport frame
+  writer.setHeader("key", "value");
+  send(writer, msg);
+  BOOST_CHECK_EQUAL(1u, wire->writes_);
+  BOOST_CHECK(receive(reader, msg.size()) == msg);
+  BOOST_CHECK_EQUAL("value", reader.getHeaders().find("key")->second);
+
+  if (!supportedTransforms().empty()) {
+    writer.setTransform(supportedTransforms()[0]);
+    send(writer, msg);
+    BOOST_CHECK_EQUAL(2u, wire->writes_);
+    BOOST_CHECK(receive(reader, msg.size()) == msg);
+  }
+
+  // headers too large for the space in front of the payload still work
+  writer.setHeader("large", string(1000, 'x'));
+  send(writer, msg);
+  BOOST_CHECK(receive(reader, msg.size()) == msg);
+  BOOST_CHECK_EQUAL(1000u, reader.getHeaders().find("large")->second.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_framed_client) {
+  std::mt19937 rng(6);
+  shared_ptr<TMemoryBuffer> message(new TMemoryBuffer());
+  TCompactProtocol(message).writeMessageBegin("ping", T_CALL, 1);
+  string request = message->getBufferAsString() + makePayload(5, rng);
+  string response = makePayload(7, rng);
+  shared_ptr<TMemoryBuffer> toServer(new TMemoryBuffer());
+  shared_ptr<TMemoryBuffer> toClient(new TMemoryBuffer());
+  THeaderTransport server(toServer, toClient);
+
+  // the server recognizes the compact protocol id behind the frame size
+  TFramedTransport client(toServer);
+  client.write(reinterpret_cast<const uint8_t*>(request.data()),
+               static_cast<uint32_t>(request.size()));
+  client.flush();
+  server.resetProtocol();
+  string got(request.size(), '\0');
+  server.readAll(reinterpret_cast<uint8_t*>(&got[0]), static_cast<uint32_t>(got.size()));
+  BOOST_CHECK(got == request);
+
+  send(server, response);
+  TFramedTransport reply(toClient);
+  got.assign(response.size(), '\0');
+  reply.readAll(reinterpret_cast<uint8_t*>(&got[0]), static_cast<uint32_t>(got.size()));
+  BOOST_CHECK(got == response);
+}
+
+BOOST_AUTO_TEST_CASE(test_client_timeout) {
+  shared_ptr<TMemoryBuffer> toServer(new TMemoryBuffer());
+  shared_ptr<TMemoryBuffer> toClient(new TMemoryBuffer());
+  THeaderProtocol client(toClient, toServer);
+  THeaderProtocol server(toServer, toClient);
+  std::static_pointer_cast<THeaderTransport>(client.getTransport())->setClientTimeout(250);
+
+  // requests carry the timeout, responses do not
+  string name;
+  TMessageType type;
+  int32_t seqid;
+  client.writeMessageBegin("ping", T_CALL, 1);
+  client.writeMessageEnd();
+  client.getTransport()->flush();
+  server.readMessageBegin(name, type, seqid);
+  server.readMessageEnd();
+  BOOST_CHECK_EQUAL(250, server.getRequestTimeout());
+
+  server.writeMessageBegin("ping", T_REPLY, 1);
+  server.writeMessageEnd();
+  server.getTransport()->flush();
+  client.readMessageBegin(name, type, seqid);
+  client.readMessageEnd();
+  BOOST_CHECK_EQUAL(0, client.getRequestTimeout());
+
+  // requests without a timeout carry no header for it
+  std::static_pointer_cast<THeaderTransport>(client.getTransport())->setClientTimeout(-1);
+  client.writeMessageBegin("ping", T_CALL, 2);
+  client.writeMessageEnd();
+  client.getTransport()->flush();
+  server.readMessageBegin(name, type, seqid);
+  server.readMessageEnd();
+  BOOST_CHECK_EQUAL(0, server.getRequestTimeout());
+  BOOST_CHECK_EQUAL(0u,
+                    std::static_pointer_cast<THeaderTransport>(server.getTransport())
+                        ->getHeaders()
+                        .count(THeaderTransport::CLIENT_TIMEOUT_HEADER));
+
+  // by default the receive timeout of the socket is sent
+  shared_ptr<TSocket> socket(new TSocket("localhost", 0));
+  socket->setRecvTimeout(100);
+  THeaderTransport trans(socket);
+  BOOST_CHECK_EQUAL(100, trans.getClientTimeout());
+  trans.setClientTimeout(-1);
+  BOOST_CHECK_EQUAL(0, trans.getClientTimeout());
+}
+
+/**
+ * Each codec, and zstd at more than one level, must shrink a structured
+ * payload on the wire.
+ */
+BOOST_AUTO_TEST_CASE(test_transforms_compress) {
+  struct Codec {
+    uint16_t transId;
+    int level;
+  };
+  const Codec codecs[] = {{THeaderTransport::ZLIB_TRANSFORM, 0},
+                          {THeaderTransport::ZSTD_TRANSFORM, 1},
+                          {THeaderTransport::ZSTD_TRANSFORM, 3},
+                          {THeaderTransport::LZ4_TRANSFORM, 0}};
+
+  std::mt19937 rng(4);
+  string payload = makePayload(200, rng);
+  for (const Codec& codec : codecs) {
+    if (!THeaderTransport::isTransformSupported(codec.transId)) {
+      continue;
+    }
+    shared_ptr<TMemoryBuffer> wire(new TMemoryBuffer());
+    THeaderTransport writer(wire);
+    THeaderTransport reader(wire);
+    writer.setTransform(codec.transId);
+    if (codec.level != 0) {
+      writer.setZstdLevel(codec.level);
+    }
+
+    send(writer, payload);
+    BOOST_CHECK_LT(wire->available_read(), payload.size());
+    BOOST_CHECK(receive(reader, payload.size()) == payload);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
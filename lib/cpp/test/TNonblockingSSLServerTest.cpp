@@ -22,6 +22,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 
+#include "thrift/concurrency/ThreadManager.h"
 #include "thrift/server/TNonblockingServer.h"
 #include "thrift/transport/TSSLSocket.h"
 #include "thrift/transport/TNonblockingSSLServerSocket.h"
@@ -146,7 +147,9 @@ private:
 
   struct Runner : public apache::thrift::concurrency::Runnable {
     int port;
+    size_t numIOThreads;
     std::shared_ptr<event_base> userEventBase;
+    std::shared_ptr<apache::thrift::concurrency::ThreadManager> handshakeThreadManager;
     std::shared_ptr<TProcessor> processor;
     std::shared_ptr<server::TNonblockingServer> server;
     std::shared_ptr<ListenEventHandler> listenHandler;
@@ -154,7 +157,7 @@ private:
     std::shared_ptr<transport::TNonblockingSSLServerSocket> socket;
     Mutex mutex_;
 
-    Runner():port(0) {
+    Runner():port(0), numIOThreads(1) {
       listenHandler.reset(new ListenEventHandler(&mutex_));
     }
 
@@ -178,7 +181,8 @@ private:
         socket.reset(new transport::TNonblockingSSLServerSocket(port, pServerSocketFactory));
         server.reset(new server::TNonblockingServer(processor, socket));
 	      server->setServerEventHandler(listenHandler);
-        server->setNumIOThreads(1);
+        server->setNumIOThreads(numIOThreads);
+        server->setHandshakeThreadManager(handshakeThreadManager);
         if (userEventBase) {
           server->registerEvents(userEventBase.get());
         }
@@ -199,7 +203,9 @@ private:
   };
 
 protected:
-  Fixture() : processor(new test::ParentServiceProcessor(std::make_shared<Handler>())) {}
+  Fixture()
+    : numIOThreads_(1),
+      processor(new test::ParentServiceProcessor(std::make_shared<Handler>())) {}
 
   ~Fixture() {
     if (server) {
@@ -214,11 +220,20 @@ protected:
     userEventBase_.reset(user_event_base, EventDeleter());
   }
 
+  void setNumIOThreads(size_t numIOThreads) { numIOThreads_ = numIOThreads; }
+
+  void setHandshakeThreadManager(
+      std::shared_ptr<apache::thrift::concurrency::ThreadManager> threadManager) {
+    handshakeThreadManager_ = threadManager;
+  }
+
   int startServer(int port) {
     std::shared_ptr<Runner> runner(new Runner);
     runner->port = port;
     runner->processor = processor;
+    runner->numIOThreads = numIOThreads_;
     runner->userEventBase = userEventBase_;
+    runner->handshakeThreadManager = handshakeThreadManager_;
 
     std::unique_ptr<apache::thrift::concurrency::ThreadFactory> threadFactory(
         new apache::thrift::concurrency::ThreadFactory(false));
@@ -239,11 +254,14 @@ protected:
     client.addString("foo");
     std::vector<std::string> strings;
     client.getStrings(strings);
-    return strings.size() == 1 && !(strings[0].compare("foo"));
+    // the handler is shared by all connections
+    return !strings.empty() && !(strings.back().compare("foo"));
   }
 
 private:
+  size_t numIOThreads_;
   std::shared_ptr<event_base> userEventBase_;
+  std::shared_ptr<apache::thrift::concurrency::ThreadManager> handshakeThreadManager_;
   std::shared_ptr<test::ParentServiceProcessor> processor;
 protected:
   std::shared_ptr<server::TNonblockingServer> server;
@@ -286,4 +304,56 @@ BOOST_FIXTURE_TEST_CASE(provide_event_base, Fixture) {
 #endif
 }
 
+BOOST_FIXTURE_TEST_CASE(handshake_on_listen_thread, Fixture) {
+  setNumIOThreads(3);
+  startServer(0);
+  int port = server->getListenPort();
+
+  for (int i = 0; i < 4; ++i) {
+    BOOST_CHECK(canCommunicate(port));
+  }
+  BOOST_CHECK_EQUAL(server->getNumHandshakes(), 4u);
+  BOOST_CHECK_EQUAL(server->getNumFailedHandshakes(), 0u);
+  BOOST_CHECK_EQUAL(server->getNumHandshakesInProgress(), 0u);
+  BOOST_CHECK_EQUAL(server->getHandshakeQueueDepth(), 0u);
+  BOOST_CHECK_GT(server->getAverageHandshakeTime(), 0u);
+  BOOST_CHECK_GE(server->getMaxHandshakeTime(), server->getAverageHandshakeTime());
+}
+
+BOOST_FIXTURE_TEST_CASE(handshake_thread_manager, Fixture) {
+  std::shared_ptr<apache::thrift::concurrency::ThreadManager> threadManager
+      = apache::thrift::concurrency::ThreadManager::newSimpleThreadManager(2);
+  threadManager->threadFactory(std::make_shared<apache::thrift::concurrency::ThreadFactory>());
+  threadManager->start();
+  setNumIOThreads(2);
+  setHandshakeThreadManager(threadManager);
+  startServer(0);
+  int port = server->getListenPort();
+
+  for (int i = 0; i < 4; ++i) {
+    BOOST_CHECK(canCommunicate(port));
+  }
+  BOOST_CHECK_EQUAL(server->getNumHandshakes(), 4u);
+  BOOST_CHECK_EQUAL(server->getNumFailedHandshakes(), 0u);
+  BOOST_CHECK_EQUAL(server->getNumHandshakesInProgress(), 0u);
+  BOOST_CHECK_EQUAL(server->getHandshakeQueueDepth(), 0u);
+  BOOST_CHECK_GT(server->getAverageHandshakeTime(), 0u);
+
+  // a client that is not speaking TLS never gets handed to an IO thread
+  std::shared_ptr<transport::TSocket> plain(new transport::TSocket("localhost", port));
+  plain->open();
+  plain->write(reinterpret_cast<const uint8_t*>("not a client hello"), 18);
+  plain->flush();
+  for (int i = 0; i < 500 && server->getNumFailedHandshakes() == 0; ++i) {
+    THRIFT_SLEEP_USEC(10000);
+  }
+  BOOST_CHECK_EQUAL(server->getNumFailedHandshakes(), 1u);
+  BOOST_CHECK_EQUAL(server->getNumHandshakes(), 4u);
+  BOOST_CHECK_EQUAL(server->getNumHandshakesInProgress(), 0u);
+  plain->close();
+
+  server->stop();
+  threadManager->stop();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -19,17 +19,32 @@
 
 #define BOOST_TEST_MODULE TNonblockingServerTest
 #include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <set>
+#include <thread>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
+#include "thrift/concurrency/FunctionRunner.h"
 #include "thrift/concurrency/Monitor.h"
 #include "thrift/concurrency/Thread.h"
 #include "thrift/server/TNonblockingServer.h"
+#include "thrift/server/TPlacementPolicy.h"
+#include "thrift/server/TRequestContext.h"
 #include "thrift/transport/TNonblockingServerSocket.h"
 
 #include "gen-cpp/ParentService.h"
 
 #include <event.h>
 
+#ifdef THRIFT_TEST_WITH_THRIFTZ
+#include "thrift/protocol/THeaderProtocol.h"
+#endif
+
+using apache::thrift::concurrency::FunctionRunner;
 using apache::thrift::concurrency::Guard;
 using apache::thrift::concurrency::Monitor;
 using apache::thrift::concurrency::Mutex;
@@ -37,6 +52,11 @@ using apache::thrift::concurrency::ThreadFactory;
 using apache::thrift::concurrency::Runnable;
 using apache::thrift::concurrency::Thread;
 using apache::thrift::concurrency::ThreadFactory;
+using apache::thrift::concurrency::ThreadManager;
+using apache::thrift::server::TAdaptivePlacementPolicy;
+using apache::thrift::server::TAnnotatedPlacementPolicy;
+using apache::thrift::server::TPlacementPolicy;
+using apache::thrift::server::TRequestContext;
 using apache::thrift::server::TServerEventHandler;
 using std::make_shared;
 using std::shared_ptr;
@@ -47,12 +67,47 @@ struct Handler : public test::ParentServiceIf {
   void addString(const std::string& s) override { strings_.push_back(s); }
   void getStrings(std::vector<std::string>& _return) override { _return = strings_; }
   std::vector<std::string> strings_;
+  void getDataWait(std::string& _return, const int32_t length) override {
+    _return.assign(static_cast<size_t>(length), 'x');
+  }
+
+  // records the threads and CPUs it is called on and the time left to
+  // answer, taking delay_ ms
+  int32_t incrementGeneration() override {
+    remaining_ = TRequestContext::getRemainingTime();
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_));
+    Guard g(mutex_);
+    threads_.insert(std::this_thread::get_id());
+#ifdef __linux__
+    cpus_.insert(sched_getcpu());
+#endif
+    return static_cast<int32_t>(threads_.size());
+  }
+
+  // blocks while blocked_ is set
+  void onewayWait() override {
+    Guard g(mutex_);
+    while (blocked_) {
+      monitor_.wait();
+    }
+  }
+
+  void block(bool blocked) {
+    Guard g(mutex_);
+    blocked_ = blocked;
+    monitor_.notifyAll();
+  }
+
+  Mutex mutex_;
+  Monitor monitor_{&mutex_};
+  bool blocked_ = false;
+  std::atomic<int> delay_{0};
+  std::atomic<int64_t> remaining_{-1};
+  std::set<std::thread::id> threads_;
+  std::set<int> cpus_;
 
   // dummy overrides not used in this test
-  int32_t incrementGeneration() override { return 0; }
   int32_t getGeneration() override { return 0; }
-  void getDataWait(std::string&, const int32_t) override {}
-  void onewayWait() override {}
   void exceptionWait(const std::string&) override {}
   void unexpectedExceptionWait(const std::string&) override {}
 };
@@ -80,10 +135,33 @@ private:
     shared_ptr<server::TNonblockingServer> server;
     shared_ptr<ListenEventHandler> listenHandler;
     shared_ptr<transport::TNonblockingServerSocket> socket;
+    shared_ptr<ThreadManager> threadManager;
+    shared_ptr<TPlacementPolicy> placementPolicy;
+    size_t numIOThreads;
+    bool reusePort;
+    bool pipelining;
+    size_t workersPerIOThread;
+    std::vector<int> ioThreadCpus;
+    size_t rebalanceThreshold;
+    size_t maxBufferMemory;
+    int64_t queueDelayTarget;
+    int64_t queueDelayInterval;
+    bool headerProtocol;
+    bool useClientTimeouts;
     Mutex mutex_;
 
     Runner() {
       port = 0;
+      numIOThreads = 1;
+      reusePort = false;
+      pipelining = false;
+      workersPerIOThread = 0;
+      rebalanceThreshold = 0;
+      maxBufferMemory = 0;
+      queueDelayTarget = 0;
+      queueDelayInterval = 100;
+      headerProtocol = false;
+      useClientTimeouts = false;
       listenHandler.reset(new ListenEventHandler(&mutex_));
     }
 
@@ -104,8 +182,28 @@ private:
     void startServer(int retry_count) {
       try {
         socket.reset(new transport::TNonblockingServerSocket(port));
+        socket->setReusePort(reusePort);
+        socket->setReusePortSteering(reusePort);
         server.reset(new server::TNonblockingServer(processor, socket));
+        if (threadManager) {
+          server->setThreadManager(threadManager);
+        }
+        server->setPlacementPolicy(placementPolicy);
         server->setServerEventHandler(listenHandler);
+        server->setNumIOThreads(numIOThreads);
+        server->setPipelining(pipelining);
+        server->setWorkersPerIOThread(workersPerIOThread);
+        server->setIOThreadCpus(ioThreadCpus);
+        server->setRebalanceThreshold(rebalanceThreshold);
+        server->setMaxBufferMemory(maxBufferMemory);
+        server->setQueueDelayTarget(queueDelayTarget, queueDelayInterval);
+#ifdef THRIFT_TEST_WITH_THRIFTZ
+        if (headerProtocol) {
+          server->setInputProtocolFactory(make_shared<protocol::THeaderProtocolFactory>());
+          server->setOutputProtocolFactory(shared_ptr<protocol::TProtocolFactory>());
+        }
+#endif
+        server->setUseClientTimeouts(useClientTimeouts);
         if (userEventBase) {
           server->registerEvents(userEventBase.get());
         }
@@ -126,7 +224,20 @@ private:
   };
 
 protected:
-  Fixture() : processor(new test::ParentServiceProcessor(make_shared<Handler>())) {}
+  Fixture()
+    : numIOThreads_(1),
+      reusePort_(false),
+      pipelining_(false),
+      workersPerIOThread_(0),
+      rebalanceThreshold_(0),
+      maxBufferMemory_(0),
+      queueDelayTarget_(0),
+      queueDelayInterval_(100),
+      headerProtocol_(false),
+      useClientTimeouts_(false),
+      handler(make_shared<Handler>()) {
+    processor.reset(new test::ParentServiceProcessor(handler));
+  }
 
   ~Fixture() {
     if (server) {
@@ -141,11 +252,59 @@ protected:
     userEventBase_.reset(user_event_base, EventDeleter());
   }
 
+  void setNumIOThreads(size_t numIOThreads) { numIOThreads_ = numIOThreads; }
+
+  void setReusePort(bool reusePort) { reusePort_ = reusePort; }
+
+  void setPipelining(bool pipelining) { pipelining_ = pipelining; }
+
+  void setWorkersPerIOThread(size_t workersPerIOThread) {
+    workersPerIOThread_ = workersPerIOThread;
+  }
+
+  void setIOThreadCpus(const std::vector<int>& ioThreadCpus) { ioThreadCpus_ = ioThreadCpus; }
+
+  void setRebalanceThreshold(size_t rebalanceThreshold) {
+    rebalanceThreshold_ = rebalanceThreshold;
+  }
+
+  void setMaxBufferMemory(size_t maxBufferMemory) { maxBufferMemory_ = maxBufferMemory; }
+
+  void setQueueDelayTarget(int64_t target, int64_t interval) {
+    queueDelayTarget_ = target;
+    queueDelayInterval_ = interval;
+  }
+
+  void setHeaderProtocol(bool headerProtocol) { headerProtocol_ = headerProtocol; }
+
+  void setUseClientTimeouts(bool useClientTimeouts) { useClientTimeouts_ = useClientTimeouts; }
+
+  void setThreadManager(shared_ptr<ThreadManager> threadManager) {
+    threadManager_ = threadManager;
+  }
+
+  void setPlacementPolicy(shared_ptr<TPlacementPolicy> placementPolicy) {
+    placementPolicy_ = placementPolicy;
+  }
+
   int startServer(int port) {
     shared_ptr<Runner> runner(new Runner);
     runner->port = port;
     runner->processor = processor;
     runner->userEventBase = userEventBase_;
+    runner->numIOThreads = numIOThreads_;
+    runner->reusePort = reusePort_;
+    runner->pipelining = pipelining_;
+    runner->workersPerIOThread = workersPerIOThread_;
+    runner->ioThreadCpus = ioThreadCpus_;
+    runner->rebalanceThreshold = rebalanceThreshold_;
+    runner->maxBufferMemory = maxBufferMemory_;
+    runner->queueDelayTarget = queueDelayTarget_;
+    runner->queueDelayInterval = queueDelayInterval_;
+    runner->headerProtocol = headerProtocol_;
+    runner->useClientTimeouts = useClientTimeouts_;
+    runner->threadManager = threadManager_;
+    runner->placementPolicy = placementPolicy_;
 
     shared_ptr<ThreadFactory> threadFactory(
         new ThreadFactory(false));
@@ -154,6 +313,7 @@ protected:
     runner->readyBarrier();
 
     server = runner->server;
+    socket = runner->socket;
     return runner->port;
   }
 
@@ -168,11 +328,58 @@ protected:
     return strings.size() == 1 && !(strings[0].compare("foo"));
   }
 
+  /**
+   * Sends numCalls requests in a single write, with a oneway request in
+   * between, and checks that the responses come back in order.
+   */
+  bool canPipeline(int serverPort, int numCalls) {
+    shared_ptr<transport::TMemoryBuffer> requests(new transport::TMemoryBuffer);
+    test::ParentServiceClient sender(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(requests)));
+    for (int i = 1; i <= numCalls; ++i) {
+      sender.send_getDataWait(i);
+      if (i == numCalls / 2) {
+        sender.send_onewayWait();
+      }
+    }
+
+    std::string bytes = requests->getBufferAsString();
+    shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", serverPort));
+    socket->open();
+    socket->write(reinterpret_cast<const uint8_t*>(bytes.data()), static_cast<uint32_t>(bytes.size()));
+
+    test::ParentServiceClient receiver(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(socket)));
+    for (int i = 1; i <= numCalls; ++i) {
+      std::string data;
+      receiver.recv_getDataWait(data);
+      if (data.size() != static_cast<size_t>(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
 private:
+  size_t numIOThreads_;
+  bool reusePort_;
+  bool pipelining_;
+  size_t workersPerIOThread_;
+  std::vector<int> ioThreadCpus_;
+  size_t rebalanceThreshold_;
+  size_t maxBufferMemory_;
+  int64_t queueDelayTarget_;
+  int64_t queueDelayInterval_;
+  bool headerProtocol_;
+  bool useClientTimeouts_;
+  shared_ptr<ThreadManager> threadManager_;
+  shared_ptr<TPlacementPolicy> placementPolicy_;
   shared_ptr<event_base> userEventBase_;
   shared_ptr<test::ParentServiceProcessor> processor;
 protected:
+  shared_ptr<Handler> handler;
   shared_ptr<server::TNonblockingServer> server;
+  shared_ptr<transport::TNonblockingServerSocket> socket;
 private:
   shared_ptr<apache::thrift::concurrency::Thread> thread;
 
@@ -212,4 +419,484 @@ BOOST_FIXTURE_TEST_CASE(provide_event_base, Fixture) {
 #endif
 }
 
+BOOST_FIXTURE_TEST_CASE(reuse_port_listeners, Fixture) {
+  setNumIOThreads(3);
+  setReusePort(true);
+  startServer(0);
+  int port = server->getListenPort();
+  BOOST_REQUIRE_NE(port, 0);
+#ifdef SO_REUSEPORT
+  BOOST_CHECK_EQUAL(socket->getNumListenSockets(), 3u);
+#endif
+
+  // keep all connections open so that each has to be accepted somewhere
+  std::vector<shared_ptr<test::ParentServiceClient> > clients;
+  for (int i = 0; i < 12; ++i) {
+    shared_ptr<transport::TSocket> clientSocket(new transport::TSocket("localhost", port));
+    clientSocket->open();
+    clients.push_back(make_shared<test::ParentServiceClient>(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(clientSocket))));
+    clients.back()->addString("foo");
+  }
+  for (auto& client : clients) {
+    std::vector<std::string> strings;
+    client->getStrings(strings);
+    BOOST_CHECK_EQUAL(strings.size(), 12u);
+  }
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(batched_completions, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(4);
+  threadManager->threadFactory(make_shared<ThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  startServer(0);
+  int port = server->getListenPort();
+
+  const int numClients = 8;
+  const int numCalls = 50;
+  std::vector<std::thread> clients;
+  for (int i = 0; i < numClients; ++i) {
+    clients.emplace_back([port] {
+      shared_ptr<transport::TSocket> clientSocket(new transport::TSocket("localhost", port));
+      clientSocket->open();
+      test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+          make_shared<transport::TFramedTransport>(clientSocket)));
+      for (int j = 0; j < numCalls; ++j) {
+        client.incrementGeneration();
+      }
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+
+  // every task hands its connection back once, some share a wakeup
+  BOOST_CHECK_GE(server->getNumCompletions(), static_cast<uint64_t>(numClients * numCalls));
+  BOOST_CHECK_GT(server->getNumCompletionWakeups(), 0u);
+  BOOST_CHECK_LE(server->getNumCompletionWakeups(), server->getNumCompletions());
+  BOOST_TEST_MESSAGE("completions: " << server->getNumCompletions()
+                     << ", wakeups: " << server->getNumCompletionWakeups());
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_requests, Fixture) {
+  setPipelining(true);
+  startServer(0);
+  int port = server->getListenPort();
+  BOOST_CHECK(canPipeline(port, 10));
+  BOOST_CHECK(canPipeline(port, 40));
+  BOOST_CHECK(canCommunicate(port));
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_requests_thread_pool, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(4);
+  threadManager->threadFactory(make_shared<ThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  setPipelining(true);
+  startServer(0);
+  int port = server->getListenPort();
+  BOOST_CHECK(canPipeline(port, 10));
+  BOOST_CHECK(canPipeline(port, 40));
+  BOOST_CHECK(canCommunicate(port));
+
+  // each batch hands its connection back to the IO thread once
+  BOOST_CHECK_LT(server->getNumCompletions(), 50u);
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(annotated_placement, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(1);
+  threadManager->threadFactory(make_shared<ThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  setPlacementPolicy(make_shared<TAnnotatedPlacementPolicy>());
+  startServer(0);
+
+  // keep the only worker busy, before the request arrives it would be
+  // scheduled ahead of this task for its deadline
+  Monitor monitor;
+  bool busy = false;
+  bool release = false;
+  threadManager->add(FunctionRunner::create([&] {
+    Guard g(monitor.mutex());
+    busy = true;
+    monitor.notify();
+    while (!release) {
+      monitor.wait();
+    }
+  }));
+  {
+    Guard g(monitor.mutex());
+    while (!busy) {
+      monitor.wait();
+    }
+  }
+
+  shared_ptr<transport::TSocket> clientSocket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  clientSocket->setRecvTimeout(5000);
+  clientSocket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(clientSocket)));
+
+  // getStrings is annotated to run inline, so it doesn't need the worker
+  std::vector<std::string> strings;
+  client.getStrings(strings);
+  BOOST_CHECK(strings.empty());
+
+  // addString has to wait for the worker
+  client.send_addString("foo");
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  BOOST_CHECK_EQUAL(threadManager->pendingTaskCount(), 1u);
+  {
+    Guard g(monitor.mutex());
+    release = true;
+    monitor.notify();
+  }
+  client.recv_addString();
+  client.getStrings(strings);
+  BOOST_CHECK_EQUAL(strings.size(), 1u);
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(adaptive_placement, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(2);
+  threadManager->threadFactory(make_shared<ThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  shared_ptr<TAdaptivePlacementPolicy> policy = make_shared<TAdaptivePlacementPolicy>(1000, 8);
+  setPlacementPolicy(policy);
+  startServer(0);
+
+  BOOST_CHECK_EQUAL(policy->getPlacement("getGeneration"), apache::thrift::T_PLACEMENT_WORKER);
+  BOOST_CHECK(canCommunicate(server->getListenPort()));
+  shared_ptr<transport::TSocket> clientSocket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  clientSocket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(clientSocket)));
+  for (int i = 0; i < 20; ++i) {
+    client.getGeneration();
+  }
+  BOOST_CHECK_EQUAL(policy->getPlacement("getGeneration"), apache::thrift::T_PLACEMENT_INLINE);
+  BOOST_CHECK_LT(policy->getServiceTime("getGeneration"), 1000.0);
+
+  // the annotation wins over measurements
+  BOOST_CHECK_EQUAL(policy->place("getGeneration", apache::thrift::T_PLACEMENT_WORKER),
+                    apache::thrift::T_PLACEMENT_WORKER);
+
+  // slow methods move back to the thread pool
+  for (int i = 0; i < 50; ++i) {
+    policy->record("getGeneration", apache::thrift::T_PLACEMENT_INLINE, 10000);
+  }
+  BOOST_CHECK_EQUAL(policy->getPlacement("getGeneration"), apache::thrift::T_PLACEMENT_WORKER);
+  BOOST_CHECK_EQUAL(client.getGeneration(), 0);
+
+  server->stop();
+
+  // methods beyond the limit share their statistics
+  TAdaptivePlacementPolicy bounded(1000, 1);
+  bounded.setMaxMethods(2);
+  bounded.record("first", apache::thrift::T_PLACEMENT_WORKER, 10);
+  bounded.record("second", apache::thrift::T_PLACEMENT_WORKER, 10);
+  for (int i = 0; i < 100; ++i) {
+    bounded.record("unknown" + std::to_string(i), apache::thrift::T_PLACEMENT_WORKER, 5000);
+  }
+  BOOST_CHECK_EQUAL(bounded.getPlacement("first"), apache::thrift::T_PLACEMENT_INLINE);
+  BOOST_CHECK_EQUAL(bounded.getPlacement("unknown0"), apache::thrift::T_PLACEMENT_WORKER);
+  BOOST_CHECK_GT(bounded.getServiceTime("another"), 1000.0);
+}
+
+BOOST_FIXTURE_TEST_CASE(thread_per_core, Fixture) {
+  std::vector<int> cpus;
+#ifdef __linux__
+  // bind all threads to the first CPU we may run on
+  cpu_set_t allowed;
+  BOOST_REQUIRE_EQUAL(sched_getaffinity(0, sizeof(allowed), &allowed), 0);
+  for (int cpu = 0; cpu < CPU_SETSIZE && cpus.empty(); ++cpu) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpus.push_back(cpu);
+    }
+  }
+#endif
+  setNumIOThreads(2);
+  setWorkersPerIOThread(1);
+  setIOThreadCpus(cpus);
+  startServer(0);
+  int port = server->getListenPort();
+
+  // the connections are spread over both IO threads, each of which runs the
+  // calls of its connections on its only worker
+  std::vector<shared_ptr<test::ParentServiceClient> > clients;
+  for (int i = 0; i < 4; ++i) {
+    shared_ptr<transport::TSocket> clientSocket(new transport::TSocket("localhost", port));
+    clientSocket->open();
+    clients.push_back(make_shared<test::ParentServiceClient>(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(clientSocket))));
+  }
+  for (int i = 0; i < 5; ++i) {
+    for (auto& client : clients) {
+      client->incrementGeneration();
+    }
+  }
+  BOOST_CHECK(canCommunicate(port));
+  {
+    Guard g(handler->mutex_);
+    BOOST_CHECK_EQUAL(handler->threads_.size(), 2u);
+#ifdef __linux__
+    BOOST_CHECK(handler->cpus_ == std::set<int>(cpus.begin(), cpus.end()));
+#endif
+  }
+  BOOST_CHECK_EQUAL(server->getNumRebalancedTasks(), 0u);
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(rebalanced_tasks, Fixture) {
+  setNumIOThreads(2);
+  setWorkersPerIOThread(1);
+  setRebalanceThreshold(1);
+  startServer(0);
+  int port = server->getListenPort();
+
+  // connections 0, 2 and 4 belong to the first IO thread
+  std::vector<shared_ptr<test::ParentServiceClient> > clients;
+  for (int i = 0; i < 5; ++i) {
+    shared_ptr<transport::TSocket> clientSocket(new transport::TSocket("localhost", port));
+    clientSocket->setRecvTimeout(5000);
+    clientSocket->open();
+    clients.push_back(make_shared<test::ParentServiceClient>(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(clientSocket))));
+  }
+
+  // keep the worker of the first IO thread busy and queue one task behind it
+  handler->block(true);
+  clients[0]->onewayWait();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  clients[2]->send_incrementGeneration();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  BOOST_CHECK_EQUAL(server->getNumRebalancedTasks(), 0u);
+
+  // the next one runs on the worker of the second IO thread instead
+  clients[4]->incrementGeneration();
+  BOOST_CHECK_EQUAL(server->getNumRebalancedTasks(), 1u);
+
+  handler->block(false);
+  clients[2]->recv_incrementGeneration();
+  {
+    Guard g(handler->mutex_);
+    BOOST_CHECK_EQUAL(handler->threads_.size(), 2u);
+  }
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(memory_budget, Fixture) {
+  setMaxBufferMemory(40000);
+  startServer(0);
+  int port = server->getListenPort();
+  std::string big(20000, 'x');
+
+  // the first client sends all of a large request but its last byte, so
+  // that its read buffer takes most of the budget
+  shared_ptr<transport::TMemoryBuffer> request(new transport::TMemoryBuffer);
+  test::ParentServiceClient sender(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(request)));
+  sender.send_addString(big);
+  std::string bytes = request->getBufferAsString();
+  shared_ptr<transport::TSocket> firstSocket(new transport::TSocket("localhost", port));
+  firstSocket->setRecvTimeout(5000);
+  firstSocket->open();
+  firstSocket->write(reinterpret_cast<const uint8_t*>(bytes.data()),
+                     static_cast<uint32_t>(bytes.size() - 1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  BOOST_CHECK_GT(server->getBufferMemory(), big.size());
+
+  // the second one has to wait until the first one releases its buffer
+  shared_ptr<transport::TSocket> secondSocket(new transport::TSocket("localhost", port));
+  secondSocket->setRecvTimeout(5000);
+  secondSocket->open();
+  test::ParentServiceClient second(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(secondSocket)));
+  second.send_addString(big);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  BOOST_CHECK_EQUAL(server->getNumStalledConnections(), 1u);
+  BOOST_CHECK_GE(server->getNumMemoryStalls(), 1u);
+  BOOST_CHECK_LE(server->getBufferMemory(), 40000u);
+
+  firstSocket->write(reinterpret_cast<const uint8_t*>(bytes.data()) + bytes.size() - 1, 1);
+  test::ParentServiceClient first(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(firstSocket)));
+  first.recv_addString();
+  firstSocket->close();
+
+  second.recv_addString();
+  BOOST_CHECK_EQUAL(server->getNumStalledConnections(), 0u);
+  std::vector<std::string> strings;
+  second.getStrings(strings);
+  BOOST_CHECK_EQUAL(strings.size(), 2u);
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(memory_budget_waiting_buffers, Fixture) {
+  setMaxBufferMemory(40000);
+  startServer(0);
+  int port = server->getListenPort();
+
+  // earlier requests leave each connection a read buffer that, together,
+  // takes too much of the budget for any of them to grow for a large one
+  std::vector<shared_ptr<test::ParentServiceClient> > clients;
+  for (int i = 0; i < 3; ++i) {
+    shared_ptr<transport::TSocket> clientSocket(new transport::TSocket("localhost", port));
+    clientSocket->setRecvTimeout(5000);
+    clientSocket->open();
+    clients.push_back(make_shared<test::ParentServiceClient>(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(clientSocket))));
+    clients.back()->addString(std::string(6000, 'x'));
+  }
+
+  std::atomic<int> completed(0);
+  std::vector<std::thread> threads;
+  for (auto& client : clients) {
+    threads.emplace_back([&completed, client] {
+      try {
+        client->addString(std::string(20000, 'y'));
+        ++completed;
+      } catch (const TException&) {
+      }
+      client->getInputProtocol()->getTransport()->close();
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  BOOST_CHECK_EQUAL(completed, 3);
+  BOOST_CHECK_GE(server->getNumMemoryStalls(), 1u);
+  BOOST_CHECK_EQUAL(server->getNumStalledConnections(), 0u);
+
+  server->stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(shed_requests, Fixture) {
+  setWorkersPerIOThread(1);
+  setQueueDelayTarget(5, 20);
+  startServer(0);
+  int port = server->getListenPort();
+  handler->delay_ = 10;
+
+  // queue up more calls than the worker serves within the target
+  std::vector<shared_ptr<test::ParentServiceClient> > clients;
+  for (int i = 0; i < 8; ++i) {
+    shared_ptr<transport::TSocket> clientSocket(new transport::TSocket("localhost", port));
+    clientSocket->setRecvTimeout(5000);
+    clientSocket->open();
+    clients.push_back(make_shared<test::ParentServiceClient>(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(clientSocket))));
+  }
+  for (auto& client : clients) {
+    client->send_incrementGeneration();
+  }
+
+  // the ones shed fail right away, the others are served
+  uint64_t shed = 0;
+  for (auto& client : clients) {
+    try {
+      client->recv_incrementGeneration();
+    } catch (const TApplicationException& x) {
+      BOOST_CHECK_EQUAL(x.getType(), TApplicationException::INTERNAL_ERROR);
+      ++shed;
+    }
+  }
+  BOOST_CHECK_GE(shed, 1u);
+  BOOST_CHECK_LT(shed, clients.size());
+  BOOST_CHECK_EQUAL(server->getNumShedTasks(), shed);
+
+  // a connection whose call was shed stays usable
+  handler->delay_ = 0;
+  for (auto& client : clients) {
+    client->incrementGeneration();
+  }
+  BOOST_CHECK_EQUAL(server->getNumShedTasks(), shed);
+
+  server->stop();
+}
+
+#ifdef THRIFT_TEST_WITH_THRIFTZ
+BOOST_FIXTURE_TEST_CASE(client_timeouts, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(1);
+  threadManager->threadFactory(make_shared<ThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  setHeaderProtocol(true);
+  setUseClientTimeouts(true);
+  startServer(0);
+  int port = server->getListenPort();
+  handler->delay_ = 20;
+
+  // keep the only worker busy, before the request arrives it would be
+  // scheduled ahead of this task for its deadline
+  Monitor monitor;
+  bool busy = false;
+  bool release = false;
+  threadManager->add(FunctionRunner::create([&] {
+    Guard g(monitor.mutex());
+    busy = true;
+    monitor.notify();
+    while (!release) {
+      monitor.wait();
+    }
+  }));
+  {
+    Guard g(monitor.mutex());
+    while (!busy) {
+      monitor.wait();
+    }
+  }
+
+  // the header protocol sends the receive timeout along as the client timeout
+  shared_ptr<transport::TSocket> impatientSocket(new transport::TSocket("localhost", port));
+  impatientSocket->setRecvTimeout(50);
+  impatientSocket->open();
+  test::ParentServiceClient impatient(make_shared<protocol::THeaderProtocol>(impatientSocket));
+  impatient.send_incrementGeneration();
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  BOOST_CHECK_EQUAL(threadManager->pendingTaskCount(), 1u);
+
+  // the request expires once its client stopped waiting, without being run
+  {
+    Guard g(monitor.mutex());
+    release = true;
+    monitor.notify();
+  }
+  BOOST_CHECK_THROW(impatient.recv_incrementGeneration(), transport::TTransportException);
+  for (int i = 0; i < 100 && threadManager->expiredTaskCount() == 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL(threadManager->expiredTaskCount(), 1u);
+  BOOST_CHECK(handler->threads_.empty());
+
+  // a request still in time runs, and its handler sees the time left
+  shared_ptr<transport::TSocket> patientSocket(new transport::TSocket("localhost", port));
+  patientSocket->setRecvTimeout(5000);
+  patientSocket->open();
+  test::ParentServiceClient patient(make_shared<protocol::THeaderProtocol>(patientSocket));
+  BOOST_CHECK_EQUAL(patient.incrementGeneration(), 1);
+  BOOST_CHECK_GE(handler->remaining_, 0);
+  BOOST_CHECK_LE(handler->remaining_, 5000);
+  BOOST_CHECK_EQUAL(threadManager->expiredTaskCount(), 1u);
+
+  server->stop();
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
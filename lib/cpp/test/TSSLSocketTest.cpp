@@ -0,0 +1,402 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE TSSLSocketTest
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <openssl/ssl.h>
+#include <thrift/transport/TSSLServerSocket.h>
+#include <thrift/transport/TSSLSocket.h>
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifndef _WIN32
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+using apache::thrift::transport::TSSLServerSocket;
+using apache::thrift::transport::TSSLSessionCache;
+using apache::thrift::transport::TSSLSessionTicketKeys;
+using apache::thrift::transport::TSSLSocket;
+using apache::thrift::transport::TSSLSocketFactory;
+using apache::thrift::transport::TTransportException;
+
+using std::shared_ptr;
+
+boost::filesystem::path keyDir;
+boost::filesystem::path certFile(const std::string& filename)
+{
+  return keyDir / filename;
+}
+
+struct GlobalFixture
+{
+  GlobalFixture()
+  {
+    using namespace boost::unit_test::framework;
+    for (int i = 0; i < master_test_suite().argc; ++i)
+    {
+      BOOST_TEST_MESSAGE(boost::format("argv[%1%] = \"%2%\"") % i % master_test_suite().argv[i]);
+    }
+
+#ifdef __linux__
+    // OpenSSL calls send() without MSG_NOSIGPIPE so writing to a socket that has
+    // disconnected can cause a SIGPIPE signal...
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    TSSLSocketFactory::setManualOpenSSLInitialization(true);
+    apache::thrift::transport::initializeOpenSSL();
+
+    keyDir = boost::filesystem::current_path().parent_path().parent_path().parent_path() / "test" / "keys";
+    if (!boost::filesystem::exists(certFile("server.crt")))
+    {
+      keyDir = boost::filesystem::path(master_test_suite().argv[master_test_suite().argc - 1]);
+      if (!boost::filesystem::exists(certFile("server.crt")))
+      {
+        throw std::invalid_argument("The last argument to this test must be the directory containing the test certificate(s).");
+      }
+    }
+  }
+
+  virtual ~GlobalFixture()
+  {
+    apache::thrift::transport::cleanupOpenSSL();
+#ifdef __linux__
+    signal(SIGPIPE, SIG_DFL);
+#endif
+  }
+};
+
+#if (BOOST_VERSION >= 105900)
+BOOST_GLOBAL_FIXTURE(GlobalFixture);
+#else
+BOOST_GLOBAL_FIXTURE(GlobalFixture)
+#endif
+
+shared_ptr<TSSLSocketFactory> createServerSocketFactory(
+    apache::thrift::transport::SSLProtocol protocol = apache::thrift::transport::SSLTLS)
+{
+  shared_ptr<TSSLSocketFactory> factory(new TSSLSocketFactory(protocol));
+  factory->loadCertificate(certFile("server.crt").string().c_str());
+  factory->loadPrivateKey(certFile("server.key").string().c_str());
+  factory->server(true);
+  return factory;
+}
+
+shared_ptr<TSSLSocketFactory> createClientSocketFactory()
+{
+  shared_ptr<TSSLSocketFactory> factory(new TSSLSocketFactory());
+  factory->authenticate(true);
+  factory->loadTrustedCertificates(certFile("CA.pem").string().c_str());
+  return factory;
+}
+
+shared_ptr<TSSLServerSocket> listen(shared_ptr<TSSLSocketFactory> factory)
+{
+  shared_ptr<TSSLServerSocket> serverSocket(new TSSLServerSocket("localhost", 0, factory));
+  serverSocket->listen();
+  return serverSocket;
+}
+
+/**
+ * A client and a server socket connected over loopback, with the handshake
+ * completed on both sides.
+ */
+struct SSLConnection
+{
+  SSLConnection(bool kernelTLS)
+  {
+    shared_ptr<TSSLSocketFactory> serverFactory = createServerSocketFactory();
+    serverFactory->kernelTLS(kernelTLS);
+    shared_ptr<TSSLSocketFactory> clientFactory = createClientSocketFactory();
+    clientFactory->kernelTLS(kernelTLS);
+    ownServerSocket = listen(serverFactory);
+    connect(ownServerSocket, clientFactory);
+  }
+
+  SSLConnection(shared_ptr<TSSLServerSocket> serverSocket, shared_ptr<TSSLSocketFactory> clientFactory)
+  {
+    connect(serverSocket, clientFactory);
+  }
+
+  ~SSLConnection()
+  {
+    client->close();
+    server->close();
+    if (ownServerSocket) {
+      ownServerSocket->close();
+    }
+  }
+
+  void connect(shared_ptr<TSSLServerSocket> serverSocket, shared_ptr<TSSLSocketFactory> clientFactory)
+  {
+    client = clientFactory->createSocket("localhost", serverSocket->getPort());
+    client->open();
+
+    // an empty write completes the handshake, the client starts it first as
+    // the server socket defers accepting until data arrives
+    std::thread handshake([this] { client->write(nullptr, 0); });
+    server = std::static_pointer_cast<TSSLSocket>(serverSocket->accept());
+    server->write(nullptr, 0);
+    handshake.join();
+
+    // TLS 1.3 session tickets arrive after the handshake, ahead of the data
+    uint8_t byte = 1;
+    server->write(&byte, 1);
+    server->flush();
+    client->read(&byte, 1);
+  }
+
+  shared_ptr<TSSLServerSocket> ownServerSocket;
+  shared_ptr<TSSLSocket> client;
+  shared_ptr<TSSLSocket> server;
+};
+
+/**
+ * Sends data from the server to the client, returns the bytes received.
+ */
+std::vector<uint8_t> transfer(SSLConnection& connection, const std::vector<uint8_t>& data)
+{
+  std::thread sender([&connection, &data] {
+    connection.server->write(data.data(), static_cast<uint32_t>(data.size()));
+    connection.server->flush();
+  });
+  std::vector<uint8_t> received(data.size());
+  connection.client->readAll(received.data(), static_cast<uint32_t>(received.size()));
+  sender.join();
+  return received;
+}
+
+std::vector<uint8_t> pattern(size_t size)
+{
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = static_cast<uint8_t>(i * 31 + i / 251);
+  }
+  return data;
+}
+
+BOOST_AUTO_TEST_CASE(test_kernel_tls_option)
+{
+  TSSLSocketFactory factory;
+  BOOST_CHECK(!factory.kernelTLS());
+  factory.kernelTLS(true);
+#ifdef SSL_OP_ENABLE_KTLS
+  BOOST_CHECK(factory.kernelTLS());
+#else
+  BOOST_CHECK(!factory.kernelTLS());
+#endif
+  factory.kernelTLS(false);
+  BOOST_CHECK(!factory.kernelTLS());
+}
+
+BOOST_AUTO_TEST_CASE(test_kernel_tls_transfer)
+{
+  for (bool kernelTLS : {false, true}) {
+    SSLConnection connection(kernelTLS);
+    BOOST_TEST_MESSAGE(boost::format("kernelTLS(%1%): send %2% recv %3%")
+                       % kernelTLS
+                       % connection.server->isKernelTLSSend()
+                       % connection.client->isKernelTLSRecv());
+    if (!kernelTLS) {
+      BOOST_CHECK(!connection.server->isKernelTLSSend());
+      BOOST_CHECK(!connection.client->isKernelTLSRecv());
+    }
+
+    // works whether or not the kernel took over the record layer
+    for (size_t size : {1u, 100u, 16384u, 16385u, 1000000u}) {
+      std::vector<uint8_t> data = pattern(size);
+      BOOST_CHECK(transfer(connection, data) == data);
+    }
+  }
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE(test_send_file)
+{
+  char path[] = "/tmp/thrift.TSSLSocketTest.XXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd >= 0);
+  unlink(path);
+  std::vector<uint8_t> data = pattern(300000);
+  BOOST_REQUIRE_EQUAL(static_cast<ssize_t>(data.size()), ::write(fd, data.data(), data.size()));
+
+  for (bool kernelTLS : {false, true}) {
+    SSLConnection connection(kernelTLS);
+    const off_t offset = 12345;
+    const size_t size = data.size() - offset - 100;
+    std::thread sender([&connection, fd, offset, size] {
+      connection.server->sendFile(fd, offset, size);
+    });
+    std::vector<uint8_t> received(size);
+    connection.client->readAll(received.data(), static_cast<uint32_t>(size));
+    sender.join();
+    BOOST_CHECK(std::equal(received.begin(), received.end(), data.begin() + offset));
+  }
+
+  // reading past the end of the file fails
+  SSLConnection connection(false);
+  BOOST_CHECK_THROW(connection.server->sendFile(fd, 0, data.size() + 1), TTransportException);
+  ::close(fd);
+}
+#endif
+
+SSL_SESSION* newSession(const char* id)
+{
+  SSL_SESSION* session = SSL_SESSION_new();
+  SSL_SESSION_set1_id(session, reinterpret_cast<const unsigned char*>(id), 1);
+  return session;
+}
+
+BOOST_AUTO_TEST_CASE(test_session_cache)
+{
+  TSSLSessionCache cache(2);
+  BOOST_CHECK(cache.get("a:1") == nullptr);
+
+  SSL_SESSION* a = newSession("a");
+  SSL_SESSION* b = newSession("b");
+  SSL_SESSION* c = newSession("c");
+  cache.put("a:1", a);
+  cache.put("b:1", b);
+  SSL_SESSION* session = cache.get("a:1");
+  BOOST_CHECK(session == a);
+  SSL_SESSION_free(session);
+
+  // evicts the least recently used session
+  cache.put("c:1", c);
+  BOOST_CHECK_EQUAL(2u, cache.size());
+  BOOST_CHECK(cache.get("b:1") == nullptr);
+  session = cache.get("c:1");
+  BOOST_CHECK(session == c);
+  SSL_SESSION_free(session);
+
+  cache.put("a:1", b);
+  session = cache.get("a:1");
+  BOOST_CHECK(session == b);
+  SSL_SESSION_free(session);
+
+  // expired sessions are dropped
+  SSL_SESSION_set_time(c, static_cast<long>(time(nullptr)) - 24 * 3600);
+  BOOST_CHECK(cache.get("c:1") == nullptr);
+  BOOST_CHECK_EQUAL(1u, cache.size());
+  cache.remove("a:1");
+  BOOST_CHECK_EQUAL(0u, cache.size());
+
+  SSL_SESSION_free(a);
+  SSL_SESSION_free(b);
+  SSL_SESSION_free(c);
+}
+
+BOOST_AUTO_TEST_CASE(test_session_resumption)
+{
+  shared_ptr<TSSLServerSocket> serverSocket = listen(createServerSocketFactory());
+  shared_ptr<TSSLSessionCache> cache = std::make_shared<TSSLSessionCache>();
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientSocketFactory();
+  clientFactory->sessionCache(cache);
+  {
+    SSLConnection connection(serverSocket, clientFactory);
+    BOOST_CHECK(!connection.client->isSessionReused());
+    BOOST_CHECK_EQUAL(1u, cache->size());
+  }
+  for (int i = 0; i < 3; ++i) {
+    SSLConnection connection(serverSocket, clientFactory);
+    BOOST_CHECK(connection.client->isSessionReused());
+    BOOST_CHECK(connection.server->isSessionReused());
+  }
+
+  // the cache works across factories
+  shared_ptr<TSSLSocketFactory> otherFactory = createClientSocketFactory();
+  otherFactory->sessionCache(cache);
+  {
+    SSLConnection connection(serverSocket, otherFactory);
+    BOOST_CHECK(connection.client->isSessionReused());
+  }
+  {
+    SSLConnection connection(serverSocket, createClientSocketFactory());
+    BOOST_CHECK(!connection.client->isSessionReused());
+  }
+  serverSocket->close();
+}
+
+BOOST_AUTO_TEST_CASE(test_server_session_cache)
+{
+  // TLS 1.2 without tickets resumes from the server's session cache
+  shared_ptr<TSSLSocketFactory> serverFactory
+      = createServerSocketFactory(apache::thrift::transport::TLSv1_2);
+  serverFactory->sessionTicketKeys(nullptr);
+  serverFactory->serverSessionCache(100, 300);
+  shared_ptr<TSSLServerSocket> serverSocket = listen(serverFactory);
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientSocketFactory();
+  clientFactory->sessionCache(std::make_shared<TSSLSessionCache>());
+  {
+    SSLConnection connection(serverSocket, clientFactory);
+    BOOST_CHECK(!connection.client->isSessionReused());
+  }
+  for (int i = 0; i < 3; ++i) {
+    SSLConnection connection(serverSocket, clientFactory);
+    BOOST_CHECK(connection.client->isSessionReused());
+  }
+
+  serverFactory->serverSessionCache(0, 300);
+  {
+    SSLConnection connection(serverSocket, clientFactory);
+    BOOST_CHECK(!connection.client->isSessionReused());
+  }
+  serverSocket->close();
+}
+
+BOOST_AUTO_TEST_CASE(test_session_ticket_keys)
+{
+  for (int gracePeriod : {3600, 0}) {
+    shared_ptr<TSSLSessionTicketKeys> keys = std::make_shared<TSSLSessionTicketKeys>(3600, gracePeriod);
+    shared_ptr<TSSLSocketFactory> serverFactory = createServerSocketFactory();
+    serverFactory->sessionTicketKeys(keys);
+    shared_ptr<TSSLServerSocket> serverSocket = listen(serverFactory);
+    shared_ptr<TSSLSocketFactory> clientFactory = createClientSocketFactory();
+    clientFactory->sessionCache(std::make_shared<TSSLSessionCache>());
+    {
+      SSLConnection connection(serverSocket, clientFactory);
+    }
+    for (int i = 0; i < 3; ++i) {
+      SSLConnection connection(serverSocket, clientFactory);
+      BOOST_CHECK(connection.client->isSessionReused());
+    }
+
+    // tickets of a retired key are accepted during the grace period only
+    keys->rotate();
+    {
+      SSLConnection connection(serverSocket, clientFactory);
+      BOOST_CHECK_EQUAL(gracePeriod > 0, connection.client->isSessionReused());
+    }
+    {
+      // the last connection got a ticket with the current key
+      SSLConnection connection(serverSocket, clientFactory);
+      BOOST_CHECK(connection.client->isSessionReused());
+    }
+    serverSocket->close();
+  }
+}
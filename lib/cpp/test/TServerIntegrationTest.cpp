@@ -24,6 +24,7 @@
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/thread.hpp>
+#include <thrift/server/TConcurrencyLimiter.h>
 #include <thrift/server/TSimpleServer.h>
 #include <thrift/server/TThreadPoolServer.h>
 #include <thrift/server/TThreadedServer.h>
@@ -50,11 +51,13 @@ using apache::thrift::transport::TSocket;
 using apache::thrift::transport::TTransport;
 using apache::thrift::transport::TTransportException;
 using apache::thrift::transport::TTransportFactory;
+using apache::thrift::server::TConcurrencyLimiter;
 using apache::thrift::server::TServer;
 using apache::thrift::server::TServerEventHandler;
 using apache::thrift::server::TSimpleServer;
 using apache::thrift::server::TThreadPoolServer;
 using apache::thrift::server::TThreadedServer;
+using apache::thrift::server::TVegasConcurrencyLimiter;
 using std::dynamic_pointer_cast;
 using std::make_shared;
 using std::shared_ptr;
@@ -375,6 +378,12 @@ BOOST_FIXTURE_TEST_CASE(test_threaded_stress,
   stress(10, boost::posix_time::seconds(3));
 }
 
+BOOST_FIXTURE_TEST_CASE(test_threaded_cached_stress,
+                        TServerIntegrationProcessorFactoryTestFixture<TThreadedServer>) {
+  pServer->setMaxIdleThreads(4);
+  stress(10, boost::posix_time::seconds(3));
+}
+
 BOOST_FIXTURE_TEST_CASE(test_threadpool_factory,
                         TServerIntegrationProcessorFactoryTestFixture<TThreadPoolServer>) {
   pServer->getThreadManager()->threadFactory(
@@ -426,6 +435,17 @@ BOOST_FIXTURE_TEST_CASE(test_threadpool_stress,
   stress(10, boost::posix_time::seconds(3));
 }
 
+BOOST_FIXTURE_TEST_CASE(test_threadpool_parking_stress,
+                        TServerIntegrationProcessorTestFixture<TThreadPoolServer>) {
+  pServer->getThreadManager()->threadFactory(
+      shared_ptr<apache::thrift::concurrency::ThreadFactory>(
+          new apache::thrift::concurrency::ThreadFactory));
+  pServer->getThreadManager()->start();
+  pServer->setIdleConnectionParking(true);
+
+  stress(10, boost::posix_time::seconds(3));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_FIXTURE_TEST_SUITE(TServerIntegrationTest,
@@ -533,4 +553,355 @@ BOOST_AUTO_TEST_CASE(test_concurrent_client_limit) {
   t2.join();
 }
 
+/**
+ * Polls until the server has the given number of parked threads.
+ */
+static bool waitForIdleThreads(TThreadedServer& server, size_t count) {
+  for (int i = 0; i < 500 && server.getNumIdleThreads() != count; ++i) {
+    boost::this_thread::sleep(milliseconds(10));
+  }
+  return server.getNumIdleThreads() == count;
+}
+
+BOOST_AUTO_TEST_CASE(test_idle_thread_reuse) {
+  BOOST_TEST_MESSAGE("Testing threads are reused across clients");
+
+  BOOST_CHECK_EQUAL(0, pServer->getMaxIdleThreads());
+  pServer->setMaxIdleThreads(2);
+  pServer->setIdleThreadTimeout(0);
+  startServer();
+
+  for (int i = 0; i < 3; ++i) {
+    shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+    ParentServiceClient client(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock)));
+    pClientSock->open();
+    BOOST_CHECK_EQUAL(i + 1, client.incrementGeneration());
+    BOOST_CHECK_EQUAL(0, pServer->getNumIdleThreads());
+    pClientSock->close();
+    BOOST_CHECK(waitForIdleThreads(*pServer, 1));
+  }
+
+  // no more than the maximum are kept once concurrent clients leave
+  std::vector<shared_ptr<TSocket> > holdSockets;
+  for (int i = 0; i < 3; ++i) {
+    shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+    ParentServiceClient client(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock)));
+    pClientSock->open();
+    client.getGeneration();
+    holdSockets.push_back(pClientSock);
+  }
+  BOOST_CHECK_EQUAL(0, pServer->getNumIdleThreads());
+  holdSockets.clear();
+  BOOST_CHECK(waitForIdleThreads(*pServer, 2));
+
+  // lowering the limit while serving releases the threads parked beyond it
+  pServer->setMaxIdleThreads(1);
+  BOOST_CHECK_EQUAL(1, pServer->getNumIdleThreads());
+  pServer->setMaxIdleThreads(0);
+  BOOST_CHECK_EQUAL(0, pServer->getNumIdleThreads());
+  shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+  ParentServiceClient client(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock)));
+  pClientSock->open();
+  BOOST_CHECK_EQUAL(4, client.incrementGeneration());
+  pClientSock->close();
+
+  stopServer();
+  BOOST_CHECK_EQUAL(0, pServer->getNumIdleThreads());
+}
+
+BOOST_AUTO_TEST_CASE(test_idle_thread_timeout) {
+  BOOST_TEST_MESSAGE("Testing parked threads exit after the idle timeout");
+
+  pServer->setMaxIdleThreads(4);
+  pServer->setIdleThreadTimeout(100);
+  startServer();
+
+  shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+  ParentServiceClient client(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock)));
+  pClientSock->open();
+  client.incrementGeneration();
+  pClientSock->close();
+
+  BOOST_CHECK(waitForIdleThreads(*pServer, 1));
+  BOOST_CHECK(waitForIdleThreads(*pServer, 0));
+
+  // a client connecting after the cache emptied gets a new thread
+  pClientSock->open();
+  BOOST_CHECK_EQUAL(2, client.incrementGeneration());
+  pClientSock->close();
+  BOOST_CHECK(waitForIdleThreads(*pServer, 1));
+
+  stopServer();
+}
+
+/**
+ * Lowers the limit to one client as soon as a request is recorded.
+ */
+class BackOffLimiter : public TConcurrencyLimiter {
+public:
+  BackOffLimiter() : limit_(INT64_MAX), samples_(0) {}
+  int64_t getLimit() const override { return limit_; }
+  int64_t record(uint64_t usec, int64_t inflight) override {
+    THRIFT_UNUSED_VARIABLE(usec);
+    THRIFT_UNUSED_VARIABLE(inflight);
+    ++samples_;
+    return limit_ = 1;
+  }
+
+  std::atomic<int64_t> limit_;
+  std::atomic<int64_t> samples_;
+};
+
+BOOST_AUTO_TEST_CASE(test_concurrency_limiter_backs_off) {
+  BOOST_TEST_MESSAGE("Testing the concurrency limiter lowers the client limit");
+
+  shared_ptr<BackOffLimiter> limiter(new BackOffLimiter);
+  pServer->setConcurrencyLimiter(limiter);
+  pServer->setConcurrentClientLimit(4);
+  BOOST_CHECK_EQUAL(4, pServer->getEffectiveConcurrentClientLimit());
+  startServer();
+
+  shared_ptr<TSocket> pClientSock1(new TSocket("localhost", getServerPort()), autoSocketCloser);
+  ParentServiceClient client1(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock1)));
+  pClientSock1->open();
+  client1.incrementGeneration();
+  // the request is recorded once its reply is written, which may be after
+  // the client has read it
+  for (int i = 0; i < 500 && limiter->samples_ == 0; ++i) {
+    boost::this_thread::sleep(milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL(1, limiter->samples_);
+  BOOST_CHECK_EQUAL(1, pServer->getEffectiveConcurrentClientLimit());
+  BOOST_CHECK_EQUAL(4, pServer->getConcurrentClientLimit());
+
+  // the second client is not accepted until the first disconnects
+  shared_ptr<TSocket> pClientSock2(new TSocket("localhost", getServerPort()), autoSocketCloser);
+  ParentServiceClient client2(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock2)));
+  pClientSock2->open();
+  boost::this_thread::sleep(milliseconds(100));
+  BOOST_CHECK_EQUAL(1, pEventHandler->acceptedCount());
+  pClientSock1->close();
+  blockUntilAccepted(2);
+  BOOST_CHECK_EQUAL(2, client2.incrementGeneration());
+
+  stopServer();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+/**
+ * Polls until the server has the given number of parked clients.
+ */
+static bool waitForParkedClients(TThreadPoolServer& server, size_t count) {
+  for (int i = 0; i < 500 && server.getParkedConnectionCount() != count; ++i) {
+    boost::this_thread::sleep(milliseconds(10));
+  }
+  return server.getParkedConnectionCount() == count;
+}
+
+BOOST_FIXTURE_TEST_SUITE(TThreadPoolServerParkingTest,
+                         TServerIntegrationProcessorTestFixture<TThreadPoolServer>)
+
+BOOST_AUTO_TEST_CASE(test_idle_clients_share_a_worker) {
+  BOOST_TEST_MESSAGE("Testing idle clients give their worker back");
+
+  pServer->getThreadManager()->threadFactory(
+      shared_ptr<apache::thrift::concurrency::ThreadFactory>(
+          new apache::thrift::concurrency::ThreadFactory));
+  pServer->getThreadManager()->start();
+  pServer->getThreadManager()->removeWorker(3);
+  BOOST_CHECK(!pServer->getIdleConnectionParking());
+  pServer->setIdleConnectionParking(true);
+  startServer();
+
+  // with a single worker this only completes if idle clients are parked
+  std::vector<shared_ptr<TSocket> > sockets;
+  std::vector<shared_ptr<ParentServiceClient> > clients;
+  for (int i = 0; i < 4; ++i) {
+    shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+    pClientSock->open();
+    sockets.push_back(pClientSock);
+    clients.push_back(shared_ptr<ParentServiceClient>(
+        new ParentServiceClient(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock)))));
+  }
+  int32_t generation = 0;
+  for (int round = 0; round < 3; ++round) {
+    BOOST_FOREACH (shared_ptr<ParentServiceClient> client, clients) {
+      BOOST_CHECK_EQUAL(++generation, client->incrementGeneration());
+    }
+  }
+  BOOST_CHECK(waitForParkedClients(*pServer, 4));
+
+  // a client that disconnects while parked leaves the poller
+  sockets.back()->close();
+  BOOST_CHECK(waitForParkedClients(*pServer, 3));
+
+  // stopping the server disconnects the parked clients
+  stopServer();
+  uint8_t buf[1];
+  BOOST_CHECK_EQUAL(0, sockets.front()->read(&buf[0], 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_parked_client_timeout) {
+  BOOST_TEST_MESSAGE("Testing parked clients time out with the receive timeout");
+
+  dynamic_pointer_cast<TServerSocket>(pServer->getServerTransport())->setRecvTimeout(100);
+  pServer->getThreadManager()->threadFactory(
+      shared_ptr<apache::thrift::concurrency::ThreadFactory>(
+          new apache::thrift::concurrency::ThreadFactory));
+  pServer->getThreadManager()->start();
+  pServer->setIdleConnectionParking(true);
+  startServer();
+
+  shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+  ParentServiceClient client(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock)));
+  pClientSock->open();
+  client.incrementGeneration();
+  BOOST_CHECK(waitForParkedClients(*pServer, 1));
+  BOOST_CHECK(waitForParkedClients(*pServer, 0));
+
+  uint8_t buf[1];
+  BOOST_CHECK_EQUAL(0, pClientSock->read(&buf[0], 1)); // 0 = disconnected
+  BOOST_CHECK_EQUAL(0, pServer->getConcurrentClientCount());
+
+  stopServer();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE(TThreadPoolServerSheddingTest,
+                         TServerIntegrationProcessorTestFixture<TThreadPoolServer>)
+
+BOOST_AUTO_TEST_CASE(test_shed_clients_are_disconnected) {
+  BOOST_TEST_MESSAGE("Testing clients shed by the queue delay target are disconnected");
+
+  // a client that sends nothing holds the only worker until the timeout
+  dynamic_pointer_cast<TServerSocket>(pServer->getServerTransport())->setRecvTimeout(50);
+  pServer->getThreadManager()->threadFactory(
+      shared_ptr<apache::thrift::concurrency::ThreadFactory>(
+          new apache::thrift::concurrency::ThreadFactory));
+  pServer->getThreadManager()->start();
+  pServer->getThreadManager()->removeWorker(3);
+  pServer->setQueueDelayTarget(10, 1);
+  startServer();
+
+  std::vector<shared_ptr<TSocket> > sockets;
+  for (int i = 0; i < 6; ++i) {
+    shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+    pClientSock->open();
+    sockets.push_back(pClientSock);
+    if (i == 0) {
+      blockUntilAccepted(1);
+    }
+  }
+
+  // served clients time out, shed ones are closed without being served
+  uint8_t buf[1];
+  BOOST_FOREACH (shared_ptr<TSocket> pClientSock, sockets) {
+    BOOST_CHECK_EQUAL(0, pClientSock->read(&buf[0], 1)); // 0 = disconnected
+  }
+  BOOST_CHECK_GE(pServer->getShedClientCount(), 1u);
+  {
+    Synchronized sync(*pEventHandler);
+    BOOST_CHECK_EQUAL(sockets.size(),
+                      pEventHandler->acceptedCount() + pServer->getShedClientCount());
+  }
+
+  stopServer();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE(TServerConcurrencyLimitTest,
+                         TServerIntegrationProcessorTestFixture<TThreadPoolServer>)
+
+BOOST_AUTO_TEST_CASE(test_vegas_limiter_samples_requests) {
+  BOOST_TEST_MESSAGE("Testing the thread pool server feeds request latency to the limiter");
+
+  pServer->getThreadManager()->threadFactory(
+      shared_ptr<apache::thrift::concurrency::ThreadFactory>(
+          new apache::thrift::concurrency::ThreadFactory));
+  pServer->getThreadManager()->start();
+  shared_ptr<TVegasConcurrencyLimiter> limiter(new TVegasConcurrencyLimiter(8));
+  pServer->setConcurrencyLimiter(limiter);
+  BOOST_CHECK(pServer->getConcurrencyLimiter() == limiter);
+  startServer();
+
+  shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+  ParentServiceClient client(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock)));
+  pClientSock->open();
+  for (int i = 0; i < 10; ++i) {
+    client.incrementGeneration();
+  }
+  // the last request is recorded once its reply is written, which may be
+  // after the client has read it
+  for (int i = 0; i < 500 && limiter->getSampleCount() < 10u; ++i) {
+    boost::this_thread::sleep(milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL(10u, limiter->getSampleCount());
+  BOOST_CHECK(limiter->getLatency() > 0);
+  BOOST_CHECK(limiter->getNoLoadLatency() > 0);
+  BOOST_CHECK_EQUAL(limiter->getLimit(), pServer->getEffectiveConcurrentClientLimit());
+  pClientSock->close();
+
+  stopServer();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(TVegasConcurrencyLimiterTest)
+
+BOOST_AUTO_TEST_CASE(test_vegas_grows_without_queue) {
+  TVegasConcurrencyLimiter limiter(10, 1, 100);
+  for (int i = 0; i < 20; ++i) {
+    limiter.record(1000, limiter.getLimit());
+  }
+  BOOST_CHECK(limiter.getLimit() > 10);
+  BOOST_CHECK(limiter.getLimit() <= 100);
+  BOOST_CHECK_EQUAL(1000u, limiter.getNoLoadLatency());
+  BOOST_CHECK_EQUAL(20u, limiter.getSampleCount());
+}
+
+BOOST_AUTO_TEST_CASE(test_vegas_holds_when_underused) {
+  TVegasConcurrencyLimiter limiter(10, 1, 100);
+  for (int i = 0; i < 20; ++i) {
+    limiter.record(1000, 2);
+  }
+  BOOST_CHECK_EQUAL(10, limiter.getLimit());
+}
+
+BOOST_AUTO_TEST_CASE(test_vegas_backs_off_when_latency_rises) {
+  TVegasConcurrencyLimiter limiter(50, 10, 100);
+  limiter.setProbeInterval(1000);
+  limiter.record(1000, 50);
+  for (int i = 0; i < 20; ++i) {
+    limiter.record(10000, 50);
+  }
+  BOOST_CHECK(limiter.getLimit() < 50);
+  BOOST_CHECK(limiter.getLimit() >= 10);
+  BOOST_CHECK_EQUAL(1000u, limiter.getNoLoadLatency());
+  BOOST_CHECK_EQUAL(10000u, limiter.getLatency());
+
+  // the limit never falls below the minimum
+  for (int i = 0; i < 200; ++i) {
+    limiter.record(10000, 50);
+  }
+  BOOST_CHECK_EQUAL(10, limiter.getLimit());
+}
+
+BOOST_AUTO_TEST_CASE(test_vegas_probes_no_load_latency) {
+  TVegasConcurrencyLimiter limiter(2, 2, 2);
+  limiter.setProbeInterval(1);
+  limiter.record(1000, 2);
+  limiter.record(3000, 2);
+  BOOST_CHECK_EQUAL(3000u, limiter.getNoLoadLatency());
+}
+
+BOOST_AUTO_TEST_CASE(test_vegas_rejects_bad_limits) {
+  BOOST_CHECK_THROW(TVegasConcurrencyLimiter(10, 0, 100), std::invalid_argument);
+  BOOST_CHECK_THROW(TVegasConcurrencyLimiter(10, 20, 10), std::invalid_argument);
+  TVegasConcurrencyLimiter limiter;
+  BOOST_CHECK_THROW(limiter.setProbeInterval(0), std::invalid_argument);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
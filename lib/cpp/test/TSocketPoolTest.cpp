@@ -0,0 +1,205 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TSocketPool.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using apache::thrift::transport::TServerSocket;
+using apache::thrift::transport::TSocketPool;
+using apache::thrift::transport::TSocketPoolLeastOutstandingPolicy;
+using apache::thrift::transport::TSocketPoolPowerOfTwoPolicy;
+using apache::thrift::transport::TSocketPoolServer;
+using apache::thrift::transport::TTransport;
+using std::make_shared;
+using std::shared_ptr;
+using std::vector;
+
+BOOST_AUTO_TEST_SUITE(TSocketPoolTest)
+
+BOOST_AUTO_TEST_CASE(test_latency_tracking) {
+  TSocketPoolServer server("localhost", 9090);
+  BOOST_CHECK_EQUAL(server.getLatency(), 0.0);
+  server.requestStarted();
+  server.requestStarted();
+  BOOST_CHECK_EQUAL(server.getOutstanding(), 2);
+
+  server.requestFinished(1000, true);
+  BOOST_CHECK_EQUAL(server.getOutstanding(), 1);
+  BOOST_CHECK_CLOSE(server.getLatency(), 1000.0, 0.001);
+
+  server.requestFinished(2000, true);
+  BOOST_CHECK_EQUAL(server.getOutstanding(), 0);
+  BOOST_CHECK_CLOSE(server.getLatency(), 1200.0, 0.001);
+
+  // failed requests carry no latency sample
+  server.requestStarted();
+  server.requestFinished(100000, false);
+  BOOST_CHECK_EQUAL(server.getOutstanding(), 0);
+  BOOST_CHECK_CLOSE(server.getLatency(), 1200.0, 0.001);
+
+  server.eject(time(nullptr) + 60);
+  BOOST_CHECK(server.isEjected(time(nullptr)));
+  BOOST_CHECK(!server.isEjected(time(nullptr) + 61));
+  BOOST_CHECK_EQUAL(server.getLatency(), 0.0);
+}
+
+BOOST_AUTO_TEST_CASE(test_least_outstanding_policy) {
+  vector<shared_ptr<TSocketPoolServer> > servers;
+  for (int i = 0; i < 3; ++i) {
+    servers.push_back(make_shared<TSocketPoolServer>("localhost", 9090 + i));
+    for (int j = 0; j < 2 - i; ++j) {
+      servers.back()->requestStarted();
+    }
+  }
+
+  TSocketPoolLeastOutstandingPolicy policy;
+  vector<shared_ptr<TSocketPoolServer> > ordered(servers);
+  policy.order(ordered);
+  BOOST_CHECK(ordered[0] == servers[2]);
+  BOOST_CHECK(ordered[1] == servers[1]);
+  BOOST_CHECK(ordered[2] == servers[0]);
+}
+
+BOOST_AUTO_TEST_CASE(test_power_of_two_policy) {
+  vector<shared_ptr<TSocketPoolServer> > servers;
+  for (int i = 0; i < 3; ++i) {
+    servers.push_back(make_shared<TSocketPoolServer>("localhost", 9090 + i));
+    servers.back()->requestStarted();
+    servers.back()->requestFinished(1000 * (i + 1), true);
+  }
+
+  // the slowest server never wins a choice between two
+  TSocketPoolPowerOfTwoPolicy policy;
+  for (int i = 0; i < 50; ++i) {
+    vector<shared_ptr<TSocketPoolServer> > ordered(servers);
+    policy.order(ordered);
+    BOOST_CHECK(ordered[0] != servers[2]);
+  }
+
+  // outstanding requests make a fast server look slow
+  for (int i = 0; i < 3; ++i) {
+    servers[0]->requestStarted();
+  }
+  for (int i = 0; i < 50; ++i) {
+    vector<shared_ptr<TSocketPoolServer> > ordered(servers);
+    policy.order(ordered);
+    BOOST_CHECK(ordered[0] != servers[0]);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_outlier_ejection) {
+  vector<shared_ptr<TServerSocket> > serverSockets;
+  vector<shared_ptr<TSocketPoolServer> > servers;
+  for (int i = 0; i < 3; ++i) {
+    serverSockets.push_back(make_shared<TServerSocket>("localhost", 0));
+    serverSockets.back()->listen();
+    servers.push_back(make_shared<TSocketPoolServer>("localhost", serverSockets.back()->getPort()));
+    servers.back()->requestStarted();
+    servers.back()->requestFinished(i == 1 ? 50000 : 1000, true);
+  }
+
+  TSocketPool pool(servers);
+  pool.setPolicy(make_shared<TSocketPoolLeastOutstandingPolicy>());
+  pool.setEjectionFactor(3.0);
+  for (int i = 0; i < 10; ++i) {
+    pool.open();
+    BOOST_CHECK_NE(pool.getPort(), servers[1]->port_);
+    pool.close();
+  }
+  BOOST_CHECK(servers[1]->isEjected(time(nullptr)));
+  BOOST_CHECK(!servers[0]->isEjected(time(nullptr)));
+
+  // an ejected server is still used when it is the only one left
+  serverSockets[0]->close();
+  serverSockets[2]->close();
+  pool.open();
+  BOOST_CHECK_EQUAL(pool.getPort(), servers[1]->port_);
+  pool.close();
+}
+
+BOOST_AUTO_TEST_CASE(test_outlier_ejection_two_servers) {
+  vector<shared_ptr<TServerSocket> > serverSockets;
+  vector<shared_ptr<TSocketPoolServer> > servers;
+  for (int i = 0; i < 2; ++i) {
+    serverSockets.push_back(make_shared<TServerSocket>("localhost", 0));
+    serverSockets.back()->listen();
+    servers.push_back(make_shared<TSocketPoolServer>("localhost", serverSockets.back()->getPort()));
+    servers.back()->requestStarted();
+    servers.back()->requestFinished(i == 1 ? 50000 : 1000, true);
+  }
+
+  // the slow server is measured against the other one, not against itself
+  TSocketPool pool(servers);
+  pool.setPolicy(make_shared<TSocketPoolLeastOutstandingPolicy>());
+  pool.setEjectionFactor(3.0);
+  pool.open();
+  BOOST_CHECK_EQUAL(pool.getPort(), servers[0]->port_);
+  pool.close();
+  BOOST_CHECK(servers[1]->isEjected(time(nullptr)));
+  BOOST_CHECK(!servers[0]->isEjected(time(nullptr)));
+}
+
+BOOST_AUTO_TEST_CASE(test_request_latency) {
+  TServerSocket serverSocket("localhost", 0);
+  serverSocket.listen();
+  TSocketPool pool("localhost", serverSocket.getPort());
+  vector<shared_ptr<TSocketPoolServer> > servers;
+  pool.getServers(servers);
+  pool.open();
+
+  uint8_t buf[4] = {'p', 'i', 'n', 'g'};
+  pool.write(buf, sizeof(buf));
+  BOOST_CHECK_EQUAL(servers[0]->getOutstanding(), 1);
+
+  shared_ptr<TTransport> accepted = serverSocket.accept();
+  accepted->readAll(buf, sizeof(buf));
+  accepted->write(buf, sizeof(buf));
+  BOOST_CHECK_EQUAL(pool.readAll(buf, sizeof(buf)), sizeof(buf));
+  BOOST_CHECK_EQUAL(servers[0]->getOutstanding(), 0);
+  BOOST_CHECK_GT(servers[0]->getLatency(), 0.0);
+
+  // a oneway request gets no response, the next request ends it without a
+  // sample rather than counting the idle time in between
+  pool.write(buf, sizeof(buf));
+  pool.flush();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  pool.write(buf, sizeof(buf));
+  BOOST_CHECK_EQUAL(servers[0]->getOutstanding(), 1);
+  accepted->readAll(buf, sizeof(buf));
+  accepted->readAll(buf, sizeof(buf));
+  accepted->write(buf, sizeof(buf));
+  BOOST_CHECK_EQUAL(pool.readAll(buf, sizeof(buf)), sizeof(buf));
+  BOOST_CHECK_EQUAL(servers[0]->getOutstanding(), 0);
+  BOOST_CHECK_LT(servers[0]->getLatency(), 50000.0);
+
+  // a request cut short by close() counts as failed
+  pool.write(buf, sizeof(buf));
+  BOOST_CHECK_EQUAL(servers[0]->getOutstanding(), 1);
+  pool.close();
+  BOOST_CHECK_EQUAL(servers[0]->getOutstanding(), 0);
+  accepted->close();
+  serverSocket.close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,152 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/**
+ * Compares the connect/disconnect throughput of TThreadedServer creating a
+ * thread for each client with that of its thread cache, for clients that
+ * connect, make one call and disconnect.
+ * Usage: ThreadedServerBenchmark [threads [connections per thread]]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TThreadedServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TSocket.h>
+#include "gen-cpp/ParentService.h"
+
+using apache::thrift::concurrency::Monitor;
+using apache::thrift::concurrency::Synchronized;
+using apache::thrift::protocol::TBinaryProtocol;
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::server::TServerEventHandler;
+using apache::thrift::server::TThreadedServer;
+using apache::thrift::test::ParentServiceClient;
+using apache::thrift::test::ParentServiceIf;
+using apache::thrift::test::ParentServiceProcessor;
+using apache::thrift::transport::TFramedTransport;
+using apache::thrift::transport::TFramedTransportFactory;
+using apache::thrift::transport::TServerSocket;
+using apache::thrift::transport::TSocket;
+using std::cout;
+using std::make_shared;
+using std::shared_ptr;
+
+class Handler : public ParentServiceIf {
+public:
+  int32_t incrementGeneration() override { return ++generation_; }
+  int32_t getGeneration() override { return generation_; }
+  void addString(const std::string& s) override { THRIFT_UNUSED_VARIABLE(s); }
+  void getStrings(std::vector<std::string>& _return) override { THRIFT_UNUSED_VARIABLE(_return); }
+  void getDataWait(std::string& _return, const int32_t length) override {
+    THRIFT_UNUSED_VARIABLE(_return);
+    THRIFT_UNUSED_VARIABLE(length);
+  }
+  void onewayWait() override {}
+  void exceptionWait(const std::string& message) override { THRIFT_UNUSED_VARIABLE(message); }
+  void unexpectedExceptionWait(const std::string& message) override {
+    THRIFT_UNUSED_VARIABLE(message);
+  }
+
+private:
+  std::atomic<int32_t> generation_{0};
+};
+
+class ReadyHandler : public TServerEventHandler, public Monitor {
+public:
+  void preServe() override {
+    Synchronized s(*this);
+    ready_ = true;
+    notifyAll();
+  }
+
+  bool ready_ = false;
+};
+
+/**
+ * Runs body on each of numThreads threads and prints the connection rate.
+ */
+static void run(const std::string& name,
+                int numThreads,
+                int connections,
+                const std::function<void()>& body) {
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < numThreads; ++i) {
+    threads.emplace_back([&] {
+      for (int j = 0; j < connections; ++j) {
+        body();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  cout << name << ": " << numThreads * connections / (1000 * elapsed.count()) << " kHz" << '\n';
+}
+
+int main(int argc, char** argv) {
+  int numThreads = argc > 1 ? atoi(argv[1]) : 8;
+  int connections = argc > 2 ? atoi(argv[2]) : 500;
+
+  for (size_t maxIdleThreads : {0, 1, 64}) {
+    shared_ptr<ReadyHandler> ready = make_shared<ReadyHandler>();
+    TThreadedServer server(make_shared<ParentServiceProcessor>(make_shared<Handler>()),
+                           make_shared<TServerSocket>("localhost", 0),
+                           make_shared<TFramedTransportFactory>(),
+                           make_shared<TBinaryProtocolFactory>());
+    server.setServerEventHandler(ready);
+    server.setMaxIdleThreads(maxIdleThreads);
+    std::thread serverThread([&server] { server.serve(); });
+    {
+      Synchronized s(*ready);
+      while (!ready->ready_) {
+        ready->wait();
+      }
+    }
+    int port = std::static_pointer_cast<TServerSocket>(server.getServerTransport())->getPort();
+
+    std::string name = maxIdleThreads == 0
+                           ? std::string("Thread per client")
+                           : "Cache, " + std::to_string(maxIdleThreads) + " idle threads";
+    run(name, numThreads, connections, [port] {
+      shared_ptr<TSocket> socket = make_shared<TSocket>("localhost", port);
+      shared_ptr<TFramedTransport> transport = make_shared<TFramedTransport>(socket);
+      ParentServiceClient client(make_shared<TBinaryProtocol>(transport));
+      transport->open();
+      client.incrementGeneration();
+      transport->close();
+    });
+
+    server.stop();
+    serverThread.join();
+  }
+  return 0;
+}
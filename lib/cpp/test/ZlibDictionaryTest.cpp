@@ -0,0 +1,264 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE ZlibDictionaryTest
+#include <boost/test/unit_test.hpp>
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/THeaderTransport.h>
+#include <thrift/transport/TZlibDictionary.h>
+#include <thrift/transport/TZlibTransport.h>
+
+using apache::thrift::protocol::TBinaryProtocol;
+using apache::thrift::protocol::T_CALL;
+using apache::thrift::protocol::T_I32;
+using apache::thrift::protocol::T_I64;
+using apache::thrift::protocol::T_STRING;
+using apache::thrift::transport::THeaderTransport;
+using apache::thrift::transport::TMemoryBuffer;
+using apache::thrift::transport::TTransportException;
+using apache::thrift::transport::TZlibDictionary;
+using apache::thrift::transport::TZlibDictionarySet;
+using apache::thrift::transport::TZlibTransport;
+using apache::thrift::transport::TZlibTransportException;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+/**
+ * Serializes a small call message in the binary protocol. Messages share
+ * their method and field names but differ in ids and payload strings, like
+ * typical RPC traffic.
+ */
+static string makeMessage(std::mt19937& rng) {
+  static const char* const methods[] = {"getUserProfile", "updateUserSettings", "listRecentOrders"};
+  static const char* const words[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot"};
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TBinaryProtocol proto(buffer);
+  proto.writeMessageBegin(methods[rng() % 3], T_CALL, static_cast<int32_t>(rng()));
+  proto.writeStructBegin("request");
+  proto.writeFieldBegin("userId", T_I64, 1);
+  proto.writeI64(static_cast<int64_t>(rng()));
+  proto.writeFieldEnd();
+  proto.writeFieldBegin("locale", T_STRING, 2);
+  proto.writeString(string(rng() % 2 ? "en_US.UTF-8" : "de_DE.UTF-8"));
+  proto.writeFieldEnd();
+  proto.writeFieldBegin("requestedFields", T_STRING, 3);
+  proto.writeString(string("displayName,emailAddress,avatarUrl,lastLoginTimestamp,preferences"));
+  proto.writeFieldEnd();
+  proto.writeFieldBegin("limit", T_I32, 4);
+  proto.writeI32(static_cast<int32_t>(rng() % 100));
+  proto.writeFieldEnd();
+  string note;
+  for (unsigned i = 0; i < 4 + rng() % 8; ++i) {
+    note += words[rng() % 6];
+    note += ' ';
+  }
+  proto.writeFieldBegin("note", T_STRING, 5);
+  proto.writeString(note);
+  proto.writeFieldEnd();
+  proto.writeFieldStop();
+  proto.writeStructEnd();
+  proto.writeMessageEnd();
+  return buffer->getBufferAsString();
+}
+
+static vector<string> makeMessages(size_t count, unsigned seed) {
+  std::mt19937 rng(seed);
+  vector<string> messages;
+  for (size_t i = 0; i < count; ++i) {
+    messages.push_back(makeMessage(rng));
+  }
+  return messages;
+}
+
+static shared_ptr<TZlibDictionarySet> trainedSet() {
+  shared_ptr<TZlibDictionarySet> set(new TZlibDictionarySet());
+  set->add(TZlibDictionary::train(makeMessages(500, 1)));
+  return set;
+}
+
+static void sendHeader(THeaderTransport& trans, const string& msg) {
+  trans.write(reinterpret_cast<const uint8_t*>(msg.data()), static_cast<uint32_t>(msg.size()));
+  trans.flush();
+}
+
+static string receiveHeader(THeaderTransport& trans, size_t len) {
+  string msg(len, '\0');
+  trans.readAll(reinterpret_cast<uint8_t*>(&msg[0]), static_cast<uint32_t>(len));
+  trans.readEnd();
+  return msg;
+}
+
+BOOST_AUTO_TEST_SUITE(ZlibDictionaryTest)
+
+BOOST_AUTO_TEST_CASE(test_dictionary_id) {
+  TZlibDictionary a("some dictionary content");
+  TZlibDictionary b("other dictionary content");
+  BOOST_CHECK_NE(a.getId(), b.getId());
+  BOOST_CHECK_EQUAL(a.getId(), TZlibDictionary("some dictionary content").getId());
+
+  TZlibDictionarySet set;
+  BOOST_CHECK(!set.getWriteDictionary());
+  set.add(std::make_shared<TZlibDictionary>(a));
+  set.add(std::make_shared<TZlibDictionary>(b));
+  BOOST_CHECK_EQUAL(a.getId(), set.getWriteDictionary()->getId());
+  set.setWriteDictionary(b.getId());
+  BOOST_CHECK_EQUAL(b.getId(), set.getWriteDictionary()->getId());
+  BOOST_CHECK(!set.find(12345));
+  BOOST_CHECK_THROW(set.setWriteDictionary(12345), TTransportException);
+}
+
+BOOST_AUTO_TEST_CASE(test_train) {
+  vector<string> samples = makeMessages(200, 2);
+  shared_ptr<TZlibDictionary> dict = TZlibDictionary::train(samples, 4096);
+  BOOST_CHECK_LE(dict->getData().size(), 4096u);
+
+  // a message that was not among the samples gets smaller
+  shared_ptr<TZlibDictionarySet> set(new TZlibDictionarySet());
+  set->add(dict);
+  string msg = makeMessages(1, 7)[0];
+  shared_ptr<TMemoryBuffer> plain(new TMemoryBuffer());
+  shared_ptr<TMemoryBuffer> primed(new TMemoryBuffer());
+  TZlibTransport plainWriter(plain);
+  TZlibTransport primedWriter(primed);
+  primedWriter.setDictionaries(set);
+  for (TZlibTransport* writer : {&plainWriter, &primedWriter}) {
+    writer->write(reinterpret_cast<const uint8_t*>(msg.data()), static_cast<uint32_t>(msg.size()));
+    writer->flush();
+  }
+  BOOST_CHECK_LT(primed->available_read(), plain->available_read() / 2);
+
+  // nothing in common
+  vector<string> unrelated;
+  unrelated.push_back("abcdefghijklmnop");
+  unrelated.push_back("qrstuvwxyz012345");
+  BOOST_CHECK_THROW(TZlibDictionary::train(unrelated), TTransportException);
+}
+
+BOOST_AUTO_TEST_CASE(test_zlib_transport_roundtrip) {
+  shared_ptr<TZlibDictionarySet> set = trainedSet();
+  vector<string> messages = makeMessages(20, 3);
+
+  shared_ptr<TMemoryBuffer> membuf(new TMemoryBuffer());
+  TZlibTransport writer(membuf);
+  writer.setDictionaries(set);
+  for (const string& msg : messages) {
+    writer.write(reinterpret_cast<const uint8_t*>(msg.data()), static_cast<uint32_t>(msg.size()));
+    writer.flush();
+  }
+  BOOST_CHECK_THROW(writer.setDictionaries(set), TTransportException);
+
+  TZlibTransport reader(membuf);
+  reader.setDictionaries(set);
+  for (const string& msg : messages) {
+    string got(msg.size(), '\0');
+    reader.readAll(reinterpret_cast<uint8_t*>(&got[0]), static_cast<uint32_t>(got.size()));
+    BOOST_CHECK(got == msg);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_zlib_transport_unknown_dictionary) {
+  shared_ptr<TMemoryBuffer> membuf(new TMemoryBuffer());
+  TZlibTransport writer(membuf);
+  writer.setDictionaries(trainedSet());
+  string msg = makeMessages(1, 4)[0];
+  writer.write(reinterpret_cast<const uint8_t*>(msg.data()), static_cast<uint32_t>(msg.size()));
+  writer.flush();
+
+  TZlibTransport reader(membuf);
+  uint8_t buf[16];
+  try {
+    reader.read(buf, sizeof(buf));
+    BOOST_ERROR("read() without the dictionary did not fail");
+  } catch (TZlibTransportException& ex) {
+    BOOST_CHECK_EQUAL(Z_NEED_DICT, ex.getZlibStatus());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_header_transport_negotiation) {
+  shared_ptr<TZlibDictionarySet> set = trainedSet();
+  vector<string> messages = makeMessages(2, 5);
+  shared_ptr<TMemoryBuffer> toServer(new TMemoryBuffer());
+  shared_ptr<TMemoryBuffer> toClient(new TMemoryBuffer());
+
+  // the client compresses its request with the set's write dictionary
+  THeaderTransport client(toClient, toServer);
+  client.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  client.setDictionaries(set);
+  sendHeader(client, messages[0]);
+
+  THeaderTransport server(toServer, toClient);
+  server.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  server.setDictionaries(set);
+  server.resetProtocol();
+  BOOST_CHECK(receiveHeader(server, messages[0].size()) == messages[0]);
+
+  // the reply uses the same dictionary
+  sendHeader(server, messages[1]);
+  client.resetProtocol();
+  BOOST_CHECK(receiveHeader(client, messages[1].size()) == messages[1]);
+
+  // a client without dictionaries gets replies it can decode
+  THeaderTransport plainClient(toClient, toServer);
+  plainClient.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  sendHeader(plainClient, messages[0]);
+  server.resetProtocol();
+  BOOST_CHECK(receiveHeader(server, messages[0].size()) == messages[0]);
+  sendHeader(server, messages[1]);
+  plainClient.resetProtocol();
+  BOOST_CHECK(receiveHeader(plainClient, messages[1].size()) == messages[1]);
+}
+
+/**
+ * Compresses small messages one frame at a time, as THeaderTransport does:
+ * a trained dictionary must make them smaller on the wire.
+ */
+BOOST_AUTO_TEST_CASE(test_dictionary_shrinks_small_messages) {
+  vector<string> messages = makeMessages(1000, 6);
+
+  size_t wireBytes[2];
+  shared_ptr<TZlibDictionarySet> dictionaries[] = {nullptr, trainedSet()};
+  for (int i = 0; i < 2; ++i) {
+    shared_ptr<TMemoryBuffer> wire(new TMemoryBuffer());
+    THeaderTransport writer(wire);
+    THeaderTransport reader(wire);
+    writer.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+    writer.setDictionaries(dictionaries[i]);
+    reader.setDictionaries(dictionaries[i]);
+
+    wireBytes[i] = 0;
+    for (const string& msg : messages) {
+      sendHeader(writer, msg);
+      wireBytes[i] += wire->available_read();
+      reader.resetProtocol();
+      BOOST_CHECK(receiveHeader(reader, msg.size()) == msg);
+      wire->resetBuffer();
+    }
+  }
+  BOOST_CHECK_LT(wireBytes[1], wireBytes[0]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
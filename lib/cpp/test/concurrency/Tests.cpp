@@ -185,6 +185,20 @@ int main(int argc, char** argv) {
         std::cerr << "\t\tThreadManager blockTest FAILED" << '\n';
         return 1;
       }
+
+      std::cout << "\t\tThreadManager queue delay test:" << '\n';
+
+      if (!threadManagerTests.queueDelayTest()) {
+        std::cerr << "\t\tThreadManager queueDelayTest FAILED" << '\n';
+        return 1;
+      }
+
+      std::cout << "\t\tThreadManager deadline test:" << '\n';
+
+      if (!threadManagerTests.deadlineTest()) {
+        std::cerr << "\t\tThreadManager deadlineTest FAILED" << '\n';
+        return 1;
+      }
     }
   }
 
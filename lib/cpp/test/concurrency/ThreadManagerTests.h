@@ -27,6 +27,7 @@
 #include <set>
 #include <iostream>
 #include <stdint.h>
+#include <vector>
 
 namespace apache {
 namespace thrift {
@@ -629,6 +630,151 @@ public:
     threadManager.reset();
     return true;
   }
+
+  /**
+   * Queue more tasks than a single worker can serve within the queue delay
+   * target. Verify that tasks are shed once the delay stands above the target
+   * for an interval, that every task is either run or shed, and that tasks
+   * which do not queue up are never shed.
+   */
+  bool queueDelayTest(size_t count = 40, int64_t timeout = 5LL) {
+    Monitor monitor;
+    size_t activeCount = count;
+    size_t shedCount = 0;
+
+    shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(1);
+    threadManager->threadFactory(shared_ptr<ThreadFactory>(new ThreadFactory(false)));
+    threadManager->setQueueDelayTarget(timeout, 4 * timeout);
+    threadManager->setShedCallback([&](shared_ptr<Runnable>) {
+      Synchronized s(monitor);
+      shedCount++;
+      activeCount--;
+      if (activeCount == 0) {
+        monitor.notify();
+      }
+    });
+    threadManager->start();
+
+    std::cout << "				add " << count << " tasks of " << timeout << "ms.. " << '\n';
+
+    for (size_t ix = 0; ix < count; ix++) {
+      threadManager->add(shared_ptr<Runnable>(new ThreadManagerTests::Task(monitor, activeCount, timeout)));
+    }
+
+    {
+      Synchronized s(monitor);
+      while (activeCount != 0) {
+        monitor.wait();
+      }
+    }
+
+    if (shedCount == 0 || shedCount == count) {
+      std::cerr << "					expected some but not all tasks to be shed, shed " << shedCount << '\n';
+      return false;
+    }
+
+    EXPECT(threadManager->shedTaskCount(), shedCount);
+    EXPECT(threadManager->expiredTaskCount(), 0);
+
+    std::cout << "				shed " << shedCount << " tasks, run tasks one at a time.. " << '\n';
+
+    for (size_t ix = 0; ix < count / 4; ix++) {
+      {
+        Synchronized s(monitor);
+        activeCount = 1;
+      }
+      threadManager->add(shared_ptr<Runnable>(new ThreadManagerTests::Task(monitor, activeCount, 1)));
+      Synchronized s(monitor);
+      while (activeCount != 0) {
+        monitor.wait();
+      }
+    }
+
+    EXPECT(threadManager->shedTaskCount(), shedCount);
+
+    threadManager->stop();
+    return true;
+  }
+
+  class OrderTask : public Runnable {
+
+  public:
+    OrderTask(Monitor& monitor, std::vector<int>& order, int id)
+      : _monitor(monitor), _order(order), _id(id) {}
+
+    void run() override {
+      Synchronized s(_monitor);
+      _order.push_back(_id);
+      _monitor.notify();
+    }
+
+    Monitor& _monitor;
+    std::vector<int>& _order;
+    int _id;
+  };
+
+  /**
+   * Queue tasks with and without expiration behind a blocked worker. Verify
+   * that with earliest deadline first the ones with an expiration run first,
+   * soonest first, followed by the others in the order they were added.
+   */
+  bool deadlineTest() {
+    Monitor entryMonitor;
+    Monitor blockMonitor;
+    Monitor doneMonitor;
+    bool blocked = true;
+    size_t blockCount = 1;
+    Monitor monitor;
+    std::vector<int> order;
+
+    shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(1);
+    threadManager->threadFactory(shared_ptr<ThreadFactory>(new ThreadFactory(false)));
+    threadManager->setEarliestDeadlineFirst(true);
+    threadManager->start();
+
+    shared_ptr<ThreadManagerTests::BlockTask> blockTask(
+        new ThreadManagerTests::BlockTask(entryMonitor, blockMonitor, blocked, doneMonitor, blockCount));
+    threadManager->add(blockTask);
+    {
+      Synchronized s(entryMonitor);
+      while (!blockTask->_entered) {
+        entryMonitor.wait();
+      }
+    }
+
+    std::cout << "\t\t\t\tadd tasks behind blocked worker.. " << '\n';
+
+    const int64_t expirations[] = {0, 5000, 1000, 3000, 0};
+    for (int id = 0; id < 5; id++) {
+      threadManager->add(shared_ptr<Runnable>(new ThreadManagerTests::OrderTask(monitor, order, id)),
+                         0,
+                         expirations[id]);
+    }
+    EXPECT(threadManager->pendingTaskCount(), 5);
+
+    {
+      Synchronized s(blockMonitor);
+      blocked = false;
+      blockMonitor.notifyAll();
+    }
+    {
+      Synchronized s(monitor);
+      while (order.size() != 5) {
+        monitor.wait();
+      }
+    }
+
+    const std::vector<int> expected = {2, 3, 1, 0, 4};
+    if (order != expected) {
+      std::cerr << "\t\t\t\t\texpected tasks to run earliest deadline first" << '\n';
+      return false;
+    }
+
+    EXPECT(threadManager->expiredTaskCount(), 0);
+
+    threadManager->stop();
+    return true;
+  }
 };
 
 }
@@ -0,0 +1,167 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Tests for the DirectClient classes generated with the cpp:direct_client
+ * option: calls go straight to the handler and the TProcessorEventHandler
+ * hooks fire in the same order as they do for a processor.
+ */
+
+#define BOOST_TEST_MODULE DirectClientTest
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include <thrift/server/TServer.h>
+
+#include "EventLog.h"
+#include "Handlers.h"
+#include "gen-cpp/ChildService.h"
+
+using namespace apache::thrift;
+using namespace apache::thrift::test;
+using std::string;
+using std::vector;
+
+namespace {
+
+/**
+ * Records hook invocations as "hook:function" strings.
+ */
+class RecordingEventHandler : public TProcessorEventHandler {
+public:
+  void* getContext(const char* fnName, void* serverContext) override {
+    (void)serverContext;
+    calls.push_back(string("getContext:") + fnName);
+    return &calls;
+  }
+  void freeContext(void* ctx, const char* fnName) override {
+    BOOST_CHECK(ctx == &calls);
+    calls.push_back(string("freeContext:") + fnName);
+  }
+  void preRead(void* ctx, const char* fnName) override {
+    BOOST_CHECK(ctx == &calls);
+    calls.push_back(string("preRead:") + fnName);
+  }
+  void postRead(void* ctx, const char* fnName, uint32_t bytes) override {
+    BOOST_CHECK(ctx == &calls);
+    BOOST_CHECK_EQUAL(0u, bytes);
+    calls.push_back(string("postRead:") + fnName);
+  }
+  void preWrite(void* ctx, const char* fnName) override {
+    BOOST_CHECK(ctx == &calls);
+    calls.push_back(string("preWrite:") + fnName);
+  }
+  void postWrite(void* ctx, const char* fnName, uint32_t bytes) override {
+    BOOST_CHECK(ctx == &calls);
+    BOOST_CHECK_EQUAL(0u, bytes);
+    calls.push_back(string("postWrite:") + fnName);
+  }
+  void asyncComplete(void* ctx, const char* fnName) override {
+    BOOST_CHECK(ctx == &calls);
+    calls.push_back(string("asyncComplete:") + fnName);
+  }
+  void handlerError(void* ctx, const char* fnName) override {
+    BOOST_CHECK(ctx == &calls);
+    calls.push_back(string("handlerError:") + fnName);
+  }
+
+  vector<string> calls;
+};
+
+vector<string> expected(const string& fn, std::initializer_list<const char*> hooks) {
+  vector<string> result;
+  for (const char* hook : hooks) {
+    result.push_back(string(hook) + ":" + fn);
+  }
+  return result;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(test_calls_reach_handler) {
+  std::shared_ptr<EventLog> log(new EventLog());
+  std::shared_ptr<ChildHandler> handler(new ChildHandler(log));
+  ChildServiceDirectClient client(handler);
+
+  BOOST_CHECK_EQUAL(1, client.incrementGeneration());
+  BOOST_CHECK_EQUAL(1, client.getGeneration());
+  client.addString("foo");
+  client.addString("bar");
+  vector<string> strings;
+  client.getStrings(strings);
+  BOOST_REQUIRE_EQUAL(2u, strings.size());
+  BOOST_CHECK_EQUAL("foo", strings[0]);
+  BOOST_CHECK_EQUAL("bar", strings[1]);
+
+  BOOST_CHECK_EQUAL(0, client.setValue(42));
+  BOOST_CHECK_EQUAL(42, client.getValue());
+}
+
+BOOST_AUTO_TEST_CASE(test_event_handler_hooks) {
+  std::shared_ptr<EventLog> log(new EventLog());
+  ChildServiceDirectClient client(std::make_shared<ChildHandler>(log));
+  std::shared_ptr<RecordingEventHandler> events(new RecordingEventHandler());
+  client.setEventHandler(events);
+  BOOST_CHECK(client.getEventHandler() == events);
+
+  client.setValue(7);
+  BOOST_CHECK(events->calls
+              == expected("ChildService.setValue",
+                          {"getContext", "preRead", "postRead", "preWrite", "postWrite",
+                           "freeContext"}));
+
+  events->calls.clear();
+  client.onewayWait();
+  BOOST_CHECK(events->calls
+              == expected("ParentService.onewayWait",
+                          {"getContext", "preRead", "postRead", "asyncComplete", "freeContext"}));
+}
+
+BOOST_AUTO_TEST_CASE(test_declared_exception) {
+  std::shared_ptr<EventLog> log(new EventLog());
+  ChildServiceDirectClient client(std::make_shared<ChildHandler>(log));
+  std::shared_ptr<RecordingEventHandler> events(new RecordingEventHandler());
+  client.setEventHandler(events);
+
+  try {
+    client.exceptionWait("oops");
+    BOOST_ERROR("expected MyError");
+  } catch (const MyError& e) {
+    BOOST_CHECK_EQUAL("oops", e.message);
+  }
+  BOOST_CHECK(events->calls
+              == expected("ParentService.exceptionWait",
+                          {"getContext", "preRead", "postRead", "preWrite", "postWrite",
+                           "freeContext"}));
+}
+
+BOOST_AUTO_TEST_CASE(test_unexpected_exception) {
+  std::shared_ptr<EventLog> log(new EventLog());
+  ChildServiceDirectClient client(std::make_shared<ChildHandler>(log));
+  std::shared_ptr<RecordingEventHandler> events(new RecordingEventHandler());
+  client.setEventHandler(events);
+
+  // undeclared exceptions surface as TApplicationException, as for a remote call
+  BOOST_CHECK_THROW(client.unexpectedExceptionWait("oops"), TApplicationException);
+  BOOST_CHECK(events->calls
+              == expected("ParentService.unexpectedExceptionWait",
+                          {"getContext", "preRead", "postRead", "handlerError", "freeContext"}));
+}
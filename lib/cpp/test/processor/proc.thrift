@@ -27,9 +27,9 @@ service ParentService {
   i32 incrementGeneration()
   i32 getGeneration()
   void addString(1: string s)
-  list<string> getStrings()
+  list<string> getStrings() (cpp.placement = "inline")
 
-  binary getDataWait(1: i32 length)
+  binary getDataWait(1: i32 length) (cpp.placement = "worker")
   oneway void onewayWait()
   void exceptionWait(1: string message) throws (2: MyError error)
   void unexpectedExceptionWait(1: string message)
@@ -344,6 +344,9 @@ int main(int argc, char** argv) {
   // Dispatcher
   std::shared_ptr<Server> serviceHandler(new Server());
 
+  std::shared_ptr<TNonblockingServer> server1;
+  std::shared_ptr<TNonblockingServer> server2;
+
   if (replayRequests) {
     std::shared_ptr<Server> serviceHandler(new Server());
     std::shared_ptr<ServiceProcessor> serviceProcessor(new ServiceProcessor(serviceHandler));
@@ -391,11 +394,9 @@ int main(int argc, char** argv) {
     if (serverType == "simple") {
 
       nbSocket1.reset(new transport::TNonblockingServerSocket(port));
-      serverThread = threadFactory->newThread(std::shared_ptr<TServer>(
-          new TNonblockingServer(serviceProcessor, protocolFactory, nbSocket1)));
+      server1.reset(new TNonblockingServer(serviceProcessor, protocolFactory, nbSocket1));
       nbSocket2.reset(new transport::TNonblockingServerSocket(port + 1));
-      serverThread2 = threadFactory->newThread(std::shared_ptr<TServer>(
-          new TNonblockingServer(serviceProcessor, protocolFactory, nbSocket2)));
+      server2.reset(new TNonblockingServer(serviceProcessor, protocolFactory, nbSocket2));
 
     } else if (serverType == "thread-pool") {
 
@@ -405,13 +406,16 @@ int main(int argc, char** argv) {
       threadManager->threadFactory(threadFactory);
       threadManager->start();
       nbSocket1.reset(new transport::TNonblockingServerSocket(port));
-      serverThread = threadFactory->newThread(std::shared_ptr<TServer>(
-          new TNonblockingServer(serviceProcessor, protocolFactory, nbSocket1, threadManager)));
+      server1.reset(
+          new TNonblockingServer(serviceProcessor, protocolFactory, nbSocket1, threadManager));
       nbSocket2.reset(new transport::TNonblockingServerSocket(port + 1));
-      serverThread2 = threadFactory->newThread(std::shared_ptr<TServer>(
-          new TNonblockingServer(serviceProcessor, protocolFactory, nbSocket2, threadManager)));
+      server2.reset(
+          new TNonblockingServer(serviceProcessor, protocolFactory, nbSocket2, threadManager));
     }
 
+    serverThread = threadFactory->newThread(server1);
+    serverThread2 = threadFactory->newThread(server2);
+
     cerr << "Starting the server on port " << port << " and " << (port + 1) << '\n';
     serverThread->start();
     serverThread2->start();
@@ -526,6 +530,18 @@ int main(int argc, char** argv) {
     cout << "workers :" << workerCount << ", client : " << clientCount << ", loops : " << loopCount
          << ", rate : " << (clientCount * loopCount * 1000) / ((double)(time01 - time00)) << '\n';
 
+    if (server1 && server2) {
+      // Finished tasks are handed back to the IO threads in batches, one
+      // wakeup covers all tasks that finished before the IO thread ran.
+      uint64_t completions = server1->getNumCompletions() + server2->getNumCompletions();
+      uint64_t wakeups = server1->getNumCompletionWakeups() + server2->getNumCompletionWakeups();
+      cout << "task completions : " << completions << ", IO thread wakeups : " << wakeups;
+      if (wakeups > 0) {
+        cout << ", completions per wakeup : " << (double)completions / wakeups;
+      }
+      cout << '\n';
+    }
+
     count_map count = serviceHandler->getCount();
     count_map::iterator iter;
     for (iter = count.begin(); iter != count.end(); ++iter) {